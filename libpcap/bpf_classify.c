@@ -0,0 +1,1762 @@
+/*
+ * Copyright (c) 1990, 1991, 1992, 1994, 1995, 1996
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Classifiers, which run a number of filter programs over each packet,
+ * sharing the work they have in common.
+ *
+ * Each program is translated into a decision DAG by following it with
+ * the registers and scratch memory holding expressions - a load of
+ * some bytes of the packet, a constant, an arithmetic operation on
+ * other expressions - rather than values.  Each node of the DAG
+ * compares two expressions and goes on to one node or another
+ * depending on the result; the leaves accept or reject the packet.
+ * The expressions are shared between all of a classifier's programs:
+ * the same load or computation, wherever it appears in whichever
+ * program, is one expression, evaluated at most once per packet.
+ * Programs that translate to the same DAG, identical programs among
+ * them, are run once.
+ *
+ * The programs' DAGs are then merged into one, each node of which
+ * stands for the node each program has got to.  A merged node
+ * evaluates the expression the first unfinished program is about to
+ * evaluate and moves every program that learns something from its
+ * value on at once: all the programs making the same comparison, and,
+ * for a value that programs compare with different constants, all of
+ * those, by looking the value up in a table of the constants.  Once
+ * the link-layer type has been checked, then, 200 "host X" filters
+ * for 200 different hosts take one lookup of the source address and
+ * one of the destination address, not 400 comparisons.
+ *
+ * Comparisons that aren't for equality with a constant, or that only
+ * one program makes, are still made one at a time, so the cost grows
+ * with the number of distinct tests.  Programs whose merged DAG would
+ * be too big, because they test unrelated things in many different
+ * orders, are split into groups that are merged separately, and each
+ * group is run in turn.
+ *
+ * Programs that can't be translated - ones that jump backwards, read
+ * a scratch memory word before storing to it, or are too big - are run
+ * by the interpreter.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pcap-types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcap-int.h"
+#include "extract.h"
+
+/*
+ * Kinds of expression.
+ */
+#define CX_CONST	0	/* k */
+#define CX_LEN		1	/* the length of the packet on the wire */
+#define CX_LOAD		2	/* size bytes at offset a + k */
+#define CX_MSH		3	/* 4 * (the byte at offset k & 0xf) */
+#define CX_ALU		4	/* a op b */
+
+struct classifier_expr {
+	u_char	kind;
+	u_char	size;		/* CX_LOAD: 1, 2, or 4 */
+	u_char	depth;		/* 1 + depth of the deepest operand */
+	u_char	may_fault;	/* evaluating it can reject the packet */
+	bpf_u_int32 op;		/* CX_ALU: BPF_ADD etc. */
+	int	a, b;		/* operands */
+	bpf_u_int32 k;
+};
+
+/*
+ * Expressions more deeply nested than this, which evaluating them
+ * would have to recurse through, make a program untranslatable.
+ */
+#define CX_MAX_DEPTH	32
+
+/*
+ * A node compares expression a with expression b with op, one of the
+ * BPF_ conditional jump operations, and goes on to jt if the result
+ * is true and to jf if it's false; a CN_GUARD node only evaluates a,
+ * and goes on to jt (which is jf) if that didn't reject the packet.
+ * jt and jf are node indices, or one of the leaves.
+ */
+#define CN_GUARD	BPF_JA
+#define CN_ACCEPT	(-1)
+#define CN_REJECT	(-2)
+
+struct classifier_node {
+	bpf_u_int32 op;
+	int	a, b;
+	int	jt, jf;
+};
+
+/*
+ * Not a node; returned when translation fails.
+ */
+#define CN_FAIL		(-3)
+
+/*
+ * A merged node evaluates expression a and then, depending on op,
+ * compares it with expression b using one of the BPF_ conditional
+ * jump operations, looks its value up in a sorted table of constants
+ * if op is CM_SWITCH, or does nothing more if op is CN_GUARD.  It then
+ * follows one of its edges, which start at edge, in this order.
+ */
+#define CM_SWITCH	0x100
+
+#define CM_TRUE		0	/* true; for a guard, a didn't reject */
+#define CM_FALSE	1	/* false; for a switch, not in the table */
+#define CM_AFAULT	2	/* evaluating a rejected the packet */
+#define CM_BFAULT	3	/* evaluating b rejected the packet */
+#define CM_CASE		4	/* the first value in the table, and so on */
+
+struct classifier_mnode {
+	bpf_u_int32 op;
+	int	a, b;
+	int	edge;		/* first edge, in c->edges */
+	int	cases;		/* CM_SWITCH: first value, in c->cases */
+	int	ncases;
+};
+
+/*
+ * Following an edge accepts the packet for the naccepts programs in
+ * c->accepts starting at accepts, and goes on to merged node next, or
+ * stops if next is -1.
+ */
+struct classifier_edge {
+	int	next;
+	int	accepts;
+	int	naccepts;
+};
+
+struct classifier_prog {
+	struct bpf_program prog;	/* copy of the program */
+	struct bpf_decoded *decoded;	/* pre-decoded form, or NULL */
+	int	root;			/* its DAG, or CN_FAIL to interpret it */
+	int	first_filter;		/* first filter with this program */
+};
+
+struct pcap_classifier {
+	int	nfilters;
+	int	*next_filter;		/* next filter with the same program */
+	int	nprogs;
+	struct classifier_prog *progs;
+	int	nexprs;
+	struct classifier_expr *exprs;
+	int	nnodes;
+	struct classifier_node *nodes;
+
+	/*
+	 * The programs' DAGs, merged in groups; each group is run by
+	 * following its merged nodes from the one in groups.
+	 */
+	int	ngroups;
+	int	*groups;
+	int	nmnodes;
+	struct classifier_mnode *mnodes;
+	int	nedges;
+	struct classifier_edge *edges;
+	int	naccepts;
+	int	*accepts;
+	int	ncases;
+	bpf_u_int32 *cases;
+
+	/*
+	 * State for a packet.  An expression's value is valid if its
+	 * stamp is gen; an expression whose stamp is gen + 1 rejected
+	 * the packet.
+	 */
+	bpf_u_int32 gen;
+	bpf_u_int32 *expr_gen;
+	bpf_u_int32 *expr_val;
+};
+
+/*
+ * An open-addressing hash table of the indices of entries that live
+ * in some other array; the hashes are kept so that it can be grown
+ * without looking at the entries.
+ */
+struct classifier_slot {
+	u_int	hash;
+	int	index;			/* -1 if empty */
+};
+
+struct classifier_hash {
+	struct classifier_slot *slots;
+	u_int	size;			/* a power of 2, or 0 */
+	u_int	count;
+};
+
+static int
+classifier_hash_find(const struct classifier_hash *t, u_int hash,
+    int (*eq)(const void *, int), const void *key)
+{
+	u_int i;
+
+	if (t->size == 0)
+		return (-1);
+	for (i = hash & (t->size - 1); t->slots[i].index != -1;
+	    i = (i + 1) & (t->size - 1)) {
+		if (t->slots[i].hash == hash && (*eq)(key, t->slots[i].index))
+			return (t->slots[i].index);
+	}
+	return (-1);
+}
+
+static int
+classifier_hash_add(struct classifier_hash *t, u_int hash, int index)
+{
+	struct classifier_slot *slots;
+	u_int size, i, j;
+
+	if (2 * (t->count + 1) > t->size) {
+		size = t->size != 0 ? 2 * t->size : 256;
+		slots = malloc(size * sizeof(*slots));
+		if (slots == NULL)
+			return (-1);
+		for (i = 0; i < size; i++)
+			slots[i].index = -1;
+		for (j = 0; j < t->size; j++) {
+			if (t->slots[j].index == -1)
+				continue;
+			for (i = t->slots[j].hash & (size - 1);
+			    slots[i].index != -1; i = (i + 1) & (size - 1))
+				;
+			slots[i] = t->slots[j];
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->size = size;
+	}
+	for (i = hash & (t->size - 1); t->slots[i].index != -1;
+	    i = (i + 1) & (t->size - 1))
+		;
+	t->slots[i].hash = hash;
+	t->slots[i].index = index;
+	t->count++;
+	return (0);
+}
+
+static void
+classifier_hash_clear(struct classifier_hash *t)
+{
+	u_int i;
+
+	for (i = 0; i < t->size; i++)
+		t->slots[i].index = -1;
+	t->count = 0;
+}
+
+static u_int
+classifier_hash_ints(const int *v, u_int n)
+{
+	u_int h = 2166136261U, i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ (u_int)v[i]) * 16777619U;
+	return (h);
+}
+
+/*
+ * The registers and scratch memory, as expressions, at some point in
+ * a program; a scratch memory word not yet stored to is -1.
+ */
+struct classifier_regs {
+	int	a;
+	int	x;
+	int	mem[BPF_MEMWORDS];
+};
+
+/*
+ * A point in a program already translated, and the node it
+ * translated to.
+ */
+struct classifier_state {
+	u_int	pc;
+	struct classifier_regs regs;
+	int	node;
+};
+
+/*
+ * The state a merged node stands for: the node each of a group's
+ * programs has got to, if it hasn't accepted or rejected the packet
+ * yet, as npairs (program, node) pairs, in program order, in
+ * b->pairs from pairs on.
+ */
+struct classifier_mstate {
+	int	pairs;
+	int	npairs;
+};
+
+/*
+ * Limits on the translation of a program: how many points we
+ * translate, per instruction, before giving up on it, how deeply
+ * nested the conditional jumps can be, and how many expressions that
+ * can reject the packet can be loaded between two of them.
+ */
+#define CB_STATES_PER_INSN	8
+#define CB_MAX_DEPTH		256
+#define CB_MAX_PENDING		8
+
+struct classifier_build {
+	pcap_classifier_t *c;
+	int	exprs_size;		/* allocated size of c->exprs */
+	int	nodes_size;		/* allocated size of c->nodes */
+	struct classifier_hash expr_hash;
+	struct classifier_hash node_hash;
+
+	/*
+	 * The program being translated.
+	 */
+	const struct bpf_insn *insns;
+	u_int	len;
+	struct classifier_hash state_hash;
+	struct classifier_state *states;
+	u_int	nstates;
+	u_int	states_size;
+	u_int	max_states;
+	int	depth;
+
+	/*
+	 * The group being merged: the states of its merged nodes, from
+	 * mbase on, as (program, node) pairs in pairs, the state being
+	 * worked out from, in cur, and the one being worked out, in
+	 * next.
+	 */
+	int	mnodes_size;
+	int	edges_size;
+	int	accepts_size;
+	int	cases_size;
+	int	groups_size;
+	struct classifier_hash mstate_hash;
+	struct classifier_mstate *mstates;
+	int	mstates_size;
+	int	mbase;
+	int	*pairs;
+	int	npairs;
+	int	pairs_size;		/* in ints */
+	int	*cur;
+	int	ncur;
+	int	*next;
+	int	nnext;
+	bpf_u_int32 *vals;		/* constants they're compared with */
+	u_long	work;
+	int	limit;			/* the group can be split */
+
+	int	nomem;			/* we ran out of memory */
+};
+
+static int
+classifier_expr_eq(const void *key, int i)
+{
+	const struct classifier_build *b = key;
+	const struct classifier_expr *x = &b->c->exprs[b->c->nexprs];
+	const struct classifier_expr *y = &b->c->exprs[i];
+
+	return (x->kind == y->kind && x->size == y->size && x->op == y->op &&
+	    x->a == y->a && x->b == y->b && x->k == y->k);
+}
+
+/*
+ * Return the index of an expression, adding it if it's new, or -1 if
+ * we run out of memory or it's too deeply nested.
+ */
+static int
+classifier_expr(struct classifier_build *b, u_char kind, u_char size,
+    bpf_u_int32 op, int a, int bb, bpf_u_int32 k)
+{
+	pcap_classifier_t *c = b->c;
+	struct classifier_expr *x;
+	int key[6], i, depth;
+	void *p;
+
+	if (c->nexprs == b->exprs_size) {
+		p = realloc(c->exprs, 2 * b->exprs_size * sizeof(*c->exprs));
+		if (p == NULL) {
+			b->nomem = 1;
+			return (-1);
+		}
+		c->exprs = p;
+		b->exprs_size *= 2;
+	}
+
+	/*
+	 * Build it in the first free entry, so that it can be
+	 * compared with the ones we have.
+	 */
+	x = &c->exprs[c->nexprs];
+	x->kind = kind;
+	x->size = size;
+	x->op = op;
+	x->a = a;
+	x->b = bb;
+	x->k = k;
+	key[0] = kind;
+	key[1] = size;
+	key[2] = (int)op;
+	key[3] = a;
+	key[4] = bb;
+	key[5] = (int)k;
+	i = classifier_hash_find(&b->expr_hash, classifier_hash_ints(key, 6),
+	    classifier_expr_eq, b);
+	if (i != -1)
+		return (i);
+
+	depth = 0;
+	x->may_fault = kind == CX_LOAD || kind == CX_MSH;
+	if (kind == CX_LOAD || kind == CX_ALU) {
+		depth = c->exprs[a].depth;
+		x->may_fault |= c->exprs[a].may_fault;
+	}
+	if (kind == CX_ALU) {
+		if (c->exprs[bb].depth > depth)
+			depth = c->exprs[bb].depth;
+		x->may_fault |= c->exprs[bb].may_fault;
+		if ((op == BPF_DIV || op == BPF_MOD) &&
+		    (c->exprs[bb].kind != CX_CONST || c->exprs[bb].k == 0))
+			x->may_fault = 1;
+	}
+	if (depth >= CX_MAX_DEPTH)
+		return (-1);
+	x->depth = (u_char)(depth + 1);
+	if (classifier_hash_add(&b->expr_hash, classifier_hash_ints(key, 6),
+	    c->nexprs) == -1) {
+		b->nomem = 1;
+		return (-1);
+	}
+	return (c->nexprs++);
+}
+
+static int
+classifier_const(struct classifier_build *b, bpf_u_int32 k)
+{
+	return (classifier_expr(b, CX_CONST, 0, 0, 0, 0, k));
+}
+
+/*
+ * Do an ALU operation, as the interpreter does, on two values; return
+ * -1 if it rejects the packet.
+ */
+static int
+classifier_alu(bpf_u_int32 op, bpf_u_int32 a, bpf_u_int32 b,
+    bpf_u_int32 *vp)
+{
+	switch (op) {
+
+	case BPF_ADD:
+		*vp = a + b;
+		break;
+
+	case BPF_SUB:
+		*vp = a - b;
+		break;
+
+	case BPF_MUL:
+		*vp = a * b;
+		break;
+
+	case BPF_DIV:
+		if (b == 0)
+			return (-1);
+		*vp = a / b;
+		break;
+
+	case BPF_MOD:
+		if (b == 0)
+			return (-1);
+		*vp = a % b;
+		break;
+
+	case BPF_AND:
+		*vp = a & b;
+		break;
+
+	case BPF_OR:
+		*vp = a | b;
+		break;
+
+	case BPF_XOR:
+		*vp = a ^ b;
+		break;
+
+	case BPF_LSH:
+		*vp = b < 32 ? a << b : 0;
+		break;
+
+	default:	/* BPF_RSH */
+		*vp = b < 32 ? a >> b : 0;
+		break;
+	}
+	return (0);
+}
+
+/*
+ * Return the expression for an ALU operation, working it out now if
+ * both operands are constants.
+ */
+static int
+classifier_alu_expr(struct classifier_build *b, bpf_u_int32 op, int a, int bb)
+{
+	const struct classifier_expr *xa = &b->c->exprs[a];
+	const struct classifier_expr *xb = &b->c->exprs[bb];
+	bpf_u_int32 v;
+
+	if (xa->kind == CX_CONST && xb->kind == CX_CONST &&
+	    classifier_alu(op, xa->k, xb->k, &v) == 0)
+		return (classifier_const(b, v));
+	return (classifier_expr(b, CX_ALU, 0, op, a, bb, 0));
+}
+
+/*
+ * Do a conditional jump's comparison on two values.
+ */
+static int
+classifier_jmp(bpf_u_int32 op, bpf_u_int32 a, bpf_u_int32 b)
+{
+	switch (op) {
+
+	case BPF_JGT:
+		return (a > b);
+
+	case BPF_JGE:
+		return (a >= b);
+
+	case BPF_JEQ:
+		return (a == b);
+
+	default:	/* BPF_JSET */
+		return ((a & b) != 0);
+	}
+}
+
+static int
+classifier_node_eq(const void *key, int i)
+{
+	const struct classifier_build *b = key;
+	const struct classifier_node *x = &b->c->nodes[b->c->nnodes];
+	const struct classifier_node *y = &b->c->nodes[i];
+
+	return (x->op == y->op && x->a == y->a && x->b == y->b &&
+	    x->jt == y->jt && x->jf == y->jf);
+}
+
+/*
+ * Return the index of a node, adding it if it's new, or CN_FAIL if we
+ * run out of memory.  A node that goes on to the same place whatever
+ * the result, other than a guard, is that place.
+ */
+static int
+classifier_node(struct classifier_build *b, bpf_u_int32 op, int a, int bb,
+    int jt, int jf)
+{
+	pcap_classifier_t *c = b->c;
+	struct classifier_node *n;
+	int key[5], i;
+	void *p;
+
+	if (jt == jf && op != CN_GUARD)
+		return (jt);
+	if (c->nnodes == b->nodes_size) {
+		p = realloc(c->nodes, 2 * b->nodes_size * sizeof(*c->nodes));
+		if (p == NULL) {
+			b->nomem = 1;
+			return (CN_FAIL);
+		}
+		c->nodes = p;
+		b->nodes_size *= 2;
+	}
+	n = &c->nodes[c->nnodes];
+	n->op = op;
+	n->a = a;
+	n->b = bb;
+	n->jt = jt;
+	n->jf = jf;
+	key[0] = (int)op;
+	key[1] = a;
+	key[2] = bb;
+	key[3] = jt;
+	key[4] = jf;
+	i = classifier_hash_find(&b->node_hash, classifier_hash_ints(key, 5),
+	    classifier_node_eq, b);
+	if (i != -1)
+		return (i);
+	if (classifier_hash_add(&b->node_hash, classifier_hash_ints(key, 5),
+	    c->nnodes) == -1) {
+		b->nomem = 1;
+		return (CN_FAIL);
+	}
+	return (c->nnodes++);
+}
+
+/*
+ * Return 1 if expression i is, or has as an operand, expression j.
+ * Operands can be shared, so, rather than look through an exponential
+ * number of them, we give up, returning 0, after looking at *budget.
+ */
+static int
+classifier_expr_uses(const pcap_classifier_t *c, int i, int j, int *budget)
+{
+	const struct classifier_expr *x = &c->exprs[i];
+
+	if (i == j)
+		return (1);
+	if (--*budget <= 0 || x->depth <= c->exprs[j].depth)
+		return (0);
+	if (x->kind == CX_LOAD)
+		return (classifier_expr_uses(c, x->a, j, budget));
+	if (x->kind == CX_ALU)
+		return (classifier_expr_uses(c, x->a, j, budget) ||
+		    classifier_expr_uses(c, x->b, j, budget));
+	return (0);
+}
+
+#define CX_USES_BUDGET	256
+
+static int
+classifier_uses(const pcap_classifier_t *c, int i, int j)
+{
+	int budget = CX_USES_BUDGET;
+
+	return (classifier_expr_uses(c, i, j, &budget));
+}
+
+/*
+ * Return 1 if evaluating expression i can itself reject the packet,
+ * rather than only by way of evaluating its operands.
+ */
+static int
+classifier_can_reject(const pcap_classifier_t *c, int i)
+{
+	const struct classifier_expr *x = &c->exprs[i];
+
+	if (x->kind == CX_LOAD || x->kind == CX_MSH)
+		return (1);
+	return (x->kind == CX_ALU && (x->op == BPF_DIV || x->op == BPF_MOD) &&
+	    (c->exprs[x->b].kind != CX_CONST || c->exprs[x->b].k == 0));
+}
+
+/*
+ * Put guards in front of a node for the expressions that can reject
+ * the packet which were evaluated since the last comparison, other
+ * than the ones that node, or another of them, evaluates anyway.
+ */
+static int
+classifier_guard(struct classifier_build *b, int node, const int *pending,
+    int npending)
+{
+	const pcap_classifier_t *c = b->c;
+	const struct classifier_node *n;
+	int i, j, p;
+
+	for (i = npending - 1; i >= 0 && node != CN_FAIL; i--) {
+		p = pending[i];
+		for (j = 0; j < npending; j++) {
+			if (j != i && pending[j] != p &&
+			    classifier_uses(c, pending[j], p))
+				break;
+		}
+		if (j < npending)
+			continue;
+		if (node >= 0) {
+			n = &c->nodes[node];
+			if (classifier_uses(c, n->a, p) ||
+			    (n->op != CN_GUARD && classifier_uses(c, n->b, p)))
+				continue;
+		}
+		node = classifier_node(b, CN_GUARD, p, p, node, node);
+	}
+	return (node);
+}
+
+static int
+classifier_state_eq(const void *key, int i)
+{
+	const struct classifier_build *b = key;
+	const struct classifier_state *x = &b->states[b->nstates];
+	const struct classifier_state *y = &b->states[i];
+
+	return (x->pc == y->pc &&
+	    memcmp(&x->regs, &y->regs, sizeof(x->regs)) == 0);
+}
+
+/*
+ * Make sure there's room for one more state, returning -1 if there
+ * isn't and can't be.
+ */
+static int
+classifier_state_room(struct classifier_build *b)
+{
+	void *p;
+
+	if (b->nstates < b->states_size)
+		return (0);
+	if (b->nstates == b->max_states)
+		return (-1);
+	p = realloc(b->states, 2 * b->states_size * sizeof(*b->states));
+	if (p == NULL) {
+		b->nomem = 1;
+		return (-1);
+	}
+	b->states = p;
+	b->states_size *= 2;
+	return (0);
+}
+
+/*
+ * Translate the program from instruction pc on, with the registers
+ * and scratch memory holding the given expressions, returning the
+ * node it translates to, or CN_FAIL if it can't be translated.
+ */
+static int
+classifier_translate(struct classifier_build *b, u_int pc,
+    const struct classifier_regs *in)
+{
+	pcap_classifier_t *c = b->c;
+	const struct bpf_insn *insn;
+	struct classifier_regs r;
+	struct classifier_state *st;
+	int pending[CB_MAX_PENDING], npending;
+	int hkey[2 + 2 + BPF_MEMWORDS];
+	u_int hash, target, jt, jf;
+	int operand, e, t, f, node;
+	const struct classifier_expr *xa, *xb;
+	bpf_u_int32 op;
+
+	/*
+	 * Have we been here, with the same registers, before?
+	 */
+	if (classifier_state_room(b) == -1)
+		return (CN_FAIL);
+	st = &b->states[b->nstates];
+	st->pc = pc;
+	st->regs = *in;
+	hkey[0] = (int)pc;
+	memcpy(&hkey[1], in, sizeof(*in));
+	hash = classifier_hash_ints(hkey, 1 + sizeof(*in) / sizeof(int));
+	node = classifier_hash_find(&b->state_hash, hash, classifier_state_eq,
+	    b);
+	if (node != -1)
+		return (b->states[node].node);
+	if (b->depth == CB_MAX_DEPTH)
+		return (CN_FAIL);
+	b->depth++;
+
+	r = *in;
+	npending = 0;
+	node = CN_FAIL;
+	for (;;) {
+		insn = &b->insns[pc];
+		e = -2;		/* nothing new computed */
+		switch (insn->code) {
+
+		case BPF_RET|BPF_K:
+			node = insn->k != 0 ? CN_ACCEPT : CN_REJECT;
+			goto done;
+
+		case BPF_RET|BPF_A:
+			if (c->exprs[r.a].kind == CX_CONST)
+				node = c->exprs[r.a].k != 0 ? CN_ACCEPT :
+				    CN_REJECT;
+			else {
+				operand = classifier_const(b, 0);
+				if (operand == -1)
+					goto done;
+				node = classifier_node(b, BPF_JEQ, r.a, operand,
+				    CN_REJECT, CN_ACCEPT);
+			}
+			goto done;
+
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_B|BPF_ABS:
+		case BPF_LD|BPF_W|BPF_IND:
+		case BPF_LD|BPF_H|BPF_IND:
+		case BPF_LD|BPF_B|BPF_IND:
+			if (BPF_MODE(insn->code) == BPF_ABS) {
+				operand = classifier_const(b, 0);
+				if (operand == -1)
+					goto done;
+			} else
+				operand = r.x;
+			e = r.a = classifier_expr(b, CX_LOAD,
+			    BPF_SIZE(insn->code) == BPF_W ? 4 :
+			    BPF_SIZE(insn->code) == BPF_H ? 2 : 1,
+			    0, operand, 0, insn->k);
+			break;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			e = r.a = classifier_expr(b, CX_LEN, 0, 0, 0, 0, 0);
+			break;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			e = r.x = classifier_expr(b, CX_LEN, 0, 0, 0, 0, 0);
+			break;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			e = r.x = classifier_expr(b, CX_MSH, 0, 0, 0, 0,
+			    insn->k);
+			break;
+
+		case BPF_LD|BPF_IMM:
+			e = r.a = classifier_const(b, insn->k);
+			break;
+
+		case BPF_LDX|BPF_IMM:
+			e = r.x = classifier_const(b, insn->k);
+			break;
+
+		case BPF_LD|BPF_MEM:
+		case BPF_LDX|BPF_MEM:
+			/*
+			 * The interpreter would read whatever was on
+			 * its stack.
+			 */
+			if (r.mem[insn->k] == -1)
+				goto done;
+			if (BPF_CLASS(insn->code) == BPF_LD)
+				r.a = r.mem[insn->k];
+			else
+				r.x = r.mem[insn->k];
+			break;
+
+		case BPF_ST:
+			r.mem[insn->k] = r.a;
+			break;
+
+		case BPF_STX:
+			r.mem[insn->k] = r.x;
+			break;
+
+		case BPF_JMP|BPF_JA:
+			target = pc + 1 + insn->k;
+			if (target <= pc)
+				goto done;	/* backwards */
+			pc = target;
+			continue;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			if (BPF_SRC(insn->code) == BPF_K) {
+				operand = classifier_const(b, insn->k);
+				if (operand == -1)
+					goto done;
+			} else
+				operand = r.x;
+			jt = pc + 1 + insn->jt;
+			jf = pc + 1 + insn->jf;
+			if (jt == jf) {
+				pc = jt;
+				continue;
+			}
+			op = BPF_OP(insn->code);
+			xa = &c->exprs[r.a];
+			xb = &c->exprs[operand];
+			if (xa->kind == CX_CONST && xb->kind == CX_CONST) {
+				pc = classifier_jmp(op, xa->k, xb->k) ?
+				    jt : jf;
+				continue;
+			}
+			t = classifier_translate(b, jt, &r);
+			if (t == CN_FAIL)
+				goto done;
+			f = classifier_translate(b, jf, &r);
+			if (f == CN_FAIL)
+				goto done;
+			node = classifier_node(b, op, r.a, operand, t, f);
+			goto done;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+		case BPF_ALU|BPF_SUB|BPF_K:
+		case BPF_ALU|BPF_MUL|BPF_K:
+		case BPF_ALU|BPF_DIV|BPF_K:
+		case BPF_ALU|BPF_MOD|BPF_K:
+		case BPF_ALU|BPF_AND|BPF_K:
+		case BPF_ALU|BPF_OR|BPF_K:
+		case BPF_ALU|BPF_XOR|BPF_K:
+		case BPF_ALU|BPF_LSH|BPF_K:
+		case BPF_ALU|BPF_RSH|BPF_K:
+		case BPF_ALU|BPF_ADD|BPF_X:
+		case BPF_ALU|BPF_SUB|BPF_X:
+		case BPF_ALU|BPF_MUL|BPF_X:
+		case BPF_ALU|BPF_DIV|BPF_X:
+		case BPF_ALU|BPF_MOD|BPF_X:
+		case BPF_ALU|BPF_AND|BPF_X:
+		case BPF_ALU|BPF_OR|BPF_X:
+		case BPF_ALU|BPF_XOR|BPF_X:
+		case BPF_ALU|BPF_LSH|BPF_X:
+		case BPF_ALU|BPF_RSH|BPF_X:
+			op = BPF_OP(insn->code);
+			if (BPF_SRC(insn->code) == BPF_K) {
+				/*
+				 * The interpreter shifts by a constant
+				 * with a C shift, which is undefined for
+				 * 32 or more.
+				 */
+				if ((op == BPF_LSH || op == BPF_RSH) &&
+				    insn->k >= 32)
+					goto done;
+				operand = classifier_const(b, insn->k);
+				if (operand == -1)
+					goto done;
+			} else
+				operand = r.x;
+			e = r.a = classifier_alu_expr(b, op, r.a, operand);
+			break;
+
+		case BPF_ALU|BPF_NEG:
+			operand = classifier_const(b, 0);
+			if (operand == -1)
+				goto done;
+			e = r.a = classifier_alu_expr(b, BPF_SUB, operand, r.a);
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			r.x = r.a;
+			break;
+
+		case BPF_MISC|BPF_TXA:
+			r.a = r.x;
+			break;
+
+		default:
+			goto done;
+		}
+		if (e == -1)
+			goto done;
+		pc++;
+
+		/*
+		 * If what we just computed can reject the packet, other
+		 * than by way of an operand that we've already noted, it
+		 * has to be checked, even if nothing uses it.
+		 */
+		if (e >= 0 && classifier_can_reject(c, e)) {
+			for (t = 0; t < npending; t++) {
+				if (pending[t] == e)
+					break;
+			}
+			if (t == npending) {
+				if (npending == CB_MAX_PENDING) {
+					/*
+					 * Check it, and the ones we have,
+					 * in front of the rest of the
+					 * program.
+					 */
+					node = classifier_translate(b, pc, &r);
+					if (node != CN_FAIL)
+						node = classifier_guard(b, node,
+						    &e, 1);
+					goto done;
+				}
+				pending[npending++] = e;
+			}
+		}
+	}
+done:
+	b->depth--;
+	if (node == CN_FAIL)
+		return (CN_FAIL);
+	node = classifier_guard(b, node, pending, npending);
+	if (node == CN_FAIL)
+		return (CN_FAIL);
+
+	/*
+	 * Remember what this point translated to.  The recursion
+	 * may have used the entry we compared it in, and moved the
+	 * states.
+	 */
+	if (classifier_state_room(b) == -1)
+		return (CN_FAIL);
+	st = &b->states[b->nstates];
+	st->pc = hkey[0];
+	memcpy(&st->regs, &hkey[1], sizeof(st->regs));
+	st->node = node;
+	if (classifier_hash_add(&b->state_hash, hash, (int)b->nstates) == -1) {
+		b->nomem = 1;
+		return (CN_FAIL);
+	}
+	b->nstates++;
+	return (node);
+}
+
+/*
+ * Limits on merging a group of programs: how many (program, node)
+ * pairs its states can have between them, and how many pairs we look
+ * at working them out, before we split it in two.
+ */
+#define CM_MAX_PAIRS	(1 << 16)
+#define CM_MAX_WORK	(1UL << 22)
+
+/*
+ * Make sure there's room for n more entries after the first count in
+ * an array of *sizep entries of elsize bytes each; returns the array,
+ * which may have moved, or NULL if we run out of memory.
+ */
+static void *
+classifier_grow(struct classifier_build *b, void *p, int *sizep, int count,
+    int n, size_t elsize)
+{
+	int size;
+
+	if (count + n <= *sizep)
+		return (p);
+	size = *sizep != 0 ? *sizep : 64;
+	while (size < count + n)
+		size *= 2;
+	p = realloc(p, size * elsize);
+	if (p == NULL) {
+		b->nomem = 1;
+		return (NULL);
+	}
+	*sizep = size;
+	return (p);
+}
+
+static int
+classifier_mstate_eq(const void *key, int i)
+{
+	const struct classifier_build *b = key;
+	const struct classifier_mstate *st = &b->mstates[i - b->mbase];
+
+	return (st->npairs == b->nnext &&
+	    memcmp(&b->pairs[2 * st->pairs], b->next,
+	    2 * b->nnext * sizeof(*b->next)) == 0);
+}
+
+/*
+ * Return the merged node for the state in b->next, adding it if it's
+ * new, -1 if it's empty, or -2 if we run out of memory or the group
+ * gets too big.
+ */
+static int
+classifier_mstate(struct classifier_build *b)
+{
+	pcap_classifier_t *c = b->c;
+	struct classifier_mstate *st;
+	u_int hash;
+	int m;
+	void *p;
+
+	if (b->nnext == 0)
+		return (-1);
+	hash = classifier_hash_ints(b->next, 2 * b->nnext);
+	m = classifier_hash_find(&b->mstate_hash, hash, classifier_mstate_eq,
+	    b);
+	if (m != -1)
+		return (m);
+	if (b->limit && b->npairs + b->nnext > CM_MAX_PAIRS)
+		return (-2);
+	p = classifier_grow(b, b->pairs, &b->pairs_size, 2 * b->npairs,
+	    2 * b->nnext, sizeof(*b->pairs));
+	if (p == NULL)
+		return (-2);
+	b->pairs = p;
+	p = classifier_grow(b, b->mstates, &b->mstates_size,
+	    c->nmnodes - b->mbase, 1, sizeof(*b->mstates));
+	if (p == NULL)
+		return (-2);
+	b->mstates = p;
+	p = classifier_grow(b, c->mnodes, &b->mnodes_size, c->nmnodes, 1,
+	    sizeof(*c->mnodes));
+	if (p == NULL)
+		return (-2);
+	c->mnodes = p;
+
+	m = c->nmnodes;
+	st = &b->mstates[m - b->mbase];
+	st->pairs = b->npairs;
+	st->npairs = b->nnext;
+	memcpy(&b->pairs[2 * b->npairs], b->next,
+	    2 * b->nnext * sizeof(*b->next));
+	b->npairs += b->nnext;
+	if (classifier_hash_add(&b->mstate_hash, hash, m) == -1) {
+		b->nomem = 1;
+		return (-2);
+	}
+	return (c->nmnodes++);
+}
+
+/*
+ * Work out where the programs in the state in b->cur go on to when
+ * merged node mn's evaluation has the given outcome, v being the
+ * value for CM_CASE, and fill in its edge for that outcome.  Returns
+ * -1 if we run out of memory or the group gets too big.
+ */
+static int
+classifier_follow(struct classifier_build *b,
+    const struct classifier_mnode *mn, int outcome, bpf_u_int32 v)
+{
+	pcap_classifier_t *c = b->c;
+	const struct classifier_node *n;
+	struct classifier_edge *e;
+	int i, prog, node, other, t, accepts, next;
+	void *p;
+
+	accepts = c->naccepts;
+	b->nnext = 0;
+	for (i = 0; i < b->ncur; i++) {
+		prog = b->cur[2 * i];
+		node = b->cur[2 * i + 1];
+		other = CN_REJECT;
+		n = &c->nodes[node];
+		if (n->a == mn->a) {
+			if (outcome == CM_AFAULT)
+				continue;
+			if (n->op == CN_GUARD)
+				node = n->jt;
+			else if (mn->op == CM_SWITCH) {
+				/*
+				 * Knowing the value tells us the outcome
+				 * of every comparison of it for equality
+				 * with a constant.
+				 */
+				if (n->op == BPF_JEQ &&
+				    c->exprs[n->b].kind == CX_CONST) {
+					t = outcome != CM_FALSE &&
+					    c->exprs[n->b].k == v;
+					node = t ? n->jt : n->jf;
+					other = t ? n->jf : n->jt;
+				}
+			} else if (n->op == mn->op && n->b == mn->b) {
+				if (outcome == CM_BFAULT)
+					continue;
+				t = outcome == CM_TRUE;
+				node = t ? n->jt : n->jf;
+				other = t ? n->jf : n->jt;
+			}
+		}
+		if (node == CN_ACCEPT) {
+			p = classifier_grow(b, c->accepts, &b->accepts_size,
+			    c->naccepts, 1, sizeof(*c->accepts));
+			if (p == NULL)
+				return (-1);
+			c->accepts = p;
+			c->accepts[c->naccepts++] = prog;
+
+			/*
+			 * A filter can't stop matching, so a program
+			 * that has accepted the packet can carry on as
+			 * if the comparison had gone the other way;
+			 * that keeps the states for the different
+			 * outcomes the same, when they'd otherwise
+			 * only differ in which programs have accepted.
+			 */
+			node = other;
+		}
+		if (node < 0)
+			continue;
+		b->next[2 * b->nnext] = prog;
+		b->next[2 * b->nnext + 1] = node;
+		b->nnext++;
+	}
+	b->work += b->ncur;
+	if (b->limit && b->work > CM_MAX_WORK)
+		return (-1);
+	next = classifier_mstate(b);
+	if (next == -2)
+		return (-1);
+	e = &c->edges[mn->edge + outcome];
+	e->next = next;
+	e->accepts = accepts;
+	e->naccepts = c->naccepts - accepts;
+	return (0);
+}
+
+static int
+classifier_cmp_vals(const void *a, const void *b)
+{
+	bpf_u_int32 x = *(const bpf_u_int32 *)a;
+	bpf_u_int32 y = *(const bpf_u_int32 *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Fill in merged node m: pick the expression to evaluate, decide what
+ * to do with its value, and work out the states that leads to.
+ * Returns -1 if we run out of memory or the group gets too big.
+ */
+static int
+classifier_merge_node(struct classifier_build *b, int m)
+{
+	pcap_classifier_t *c = b->c;
+	const struct classifier_mstate *st = &b->mstates[m - b->mbase];
+	const struct classifier_node *n;
+	struct classifier_mnode mn;
+	int i, j, best, test, nvals, nedges;
+	void *p;
+
+	b->ncur = st->npairs;
+	memcpy(b->cur, &b->pairs[2 * st->pairs],
+	    2 * b->ncur * sizeof(*b->cur));
+
+	/*
+	 * Run the first program's next node - so that programs are
+	 * finished one after another, rather than the state being made
+	 * of every combination of their progress - along with everything
+	 * else the others can learn from the value of its expression.
+	 */
+	best = c->nodes[b->cur[1]].a;
+	nvals = 0;
+	test = -1;
+	for (i = 0; i < b->ncur; i++) {
+		n = &c->nodes[b->cur[2 * i + 1]];
+		if (n->a != best)
+			continue;
+		if (n->op == BPF_JEQ && c->exprs[n->b].kind == CX_CONST)
+			b->vals[nvals++] = c->exprs[n->b].k;
+		if (n->op != CN_GUARD && test == -1)
+			test = b->cur[2 * i + 1];
+	}
+	if (nvals > 1) {
+		qsort(b->vals, nvals, sizeof(*b->vals), classifier_cmp_vals);
+		for (i = 1, j = 1; i < nvals; i++) {
+			if (b->vals[i] != b->vals[j - 1])
+				b->vals[j++] = b->vals[i];
+		}
+		nvals = j;
+	}
+
+	mn.a = best;
+	mn.b = best;
+	mn.cases = c->ncases;
+	mn.ncases = 0;
+	if (nvals > 1) {
+		mn.op = CM_SWITCH;
+		mn.ncases = nvals;
+		p = classifier_grow(b, c->cases, &b->cases_size, c->ncases,
+		    nvals, sizeof(*c->cases));
+		if (p == NULL)
+			return (-1);
+		c->cases = p;
+		memcpy(&c->cases[c->ncases], b->vals,
+		    nvals * sizeof(*b->vals));
+		c->ncases += nvals;
+	} else if (test != -1) {
+		mn.op = c->nodes[test].op;
+		mn.b = c->nodes[test].b;
+	} else
+		mn.op = CN_GUARD;
+
+	nedges = CM_CASE + mn.ncases;
+	p = classifier_grow(b, c->edges, &b->edges_size, c->nedges, nedges,
+	    sizeof(*c->edges));
+	if (p == NULL)
+		return (-1);
+	c->edges = p;
+	mn.edge = c->nedges;
+	for (i = 0; i < nedges; i++) {
+		c->edges[mn.edge + i].next = -1;
+		c->edges[mn.edge + i].accepts = 0;
+		c->edges[mn.edge + i].naccepts = 0;
+	}
+	c->nedges += nedges;
+
+	if (c->exprs[mn.a].may_fault &&
+	    classifier_follow(b, &mn, CM_AFAULT, 0) == -1)
+		return (-1);
+	if (mn.op == CM_SWITCH) {
+		if (classifier_follow(b, &mn, CM_FALSE, 0) == -1)
+			return (-1);
+		for (i = 0; i < mn.ncases; i++) {
+			if (classifier_follow(b, &mn, CM_CASE + i,
+			    c->cases[mn.cases + i]) == -1)
+				return (-1);
+		}
+	} else {
+		if (classifier_follow(b, &mn, CM_TRUE, 0) == -1)
+			return (-1);
+		if (mn.op != CN_GUARD) {
+			if (classifier_follow(b, &mn, CM_FALSE, 0) == -1)
+				return (-1);
+			if (c->exprs[mn.b].may_fault &&
+			    classifier_follow(b, &mn, CM_BFAULT, 0) == -1)
+				return (-1);
+		}
+	}
+	c->mnodes[m] = mn;
+	return (0);
+}
+
+/*
+ * Merge the DAGs of a group of n programs into one.  Returns -1 if we
+ * run out of memory or the group gets too big.
+ */
+static int
+classifier_merge_group(struct classifier_build *b, const int *progs, int n)
+{
+	pcap_classifier_t *c = b->c;
+	int i, m, root;
+	void *p;
+
+	b->mbase = c->nmnodes;
+	b->npairs = 0;
+	b->work = 0;
+	b->limit = n > 1;
+	classifier_hash_clear(&b->mstate_hash);
+	for (i = 0; i < n; i++) {
+		b->next[2 * i] = progs[i];
+		b->next[2 * i + 1] = c->progs[progs[i]].root;
+	}
+	b->nnext = n;
+	root = classifier_mstate(b);
+	if (root < 0)
+		return (-1);
+	for (m = root; m < c->nmnodes; m++) {
+		if (classifier_merge_node(b, m) == -1)
+			return (-1);
+	}
+	p = classifier_grow(b, c->groups, &b->groups_size, c->ngroups, 1,
+	    sizeof(*c->groups));
+	if (p == NULL)
+		return (-1);
+	c->groups = p;
+	c->groups[c->ngroups++] = root;
+	return (0);
+}
+
+/*
+ * Merge the DAGs of n programs, splitting them into smaller groups
+ * if they'd be too big merged together.  Returns -1 if we run out of
+ * memory.
+ */
+static int
+classifier_merge(struct classifier_build *b, const int *progs, int n)
+{
+	pcap_classifier_t *c = b->c;
+	int nmnodes = c->nmnodes, nedges = c->nedges;
+	int naccepts = c->naccepts, ncases = c->ncases;
+
+	if (classifier_merge_group(b, progs, n) == 0)
+		return (0);
+	if (b->nomem || n == 1)
+		return (-1);
+	c->nmnodes = nmnodes;
+	c->nedges = nedges;
+	c->naccepts = naccepts;
+	c->ncases = ncases;
+	if (classifier_merge(b, progs, n / 2) == -1)
+		return (-1);
+	return (classifier_merge(b, progs + n / 2, n - n / 2));
+}
+
+void
+pcap_classifier_free(pcap_classifier_t *c)
+{
+	int i;
+
+	if (c == NULL)
+		return;
+	if (c->progs != NULL) {
+		for (i = 0; i < c->nprogs; i++) {
+			free(c->progs[i].prog.bf_insns);
+			pcap_free_predecoded(c->progs[i].decoded);
+		}
+		free(c->progs);
+	}
+	free(c->next_filter);
+	free(c->exprs);
+	free(c->nodes);
+	free(c->groups);
+	free(c->mnodes);
+	free(c->edges);
+	free(c->accepts);
+	free(c->cases);
+	free(c->expr_gen);
+	free(c->expr_val);
+	free(c);
+}
+
+/*
+ * Translate all of a classifier's programs, and merge their DAGs.
+ * Returns -1 if we run out of memory.
+ */
+static int
+classifier_build(pcap_classifier_t *c)
+{
+	struct classifier_build b;
+	struct classifier_prog *cp;
+	struct classifier_regs regs;
+	int *live;
+	int i, j, f, n, zero, ret;
+
+	memset(&b, 0, sizeof(b));
+	b.c = c;
+	ret = -1;
+	live = NULL;
+	b.exprs_size = 64;
+	b.nodes_size = 64;
+	b.states_size = 64;
+	c->exprs = malloc(b.exprs_size * sizeof(*c->exprs));
+	c->nodes = malloc(b.nodes_size * sizeof(*c->nodes));
+	b.states = malloc(b.states_size * sizeof(*b.states));
+	if (c->exprs == NULL || c->nodes == NULL || b.states == NULL)
+		goto out;
+
+	zero = classifier_const(&b, 0);
+	if (zero == -1)
+		goto out;
+	for (i = 0; i < c->nprogs; i++) {
+		cp = &c->progs[i];
+		b.insns = cp->prog.bf_insns;
+		b.len = cp->prog.bf_len;
+		b.nstates = 0;
+		b.max_states = CB_STATES_PER_INSN * b.len;
+		if (b.max_states < b.states_size)
+			b.max_states = b.states_size;
+		classifier_hash_clear(&b.state_hash);
+		regs.a = zero;
+		regs.x = zero;
+		for (j = 0; j < BPF_MEMWORDS; j++)
+			regs.mem[j] = -1;
+		cp->root = classifier_translate(&b, 0, &regs);
+		if (b.nomem)
+			goto out;
+		if (cp->root == CN_FAIL)
+			continue;
+
+		/*
+		 * Run it as part of an earlier program that translated
+		 * to the same DAG, if there is one.
+		 */
+		for (j = 0; j < i; j++) {
+			if (c->progs[j].first_filter != -1 &&
+			    c->progs[j].root == cp->root)
+				break;
+		}
+		if (j < i) {
+			for (f = cp->first_filter; c->next_filter[f] != -1;
+			    f = c->next_filter[f])
+				;
+			c->next_filter[f] = c->progs[j].first_filter;
+			c->progs[j].first_filter = cp->first_filter;
+			cp->first_filter = -1;
+		}
+	}
+
+	/*
+	 * Merge the DAGs of the programs that have to be run.
+	 */
+	live = malloc(c->nprogs * sizeof(*live));
+	b.cur = malloc(2 * c->nprogs * sizeof(*b.cur));
+	b.next = malloc(2 * c->nprogs * sizeof(*b.next));
+	b.vals = malloc(c->nprogs * sizeof(*b.vals));
+	if (live == NULL || b.cur == NULL || b.next == NULL || b.vals == NULL)
+		goto out;
+	n = 0;
+	for (i = 0; i < c->nprogs; i++) {
+		if (c->progs[i].first_filter != -1 && c->progs[i].root >= 0)
+			live[n++] = i;
+	}
+	if (n != 0 && classifier_merge(&b, live, n) == -1)
+		goto out;
+
+	c->expr_gen = calloc(c->nexprs, sizeof(*c->expr_gen));
+	c->expr_val = malloc(c->nexprs * sizeof(*c->expr_val));
+	if (c->expr_gen == NULL || c->expr_val == NULL)
+		goto out;
+	c->gen = 2;
+	ret = 0;
+out:
+	free(b.expr_hash.slots);
+	free(b.node_hash.slots);
+	free(b.state_hash.slots);
+	free(b.states);
+	free(live);
+	free(b.cur);
+	free(b.next);
+	free(b.vals);
+	free(b.mstate_hash.slots);
+	free(b.mstates);
+	free(b.pairs);
+	return (ret);
+}
+
+pcap_classifier_t *
+pcap_classifier_create(const struct bpf_program *fps, int n, char *errbuf)
+{
+	pcap_classifier_t *c;
+	struct classifier_prog *cp;
+	size_t size;
+	int i, j;
+
+	if (n <= 0) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "The number of filters must be positive");
+		return (NULL);
+	}
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (NULL);
+	}
+	c->nfilters = n;
+	c->next_filter = malloc(n * sizeof(*c->next_filter));
+	c->progs = calloc(n, sizeof(*c->progs));
+	if (c->next_filter == NULL || c->progs == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		pcap_classifier_free(c);
+		return (NULL);
+	}
+
+	/*
+	 * Copy the programs, leaving out duplicates.
+	 */
+	for (i = 0; i < n; i++) {
+		if (!pcap_validate_filter(fps[i].bf_insns, fps[i].bf_len)) {
+			snprintf(errbuf, PCAP_ERRBUF_SIZE,
+			    "Filter %d is not a valid BPF program", i);
+			pcap_classifier_free(c);
+			return (NULL);
+		}
+		size = fps[i].bf_len * sizeof(*fps[i].bf_insns);
+		for (j = 0; j < c->nprogs; j++) {
+			if (c->progs[j].prog.bf_len == fps[i].bf_len &&
+			    memcmp(c->progs[j].prog.bf_insns, fps[i].bf_insns,
+			    size) == 0)
+				break;
+		}
+		cp = &c->progs[j];
+		if (j == c->nprogs) {
+			c->nprogs++;
+			cp->first_filter = -1;
+			cp->prog.bf_len = fps[i].bf_len;
+			cp->prog.bf_insns = malloc(size);
+			if (cp->prog.bf_insns == NULL) {
+				pcap_fmt_errmsg_for_errno(errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "malloc");
+				pcap_classifier_free(c);
+				return (NULL);
+			}
+			memcpy(cp->prog.bf_insns, fps[i].bf_insns, size);
+		}
+		c->next_filter[i] = cp->first_filter;
+		cp->first_filter = i;
+	}
+
+	if (classifier_build(c) == -1) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		pcap_classifier_free(c);
+		return (NULL);
+	}
+
+	/*
+	 * The programs we couldn't translate are interpreted; pre-decode
+	 * them if we can.
+	 */
+	for (j = 0; j < c->nprogs; j++) {
+		cp = &c->progs[j];
+		if (cp->root == CN_FAIL)
+			cp->decoded = pcap_predecode_filter(cp->prog.bf_insns,
+			    cp->prog.bf_len);
+	}
+	return (c);
+}
+
+/*
+ * Evaluate an expression for the current packet, returning -1 if that
+ * rejects the packet.
+ */
+static int
+classifier_eval_expr(pcap_classifier_t *c, int i, const struct pcap_pkthdr *h,
+    const u_char *pkt, bpf_u_int32 *vp)
+{
+	const struct classifier_expr *x = &c->exprs[i];
+	bpf_u_int32 a, b, v;
+
+	if (x->kind == CX_CONST) {
+		*vp = x->k;
+		return (0);
+	}
+	if (c->expr_gen[i] == c->gen) {
+		*vp = c->expr_val[i];
+		return (0);
+	}
+	if (c->expr_gen[i] == c->gen + 1)
+		return (-1);
+	switch (x->kind) {
+
+	case CX_LEN:
+		v = h->len;
+		break;
+
+	case CX_LOAD:
+		if (classifier_eval_expr(c, x->a, h, pkt, &a) == -1)
+			goto reject;
+		if ((uint64_t)a + x->k + x->size > h->caplen)
+			goto reject;
+		a += x->k;
+		if (x->size == 4)
+			v = EXTRACT_BE_U_4(&pkt[a]);
+		else if (x->size == 2)
+			v = EXTRACT_BE_U_2(&pkt[a]);
+		else
+			v = pkt[a];
+		break;
+
+	case CX_MSH:
+		if (x->k >= h->caplen)
+			goto reject;
+		v = (pkt[x->k] & 0xf) << 2;
+		break;
+
+	default:	/* CX_ALU */
+		if (classifier_eval_expr(c, x->a, h, pkt, &a) == -1 ||
+		    classifier_eval_expr(c, x->b, h, pkt, &b) == -1 ||
+		    classifier_alu(x->op, a, b, &v) == -1)
+			goto reject;
+		break;
+	}
+	c->expr_gen[i] = c->gen;
+	c->expr_val[i] = v;
+	*vp = v;
+	return (0);
+
+reject:
+	c->expr_gen[i] = c->gen + 1;
+	return (-1);
+}
+
+/*
+ * Follow a group's merged nodes from m for the current packet, setting
+ * the bits in matches for the filters that accept it.
+ */
+static void
+classifier_run(pcap_classifier_t *c, int m, const struct pcap_pkthdr *h,
+    const u_char *pkt, uint32_t *matches)
+{
+	const struct classifier_mnode *mn;
+	const struct classifier_edge *e;
+	const bpf_u_int32 *cases;
+	bpf_u_int32 a, b;
+	int i, lo, hi, f;
+
+	while (m != -1) {
+		mn = &c->mnodes[m];
+		if (classifier_eval_expr(c, mn->a, h, pkt, &a) == -1)
+			i = CM_AFAULT;
+		else if (mn->op == CN_GUARD)
+			i = CM_TRUE;
+		else if (mn->op == CM_SWITCH) {
+			cases = &c->cases[mn->cases];
+			lo = 0;
+			hi = mn->ncases;
+			while (lo < hi) {
+				i = lo + (hi - lo) / 2;
+				if (cases[i] < a)
+					lo = i + 1;
+				else
+					hi = i;
+			}
+			i = lo < mn->ncases && cases[lo] == a ? CM_CASE + lo :
+			    CM_FALSE;
+		} else if (classifier_eval_expr(c, mn->b, h, pkt, &b) == -1)
+			i = CM_BFAULT;
+		else
+			i = classifier_jmp(mn->op, a, b) ? CM_TRUE : CM_FALSE;
+		e = &c->edges[mn->edge + i];
+		for (i = e->accepts; i < e->accepts + e->naccepts; i++) {
+			for (f = c->progs[c->accepts[i]].first_filter; f != -1;
+			    f = c->next_filter[f])
+				matches[f / 32] |= (uint32_t)1 << (f % 32);
+		}
+		m = e->next;
+	}
+}
+
+/*
+ * Run all of a classifier's filters over a packet, setting bit i % 32
+ * of matches[i / 32] if filter i matches and clearing it otherwise;
+ * returns the number of filters that match.
+ */
+int
+pcap_classify(pcap_classifier_t *c, const struct pcap_pkthdr *h,
+    const u_char *pkt, uint32_t *matches)
+{
+	const struct classifier_prog *cp;
+	int count, i, f;
+	u_int r;
+	uint32_t w;
+
+	memset(matches, 0, ((c->nfilters + 31) / 32) * sizeof(*matches));
+
+	/*
+	 * Forget the last packet's values, starting the stamps again if
+	 * they wrap.
+	 */
+	c->gen += 2;
+	if (c->gen == 0) {
+		memset(c->expr_gen, 0, c->nexprs * sizeof(*c->expr_gen));
+		c->gen = 2;
+	}
+
+	for (i = 0; i < c->ngroups; i++)
+		classifier_run(c, c->groups[i], h, pkt, matches);
+
+	/*
+	 * Run the programs that aren't in a group.
+	 */
+	for (i = 0; i < c->nprogs; i++) {
+		cp = &c->progs[i];
+		if (cp->first_filter == -1 || cp->root >= 0)
+			continue;
+		if (cp->root == CN_ACCEPT)
+			r = 1;
+		else if (cp->root == CN_REJECT)
+			r = 0;
+		else if (cp->decoded != NULL)
+			r = pcap_filter_predecoded(cp->decoded, pkt, h->len,
+			    h->caplen, NULL);
+		else
+			r = pcap_filter(cp->prog.bf_insns, pkt, h->len,
+			    h->caplen);
+		if (r == 0)
+			continue;
+		for (f = cp->first_filter; f != -1; f = c->next_filter[f])
+			matches[f / 32] |= (uint32_t)1 << (f % 32);
+	}
+
+	/*
+	 * A group can set a filter's bit more than once, so count the
+	 * bits.
+	 */
+	count = 0;
+	for (i = 0; i < (c->nfilters + 31) / 32; i++) {
+		for (w = matches[i]; w != 0; w &= w - 1)
+			count++;
+	}
+	return (count);
+}
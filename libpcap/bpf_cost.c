@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 1990, 1991, 1992, 1994, 1995, 1996
+ *	The Regents of the University of California.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that: (1) source code distributions
+ * retain the above copyright notice and this paragraph in its entirety, (2)
+ * distributions including binary code include the above copyright notice and
+ * this paragraph in its entirety in the documentation or other materials
+ * provided with the distribution, and (3) all advertising materials mentioning
+ * features or use of this software display the following acknowledgement:
+ * ``This product includes software developed by the University of California,
+ * Lawrence Berkeley Laboratory and its contributors.'' Neither the name of
+ * the University nor the names of its contributors may be used to endorse
+ * or promote products derived from this software without specific prior
+ * written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * Static cost analysis and execution profiles of filter programs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pcap-types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcap-int.h"
+
+/*
+ * A range of packet bytes read by loads at fixed offsets.
+ */
+struct load_range {
+	bpf_u_int32	start;
+	bpf_u_int32	end;	/* one past the last byte */
+};
+
+static int
+load_range_cmp(const void *a, const void *b)
+{
+	const struct load_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start ? -1 : 1);
+	return (ra->end < rb->end ? -1 : ra->end > rb->end);
+}
+
+/*
+ * Return the number of bytes a packet data load reads, or 0 if the
+ * instruction isn't one.  Loads of Linux's special locations don't
+ * read packet data, but we don't try to tell them apart.
+ */
+static u_int
+load_size(u_short code)
+{
+	if (BPF_CLASS(code) == BPF_LDX)
+		return (BPF_MODE(code) == BPF_MSH ? 1 : 0);
+	if (BPF_CLASS(code) != BPF_LD)
+		return (0);
+	if (BPF_MODE(code) != BPF_ABS && BPF_MODE(code) != BPF_IND)
+		return (0);
+	switch (BPF_SIZE(code)) {
+
+	case BPF_W:
+		return (4);
+
+	case BPF_H:
+		return (2);
+
+	default:
+		return (1);
+	}
+}
+
+/*
+ * Find the ranges of packet bytes read by loads at fixed offsets,
+ * sorted and with overlapping and adjacent ranges merged.  Returns
+ * the number of ranges, or -1 if we run out of memory; *rangesp is
+ * set to an allocated array of them, or NULL if there are none.
+ */
+static int
+load_ranges(const struct bpf_program *fp, struct load_range **rangesp)
+{
+	struct load_range *ranges;
+	const struct bpf_insn *insn;
+	u_int i, size;
+	int n, m;
+
+	*rangesp = NULL;
+	ranges = malloc(fp->bf_len * sizeof(*ranges));
+	if (ranges == NULL)
+		return (-1);
+	n = 0;
+	for (i = 0; i < fp->bf_len; i++) {
+		insn = &fp->bf_insns[i];
+		size = load_size(insn->code);
+		if (size == 0 || BPF_MODE(insn->code) == BPF_IND)
+			continue;
+		ranges[n].start = insn->k;
+		ranges[n].end = insn->k > 0xffffffffU - size ?
+		    0xffffffffU : insn->k + size;
+		n++;
+	}
+	if (n == 0) {
+		free(ranges);
+		return (0);
+	}
+	qsort(ranges, n, sizeof(*ranges), load_range_cmp);
+	m = 0;
+	for (i = 1; i < (u_int)n; i++) {
+		if (ranges[i].start <= ranges[m].end) {
+			if (ranges[i].end > ranges[m].end)
+				ranges[m].end = ranges[i].end;
+		} else
+			ranges[++m] = ranges[i];
+	}
+	*rangesp = ranges;
+	return (m + 1);
+}
+
+/*
+ * Compute the static cost of a filter program.  Path lengths are
+ * worked out backwards from the end of the program, as every
+ * instruction but a backward jump can only go forward; a backward
+ * jump, used by "ip6 protochain", is counted as ending its path.
+ */
+int
+pcap_analyze_filter(const struct bpf_program *fp, struct pcap_filter_cost *cost)
+{
+	const struct bpf_insn *insn;
+	u_int *minp, *maxp;
+	double *avgp;
+	struct load_range *ranges;
+	u_int i, size, t, f;
+	int nranges, r;
+
+	memset(cost, 0, sizeof(*cost));
+	if (fp->bf_insns == NULL ||
+	    !pcap_validate_filter(fp->bf_insns, fp->bf_len))
+		return (PCAP_ERROR);
+
+	minp = malloc(fp->bf_len * sizeof(*minp));
+	maxp = malloc(fp->bf_len * sizeof(*maxp));
+	avgp = malloc(fp->bf_len * sizeof(*avgp));
+	if (minp == NULL || maxp == NULL || avgp == NULL) {
+		free(minp);
+		free(maxp);
+		free(avgp);
+		return (PCAP_ERROR);
+	}
+	cost->fc_insns = fp->bf_len;
+	for (i = fp->bf_len; i-- > 0; ) {
+		insn = &fp->bf_insns[i];
+		size = load_size(insn->code);
+		if (size != 0) {
+			if (BPF_MODE(insn->code) == BPF_IND)
+				cost->fc_ind_loads++;
+			else
+				cost->fc_loads++;
+		}
+		switch (BPF_CLASS(insn->code)) {
+
+		case BPF_RET:
+			minp[i] = maxp[i] = 1;
+			avgp[i] = 1;
+			break;
+
+		case BPF_JMP:
+			if (BPF_OP(insn->code) == BPF_JA) {
+				t = i + 1 + insn->k;
+				if (t <= i) {
+					cost->fc_loops = 1;
+					minp[i] = maxp[i] = 1;
+					avgp[i] = 1;
+				} else {
+					minp[i] = 1 + minp[t];
+					maxp[i] = 1 + maxp[t];
+					avgp[i] = 1 + avgp[t];
+				}
+				break;
+			}
+			t = i + 1 + insn->jt;
+			f = i + 1 + insn->jf;
+			minp[i] = 1 + (minp[t] < minp[f] ? minp[t] : minp[f]);
+			maxp[i] = 1 + (maxp[t] > maxp[f] ? maxp[t] : maxp[f]);
+			avgp[i] = 1 + (avgp[t] + avgp[f]) / 2;
+			break;
+
+		default:
+			minp[i] = 1 + minp[i + 1];
+			maxp[i] = 1 + maxp[i + 1];
+			avgp[i] = 1 + avgp[i + 1];
+			break;
+		}
+	}
+	cost->fc_min_path = minp[0];
+	cost->fc_max_path = maxp[0];
+	cost->fc_avg_path = avgp[0];
+	free(minp);
+	free(maxp);
+	free(avgp);
+
+	nranges = load_ranges(fp, &ranges);
+	if (nranges == -1)
+		return (PCAP_ERROR);
+	for (r = 0; r < nranges; r++)
+		cost->fc_offsets += ranges[r].end - ranges[r].start;
+	if (nranges != 0)
+		cost->fc_max_offset = ranges[nranges - 1].end;
+	free(ranges);
+	return (0);
+}
+
+/*
+ * Print the static cost of a filter program, and the ranges of packet
+ * bytes it reads at fixed offsets.
+ */
+void
+bpf_dump_cost(const struct bpf_program *fp)
+{
+	struct pcap_filter_cost cost;
+	struct load_range *ranges;
+	bpf_u_int32 maxoff;
+	int nranges, r;
+
+	if (pcap_analyze_filter(fp, &cost) == PCAP_ERROR) {
+		printf("(invalid program)\n");
+		return;
+	}
+	printf("instructions: %u\n", cost.fc_insns);
+	printf("path length: min %u, max %u, average %.1f%s\n",
+	    cost.fc_min_path, cost.fc_max_path, cost.fc_avg_path,
+	    cost.fc_loops ? " (loops counted once)" : "");
+	printf("loads: %u at fixed offsets, %u at variable offsets\n",
+	    cost.fc_loads, cost.fc_ind_loads);
+	if (pcap_filter_max_offset(fp, &maxoff, NULL) == 0) {
+		if (maxoff == PCAP_FILTER_UNBOUNDED)
+			printf("packet bytes needed: unbounded\n");
+		else
+			printf("packet bytes needed: %u\n", maxoff);
+	}
+	nranges = load_ranges(fp, &ranges);
+	if (nranges <= 0)
+		return;
+	printf("bytes read at fixed offsets:");
+	for (r = 0; r < nranges; r++) {
+		if (ranges[r].end - ranges[r].start == 1)
+			printf(" %u", ranges[r].start);
+		else
+			printf(" %u-%u", ranges[r].start, ranges[r].end - 1);
+	}
+	printf("\n");
+	free(ranges);
+}
+
+struct pcap_filter_profile *
+pcap_filter_profile_create(const struct bpf_program *fp, char *errbuf)
+{
+	struct pcap_filter_profile *prof;
+
+	if (fp->bf_insns == NULL || fp->bf_len == 0) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "The filter program is empty");
+		return (NULL);
+	}
+	prof = calloc(1, sizeof(*prof));
+	if (prof == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (NULL);
+	}
+	prof->fp_len = fp->bf_len;
+	prof->fp_executed = calloc(fp->bf_len, sizeof(*prof->fp_executed));
+	prof->fp_taken = calloc(fp->bf_len, sizeof(*prof->fp_taken));
+	if (prof->fp_executed == NULL || prof->fp_taken == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		pcap_filter_profile_free(prof);
+		return (NULL);
+	}
+	return (prof);
+}
+
+void
+pcap_filter_profile_free(struct pcap_filter_profile *prof)
+{
+	if (prof == NULL)
+		return;
+	free(prof->fp_executed);
+	free(prof->fp_taken);
+	free(prof);
+}
+
+/*
+ * Print a filter program with the number of times each instruction
+ * was executed and, for conditional jumps, the number of times the
+ * jump was taken.
+ */
+void
+bpf_dump_profile(const struct bpf_program *fp,
+    const struct pcap_filter_profile *prof)
+{
+	const struct bpf_insn *insn;
+	u_int i;
+
+	printf("%llu packets, %llu accepted\n",
+	    (unsigned long long)prof->fp_runs,
+	    (unsigned long long)prof->fp_accepted);
+	for (i = 0; i < fp->bf_len && i < prof->fp_len; i++) {
+		insn = &fp->bf_insns[i];
+		printf("%12llu  %s", (unsigned long long)prof->fp_executed[i],
+		    bpf_image(insn, i));
+		if (BPF_CLASS(insn->code) == BPF_JMP &&
+		    BPF_OP(insn->code) != BPF_JA)
+			printf("  [taken %llu]",
+			    (unsigned long long)prof->fp_taken[i]);
+		printf("\n");
+	}
+}
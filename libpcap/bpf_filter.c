@@ -72,6 +72,19 @@ enum {
         BPF_S_ANC_VLAN_TAG_PRESENT,
 };
 
+/*
+ * Force the interpreter to be expanded separately into
+ * pcap_filter_with_aux_data() and pcap_filter_profile(), so that the
+ * former has no profiling checks left in its loop.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define BPF_ALWAYS_INLINE	inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define BPF_ALWAYS_INLINE	__forceinline
+#else
+#define BPF_ALWAYS_INLINE	inline
+#endif
+
 /*
  * Execute the filter program starting at pc on the packet p
  * wirelen is the length of the original packet
@@ -79,24 +92,29 @@ enum {
  * aux_data is auxiliary data, currently used only when interpreting
  * filters intended for the Linux kernel in cases where the kernel
  * rejects the filter; it contains VLAN tag information
+ * prof, if not null, has the count for each instruction executed, and
+ * for each conditional jump taken, incremented
  * For the kernel, p is assumed to be a pointer to an mbuf if buflen is 0,
  * in all other cases, p is a pointer to a buffer and buflen is its size.
  *
  * Thanks to Ani Sinha <ani@arista.com> for providing initial implementation
  */
 #if defined(SKF_AD_VLAN_TAG_PRESENT)
-u_int
-pcap_filter_with_aux_data(const struct bpf_insn *pc, const u_char *p,
-    u_int wirelen, u_int buflen, const struct pcap_bpf_aux_data *aux_data)
+static BPF_ALWAYS_INLINE u_int
+bpf_run(const struct bpf_insn *pc, const u_char *p, u_int wirelen,
+    u_int buflen, const struct pcap_bpf_aux_data *aux_data,
+    struct pcap_filter_profile *prof)
 #else
-u_int
-pcap_filter_with_aux_data(const struct bpf_insn *pc, const u_char *p,
-    u_int wirelen, u_int buflen, const struct pcap_bpf_aux_data *aux_data _U_)
+static BPF_ALWAYS_INLINE u_int
+bpf_run(const struct bpf_insn *pc, const u_char *p, u_int wirelen,
+    u_int buflen, const struct pcap_bpf_aux_data *aux_data _U_,
+    struct pcap_filter_profile *prof)
 #endif
 {
 	register uint32_t A, X;
 	register bpf_u_int32 k;
 	uint32_t mem[BPF_MEMWORDS];
+	const struct bpf_insn *start, *last;
 
 	if (pc == 0)
 		/*
@@ -105,9 +123,23 @@ pcap_filter_with_aux_data(const struct bpf_insn *pc, const u_char *p,
 		return (u_int)-1;
 	A = 0;
 	X = 0;
+	start = pc;
+	last = NULL;
 	--pc;
 	for (;;) {
 		++pc;
+		if (prof != NULL) {
+			/*
+			 * Count this instruction, and, if the last one
+			 * was a conditional jump, whether it was taken.
+			 */
+			prof->fp_executed[pc - start]++;
+			if (last != NULL && BPF_CLASS(last->code) == BPF_JMP &&
+			    BPF_OP(last->code) != BPF_JA &&
+			    pc == last + 1 + last->jt)
+				prof->fp_taken[last - start]++;
+			last = pc;
+		}
 		switch (pc->code) {
 
 		default:
@@ -387,6 +419,33 @@ DIAG_ON_DEFAULT_ONLY_SWITCH
 	}
 }
 
+u_int
+pcap_filter_with_aux_data(const struct bpf_insn *pc, const u_char *p,
+    u_int wirelen, u_int buflen, const struct pcap_bpf_aux_data *aux_data)
+{
+	return bpf_run(pc, p, wirelen, buflen, aux_data, NULL);
+}
+
+/*
+ * Run a filter program as pcap_filter_with_aux_data() does, counting,
+ * in prof, the packet, whether it was accepted, and the instructions
+ * executed and branches taken.  prof must have been created for the
+ * program.
+ */
+u_int
+pcap_filter_profile(const struct bpf_insn *pc, const u_char *p,
+    u_int wirelen, u_int buflen, const struct pcap_bpf_aux_data *aux_data,
+    struct pcap_filter_profile *prof)
+{
+	u_int ret;
+
+	ret = bpf_run(pc, p, wirelen, buflen, aux_data, prof);
+	prof->fp_runs++;
+	if (ret != 0)
+		prof->fp_accepted++;
+	return ret;
+}
+
 u_int
 pcap_filter(const struct bpf_insn *pc, const u_char *p, u_int wirelen,
     u_int buflen)
@@ -394,6 +453,777 @@ pcap_filter(const struct bpf_insn *pc, const u_char *p, u_int wirelen,
 	return pcap_filter_with_aux_data(pc, p, wirelen, buflen, NULL);
 }
 
+/*
+ * Pre-decoded form of a validated filter program, for running it
+ * many times: each instruction's opcode is mapped to the index of
+ * its handler, branch offsets are resolved to instruction indices,
+ * and the range check for BPF_ABS loads is folded into a single
+ * comparison against the end of the load (loads that can never be
+ * in range become "return 0").  Runs of loads and comparisons of
+ * up to 16 bytes of packet data, such as IPv6 and MAC address tests,
+ * become single 64-bit or 128-bit comparisons, which classic BPF has
+ * no instructions for; see bpf_lower_wide().  When the compiler
+ * supports it, the handlers are dispatched with computed gotos, which gives each
+ * handler its own indirect branch rather than having them all share
+ * the branch of a switch.
+ *
+ * The results are the same as those of pcap_filter_with_aux_data()
+ * for the same program; as there, the program must have been checked
+ * with pcap_validate_filter() first.
+ */
+#if defined(__GNUC__)
+#define BPF_COMPUTED_GOTO
+#endif
+
+#define BPF_DECODED_OPS \
+	OP(RET_K) OP(RET_A) \
+	OP(LD_W_ABS) OP(LD_H_ABS) OP(LD_B_ABS) \
+	OP(LD_VLAN_TAG) OP(LD_VLAN_TAG_PRESENT) \
+	OP(LD_W_IND) OP(LD_H_IND) OP(LD_B_IND) OP(LDX_MSH_B) \
+	OP(LD_LEN) OP(LDX_LEN) OP(LD_IMM) OP(LDX_IMM) \
+	OP(LD_MEM) OP(LDX_MEM) OP(ST) OP(STX) \
+	OP(JA) OP(JGT_K) OP(JGE_K) OP(JEQ_K) OP(JSET_K) \
+	OP(JGT_X) OP(JGE_X) OP(JEQ_X) OP(JSET_X) \
+	OP(ADD_X) OP(SUB_X) OP(MUL_X) OP(DIV_X) OP(MOD_X) \
+	OP(AND_X) OP(OR_X) OP(XOR_X) OP(LSH_X) OP(RSH_X) \
+	OP(ADD_K) OP(SUB_K) OP(MUL_K) OP(DIV_K) OP(MOD_K) \
+	OP(AND_K) OP(OR_K) OP(XOR_K) OP(LSH_K) OP(RSH_K) \
+	OP(NEG) OP(TAX) OP(TXA) \
+	OP(WIDE64_ABS) OP(WIDE128_ABS) OP(WIDE64_IND) OP(WIDE128_IND)
+
+enum {
+#define OP(name)	BPF_D_##name,
+	BPF_DECODED_OPS
+#undef OP
+};
+
+struct bpf_decoded_insn {
+	u_int		op;	/* BPF_D_ handler */
+	bpf_u_int32	k;
+	bpf_u_int32	end;	/* BPF_ABS loads: k plus the size loaded */
+	u_int		jt;	/* instruction to go to if true, or next */
+	u_int		jf;	/* instruction to go to if false */
+};
+
+struct bpf_decoded {
+	u_int			len;
+	struct bpf_wide_cmp	*wide;	/* see bpf_lower_wide() */
+	struct bpf_decoded_insn	insns[];
+};
+
+/*
+ * Handler for a BPF_ABS load of size bytes; if k + size overflows,
+ * the load can't succeed whatever the buffer length.
+ */
+static void
+predecode_abs_load(struct bpf_decoded_insn *dp, u_int op, bpf_u_int32 k,
+    u_int size)
+{
+	if (k > 0xffffffffU - size) {
+		dp->op = BPF_D_RET_K;
+		dp->k = 0;
+	} else {
+		dp->op = op;
+		dp->end = k + size;
+	}
+}
+
+/*
+ * Pre-decode a validated program; returns NULL if it can't be
+ * allocated or has an instruction the interpreter doesn't handle.
+ */
+struct bpf_decoded *
+pcap_predecode_filter(const struct bpf_insn *f, u_int len)
+{
+	struct bpf_decoded *d;
+	struct bpf_decoded_insn *dp;
+	const struct bpf_insn *p;
+	struct bpf_wide_cmp *w;
+	size_t count = len;
+	u_int i;
+	int nwide;
+
+	if (count == 0 ||
+	    count > (SIZE_MAX - sizeof(*d)) / sizeof(d->insns[0]))
+		return NULL;
+	d = malloc(sizeof(*d) + count * sizeof(d->insns[0]));
+	if (d == NULL)
+		return NULL;
+	d->len = len;
+	d->wide = NULL;
+	for (i = 0; i < len; i++) {
+		p = &f[i];
+		dp = &d->insns[i];
+		dp->k = p->k;
+		dp->end = 0;
+		dp->jt = i + 1;
+		dp->jf = i + 1;
+		switch (p->code) {
+
+		case BPF_RET|BPF_K:
+			dp->op = BPF_D_RET_K;
+			break;
+
+		case BPF_RET|BPF_A:
+			dp->op = BPF_D_RET_A;
+			break;
+
+		case BPF_LD|BPF_W|BPF_ABS:
+			predecode_abs_load(dp, BPF_D_LD_W_ABS, p->k, 4);
+			break;
+
+		case BPF_LD|BPF_H|BPF_ABS:
+			predecode_abs_load(dp, BPF_D_LD_H_ABS, p->k, 2);
+			break;
+
+		case BPF_LD|BPF_B|BPF_ABS:
+DIAG_OFF_DEFAULT_ONLY_SWITCH
+			switch (p->k) {
+
+#if defined(SKF_AD_VLAN_TAG_PRESENT)
+			case SKF_AD_OFF + SKF_AD_VLAN_TAG:
+				dp->op = BPF_D_LD_VLAN_TAG;
+				break;
+
+			case SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT:
+				dp->op = BPF_D_LD_VLAN_TAG_PRESENT;
+				break;
+#endif
+			default:
+				predecode_abs_load(dp, BPF_D_LD_B_ABS, p->k, 1);
+				break;
+			}
+DIAG_ON_DEFAULT_ONLY_SWITCH
+			break;
+
+		case BPF_LD|BPF_W|BPF_IND:
+			dp->op = BPF_D_LD_W_IND;
+			break;
+
+		case BPF_LD|BPF_H|BPF_IND:
+			dp->op = BPF_D_LD_H_IND;
+			break;
+
+		case BPF_LD|BPF_B|BPF_IND:
+			dp->op = BPF_D_LD_B_IND;
+			break;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			predecode_abs_load(dp, BPF_D_LDX_MSH_B, p->k, 1);
+			break;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			dp->op = BPF_D_LD_LEN;
+			break;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			dp->op = BPF_D_LDX_LEN;
+			break;
+
+		case BPF_LD|BPF_IMM:
+			dp->op = BPF_D_LD_IMM;
+			break;
+
+		case BPF_LDX|BPF_IMM:
+			dp->op = BPF_D_LDX_IMM;
+			break;
+
+		case BPF_LD|BPF_MEM:
+			dp->op = BPF_D_LD_MEM;
+			break;
+
+		case BPF_LDX|BPF_MEM:
+			dp->op = BPF_D_LDX_MEM;
+			break;
+
+		case BPF_ST:
+			dp->op = BPF_D_ST;
+			break;
+
+		case BPF_STX:
+			dp->op = BPF_D_STX;
+			break;
+
+		case BPF_JMP|BPF_JA:
+			/*
+			 * As in the interpreter, backward jumps are
+			 * allowed; the offset wraps to the right index.
+			 */
+			dp->op = BPF_D_JA;
+			dp->jt = i + 1 + p->k;
+			break;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			switch (BPF_OP(p->code)) {
+
+			case BPF_JGT:
+				dp->op = BPF_SRC(p->code) == BPF_K ?
+				    BPF_D_JGT_K : BPF_D_JGT_X;
+				break;
+
+			case BPF_JGE:
+				dp->op = BPF_SRC(p->code) == BPF_K ?
+				    BPF_D_JGE_K : BPF_D_JGE_X;
+				break;
+
+			case BPF_JEQ:
+				dp->op = BPF_SRC(p->code) == BPF_K ?
+				    BPF_D_JEQ_K : BPF_D_JEQ_X;
+				break;
+
+			case BPF_JSET:
+				dp->op = BPF_SRC(p->code) == BPF_K ?
+				    BPF_D_JSET_K : BPF_D_JSET_X;
+				break;
+			}
+			dp->jt = i + 1 + p->jt;
+			dp->jf = i + 1 + p->jf;
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+			dp->op = BPF_D_ADD_X;
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_X:
+			dp->op = BPF_D_SUB_X;
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_X:
+			dp->op = BPF_D_MUL_X;
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			dp->op = BPF_D_DIV_X;
+			break;
+
+		case BPF_ALU|BPF_MOD|BPF_X:
+			dp->op = BPF_D_MOD_X;
+			break;
+
+		case BPF_ALU|BPF_AND|BPF_X:
+			dp->op = BPF_D_AND_X;
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_X:
+			dp->op = BPF_D_OR_X;
+			break;
+
+		case BPF_ALU|BPF_XOR|BPF_X:
+			dp->op = BPF_D_XOR_X;
+			break;
+
+		case BPF_ALU|BPF_LSH|BPF_X:
+			dp->op = BPF_D_LSH_X;
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_X:
+			dp->op = BPF_D_RSH_X;
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			dp->op = BPF_D_ADD_K;
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_K:
+			dp->op = BPF_D_SUB_K;
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_K:
+			dp->op = BPF_D_MUL_K;
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_K:
+			dp->op = BPF_D_DIV_K;
+			break;
+
+		case BPF_ALU|BPF_MOD|BPF_K:
+			dp->op = BPF_D_MOD_K;
+			break;
+
+		case BPF_ALU|BPF_AND|BPF_K:
+			dp->op = BPF_D_AND_K;
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_K:
+			dp->op = BPF_D_OR_K;
+			break;
+
+		case BPF_ALU|BPF_XOR|BPF_K:
+			dp->op = BPF_D_XOR_K;
+			break;
+
+		case BPF_ALU|BPF_LSH|BPF_K:
+			dp->op = BPF_D_LSH_K;
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_K:
+			dp->op = BPF_D_RSH_K;
+			break;
+
+		case BPF_ALU|BPF_NEG:
+			dp->op = BPF_D_NEG;
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			dp->op = BPF_D_TAX;
+			break;
+
+		case BPF_MISC|BPF_TXA:
+			dp->op = BPF_D_TXA;
+			break;
+
+		default:
+			free(d);
+			return NULL;
+		}
+	}
+
+	/*
+	 * Replace the first instruction of each run of comparisons
+	 * that can be done at once with the wide comparison; the
+	 * rest of the run is then never reached.  If that can't be
+	 * done, the program is still run correctly, just more slowly.
+	 */
+	nwide = bpf_lower_wide(f, len, &d->wide);
+	for (i = 0; i < (u_int)(nwide > 0 ? nwide : 0); i++) {
+		w = &d->wide[i];
+		dp = &d->insns[w->start];
+		if (w->ind)
+			dp->op = w->width == 8 ? BPF_D_WIDE64_IND :
+			    BPF_D_WIDE128_IND;
+		else
+			dp->op = w->width == 8 ? BPF_D_WIDE64_ABS :
+			    BPF_D_WIDE128_ABS;
+		dp->k = i;
+		dp->end = w->off + w->width;
+		dp->jt = w->jt;
+		dp->jf = w->jf;
+	}
+	return d;
+}
+
+void
+pcap_free_predecoded(struct bpf_decoded *d)
+{
+	if (d == NULL)
+		return;
+	free(d->wide);
+	free(d);
+}
+
+/*
+ * Do the loads and comparisons of a run one at a time, as the
+ * program would, for when not all of the data it compares was
+ * captured; returns -1 if a load fails, 0 if a comparison fails,
+ * and 1 if they all succeed, leaving the last value compared in *Ap.
+ */
+static int
+wide_cmp_loads(const struct bpf_wide_cmp *w, const u_char *p, u_int buflen,
+    uint32_t X, uint32_t *Ap)
+{
+	const struct bpf_wide_load *ld;
+	bpf_u_int32 k;
+	uint32_t v;
+	u_int i;
+
+	for (i = 0; i < w->nloads; i++) {
+		ld = &w->loads[i];
+		k = ld->k;
+		if (w->ind) {
+			if (k > buflen || X > buflen - k)
+				return -1;
+			k += X;
+		}
+		if (k > buflen || ld->size > buflen - k)
+			return -1;
+		switch (ld->size) {
+
+		case 4:
+			v = EXTRACT_LONG(&p[k]);
+			break;
+
+		case 2:
+			v = EXTRACT_SHORT(&p[k]);
+			break;
+
+		default:
+			v = p[k];
+			break;
+		}
+		*Ap = v & ld->mask;
+		if (*Ap != ld->val)
+			return 0;
+	}
+	return 1;
+}
+
+#ifdef BPF_COMPUTED_GOTO
+#define HANDLER(name)	op_##name
+#define DISPATCH	goto *handlers[pc->op]
+#else
+#define HANDLER(name)	case BPF_D_##name
+#define DISPATCH	continue
+#endif
+#define NEXT		pc++; DISPATCH
+#define BRANCH(cond)	pc = &insns[(cond) ? pc->jt : pc->jf]; DISPATCH
+
+u_int
+pcap_filter_predecoded(const struct bpf_decoded *d, const u_char *p,
+    u_int wirelen, u_int buflen, const struct pcap_bpf_aux_data *aux_data)
+{
+	register const struct bpf_decoded_insn *pc, *insns;
+	register uint32_t A, X;
+	register bpf_u_int32 k;
+	uint32_t mem[BPF_MEMWORDS];
+	const struct bpf_wide_cmp *w;
+	const u_char *q;
+	uint32_t v;
+#ifdef BPF_COMPUTED_GOTO
+	static const void *const handlers[] = {
+#define OP(name)	&&op_##name,
+		BPF_DECODED_OPS
+#undef OP
+	};
+#endif
+
+	A = 0;
+	X = 0;
+	insns = d->insns;
+	pc = insns;
+#ifdef BPF_COMPUTED_GOTO
+	DISPATCH;
+#else
+	for (;;)
+	switch (pc->op) {
+
+	default:
+		abort();
+#endif
+
+	HANDLER(RET_K):
+		return (u_int)pc->k;
+
+	HANDLER(RET_A):
+		return (u_int)A;
+
+	HANDLER(LD_W_ABS):
+		if (pc->end > buflen)
+			return 0;
+		A = EXTRACT_LONG(&p[pc->k]);
+		NEXT;
+
+	HANDLER(LD_H_ABS):
+		if (pc->end > buflen)
+			return 0;
+		A = EXTRACT_SHORT(&p[pc->k]);
+		NEXT;
+
+	HANDLER(LD_B_ABS):
+		if (pc->end > buflen)
+			return 0;
+		A = p[pc->k];
+		NEXT;
+
+	HANDLER(LD_VLAN_TAG):
+		if (!aux_data)
+			return 0;
+		A = aux_data->vlan_tag;
+		NEXT;
+
+	HANDLER(LD_VLAN_TAG_PRESENT):
+		if (!aux_data)
+			return 0;
+		A = aux_data->vlan_tag_present;
+		NEXT;
+
+	HANDLER(LD_W_IND):
+		k = X + pc->k;
+		if (pc->k > buflen || X > buflen - pc->k ||
+		    sizeof(int32_t) > buflen - k) {
+			return 0;
+		}
+		A = EXTRACT_LONG(&p[k]);
+		NEXT;
+
+	HANDLER(LD_H_IND):
+		k = X + pc->k;
+		if (X > buflen || pc->k > buflen - X ||
+		    sizeof(int16_t) > buflen - k) {
+			return 0;
+		}
+		A = EXTRACT_SHORT(&p[k]);
+		NEXT;
+
+	HANDLER(LD_B_IND):
+		k = X + pc->k;
+		if (pc->k >= buflen || X >= buflen - pc->k) {
+			return 0;
+		}
+		A = p[k];
+		NEXT;
+
+	HANDLER(LDX_MSH_B):
+		if (pc->end > buflen)
+			return 0;
+		X = (p[pc->k] & 0xf) << 2;
+		NEXT;
+
+	HANDLER(LD_LEN):
+		A = wirelen;
+		NEXT;
+
+	HANDLER(LDX_LEN):
+		X = wirelen;
+		NEXT;
+
+	HANDLER(LD_IMM):
+		A = pc->k;
+		NEXT;
+
+	HANDLER(LDX_IMM):
+		X = pc->k;
+		NEXT;
+
+	HANDLER(LD_MEM):
+		A = mem[pc->k];
+		NEXT;
+
+	HANDLER(LDX_MEM):
+		X = mem[pc->k];
+		NEXT;
+
+	HANDLER(ST):
+		mem[pc->k] = A;
+		NEXT;
+
+	HANDLER(STX):
+		mem[pc->k] = X;
+		NEXT;
+
+	HANDLER(JA):
+		pc = &insns[pc->jt];
+		DISPATCH;
+
+	HANDLER(JGT_K):
+		BRANCH(A > pc->k);
+
+	HANDLER(JGE_K):
+		BRANCH(A >= pc->k);
+
+	HANDLER(JEQ_K):
+		BRANCH(A == pc->k);
+
+	HANDLER(JSET_K):
+		BRANCH(A & pc->k);
+
+	HANDLER(JGT_X):
+		BRANCH(A > X);
+
+	HANDLER(JGE_X):
+		BRANCH(A >= X);
+
+	HANDLER(JEQ_X):
+		BRANCH(A == X);
+
+	HANDLER(JSET_X):
+		BRANCH(A & X);
+
+	HANDLER(ADD_X):
+		A += X;
+		NEXT;
+
+	HANDLER(SUB_X):
+		A -= X;
+		NEXT;
+
+	HANDLER(MUL_X):
+		A *= X;
+		NEXT;
+
+	HANDLER(DIV_X):
+		if (X == 0)
+			return 0;
+		A /= X;
+		NEXT;
+
+	HANDLER(MOD_X):
+		if (X == 0)
+			return 0;
+		A %= X;
+		NEXT;
+
+	HANDLER(AND_X):
+		A &= X;
+		NEXT;
+
+	HANDLER(OR_X):
+		A |= X;
+		NEXT;
+
+	HANDLER(XOR_X):
+		A ^= X;
+		NEXT;
+
+	HANDLER(LSH_X):
+		if (X < 32)
+			A <<= X;
+		else
+			A = 0;
+		NEXT;
+
+	HANDLER(RSH_X):
+		if (X < 32)
+			A >>= X;
+		else
+			A = 0;
+		NEXT;
+
+	HANDLER(ADD_K):
+		A += pc->k;
+		NEXT;
+
+	HANDLER(SUB_K):
+		A -= pc->k;
+		NEXT;
+
+	HANDLER(MUL_K):
+		A *= pc->k;
+		NEXT;
+
+	HANDLER(DIV_K):
+		A /= pc->k;
+		NEXT;
+
+	HANDLER(MOD_K):
+		A %= pc->k;
+		NEXT;
+
+	HANDLER(AND_K):
+		A &= pc->k;
+		NEXT;
+
+	HANDLER(OR_K):
+		A |= pc->k;
+		NEXT;
+
+	HANDLER(XOR_K):
+		A ^= pc->k;
+		NEXT;
+
+	HANDLER(LSH_K):
+		A <<= pc->k;
+		NEXT;
+
+	HANDLER(RSH_K):
+		A >>= pc->k;
+		NEXT;
+
+	HANDLER(NEG):
+		/* See pcap_filter_with_aux_data(). */
+		A = (0U - A);
+		NEXT;
+
+	HANDLER(TAX):
+		X = A;
+		NEXT;
+
+	HANDLER(TXA):
+		A = X;
+		NEXT;
+
+	/*
+	 * A run of comparisons done at once.  If they're all equal,
+	 * the accumulator is left with the last value compared, which
+	 * is the constant it was compared with; if not, the
+	 * instruction gone to doesn't use it.
+	 */
+	HANDLER(WIDE64_ABS):
+		w = &d->wide[pc->k];
+		if (pc->end > buflen)
+			goto wide_loads;
+		q = &p[w->off];
+		if ((EXTRACT_BE_U_8(q) & w->mask[0]) != w->val[0]) {
+			pc = &insns[pc->jf];
+			DISPATCH;
+		}
+		A = w->loads[w->nloads - 1].val;
+		pc = &insns[pc->jt];
+		DISPATCH;
+
+	HANDLER(WIDE128_ABS):
+		w = &d->wide[pc->k];
+		if (pc->end > buflen)
+			goto wide_loads;
+		q = &p[w->off];
+		if (((EXTRACT_BE_U_8(q) & w->mask[0]) ^ w->val[0]) |
+		    ((EXTRACT_BE_U_8(q + 8) & w->mask[1]) ^ w->val[1])) {
+			pc = &insns[pc->jf];
+			DISPATCH;
+		}
+		A = w->loads[w->nloads - 1].val;
+		pc = &insns[pc->jt];
+		DISPATCH;
+
+	HANDLER(WIDE64_IND):
+		w = &d->wide[pc->k];
+		if (X > buflen || pc->end > buflen - X)
+			goto wide_loads;
+		q = &p[X + w->off];
+		if ((EXTRACT_BE_U_8(q) & w->mask[0]) != w->val[0]) {
+			pc = &insns[pc->jf];
+			DISPATCH;
+		}
+		A = w->loads[w->nloads - 1].val;
+		pc = &insns[pc->jt];
+		DISPATCH;
+
+	HANDLER(WIDE128_IND):
+		w = &d->wide[pc->k];
+		if (X > buflen || pc->end > buflen - X)
+			goto wide_loads;
+		q = &p[X + w->off];
+		if (((EXTRACT_BE_U_8(q) & w->mask[0]) ^ w->val[0]) |
+		    ((EXTRACT_BE_U_8(q + 8) & w->mask[1]) ^ w->val[1])) {
+			pc = &insns[pc->jf];
+			DISPATCH;
+		}
+		A = w->loads[w->nloads - 1].val;
+		pc = &insns[pc->jt];
+		DISPATCH;
+
+	wide_loads:
+		switch (wide_cmp_loads(w, p, buflen, X, &v)) {
+
+		case -1:
+			return 0;
+
+		case 0:
+			A = v;
+			pc = &insns[pc->jf];
+			break;
+
+		default:
+			A = v;
+			pc = &insns[pc->jt];
+			break;
+		}
+		DISPATCH;
+#ifndef BPF_COMPUTED_GOTO
+	}
+#endif
+}
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH
+
 /*
  * Return true if the 'fcode' is a valid filter program.
  * The constraints are that each jump be forward and to a valid
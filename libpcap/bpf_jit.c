@@ -0,0 +1,1018 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Translation of classic BPF programs into native code, for filters
+ * run in userland - savefiles, and capture mechanisms that have no
+ * in-kernel filtering.
+ *
+ * The generated function has the signature of pcap_filter() without
+ * the program argument, and must give the same result for every
+ * packet.  The program has already been checked by
+ * pcap_validate_filter(); anything else the interpreter would treat
+ * specially (the Linux ancillary data loads, which need auxiliary
+ * data, and opcodes the interpreter doesn't know) makes
+ * pcap_jit_compile() fail, and the program is then interpreted.
+ *
+ * Code is generated in two passes: the first computes the offset of
+ * each instruction, and the second, into a buffer of the size the
+ * first found, resolves the branches.  Every instruction's code has
+ * the same length in both passes, as all branches use the long form.
+ * Packet loads jump to a shared "return 0" at the end if they're out
+ * of range, with the range check done in 64 bits so that the offset
+ * can't wrap.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pcap-int.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ENABLE_BPF_JIT) && !defined(_WIN32) && !defined(__APPLE__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+/*
+ * XXX - macOS requires MAP_JIT, and entitlements for hardened
+ * runtime binaries, to map executable memory; for now, filters are
+ * interpreted there.
+ */
+#define HAVE_BPF_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_BPF_JIT
+
+/*
+ * BPF_LD|BPF_B|BPF_ABS loads at or above this offset are Linux
+ * ancillary data loads (SKF_AD_OFF).
+ */
+#define JIT_AD_OFF	0xfffff000U
+
+struct jit_state {
+	u_char	*buf;		/* NULL while sizing the code */
+	size_t	len;		/* code generated so far */
+	size_t	*offs;		/* offset of each instruction's code */
+	size_t	ret0;		/* offset of the shared "return 0" */
+	int	uses_mem;	/* program uses the scratch memory */
+	int	bad;		/* a branch is out of range */
+};
+
+static void
+emit_bytes(struct jit_state *st, const u_char *bytes, size_t n)
+{
+	if (st->buf != NULL)
+		memcpy(st->buf + st->len, bytes, n);
+	st->len += n;
+}
+
+#define EMIT(st, ...) \
+	emit_bytes((st), (const u_char []){ __VA_ARGS__ }, \
+	    sizeof ((const u_char []){ __VA_ARGS__ }))
+
+/*
+ * Both x86 immediates and AArch64 instructions are little-endian.
+ */
+static void
+emit_u32(struct jit_state *st, uint32_t v)
+{
+	EMIT(st, (u_char)v, (u_char)(v >> 8), (u_char)(v >> 16),
+	    (u_char)(v >> 24));
+}
+
+/*
+ * Offset of the code for the instruction that a branch in instruction
+ * i with the given offset goes to.  The offset is added as unsigned,
+ * so that backward BPF_JA branches wrap to the right instruction, as
+ * they do in pcap_validate_filter().
+ */
+#define TARGET(st, i, off)	((st)->offs[(u_int)((i) + 1 + (off))])
+
+#if defined(__x86_64__)
+/*
+ * The function is called with the packet in rdi, the wire length in
+ * esi and the buffer length in edx.  A is in eax, X in r9d, and the
+ * buffer length is moved to r10d, as division uses edx; rcx, rdx and
+ * r11 are temporaries.  The scratch memory is in the red zone below
+ * the stack pointer, which a leaf function can use without adjusting
+ * it.
+ */
+#define X86_JB	0x2
+#define X86_JAE	0x3
+#define X86_JE	0x4
+#define X86_JNE	0x5
+#define X86_JBE	0x6
+#define X86_JA	0x7
+
+#define X86_MEM(k)	((u_char)(-64 + 4 * (int)(k)))	/* disp8 from rsp */
+
+static void
+jit_jmp(struct jit_state *st, size_t target)
+{
+	EMIT(st, 0xe9);				/* jmp rel32 */
+	emit_u32(st, (uint32_t)(target - (st->len + 4)));
+}
+
+static void
+jit_jcc(struct jit_state *st, int cc, size_t target)
+{
+	EMIT(st, 0x0f, 0x80 | cc);		/* jcc rel32 */
+	emit_u32(st, (uint32_t)(target - (st->len + 4)));
+}
+
+static void
+jit_prologue(struct jit_state *st)
+{
+	EMIT(st, 0x31, 0xc0);			/* xor eax, eax */
+	EMIT(st, 0x45, 0x31, 0xc9);		/* xor r9d, r9d */
+	EMIT(st, 0x41, 0x89, 0xd2);		/* mov r10d, edx */
+}
+
+static void
+jit_ret(struct jit_state *st)
+{
+	EMIT(st, 0xc3);				/* ret */
+}
+
+static void
+jit_ret0(struct jit_state *st)
+{
+	EMIT(st, 0x31, 0xc0);			/* xor eax, eax */
+	jit_ret(st);
+}
+
+/*
+ * Check that the size bytes at the offset in rcx are in the buffer.
+ */
+static void
+jit_check_load(struct jit_state *st, u_int size)
+{
+	EMIT(st, 0x48, 0x8d, 0x51, size);	/* lea rdx, [rcx + size] */
+	EMIT(st, 0x45, 0x89, 0xd3);		/* mov r11d, r10d */
+	EMIT(st, 0x49, 0x39, 0xd3);		/* cmp r11, rdx */
+	jit_jcc(st, X86_JB, st->ret0);
+}
+
+static void
+jit_load(struct jit_state *st, u_int code)
+{
+	switch (BPF_SIZE(code)) {
+
+	case BPF_W:
+		jit_check_load(st, 4);
+		EMIT(st, 0x8b, 0x04, 0x0f);	/* mov eax, [rdi + rcx] */
+		EMIT(st, 0x0f, 0xc8);		/* bswap eax */
+		break;
+
+	case BPF_H:
+		jit_check_load(st, 2);
+		EMIT(st, 0x0f, 0xb7, 0x04, 0x0f); /* movzx eax, word [rdi + rcx] */
+		EMIT(st, 0x66, 0xc1, 0xc0, 0x08); /* rol ax, 8 */
+		break;
+
+	case BPF_B:
+		jit_check_load(st, 1);
+		EMIT(st, 0x0f, 0xb6, 0x04, 0x0f); /* movzx eax, byte [rdi + rcx] */
+		break;
+	}
+}
+
+static void
+jit_cond(struct jit_state *st, const struct bpf_insn *p, u_int i, int cc)
+{
+	if (p->jt == p->jf) {
+		if (p->jt != 0)
+			jit_jmp(st, TARGET(st, i, p->jt));
+	} else if (p->jf == 0)
+		jit_jcc(st, cc, TARGET(st, i, p->jt));
+	else if (p->jt == 0)
+		jit_jcc(st, cc ^ 1, TARGET(st, i, p->jf));
+	else {
+		jit_jcc(st, cc, TARGET(st, i, p->jt));
+		jit_jmp(st, TARGET(st, i, p->jf));
+	}
+}
+
+static void
+jit_insn(struct jit_state *st, const struct bpf_insn *p, u_int i)
+{
+	switch (p->code) {
+
+	case BPF_RET|BPF_K:
+		EMIT(st, 0xb8);			/* mov eax, k */
+		emit_u32(st, p->k);
+		jit_ret(st);
+		break;
+
+	case BPF_RET|BPF_A:
+		jit_ret(st);
+		break;
+
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_ABS:
+		EMIT(st, 0xb9);			/* mov ecx, k */
+		emit_u32(st, p->k);
+		jit_load(st, p->code);
+		break;
+
+	case BPF_LD|BPF_W|BPF_IND:
+	case BPF_LD|BPF_H|BPF_IND:
+	case BPF_LD|BPF_B|BPF_IND:
+		EMIT(st, 0x44, 0x89, 0xc9);	/* mov ecx, r9d */
+		EMIT(st, 0x41, 0xbb);		/* mov r11d, k */
+		emit_u32(st, p->k);
+		EMIT(st, 0x4c, 0x01, 0xd9);	/* add rcx, r11 */
+		jit_load(st, p->code);
+		break;
+
+	case BPF_LDX|BPF_MSH|BPF_B:
+		EMIT(st, 0xb9);			/* mov ecx, k */
+		emit_u32(st, p->k);
+		jit_check_load(st, 1);
+		EMIT(st, 0x0f, 0xb6, 0x14, 0x0f); /* movzx edx, byte [rdi + rcx] */
+		EMIT(st, 0x83, 0xe2, 0x0f);	/* and edx, 0xf */
+		EMIT(st, 0xc1, 0xe2, 0x02);	/* shl edx, 2 */
+		EMIT(st, 0x41, 0x89, 0xd1);	/* mov r9d, edx */
+		break;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		EMIT(st, 0x89, 0xf0);		/* mov eax, esi */
+		break;
+
+	case BPF_LDX|BPF_W|BPF_LEN:
+		EMIT(st, 0x41, 0x89, 0xf1);	/* mov r9d, esi */
+		break;
+
+	case BPF_LD|BPF_IMM:
+		EMIT(st, 0xb8);			/* mov eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_LDX|BPF_IMM:
+		EMIT(st, 0x41, 0xb9);		/* mov r9d, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_LD|BPF_MEM:
+		EMIT(st, 0x8b, 0x44, 0x24, X86_MEM(p->k)); /* mov eax, M[k] */
+		break;
+
+	case BPF_LDX|BPF_MEM:
+		EMIT(st, 0x44, 0x8b, 0x4c, 0x24, X86_MEM(p->k)); /* mov r9d, M[k] */
+		break;
+
+	case BPF_ST:
+		EMIT(st, 0x89, 0x44, 0x24, X86_MEM(p->k)); /* mov M[k], eax */
+		break;
+
+	case BPF_STX:
+		EMIT(st, 0x44, 0x89, 0x4c, 0x24, X86_MEM(p->k)); /* mov M[k], r9d */
+		break;
+
+	case BPF_JMP|BPF_JA:
+		jit_jmp(st, TARGET(st, i, p->k));
+		break;
+
+	case BPF_JMP|BPF_JGT|BPF_K:
+	case BPF_JMP|BPF_JGE|BPF_K:
+	case BPF_JMP|BPF_JEQ|BPF_K:
+		EMIT(st, 0x3d);			/* cmp eax, k */
+		emit_u32(st, p->k);
+		goto cond;
+
+	case BPF_JMP|BPF_JSET|BPF_K:
+		EMIT(st, 0xa9);			/* test eax, k */
+		emit_u32(st, p->k);
+		goto cond;
+
+	case BPF_JMP|BPF_JGT|BPF_X:
+	case BPF_JMP|BPF_JGE|BPF_X:
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		EMIT(st, 0x44, 0x39, 0xc8);	/* cmp eax, r9d */
+		goto cond;
+
+	case BPF_JMP|BPF_JSET|BPF_X:
+		EMIT(st, 0x44, 0x85, 0xc8);	/* test eax, r9d */
+	cond:
+		switch (BPF_OP(p->code)) {
+
+		case BPF_JGT:
+			jit_cond(st, p, i, X86_JA);
+			break;
+
+		case BPF_JGE:
+			jit_cond(st, p, i, X86_JAE);
+			break;
+
+		case BPF_JEQ:
+			jit_cond(st, p, i, X86_JE);
+			break;
+
+		case BPF_JSET:
+			jit_cond(st, p, i, X86_JNE);
+			break;
+		}
+		break;
+
+	case BPF_ALU|BPF_ADD|BPF_X:
+		EMIT(st, 0x44, 0x01, 0xc8);	/* add eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_SUB|BPF_X:
+		EMIT(st, 0x44, 0x29, 0xc8);	/* sub eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_MUL|BPF_X:
+		EMIT(st, 0x41, 0x0f, 0xaf, 0xc1); /* imul eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_DIV|BPF_X:
+	case BPF_ALU|BPF_MOD|BPF_X:
+		EMIT(st, 0x45, 0x85, 0xc9);	/* test r9d, r9d */
+		jit_jcc(st, X86_JE, st->ret0);
+		EMIT(st, 0x31, 0xd2);		/* xor edx, edx */
+		EMIT(st, 0x41, 0xf7, 0xf1);	/* div r9d */
+		if (BPF_OP(p->code) == BPF_MOD)
+			EMIT(st, 0x89, 0xd0);	/* mov eax, edx */
+		break;
+
+	case BPF_ALU|BPF_AND|BPF_X:
+		EMIT(st, 0x44, 0x21, 0xc8);	/* and eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_OR|BPF_X:
+		EMIT(st, 0x44, 0x09, 0xc8);	/* or eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_XOR|BPF_X:
+		EMIT(st, 0x44, 0x31, 0xc8);	/* xor eax, r9d */
+		break;
+
+	case BPF_ALU|BPF_LSH|BPF_X:
+	case BPF_ALU|BPF_RSH|BPF_X:
+		/*
+		 * x86 shifts use the count modulo 32; BPF shifts
+		 * by 32 or more give 0.
+		 */
+		EMIT(st, 0x44, 0x89, 0xc9);	/* mov ecx, r9d */
+		if (BPF_OP(p->code) == BPF_LSH)
+			EMIT(st, 0xd3, 0xe0);	/* shl eax, cl */
+		else
+			EMIT(st, 0xd3, 0xe8);	/* shr eax, cl */
+		EMIT(st, 0x31, 0xd2);		/* xor edx, edx */
+		EMIT(st, 0x41, 0x83, 0xf9, 0x20); /* cmp r9d, 32 */
+		EMIT(st, 0x0f, 0x43, 0xc2);	/* cmovae eax, edx */
+		break;
+
+	case BPF_ALU|BPF_ADD|BPF_K:
+		EMIT(st, 0x05);			/* add eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_SUB|BPF_K:
+		EMIT(st, 0x2d);			/* sub eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_MUL|BPF_K:
+		EMIT(st, 0x69, 0xc0);		/* imul eax, eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_DIV|BPF_K:
+	case BPF_ALU|BPF_MOD|BPF_K:
+		EMIT(st, 0xb9);			/* mov ecx, k */
+		emit_u32(st, p->k);
+		EMIT(st, 0x31, 0xd2);		/* xor edx, edx */
+		EMIT(st, 0xf7, 0xf1);		/* div ecx */
+		if (BPF_OP(p->code) == BPF_MOD)
+			EMIT(st, 0x89, 0xd0);	/* mov eax, edx */
+		break;
+
+	case BPF_ALU|BPF_AND|BPF_K:
+		EMIT(st, 0x25);			/* and eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_OR|BPF_K:
+		EMIT(st, 0x0d);			/* or eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_XOR|BPF_K:
+		EMIT(st, 0x35);			/* xor eax, k */
+		emit_u32(st, p->k);
+		break;
+
+	case BPF_ALU|BPF_LSH|BPF_K:
+		EMIT(st, 0xc1, 0xe0, p->k & 31);	/* shl eax, k */
+		break;
+
+	case BPF_ALU|BPF_RSH|BPF_K:
+		EMIT(st, 0xc1, 0xe8, p->k & 31);	/* shr eax, k */
+		break;
+
+	case BPF_ALU|BPF_NEG:
+		EMIT(st, 0xf7, 0xd8);		/* neg eax */
+		break;
+
+	case BPF_MISC|BPF_TAX:
+		EMIT(st, 0x41, 0x89, 0xc1);	/* mov r9d, eax */
+		break;
+
+	case BPF_MISC|BPF_TXA:
+		EMIT(st, 0x44, 0x89, 0xc8);	/* mov eax, r9d */
+		break;
+	}
+}
+#elif defined(__aarch64__)
+/*
+ * The function is called with the packet in x0, the wire length in
+ * w1 and the buffer length in w2.  The packet pointer is moved to x5,
+ * as A is w0; X is w3, and w6 and w7 are temporaries.  There's no
+ * red zone, so the stack pointer is lowered to make room for the
+ * scratch memory if the program uses it.
+ */
+#define A64_EQ	0x0
+#define A64_NE	0x1
+#define A64_HS	0x2
+#define A64_LO	0x3
+#define A64_HI	0x8
+#define A64_LS	0x9
+
+#define A64_A	0	/* w0 */
+#define A64_X	3	/* w3 */
+#define A64_T0	6	/* w6/x6 */
+#define A64_T1	7	/* w7/x7 */
+
+static void
+jit_jmp(struct jit_state *st, size_t target)
+{
+	int64_t rel = ((int64_t)target - (int64_t)st->len) / 4;
+
+	if (rel < -(1 << 25) || rel >= (1 << 25))
+		st->bad = 1;
+	emit_u32(st, 0x14000000 | ((uint32_t)rel & 0x3ffffff));	/* b */
+}
+
+static void
+jit_jcc(struct jit_state *st, int cc, size_t target)
+{
+	int64_t rel = ((int64_t)target - (int64_t)st->len) / 4;
+
+	if (rel < -(1 << 18) || rel >= (1 << 18))
+		st->bad = 1;
+	emit_u32(st, 0x54000000 | ((uint32_t)rel & 0x7ffff) << 5 | cc);	/* b.cc */
+}
+
+/*
+ * mov wd, k
+ */
+static void
+jit_movi(struct jit_state *st, u_int rd, uint32_t k)
+{
+	emit_u32(st, 0x52800000 | (k & 0xffff) << 5 | rd);	/* movz */
+	emit_u32(st, 0x72a00000 | (k >> 16) << 5 | rd);	/* movk, lsl 16 */
+}
+
+static void
+jit_prologue(struct jit_state *st)
+{
+	emit_u32(st, 0xaa0003e5);		/* mov x5, x0 */
+	emit_u32(st, 0x2a0203e2);		/* mov w2, w2 */
+	emit_u32(st, 0x52800000);		/* mov w0, 0 */
+	emit_u32(st, 0x52800003);		/* mov w3, 0 */
+	if (st->uses_mem)
+		emit_u32(st, 0xd10103ff);	/* sub sp, sp, 64 */
+}
+
+static void
+jit_ret(struct jit_state *st)
+{
+	if (st->uses_mem)
+		emit_u32(st, 0x910103ff);	/* add sp, sp, 64 */
+	emit_u32(st, 0xd65f03c0);		/* ret */
+}
+
+static void
+jit_ret0(struct jit_state *st)
+{
+	emit_u32(st, 0x52800000);		/* mov w0, 0 */
+	jit_ret(st);
+}
+
+/*
+ * Check that the size bytes at the offset in x6 are in the buffer.
+ */
+static void
+jit_check_load(struct jit_state *st, u_int size)
+{
+	emit_u32(st, 0x910000c7 | size << 10);	/* add x7, x6, size */
+	emit_u32(st, 0xeb0200ff);		/* cmp x7, x2 */
+	jit_jcc(st, A64_HI, st->ret0);
+}
+
+static void
+jit_load(struct jit_state *st, u_int code)
+{
+	switch (BPF_SIZE(code)) {
+
+	case BPF_W:
+		jit_check_load(st, 4);
+		emit_u32(st, 0xb86668a0);	/* ldr w0, [x5, x6] */
+		emit_u32(st, 0x5ac00800);	/* rev w0, w0 */
+		break;
+
+	case BPF_H:
+		jit_check_load(st, 2);
+		emit_u32(st, 0x786668a0);	/* ldrh w0, [x5, x6] */
+		emit_u32(st, 0x5ac00400);	/* rev16 w0, w0 */
+		break;
+
+	case BPF_B:
+		jit_check_load(st, 1);
+		emit_u32(st, 0x386668a0);	/* ldrb w0, [x5, x6] */
+		break;
+	}
+}
+
+static void
+jit_cond(struct jit_state *st, const struct bpf_insn *p, u_int i, int cc)
+{
+	if (p->jt == p->jf) {
+		if (p->jt != 0)
+			jit_jmp(st, TARGET(st, i, p->jt));
+	} else if (p->jf == 0)
+		jit_jcc(st, cc, TARGET(st, i, p->jt));
+	else if (p->jt == 0)
+		jit_jcc(st, cc ^ 1, TARGET(st, i, p->jf));
+	else {
+		jit_jcc(st, cc, TARGET(st, i, p->jt));
+		jit_jmp(st, TARGET(st, i, p->jf));
+	}
+}
+
+/*
+ * Data-processing (register) instructions with A as the destination
+ * and first operand; rm is the second operand.
+ */
+#define A64_ADD		0x0b000000
+#define A64_SUB		0x4b000000
+#define A64_AND		0x0a000000
+#define A64_ORR		0x2a000000
+#define A64_EOR		0x4a000000
+#define A64_MUL		0x1b007c00
+#define A64_UDIV	0x1ac00800
+#define A64_LSLV	0x1ac02000
+#define A64_LSRV	0x1ac02400
+
+static void
+jit_alu(struct jit_state *st, uint32_t op, u_int rm)
+{
+	emit_u32(st, op | rm << 16 | A64_A << 5 | A64_A);
+}
+
+static void
+jit_alu_op(struct jit_state *st, u_int code, u_int rm)
+{
+	switch (BPF_OP(code)) {
+
+	case BPF_ADD:
+		jit_alu(st, A64_ADD, rm);
+		break;
+
+	case BPF_SUB:
+		jit_alu(st, A64_SUB, rm);
+		break;
+
+	case BPF_MUL:
+		jit_alu(st, A64_MUL, rm);
+		break;
+
+	case BPF_DIV:
+		jit_alu(st, A64_UDIV, rm);
+		break;
+
+	case BPF_MOD:
+		/* udiv w7, w0, wm; msub w0, w7, wm, w0 */
+		emit_u32(st, A64_UDIV | rm << 16 | A64_A << 5 | A64_T1);
+		emit_u32(st, 0x1b008000 | rm << 16 | A64_A << 10 |
+		    A64_T1 << 5 | A64_A);
+		break;
+
+	case BPF_AND:
+		jit_alu(st, A64_AND, rm);
+		break;
+
+	case BPF_OR:
+		jit_alu(st, A64_ORR, rm);
+		break;
+
+	case BPF_XOR:
+		jit_alu(st, A64_EOR, rm);
+		break;
+	}
+}
+
+static void
+jit_insn(struct jit_state *st, const struct bpf_insn *p, u_int i)
+{
+	u_int shift;
+
+	switch (p->code) {
+
+	case BPF_RET|BPF_K:
+		jit_movi(st, A64_A, p->k);
+		jit_ret(st);
+		break;
+
+	case BPF_RET|BPF_A:
+		jit_ret(st);
+		break;
+
+	case BPF_LD|BPF_W|BPF_ABS:
+	case BPF_LD|BPF_H|BPF_ABS:
+	case BPF_LD|BPF_B|BPF_ABS:
+		jit_movi(st, A64_T0, p->k);
+		jit_load(st, p->code);
+		break;
+
+	case BPF_LD|BPF_W|BPF_IND:
+	case BPF_LD|BPF_H|BPF_IND:
+	case BPF_LD|BPF_B|BPF_IND:
+		jit_movi(st, A64_T0, p->k);
+		emit_u32(st, 0x8b2340c6);	/* add x6, x6, w3, uxtw */
+		jit_load(st, p->code);
+		break;
+
+	case BPF_LDX|BPF_MSH|BPF_B:
+		jit_movi(st, A64_T0, p->k);
+		jit_check_load(st, 1);
+		emit_u32(st, 0x386668a7);	/* ldrb w7, [x5, x6] */
+		emit_u32(st, 0x12000ce7);	/* and w7, w7, 0xf */
+		emit_u32(st, 0x531e74e3);	/* lsl w3, w7, 2 */
+		break;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		emit_u32(st, 0x2a0103e0);	/* mov w0, w1 */
+		break;
+
+	case BPF_LDX|BPF_W|BPF_LEN:
+		emit_u32(st, 0x2a0103e3);	/* mov w3, w1 */
+		break;
+
+	case BPF_LD|BPF_IMM:
+		jit_movi(st, A64_A, p->k);
+		break;
+
+	case BPF_LDX|BPF_IMM:
+		jit_movi(st, A64_X, p->k);
+		break;
+
+	case BPF_LD|BPF_MEM:
+		emit_u32(st, 0xb94003e0 | p->k << 10);	/* ldr w0, [sp, 4k] */
+		break;
+
+	case BPF_LDX|BPF_MEM:
+		emit_u32(st, 0xb94003e3 | p->k << 10);	/* ldr w3, [sp, 4k] */
+		break;
+
+	case BPF_ST:
+		emit_u32(st, 0xb90003e0 | p->k << 10);	/* str w0, [sp, 4k] */
+		break;
+
+	case BPF_STX:
+		emit_u32(st, 0xb90003e3 | p->k << 10);	/* str w3, [sp, 4k] */
+		break;
+
+	case BPF_JMP|BPF_JA:
+		jit_jmp(st, TARGET(st, i, p->k));
+		break;
+
+	case BPF_JMP|BPF_JGT|BPF_K:
+	case BPF_JMP|BPF_JGE|BPF_K:
+	case BPF_JMP|BPF_JEQ|BPF_K:
+		if (p->k < 4096)
+			emit_u32(st, 0x7100001f | p->k << 10); /* cmp w0, k */
+		else {
+			jit_movi(st, A64_T0, p->k);
+			emit_u32(st, 0x6b06001f);	/* cmp w0, w6 */
+		}
+		goto cond;
+
+	case BPF_JMP|BPF_JSET|BPF_K:
+		jit_movi(st, A64_T0, p->k);
+		emit_u32(st, 0x6a06001f);		/* tst w0, w6 */
+		goto cond;
+
+	case BPF_JMP|BPF_JGT|BPF_X:
+	case BPF_JMP|BPF_JGE|BPF_X:
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		emit_u32(st, 0x6b03001f);		/* cmp w0, w3 */
+		goto cond;
+
+	case BPF_JMP|BPF_JSET|BPF_X:
+		emit_u32(st, 0x6a03001f);		/* tst w0, w3 */
+	cond:
+		switch (BPF_OP(p->code)) {
+
+		case BPF_JGT:
+			jit_cond(st, p, i, A64_HI);
+			break;
+
+		case BPF_JGE:
+			jit_cond(st, p, i, A64_HS);
+			break;
+
+		case BPF_JEQ:
+			jit_cond(st, p, i, A64_EQ);
+			break;
+
+		case BPF_JSET:
+			jit_cond(st, p, i, A64_NE);
+			break;
+		}
+		break;
+
+	case BPF_ALU|BPF_DIV|BPF_X:
+	case BPF_ALU|BPF_MOD|BPF_X:
+		{
+			int64_t rel = ((int64_t)st->ret0 - (int64_t)st->len) / 4;
+
+			if (rel < -(1 << 18) || rel >= (1 << 18))
+				st->bad = 1;
+			/* cbz w3, ret0 */
+			emit_u32(st, 0x34000000 | ((uint32_t)rel & 0x7ffff) << 5 |
+			    A64_X);
+		}
+		/* FALLTHROUGH */
+	case BPF_ALU|BPF_ADD|BPF_X:
+	case BPF_ALU|BPF_SUB|BPF_X:
+	case BPF_ALU|BPF_MUL|BPF_X:
+	case BPF_ALU|BPF_AND|BPF_X:
+	case BPF_ALU|BPF_OR|BPF_X:
+	case BPF_ALU|BPF_XOR|BPF_X:
+		jit_alu_op(st, p->code, A64_X);
+		break;
+
+	case BPF_ALU|BPF_LSH|BPF_X:
+	case BPF_ALU|BPF_RSH|BPF_X:
+		/*
+		 * The shift instructions use the count modulo 32;
+		 * BPF shifts by 32 or more give 0.
+		 */
+		jit_alu(st, BPF_OP(p->code) == BPF_LSH ? A64_LSLV : A64_LSRV,
+		    A64_X);
+		emit_u32(st, 0x7100807f);		/* cmp w3, 32 */
+		emit_u32(st, 0x1a8023e0);		/* csel w0, wzr, w0, hs */
+		break;
+
+	case BPF_ALU|BPF_ADD|BPF_K:
+	case BPF_ALU|BPF_SUB|BPF_K:
+		if (p->k < 4096) {
+			/* add/sub w0, w0, k */
+			emit_u32(st, (BPF_OP(p->code) == BPF_ADD ?
+			    0x11000000 : 0x51000000) | p->k << 10);
+			break;
+		}
+		/* FALLTHROUGH */
+	case BPF_ALU|BPF_MUL|BPF_K:
+	case BPF_ALU|BPF_DIV|BPF_K:
+	case BPF_ALU|BPF_MOD|BPF_K:
+	case BPF_ALU|BPF_AND|BPF_K:
+	case BPF_ALU|BPF_OR|BPF_K:
+	case BPF_ALU|BPF_XOR|BPF_K:
+		jit_movi(st, A64_T0, p->k);
+		jit_alu_op(st, p->code, A64_T0);
+		break;
+
+	case BPF_ALU|BPF_LSH|BPF_K:
+		shift = p->k & 31;
+		/* lsl w0, w0, shift, i.e. ubfm w0, w0, -shift % 32, 31 - shift */
+		emit_u32(st, 0x53000000 | ((32 - shift) & 31) << 16 |
+		    (31 - shift) << 10);
+		break;
+
+	case BPF_ALU|BPF_RSH|BPF_K:
+		shift = p->k & 31;
+		/* lsr w0, w0, shift, i.e. ubfm w0, w0, shift, 31 */
+		emit_u32(st, 0x53007c00 | shift << 16);
+		break;
+
+	case BPF_ALU|BPF_NEG:
+		emit_u32(st, 0x4b0003e0);		/* neg w0, w0 */
+		break;
+
+	case BPF_MISC|BPF_TAX:
+		emit_u32(st, 0x2a0003e3);		/* mov w3, w0 */
+		break;
+
+	case BPF_MISC|BPF_TXA:
+		emit_u32(st, 0x2a0303e0);		/* mov w0, w3 */
+		break;
+	}
+}
+#endif
+
+/*
+ * Check whether every instruction in the program can be translated.
+ */
+static int
+jit_supported(const struct bpf_insn *insns, u_int len, int *uses_mem)
+{
+	u_int i;
+
+	*uses_mem = 0;
+	for (i = 0; i < len; i++) {
+		switch (insns[i].code) {
+
+		case BPF_LD|BPF_B|BPF_ABS:
+			if (insns[i].k >= JIT_AD_OFF)
+				return 0;
+			break;
+
+		case BPF_LD|BPF_MEM:
+		case BPF_LDX|BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			*uses_mem = 1;
+			break;
+
+		case BPF_RET|BPF_K:
+		case BPF_RET|BPF_A:
+		case BPF_LD|BPF_W|BPF_ABS:
+		case BPF_LD|BPF_H|BPF_ABS:
+		case BPF_LD|BPF_W|BPF_IND:
+		case BPF_LD|BPF_H|BPF_IND:
+		case BPF_LD|BPF_B|BPF_IND:
+		case BPF_LDX|BPF_MSH|BPF_B:
+		case BPF_LD|BPF_W|BPF_LEN:
+		case BPF_LDX|BPF_W|BPF_LEN:
+		case BPF_LD|BPF_IMM:
+		case BPF_LDX|BPF_IMM:
+		case BPF_JMP|BPF_JA:
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+		case BPF_ALU|BPF_ADD|BPF_X:
+		case BPF_ALU|BPF_SUB|BPF_X:
+		case BPF_ALU|BPF_MUL|BPF_X:
+		case BPF_ALU|BPF_DIV|BPF_X:
+		case BPF_ALU|BPF_MOD|BPF_X:
+		case BPF_ALU|BPF_AND|BPF_X:
+		case BPF_ALU|BPF_OR|BPF_X:
+		case BPF_ALU|BPF_XOR|BPF_X:
+		case BPF_ALU|BPF_LSH|BPF_X:
+		case BPF_ALU|BPF_RSH|BPF_X:
+		case BPF_ALU|BPF_ADD|BPF_K:
+		case BPF_ALU|BPF_SUB|BPF_K:
+		case BPF_ALU|BPF_MUL|BPF_K:
+		case BPF_ALU|BPF_DIV|BPF_K:
+		case BPF_ALU|BPF_MOD|BPF_K:
+		case BPF_ALU|BPF_AND|BPF_K:
+		case BPF_ALU|BPF_OR|BPF_K:
+		case BPF_ALU|BPF_XOR|BPF_K:
+		case BPF_ALU|BPF_LSH|BPF_K:
+		case BPF_ALU|BPF_RSH|BPF_K:
+		case BPF_ALU|BPF_NEG:
+		case BPF_MISC|BPF_TAX:
+		case BPF_MISC|BPF_TXA:
+			break;
+
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+jit_emit(struct jit_state *st, const struct bpf_insn *insns, u_int len)
+{
+	u_int i;
+
+	st->len = 0;
+	jit_prologue(st);
+	for (i = 0; i < len; i++) {
+		st->offs[i] = st->len;
+		jit_insn(st, &insns[i], i);
+	}
+	st->ret0 = st->len;
+	jit_ret0(st);
+}
+
+/*
+ * Translate a validated program; returns 0 on success and -1 if the
+ * program should be interpreted instead.
+ */
+int
+pcap_jit_compile(struct bpf_jit *jit, const struct bpf_insn *insns, u_int len)
+{
+	struct jit_state st;
+	union {
+		void		*mem;
+		bpf_jit_func	func;
+	} code;
+	size_t size;
+
+	jit->func = NULL;
+	jit->size = 0;
+	memset(&st, 0, sizeof(st));
+	if (len == 0 || !jit_supported(insns, len, &st.uses_mem))
+		return (-1);
+	st.offs = calloc(len, sizeof(*st.offs));
+	if (st.offs == NULL)
+		return (-1);
+
+	/*
+	 * Size the code, then generate it.
+	 */
+	jit_emit(&st, insns, len);
+	size = st.len;
+	code.mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (code.mem == MAP_FAILED) {
+		free(st.offs);
+		return (-1);
+	}
+	st.buf = code.mem;
+	jit_emit(&st, insns, len);
+	free(st.offs);
+	if (st.bad || st.len != size ||
+	    mprotect(code.mem, size, PROT_READ|PROT_EXEC) == -1) {
+		munmap(code.mem, size);
+		return (-1);
+	}
+#ifdef __aarch64__
+	__builtin___clear_cache((char *)code.mem, (char *)code.mem + size);
+#endif
+	jit->func = code.func;
+	jit->size = size;
+	return (0);
+}
+
+void
+pcap_jit_free(struct bpf_jit *jit)
+{
+	union {
+		void		*mem;
+		bpf_jit_func	func;
+	} code;
+
+	if (jit->func != NULL) {
+		code.func = jit->func;
+		munmap(code.mem, jit->size);
+		jit->func = NULL;
+		jit->size = 0;
+	}
+}
+#else /* HAVE_BPF_JIT */
+int
+pcap_jit_compile(struct bpf_jit *jit, const struct bpf_insn *insns _U_,
+    u_int len _U_)
+{
+	jit->func = NULL;
+	jit->size = 0;
+	return (-1);
+}
+
+void
+pcap_jit_free(struct bpf_jit *jit _U_)
+{
+}
+#endif /* HAVE_BPF_JIT */
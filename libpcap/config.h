@@ -151,6 +151,9 @@
 /* Define to 1 if you have a POSIX-style `strerror_r' function. */
 #define HAVE_POSIX_STRERROR_R /**/
 
+/* define if you have pthreads */
+#define HAVE_PTHREADS 1
+
 /* define if you have the Septel API */
 /* #undef HAVE_SEPTEL_API */
 
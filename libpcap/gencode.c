@@ -43,6 +43,11 @@
 #include <memory.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32) && defined(HAVE_PTHREADS)
+#include <pthread.h>
+#endif
 
 #ifdef MSDOS
 #include "pcap-dos.h"
@@ -232,18 +237,64 @@ enum e_offrel {
 };
 
 /*
- * We divy out chunks of memory rather than call malloc each time so
- * we don't have to worry about leaking memory.  It's probably
- * not a big deal if all this memory was wasted but if this ever
- * goes into a library that would probably not be a good idea.
+ * We divy out memory from an arena rather than call malloc each time,
+ * so we don't have to worry about leaking memory, and free it all at
+ * once when the compile is over.  The scanner, the parser, the code
+ * generator, and the optimizer all allocate from the same arena.
  *
- * XXX - this *is* in a library....
+ * The arena is a list of chunks, each twice the size of the one
+ * before it; the memory in them that hasn't been handed out is kept
+ * zeroed.  When a compile is over, its arena is reset, rather than
+ * freed, and put into a pool of idle arenas for later compiles to use,
+ * so that compiling doesn't mean calling malloc and free for every
+ * chunk every time; an idle arena keeps only as many chunks as add up
+ * to ARENA_KEEP bytes, so one big compile doesn't tie up a lot of
+ * memory, and at most ARENA_POOL_SIZE arenas are kept.
  */
-#define NCHUNKS 16
 #define CHUNK0SIZE 1024
-struct chunk {
-	size_t n_left;
-	void *m;
+#define ARENA_KEEP (256 * 1024)
+#define ARENA_POOL_SIZE 4
+
+/*
+ * Allocations are rounded up to a multiple of the size of this, so
+ * that anything can be put into them.
+ */
+union arena_align {
+	long l;
+	double d;
+	void *p;
+	uint64_t u;
+};
+#define ARENA_ROUNDUP(n) \
+	(((n) + sizeof(union arena_align) - 1) & ~(sizeof(union arena_align) - 1))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;		/* bytes of memory in the chunk */
+	size_t used;		/* bytes of it handed out */
+};
+#define CHUNK_HDRSIZE	ARENA_ROUNDUP(sizeof(struct arena_chunk))
+#define CHUNK_MEM(cp)	((char *)(cp) + CHUNK_HDRSIZE)
+
+struct compile_arena {
+	struct arena_chunk *chunks;	/* all the chunks, smallest first */
+	struct arena_chunk *cur;	/* the one being handed out from */
+	size_t in_use;		/* bytes handed out since the last reset */
+	struct compile_arena *next;	/* next arena in the pool */
+};
+
+/*
+ * An element of an "in { ... }" or "in file" set: an address, network,
+ * host name, port number, or service name, as written; "s" is null for
+ * a number.
+ */
+struct set_elem {
+	struct set_elem *next;
+	const char *s;
+	bpf_u_int32 v;
+	bpf_u_int32 masklen;	/* SET_NO_MASKLEN if there was no "/len" */
+	const char *file;	/* file it was read from, or NULL */
+	u_int lineno;		/* and the line it was on */
 };
 
 /* Code generator state */
@@ -424,10 +475,19 @@ struct _compiler_state {
 	int curreg;
 
 	/*
-	 * Memory chunks.
+	 * Elements of the "in { ... }" or "in file" set being parsed;
+	 * gen_set() consumes them.
+	 */
+	struct set_elem *set_elems;
+
+	/*
+	 * While gen_set() is generating code for a set, the sorted
+	 * values of the set; gen_hostop() and the port atoms then
+	 * compare the field with all of them, with a binary search
+	 * tree, rather than with the single value they were handed.
 	 */
-	struct chunk chunks[NCHUNKS];
-	int cur_chunk;
+	const bpf_u_int32 *cmp_set;
+	u_int cmp_set_len;
 };
 
 /*
@@ -483,10 +543,10 @@ static void init_regs(compiler_state_t *);
 static int alloc_reg(compiler_state_t *);
 static void free_reg(compiler_state_t *, int);
 
-static void initchunks(compiler_state_t *cstate);
+static struct compile_arena *arena_get(void);
+static void arena_put(struct compile_arena *);
 static void *newchunk_nolongjmp(compiler_state_t *cstate, size_t);
 static void *newchunk(compiler_state_t *cstate, size_t);
-static void freechunks(compiler_state_t *cstate);
 static inline struct block *new_block(compiler_state_t *cstate, int);
 static inline struct slist *new_stmt(compiler_state_t *cstate, int);
 static struct block *gen_retblk(compiler_state_t *cstate, int);
@@ -510,6 +570,12 @@ static struct block *gen_bcmp(compiler_state_t *, enum e_offrel, u_int,
     u_int, const u_char *);
 static struct block *gen_ncmp(compiler_state_t *, enum e_offrel, u_int,
     u_int, bpf_u_int32, int, int, bpf_u_int32);
+static struct block *gen_set_subtree(compiler_state_t *, const bpf_u_int32 *,
+    u_int, struct block *, int);
+static struct block *gen_set_tree(compiler_state_t *, enum e_offrel, u_int,
+    u_int, bpf_u_int32, const bpf_u_int32 *, u_int);
+static struct block *gen_mcmp_set(compiler_state_t *, enum e_offrel, u_int,
+    u_int, bpf_u_int32, bpf_u_int32);
 static struct slist *gen_load_absoffsetrel(compiler_state_t *, bpf_abs_offset *,
     u_int, u_int);
 static struct slist *gen_load_a(compiler_state_t *, enum e_offrel, u_int,
@@ -589,56 +655,115 @@ static struct block *gen_atmfield_code_internal(compiler_state_t *, int,
 static struct block *gen_atmtype_llc(compiler_state_t *);
 static struct block *gen_msg_abbrev(compiler_state_t *, int type);
 
+/*
+ * Allocate zeroed memory for an array of nmemb elements of the given
+ * size from an arena; return NULL if that fails.
+ */
+void *
+arena_calloc(struct compile_arena *a, size_t nmemb, size_t size)
+{
+	struct arena_chunk *cp, *last;
+	size_t n, chunksize;
+	void *p;
+
+	if (nmemb != 0 && size > (SIZE_MAX - sizeof(union arena_align)) / nmemb)
+		return (NULL);
+	n = ARENA_ROUNDUP(nmemb * size);
+
+	/*
+	 * Use the first chunk, starting with the current one, with
+	 * room for this; if there isn't one, add a new one, at least
+	 * twice as big as the last one, to the end of the list.
+	 */
+	last = NULL;
+	for (cp = a->cur; cp != NULL; cp = cp->next) {
+		if (cp->size - cp->used >= n)
+			break;
+		last = cp;
+	}
+	if (cp == NULL) {
+		chunksize = last != NULL ? 2 * last->size : CHUNK0SIZE;
+		if (chunksize < n)
+			chunksize = n;
+		if (chunksize > SIZE_MAX - CHUNK_HDRSIZE)
+			return (NULL);
+		cp = (struct arena_chunk *)calloc(1, CHUNK_HDRSIZE + chunksize);
+		if (cp == NULL)
+			return (NULL);
+		cp->size = chunksize;
+		if (last != NULL)
+			last->next = cp;
+		else
+			a->chunks = cp;
+	}
+	a->cur = cp;
+	p = CHUNK_MEM(cp) + cp->used;
+	cp->used += n;
+	a->in_use += n;
+	return (p);
+}
+
+/*
+ * Return the number of bytes handed out from an arena since it was
+ * last reset.
+ */
+size_t
+arena_in_use(struct compile_arena *a)
+{
+	return (a->in_use);
+}
+
+/*
+ * Make all the memory in an arena available again, zeroing what was
+ * handed out, and free the chunks beyond the first ARENA_KEEP bytes.
+ */
+static void
+arena_reset(struct compile_arena *a)
+{
+	struct arena_chunk *cp, *next, **cpp;
+	size_t kept = 0;
+
+	for (cpp = &a->chunks; (cp = *cpp) != NULL; ) {
+		if (kept + cp->size > ARENA_KEEP && kept != 0) {
+			*cpp = NULL;
+			for (; cp != NULL; cp = next) {
+				next = cp->next;
+				free(cp);
+			}
+			break;
+		}
+		memset(CHUNK_MEM(cp), 0, cp->used);
+		cp->used = 0;
+		kept += cp->size;
+		cpp = &cp->next;
+	}
+	a->cur = a->chunks;
+	a->in_use = 0;
+}
+
 static void
-initchunks(compiler_state_t *cstate)
+arena_free(struct compile_arena *a)
 {
-	int i;
+	struct arena_chunk *cp, *next;
 
-	for (i = 0; i < NCHUNKS; i++) {
-		cstate->chunks[i].n_left = 0;
-		cstate->chunks[i].m = NULL;
+	for (cp = a->chunks; cp != NULL; cp = next) {
+		next = cp->next;
+		free(cp);
 	}
-	cstate->cur_chunk = 0;
+	free(a);
 }
 
 static void *
 newchunk_nolongjmp(compiler_state_t *cstate, size_t n)
 {
-	struct chunk *cp;
-	int k;
-	size_t size;
-
-#ifndef __NetBSD__
-	/* XXX Round up to nearest long. */
-	n = (n + sizeof(long) - 1) & ~(sizeof(long) - 1);
-#else
-	/* XXX Round up to structure boundary. */
-	n = ALIGN(n);
-#endif
+	void *p;
 
-	cp = &cstate->chunks[cstate->cur_chunk];
-	if (n > cp->n_left) {
-		++cp;
-		k = ++cstate->cur_chunk;
-		if (k >= NCHUNKS) {
-			bpf_set_error(cstate, "out of memory");
-			return (NULL);
-		}
-		size = CHUNK0SIZE << k;
-		cp->m = (void *)malloc(size);
-		if (cp->m == NULL) {
-			bpf_set_error(cstate, "out of memory");
-			return (NULL);
-		}
-		memset((char *)cp->m, 0, size);
-		cp->n_left = size;
-		if (n > size) {
-			bpf_set_error(cstate, "out of memory");
-			return (NULL);
-		}
+	p = arena_calloc(cstate->ic.arena, 1, n);
+	if (p == NULL) {
+		bpf_set_error(cstate, "out of memory");
+		return (NULL);
 	}
-	cp->n_left -= n;
-	return (void *)((char *)cp->m + cp->n_left);
+	return (p);
 }
 
 static void *
@@ -654,16 +779,6 @@ newchunk(compiler_state_t *cstate, size_t n)
 	return (p);
 }
 
-static void
-freechunks(compiler_state_t *cstate)
-{
-	int i;
-
-	for (i = 0; i < NCHUNKS; ++i)
-		if (cstate->chunks[i].m != NULL)
-			free(cstate->chunks[i].m);
-}
-
 /*
  * A strdup whose allocations are freed after code generation is over.
  * This is used by the lexical analyzer, so it can't longjmp; it just
@@ -682,6 +797,17 @@ sdup(compiler_state_t *cstate, const char *s)
 	return (cp);
 }
 
+/*
+ * A malloc whose allocations are freed after code generation is over.
+ * This is used by the parser, so it can't longjmp; it just returns
+ * NULL on an allocation error.
+ */
+void *
+compile_alloc(compiler_state_t *cstate, size_t n)
+{
+	return (arena_calloc(cstate->ic.arena, 1, n));
+}
+
 static inline struct block *
 new_block(compiler_state_t *cstate, int code)
 {
@@ -720,9 +846,17 @@ syntax(compiler_state_t *cstate)
 	bpf_error(cstate, "syntax error in filter expression");
 }
 
-int
-pcap_compile(pcap_t *p, struct bpf_program *program,
-	     const char *buf, int optimize, bpf_u_int32 mask)
+/*
+ * Compile a filter expression, optimizing it as opts says, and fill
+ * in stats with what was done; at PCAP_OPTIMIZE_PROFILE, reorder the
+ * tests of the optimized program to run the ones that are cheapest
+ * for how often they decide the outcome first.
+ */
+static int
+compile_filter(pcap_t *p, struct bpf_program *program,
+	     const char *buf, bpf_u_int32 mask,
+	     const struct pcap_compile_opts *opts,
+	     struct pcap_compile_stat *stats)
 {
 #ifdef _WIN32
 	static int done = 0;
@@ -731,9 +865,28 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 	const char * volatile xbuf = buf;
 	yyscan_t scanner = NULL;
 	volatile YY_BUFFER_STATE in_buffer = NULL;
+	uint64_t start, opt_start;
+	char *text;
+	size_t textlen;
 	u_int len;
 	int  rc;
 
+	start = bpf_compile_usecs();
+	memset(stats, 0, sizeof(*stats));
+	if (opts->co_level < PCAP_OPTIMIZE_NONE ||
+	    opts->co_level > PCAP_OPTIMIZE_PROFILE) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "optimization level %d is not valid", opts->co_level);
+		return (-1);
+	}
+	if (opts->co_level == PCAP_OPTIMIZE_PROFILE &&
+	    opts->co_profile == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "optimization level %d requires a profile",
+		    PCAP_OPTIMIZE_PROFILE);
+		return (-1);
+	}
+
 	/*
 	 * If this pcap_t hasn't been activated, it doesn't have a
 	 * link-layer type, so we can't use it.
@@ -771,12 +924,19 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 		(p->save_current_filter_op)(p, buf);
 #endif
 
-	initchunks(&cstate);
+	cstate.ic.arena = arena_get();
+	if (cstate.ic.arena == NULL) {
+		pcap_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (-1);
+	}
 	cstate.no_optimize = 0;
 #ifdef INET6
 	cstate.ai = NULL;
 #endif
 	cstate.e = NULL;
+	cstate.set_elems = NULL;
+	cstate.cmp_set = NULL;
 	cstate.ic.root = NULL;
 	cstate.ic.cur_mark = 0;
 	cstate.bpf_pcap = p;
@@ -799,7 +959,21 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 		rc = -1;
 		goto quit;
 	}
-	in_buffer = pcap__scan_string(xbuf ? xbuf : "", scanner);
+
+	/*
+	 * Have the scanner scan a copy of the string in the arena,
+	 * rather than one that it allocates; the copy must end with
+	 * two NULs.
+	 */
+	textlen = strlen(xbuf ? xbuf : "");
+	text = arena_calloc(cstate.ic.arena, textlen + 2, 1);
+	if (text == NULL) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "out of memory");
+		rc = -1;
+		goto quit;
+	}
+	memcpy(text, xbuf ? xbuf : "", textlen);
+	in_buffer = pcap__scan_buffer(text, textlen + 2, scanner);
 
 	/*
 	 * Associate the compiler state with the lexical analyzer
@@ -833,8 +1007,9 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 		cstate.ic.root = gen_retblk(&cstate, cstate.snaplen);
 	}
 
-	if (optimize && !cstate.no_optimize) {
-		if (bpf_optimize(&cstate.ic, p->errbuf) == -1) {
+	if (opts->co_level != PCAP_OPTIMIZE_NONE && !cstate.no_optimize) {
+		opt_start = bpf_compile_usecs();
+		if (bpf_optimize(&cstate.ic, opts, stats, p->errbuf) == -1) {
 			/* Failure */
 			rc = -1;
 			goto quit;
@@ -846,6 +1021,13 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 			rc = -1;
 			goto quit;
 		}
+		if (opts->co_level == PCAP_OPTIMIZE_PROFILE &&
+		    bpf_reorder_by_profile(&cstate.ic, opts->co_profile,
+		    p->errbuf) == -1) {
+			rc = -1;
+			goto quit;
+		}
+		stats->cs_opt_usecs = bpf_compile_usecs() - opt_start;
 	}
 	program->bf_insns = icode_to_fcode(&cstate.ic,
 	    cstate.ic.root, &len, p->errbuf);
@@ -855,6 +1037,8 @@ pcap_compile(pcap_t *p, struct bpf_program *program,
 		goto quit;
 	}
 	program->bf_len = len;
+	stats->cs_insns = len;
+	stats->cs_usecs = bpf_compile_usecs() - start;
 
 	rc = 0;  /* We're all okay */
 
@@ -870,11 +1054,63 @@ quit:
 	/*
 	 * Clean up our own allocated memory.
 	 */
-	freechunks(&cstate);
+	stats->cs_peak_bytes = arena_in_use(cstate.ic.arena);
+	arena_put(cstate.ic.arena);
 
 	return (rc);
 }
 
+int
+pcap_compile(pcap_t *p, struct bpf_program *program,
+	     const char *buf, int optimize, bpf_u_int32 mask)
+{
+	struct pcap_compile_opts opts;
+	struct pcap_compile_stat stats;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.co_level = optimize ? PCAP_OPTIMIZE_DEFAULT : PCAP_OPTIMIZE_NONE;
+	return (compile_filter(p, program, buf, mask, &opts, &stats));
+}
+
+int
+pcap_compile_with_profile(pcap_t *p, struct bpf_program *program,
+	     const char *buf, int optimize, bpf_u_int32 mask,
+	     const struct pcap_filter_profile *prof)
+{
+	struct pcap_compile_opts opts;
+	struct pcap_compile_stat stats;
+
+	memset(&opts, 0, sizeof(opts));
+	if (!optimize)
+		opts.co_level = PCAP_OPTIMIZE_NONE;
+	else if (prof == NULL)
+		opts.co_level = PCAP_OPTIMIZE_DEFAULT;
+	else {
+		opts.co_level = PCAP_OPTIMIZE_PROFILE;
+		opts.co_profile = prof;
+	}
+	return (compile_filter(p, program, buf, mask, &opts, &stats));
+}
+
+int
+pcap_compile_ex(pcap_t *p, struct bpf_program *program,
+	     const char *buf, bpf_u_int32 mask,
+	     const struct pcap_compile_opts *opts,
+	     struct pcap_compile_stat *stats)
+{
+	struct pcap_compile_opts default_opts;
+	struct pcap_compile_stat dummy_stats;
+
+	if (opts == NULL) {
+		memset(&default_opts, 0, sizeof(default_opts));
+		default_opts.co_level = PCAP_OPTIMIZE_DEFAULT;
+		opts = &default_opts;
+	}
+	if (stats == NULL)
+		stats = &dummy_stats;
+	return (compile_filter(p, program, buf, mask, opts, stats));
+}
+
 /*
  * entry point for using the compiler with no pcap open
  * pass in all the stuff that is needed explicitly instead.
@@ -909,6 +1145,634 @@ pcap_freecode(struct bpf_program *program)
 	}
 }
 
+/*
+ * A process-wide cache of compiled filters, for programs that compile
+ * the same filters over and over.  Entries are keyed on the filter
+ * text and on everything about the arguments and the pcap_t that the
+ * generated code depends on.  The programs in it are shared and
+ * reference-counted, so that a program that's evicted while it's
+ * still in use is freed only when it's no longer used.
+ *
+ * Filters are compiled without the lock held, so that threads
+ * compiling different filters don't wait for one another; if two
+ * threads compile the same filter at once, the program of the first
+ * one to finish goes in the cache and the other one uses it.
+ */
+#define COMPILE_CACHE_BUCKETS		64
+#define COMPILE_CACHE_DEFAULT_SIZE	64
+
+#if defined(_WIN32)
+static SRWLOCK compile_cache_lock = SRWLOCK_INIT;
+#define COMPILE_CACHE_LOCK()	AcquireSRWLockExclusive(&compile_cache_lock)
+#define COMPILE_CACHE_UNLOCK()	ReleaseSRWLockExclusive(&compile_cache_lock)
+#elif defined(HAVE_PTHREADS)
+static pthread_mutex_t compile_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define COMPILE_CACHE_LOCK()	pthread_mutex_lock(&compile_cache_lock)
+#define COMPILE_CACHE_UNLOCK()	pthread_mutex_unlock(&compile_cache_lock)
+#elif defined(MSDOS)
+/* No threads, so nothing to lock against. */
+#define COMPILE_CACHE_LOCK()
+#define COMPILE_CACHE_UNLOCK()
+#else
+#error "No mutex to protect the cache of compiled filters with"
+#endif
+
+/*
+ * Idle arenas, for compiles to reuse; they're protected by the same
+ * lock as the cache, which every platform with threads has, as
+ * compiles in different threads get and put arenas at the same time.
+ */
+static struct compile_arena *arena_pool;
+static u_int arena_pool_len;
+
+/*
+ * Get an arena for a compile, from the pool if there's one there.
+ */
+static struct compile_arena *
+arena_get(void)
+{
+	struct compile_arena *a;
+
+	COMPILE_CACHE_LOCK();
+	a = arena_pool;
+	if (a != NULL) {
+		arena_pool = a->next;
+		arena_pool_len--;
+	}
+	COMPILE_CACHE_UNLOCK();
+	if (a == NULL)
+		a = (struct compile_arena *)calloc(1, sizeof(*a));
+	return (a);
+}
+
+/*
+ * Release an arena when a compile is over, resetting it and putting
+ * it into the pool, or freeing it if the pool is full.
+ */
+static void
+arena_put(struct compile_arena *a)
+{
+	arena_reset(a);
+	COMPILE_CACHE_LOCK();
+	if (arena_pool_len < ARENA_POOL_SIZE) {
+		a->next = arena_pool;
+		arena_pool = a;
+		arena_pool_len++;
+		a = NULL;
+	}
+	COMPILE_CACHE_UNLOCK();
+	if (a != NULL)
+		arena_free(a);
+}
+
+/*
+ * What, other than the filter text, a compiled program depends on.
+ */
+struct compile_cache_key {
+	int	linktype;
+	int	snaplen;
+	bpf_u_int32 netmask;
+	int	optimize;
+	int	codegen_flags;
+	int	fddipad;
+	int	savefile;	/* affects pflog and Linux cooked headers */
+	int	swapped;
+};
+
+struct compile_cache_entry {
+	struct bpf_program prog;	/* must be first */
+	char	*text;			/* our copy of the filter text */
+	struct compile_cache_key key;
+	u_int	hash;
+	u_int	refs;		/* users, plus one while it's cached */
+	struct compile_cache_entry *next;	/* in the hash chain */
+	struct compile_cache_entry *newer, *older;
+};
+
+static struct compile_cache_entry *compile_cache[COMPILE_CACHE_BUCKETS];
+static struct compile_cache_entry *compile_cache_newest, *compile_cache_oldest;
+static u_int compile_cache_entries;
+static u_int compile_cache_size = COMPILE_CACHE_DEFAULT_SIZE;
+static uint64_t compile_cache_hits, compile_cache_misses;
+
+static u_int
+compile_cache_hash(const char *text, const struct compile_cache_key *key)
+{
+	const u_char *cp;
+	u_int h = 2166136261U;
+
+	for (cp = (const u_char *)text; *cp != '\0'; cp++)
+		h = (h ^ *cp) * 16777619U;
+	h = (h ^ (u_int)key->linktype) * 16777619U;
+	h = (h ^ (u_int)key->snaplen) * 16777619U;
+	h = (h ^ key->netmask) * 16777619U;
+	h = (h ^ (u_int)key->optimize) * 16777619U;
+	h = (h ^ (u_int)key->codegen_flags) * 16777619U;
+	h = (h ^ (u_int)key->fddipad) * 16777619U;
+	h = (h ^ (u_int)(key->savefile << 1 | key->swapped)) * 16777619U;
+	return (h);
+}
+
+static int
+compile_cache_key_eq(const struct compile_cache_key *a,
+    const struct compile_cache_key *b)
+{
+	return (a->linktype == b->linktype && a->snaplen == b->snaplen &&
+	    a->netmask == b->netmask && a->optimize == b->optimize &&
+	    a->codegen_flags == b->codegen_flags &&
+	    a->fddipad == b->fddipad && a->savefile == b->savefile &&
+	    a->swapped == b->swapped);
+}
+
+static void
+compile_cache_free_entry(struct compile_cache_entry *e)
+{
+	pcap_freecode(&e->prog);
+	free(e->text);
+	free(e);
+}
+
+/*
+ * The rest of these must be called with the lock held.
+ */
+static struct compile_cache_entry *
+compile_cache_lookup(const char *text, const struct compile_cache_key *key,
+    u_int hash)
+{
+	struct compile_cache_entry *e;
+
+	for (e = compile_cache[hash % COMPILE_CACHE_BUCKETS]; e != NULL;
+	    e = e->next) {
+		if (e->hash == hash && compile_cache_key_eq(&e->key, key) &&
+		    strcmp(e->text, text) == 0)
+			return (e);
+	}
+	return (NULL);
+}
+
+static void
+compile_cache_unlink_lru(struct compile_cache_entry *e)
+{
+	if (e->newer != NULL)
+		e->newer->older = e->older;
+	else
+		compile_cache_newest = e->older;
+	if (e->older != NULL)
+		e->older->newer = e->newer;
+	else
+		compile_cache_oldest = e->newer;
+}
+
+static void
+compile_cache_link_lru(struct compile_cache_entry *e)
+{
+	e->newer = NULL;
+	e->older = compile_cache_newest;
+	if (compile_cache_newest != NULL)
+		compile_cache_newest->newer = e;
+	else
+		compile_cache_oldest = e;
+	compile_cache_newest = e;
+}
+
+/*
+ * Evict the least recently used entries until there are no more than
+ * compile_cache_size of them.
+ */
+static void
+compile_cache_trim(void)
+{
+	struct compile_cache_entry *e, **ep;
+
+	while (compile_cache_entries > compile_cache_size) {
+		e = compile_cache_oldest;
+		compile_cache_unlink_lru(e);
+		for (ep = &compile_cache[e->hash % COMPILE_CACHE_BUCKETS];
+		    *ep != e; ep = &(*ep)->next)
+			;
+		*ep = e->next;
+		compile_cache_entries--;
+		if (--e->refs == 0)
+			compile_cache_free_entry(e);
+	}
+}
+
+/*
+ * Compile a filter, or find the result of compiling it with the same
+ * arguments and the same kind of pcap_t in the cache.  On success,
+ * the program is stored in *programp; it's shared, so it must not be
+ * modified, and it must be released with pcap_freecode_cached() rather
+ * than pcap_freecode().
+ */
+int
+pcap_compile_cached(pcap_t *p, struct bpf_program **programp,
+    const char *buf, int optimize, bpf_u_int32 mask)
+{
+	struct compile_cache_key key;
+	struct compile_cache_entry *e, *other;
+	const char *text;
+	u_int hash;
+
+	if (!p->activated) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "not-yet-activated pcap_t passed to pcap_compile");
+		return (-1);
+	}
+	text = buf != NULL ? buf : "";
+	key.linktype = p->linktype;
+	key.snaplen = p->snapshot;
+	key.netmask = mask;
+	key.optimize = optimize != 0;
+	key.codegen_flags = p->bpf_codegen_flags;
+	key.fddipad = p->fddipad;
+	key.savefile = p->rfile != NULL;
+	key.swapped = p->swapped;
+	hash = compile_cache_hash(text, &key);
+
+	COMPILE_CACHE_LOCK();
+	e = compile_cache_lookup(text, &key, hash);
+	if (e != NULL) {
+		compile_cache_hits++;
+		e->refs++;
+		compile_cache_unlink_lru(e);
+		compile_cache_link_lru(e);
+		COMPILE_CACHE_UNLOCK();
+#ifdef ENABLE_REMOTE
+		/*
+		 * Let the device know, as pcap_compile() would.
+		 */
+		if (p->save_current_filter_op != NULL)
+			(p->save_current_filter_op)(p, buf);
+#endif
+		*programp = &e->prog;
+		return (0);
+	}
+	compile_cache_misses++;
+	COMPILE_CACHE_UNLOCK();
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL || (e->text = strdup(text)) == NULL) {
+		pcap_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(e);
+		return (-1);
+	}
+	if (pcap_compile(p, &e->prog, buf, optimize, mask) == -1) {
+		compile_cache_free_entry(e);
+		return (-1);
+	}
+	e->key = key;
+	e->hash = hash;
+	e->refs = 1;
+
+	COMPILE_CACHE_LOCK();
+	other = compile_cache_lookup(text, &key, hash);
+	if (other != NULL) {
+		/*
+		 * Another thread got there first; use its program.
+		 */
+		other->refs++;
+		COMPILE_CACHE_UNLOCK();
+		compile_cache_free_entry(e);
+		*programp = &other->prog;
+		return (0);
+	}
+	if (compile_cache_size != 0) {
+		e->refs++;
+		e->next = compile_cache[hash % COMPILE_CACHE_BUCKETS];
+		compile_cache[hash % COMPILE_CACHE_BUCKETS] = e;
+		compile_cache_link_lru(e);
+		compile_cache_entries++;
+		compile_cache_trim();
+	}
+	COMPILE_CACHE_UNLOCK();
+	*programp = &e->prog;
+	return (0);
+}
+
+/*
+ * Release a program returned by pcap_compile_cached().
+ */
+void
+pcap_freecode_cached(struct bpf_program *program)
+{
+	struct compile_cache_entry *e;
+	u_int refs;
+
+	if (program == NULL)
+		return;
+	e = (struct compile_cache_entry *)program;
+	COMPILE_CACHE_LOCK();
+	refs = --e->refs;
+	COMPILE_CACHE_UNLOCK();
+	if (refs == 0)
+		compile_cache_free_entry(e);
+}
+
+/*
+ * Set the maximum number of programs kept in the cache; 0 means that
+ * programs aren't kept once they're no longer in use.
+ */
+int
+pcap_set_compile_cache_size(int size)
+{
+	if (size < 0)
+		return (PCAP_ERROR);
+	COMPILE_CACHE_LOCK();
+	compile_cache_size = size;
+	compile_cache_trim();
+	COMPILE_CACHE_UNLOCK();
+	return (0);
+}
+
+void
+pcap_compile_cache_stats(struct pcap_compile_cache_stat *st)
+{
+	COMPILE_CACHE_LOCK();
+	st->ccs_hits = compile_cache_hits;
+	st->ccs_misses = compile_cache_misses;
+	st->ccs_entries = compile_cache_entries;
+	COMPILE_CACHE_UNLOCK();
+}
+
+/*
+ * A filter built from a base expression and terms ANDed with it, for
+ * programs that add terms to, and remove them from, a filter on a
+ * pcap_t over and over.  The code generator emits code as it parses,
+ * and some primitives, such as "vlan" and "mpls", change how what
+ * follows them is compiled, so terms can't be compiled on their own
+ * and spliced into a program; instead, each change compiles the whole
+ * expression, through the cache, so that going back to an expression
+ * compiled before costs nothing, and the new program is installed only
+ * if it differs from the one that's installed.
+ */
+struct filter_term {
+	struct filter_term *next;
+	int	id;
+	char	*text;
+};
+
+struct pcap_filter_builder {
+	pcap_t	*p;
+	char	*base;
+	int	optimize;
+	bpf_u_int32 netmask;
+	struct filter_term *terms;	/* in the order they were added */
+	int	next_id;
+	struct bpf_program *prog;	/* from pcap_compile_cached() */
+	struct bpf_program installed;	/* copy of what we last installed */
+};
+
+/*
+ * Check whether the parentheses in an expression balance, outside of
+ * quoted strings; if they don't, putting the expression in parentheses
+ * could leave part of it outside them, so that ANDing it with other
+ * terms wouldn't restrict what it matches.
+ */
+static int
+filter_parens_balance(const char *s)
+{
+	int depth;
+
+	depth = 0;
+	for (; *s != '\0'; s++) {
+		if (*s == '"') {
+			/*
+			 * A quoted string ends at the next quote, which
+			 * must be on the same line.
+			 */
+			s = strpbrk(s + 1, "\"\n");
+			if (s == NULL || *s == '\n')
+				return (0);
+		} else if (*s == '(')
+			depth++;
+		else if (*s == ')' && --depth < 0)
+			return (0);
+	}
+	return (depth == 0);
+}
+
+/*
+ * Compile the base expression and all the terms except the one with
+ * the ID skip_id, and extra if it's not null, and make the result the
+ * builder's program.
+ */
+static int
+filter_builder_compile(pcap_filter_builder_t *fb, int skip_id,
+    const char *extra)
+{
+	struct filter_term *t;
+	struct bpf_program *prog;
+	size_t len;
+	char *text, *cp;
+	int rc;
+
+	len = strlen(fb->base) + 3;
+	for (t = fb->terms; t != NULL; t = t->next)
+		len += strlen(t->text) + 7;
+	if (extra != NULL)
+		len += strlen(extra) + 7;
+	text = malloc(len);
+	if (text == NULL) {
+		pcap_fmt_errmsg_for_errno(fb->p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (-1);
+	}
+	cp = text;
+	*cp = '\0';
+	if (fb->base[0] != '\0')
+		cp += snprintf(cp, len - (cp - text), "(%s)", fb->base);
+	for (t = fb->terms; t != NULL; t = t->next) {
+		if (t->id != skip_id)
+			cp += snprintf(cp, len - (cp - text), "%s(%s)",
+			    cp == text ? "" : " and ", t->text);
+	}
+	if (extra != NULL)
+		cp += snprintf(cp, len - (cp - text), "%s(%s)",
+		    cp == text ? "" : " and ", extra);
+
+	rc = pcap_compile_cached(fb->p, &prog, text, fb->optimize,
+	    fb->netmask);
+	free(text);
+	if (rc == -1)
+		return (-1);
+	pcap_freecode_cached(fb->prog);
+	fb->prog = prog;
+	return (0);
+}
+
+pcap_filter_builder_t *
+pcap_filter_builder_create(pcap_t *p, const char *base, int optimize,
+    bpf_u_int32 mask)
+{
+	pcap_filter_builder_t *fb;
+
+	if (base != NULL && !filter_parens_balance(base)) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "unbalanced parentheses or quotes in base filter");
+		return (NULL);
+	}
+	fb = calloc(1, sizeof(*fb));
+	if (fb == NULL ||
+	    (fb->base = strdup(base != NULL ? base : "")) == NULL) {
+		pcap_fmt_errmsg_for_errno(p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(fb);
+		return (NULL);
+	}
+	fb->p = p;
+	fb->optimize = optimize;
+	fb->netmask = mask;
+	fb->next_id = 1;
+	if (filter_builder_compile(fb, 0, NULL) == -1) {
+		pcap_filter_builder_free(fb);
+		return (NULL);
+	}
+	return (fb);
+}
+
+/*
+ * AND a term with the filter; return an ID with which the term can be
+ * removed.  The term isn't added if its parentheses don't balance or
+ * the filter doesn't compile with it.
+ */
+int
+pcap_filter_builder_add_term(pcap_filter_builder_t *fb, const char *term)
+{
+	struct filter_term *t, **tp;
+
+	if (!filter_parens_balance(term)) {
+		snprintf(fb->p->errbuf, PCAP_ERRBUF_SIZE,
+		    "unbalanced parentheses or quotes in filter term");
+		return (PCAP_ERROR);
+	}
+	t = calloc(1, sizeof(*t));
+	if (t == NULL || (t->text = strdup(term)) == NULL) {
+		pcap_fmt_errmsg_for_errno(fb->p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(t);
+		return (PCAP_ERROR);
+	}
+	if (filter_builder_compile(fb, 0, term) == -1) {
+		free(t->text);
+		free(t);
+		return (PCAP_ERROR);
+	}
+	t->id = fb->next_id++;
+	for (tp = &fb->terms; *tp != NULL; tp = &(*tp)->next)
+		;
+	*tp = t;
+	return (t->id);
+}
+
+int
+pcap_filter_builder_remove_term(pcap_filter_builder_t *fb, int id)
+{
+	struct filter_term *t, **tp;
+
+	for (tp = &fb->terms; *tp != NULL; tp = &(*tp)->next) {
+		if ((*tp)->id == id)
+			break;
+	}
+	if (*tp == NULL) {
+		snprintf(fb->p->errbuf, PCAP_ERRBUF_SIZE,
+		    "no filter term with ID %d", id);
+		return (PCAP_ERROR);
+	}
+	if (filter_builder_compile(fb, id, NULL) == -1)
+		return (PCAP_ERROR);
+	t = *tp;
+	*tp = t->next;
+	free(t->text);
+	free(t);
+	return (0);
+}
+
+const struct bpf_program *
+pcap_filter_builder_program(pcap_filter_builder_t *fb)
+{
+	return (fb->prog);
+}
+
+/*
+ * Return the number of instructions that would have to be replaced
+ * to turn program a into program b, not counting the ones they start
+ * and end with in common; 0 means that they're identical.
+ */
+u_int
+pcap_filter_diff(const struct bpf_program *a, const struct bpf_program *b)
+{
+	u_int head, tail, min, max;
+
+	if (a->bf_len < b->bf_len) {
+		min = a->bf_len;
+		max = b->bf_len;
+	} else {
+		min = b->bf_len;
+		max = a->bf_len;
+	}
+	for (head = 0; head < min; head++) {
+		if (memcmp(&a->bf_insns[head], &b->bf_insns[head],
+		    sizeof(struct bpf_insn)) != 0)
+			break;
+	}
+	for (tail = 0; head + tail < min; tail++) {
+		if (memcmp(&a->bf_insns[a->bf_len - tail - 1],
+		    &b->bf_insns[b->bf_len - tail - 1],
+		    sizeof(struct bpf_insn)) != 0)
+			break;
+	}
+	return (max - head - tail);
+}
+
+/*
+ * Install the builder's program as the filter for its pcap_t, unless
+ * it's the one we last installed; return 0 if it wasn't installed,
+ * and otherwise the number of instructions it differs in.
+ */
+int
+pcap_filter_builder_setfilter(pcap_filter_builder_t *fb)
+{
+	struct bpf_insn *insns;
+	u_int changed;
+
+	changed = pcap_filter_diff(&fb->installed, fb->prog);
+	if (changed == 0)
+		return (0);
+	insns = malloc(fb->prog->bf_len * sizeof(struct bpf_insn));
+	if (insns == NULL) {
+		pcap_fmt_errmsg_for_errno(fb->p->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (PCAP_ERROR);
+	}
+	if (pcap_setfilter(fb->p, fb->prog) == -1) {
+		free(insns);
+		return (PCAP_ERROR);
+	}
+	memcpy(insns, fb->prog->bf_insns,
+	    fb->prog->bf_len * sizeof(struct bpf_insn));
+	pcap_freecode(&fb->installed);
+	fb->installed.bf_insns = insns;
+	fb->installed.bf_len = fb->prog->bf_len;
+	return ((int)changed);
+}
+
+void
+pcap_filter_builder_free(pcap_filter_builder_t *fb)
+{
+	struct filter_term *t, *next;
+
+	for (t = fb->terms; t != NULL; t = next) {
+		next = t->next;
+		free(t->text);
+		free(t);
+	}
+	pcap_freecode_cached(fb->prog);
+	pcap_freecode(&fb->installed);
+	free(fb->base);
+	free(fb);
+}
+
 /*
  * Backpatch the blocks in 'list' to 'target'.  The 'sense' field indicates
  * which of the jt and jf fields has been resolved and which is a pointer
@@ -1141,6 +2005,85 @@ gen_ncmp(compiler_state_t *cstate, enum e_offrel offrel, u_int offset,
 	return b;
 }
 
+/*
+ * Helper for gen_set_tree(): generate the subtree for the "n" values
+ * in "v".  Leaves add themselves to the true list of "last", and jump
+ * to "last" if they don't match, as the value can't match it either;
+ * "last" is the leaf for the largest value, and the root of the whole
+ * tree.
+ */
+static struct block *
+gen_set_subtree(compiler_state_t *cstate, const bpf_u_int32 *v, u_int n,
+    struct block *last, int rightmost)
+{
+	struct block *b;
+	u_int half;
+
+	if (n == 1) {
+		if (rightmost)
+			return last;
+		b = new_block(cstate, JMP(BPF_JEQ));
+		b->s.k = v[0];
+		JF(b) = last;
+		JT(b) = JT(last);
+		JT(last) = b;
+		return b;
+	}
+	half = (n + 1) / 2;
+	b = new_block(cstate, JMP(BPF_JGT));
+	b->s.k = v[half - 1];
+	JF(b) = gen_set_subtree(cstate, v, half, last, 0);
+	JT(b) = gen_set_subtree(cstate, v + half, n - half, last, rightmost);
+	return b;
+}
+
+/*
+ * AND the field with "mask" and test whether the result is one of the
+ * "n" values in "v", which must be sorted in ascending order and have
+ * no duplicates.  Rather than a chain of "n" comparisons, generate a
+ * balanced binary search tree: each interior node is a "jgt" that
+ * picks the half of the values that could still match, and each leaf
+ * is a "jeq", so a packet is tested against O(log n) values, whether
+ * the program is run in the kernel or in userland.
+ *
+ * The field is loaded only by the root of the tree; every other node
+ * can only be reached from within the tree, with the field still in A.
+ */
+static struct block *
+gen_set_tree(compiler_state_t *cstate, enum e_offrel offrel, u_int offset,
+    u_int size, bpf_u_int32 mask, const bpf_u_int32 *v, u_int n)
+{
+	struct slist *s, *s2;
+	struct block *last;
+
+	s = gen_load_a(cstate, offrel, offset, size);
+	if (mask != 0xffffffff) {
+		s2 = new_stmt(cstate, BPF_ALU|BPF_AND|BPF_K);
+		s2->s.k = mask;
+		sappend(s, s2);
+	}
+
+	last = new_block(cstate, JMP(BPF_JEQ));
+	last->s.k = v[n - 1];
+	last->head = gen_set_subtree(cstate, v, n, last, 1);
+	last->head->stmts = s;
+	return last;
+}
+
+/*
+ * Like gen_mcmp(), but, if gen_set() is generating code for a set,
+ * compare the field with the values in that set instead of with "v".
+ */
+static struct block *
+gen_mcmp_set(compiler_state_t *cstate, enum e_offrel offrel, u_int offset,
+    u_int size, bpf_u_int32 v, bpf_u_int32 mask)
+{
+	if (cstate->cmp_set != NULL)
+		return gen_set_tree(cstate, offrel, offset, size, mask,
+		    cstate->cmp_set, cstate->cmp_set_len);
+	return gen_mcmp(cstate, offrel, offset, size, v, mask);
+}
+
 static int
 init_linktype(compiler_state_t *cstate, pcap_t *p)
 {
@@ -4028,7 +4971,7 @@ gen_hostop(compiler_state_t *cstate, bpf_u_int32 addr, bpf_u_int32 mask,
 		/*NOTREACHED*/
 	}
 	b0 = gen_linktype(cstate, ll_proto);
-	b1 = gen_mcmp(cstate, OR_LINKPL, offset, BPF_W, addr, mask);
+	b1 = gen_mcmp_set(cstate, OR_LINKPL, offset, BPF_W, addr, mask);
 	gen_and(b0, b1);
 	return b1;
 }
@@ -5585,13 +6528,13 @@ gen_ipfrag(compiler_state_t *cstate)
 static struct block *
 gen_portatom(compiler_state_t *cstate, int off, bpf_u_int32 v)
 {
-	return gen_cmp(cstate, OR_TRAN_IPV4, off, BPF_H, v);
+	return gen_mcmp_set(cstate, OR_TRAN_IPV4, off, BPF_H, v, 0xffffffff);
 }
 
 static struct block *
 gen_portatom6(compiler_state_t *cstate, int off, bpf_u_int32 v)
 {
-	return gen_cmp(cstate, OR_TRAN_IPV6, off, BPF_H, v);
+	return gen_mcmp_set(cstate, OR_TRAN_IPV6, off, BPF_H, v, 0xffffffff);
 }
 
 static struct block *
@@ -7196,6 +8139,643 @@ gen_mcode6(compiler_state_t *cstate, const char *s1, const char *s2,
 }
 #endif /*INET6*/
 
+/*
+ * Add an element to the set being parsed.  "s" is the element as
+ * written, or null if the element is the number "v"; "masklen" is the
+ * prefix length given with "/", or SET_NO_MASKLEN.
+ */
+int
+gen_set_add(compiler_state_t *cstate, const char *s, bpf_u_int32 v,
+    bpf_u_int32 masklen)
+{
+	struct set_elem *e;
+
+	e = (struct set_elem *)newchunk_nolongjmp(cstate, sizeof(*e));
+	if (e == NULL)
+		return (-1);
+	e->s = s;
+	e->v = v;
+	e->masklen = masklen;
+	e->file = NULL;
+	e->lineno = 0;
+	e->next = cstate->set_elems;
+	cstate->set_elems = e;
+	return (0);
+}
+
+#define SET_FILE_SEPS	" \t\r\n,"
+
+/*
+ * Add the elements listed in the file "path" to the set being parsed.
+ * Elements are separated by white space or commas, and a "#" starts a
+ * comment that runs to the end of the line.  The file must be a
+ * regular file, so that reading it can't block or go on forever, and
+ * must be text.  As the file might not be one the user can read, error
+ * messages give the line an element is on rather than the element.
+ */
+int
+gen_set_file(compiler_state_t *cstate, const char *path)
+{
+	FILE *fp;
+	struct stat st;
+	char line[1024];
+	char *cp, *elem, *slash, *end;
+	size_t len, n;
+	bpf_u_int32 v, masklen;
+	u_int lineno;
+	int c, ret;
+
+	/*
+	 * Check before opening it, as opening a FIFO blocks, and
+	 * again after, in case it was replaced in between.
+	 */
+	if (stat(path, &st) == 0 && (st.st_mode & S_IFMT) != S_IFREG) {
+		bpf_set_error(cstate, "%s is not a regular file", path);
+		return (-1);
+	}
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (!cstate->error_set) {
+			pcap_fmt_errmsg_for_errno(cstate->bpf_pcap->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "can't open %s", path);
+			cstate->error_set = 1;
+		}
+		return (-1);
+	}
+	if (fstat(fileno(fp), &st) == -1) {
+		if (!cstate->error_set) {
+			pcap_fmt_errmsg_for_errno(cstate->bpf_pcap->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "can't stat %s", path);
+			cstate->error_set = 1;
+		}
+		fclose(fp);
+		return (-1);
+	}
+	if ((st.st_mode & S_IFMT) != S_IFREG) {
+		bpf_set_error(cstate, "%s is not a regular file", path);
+		fclose(fp);
+		return (-1);
+	}
+	ret = 0;
+	lineno = 0;
+	c = 0;
+	while (ret == 0 && c != EOF) {
+		lineno++;
+		n = 0;
+		while ((c = getc(fp)) != EOF && c != '\n') {
+			if (c == '\0') {
+				bpf_set_error(cstate,
+				    "%s, line %u: null character", path,
+				    lineno);
+				ret = -1;
+				break;
+			}
+			if (n == sizeof(line) - 1) {
+				bpf_set_error(cstate,
+				    "%s, line %u: line too long", path,
+				    lineno);
+				ret = -1;
+				break;
+			}
+			line[n++] = (char)c;
+		}
+		if (ret != 0)
+			break;
+		line[n] = '\0';
+		cp = strchr(line, '#');
+		if (cp != NULL)
+			*cp = '\0';
+		for (cp = line; ret == 0; cp += len) {
+			cp += strspn(cp, SET_FILE_SEPS);
+			if (*cp == '\0')
+				break;
+			len = strcspn(cp, SET_FILE_SEPS);
+			elem = (char *)newchunk_nolongjmp(cstate, len + 1);
+			if (elem == NULL) {
+				ret = -1;
+				break;
+			}
+			memcpy(elem, cp, len);
+			elem[len] = '\0';
+
+			masklen = SET_NO_MASKLEN;
+			slash = strchr(elem, '/');
+			if (slash != NULL) {
+				*slash++ = '\0';
+				masklen = (bpf_u_int32)strtoul(slash, &end, 10);
+				if (*slash < '0' || *slash > '9' ||
+				    *end != '\0' || masklen > 128) {
+					bpf_set_error(cstate,
+					    "%s, line %u: invalid prefix length",
+					    path, lineno);
+					ret = -1;
+					break;
+				}
+			}
+
+			/*
+			 * A plain number is a number, as it would be
+			 * in a filter expression.
+			 */
+			v = 0;
+			if (masklen == SET_NO_MASKLEN &&
+			    elem[0] >= '0' && elem[0] <= '9') {
+				v = (bpf_u_int32)strtoul(elem, &end, 0);
+				if (*end == '\0')
+					elem = NULL;
+				else
+					v = 0;
+			}
+			ret = gen_set_add(cstate, elem, v, masklen);
+			if (ret == 0) {
+				cstate->set_elems->file = path;
+				cstate->set_elems->lineno = lineno;
+			}
+		}
+	}
+	if (ret == 0 && ferror(fp)) {
+		bpf_set_error(cstate, "error reading %s", path);
+		ret = -1;
+	}
+	fclose(fp);
+	return (ret);
+}
+
+/*
+ * An IPv4 address or network, or a port number, in a set.
+ */
+struct set_val {
+	struct set_val *next;
+	bpf_u_int32 v;
+	bpf_u_int32 mask;
+};
+
+static void
+add_set_val(compiler_state_t *cstate, struct set_val **vals, u_int *nvals,
+    bpf_u_int32 v, bpf_u_int32 mask)
+{
+	struct set_val *sv;
+
+	sv = (struct set_val *)newchunk(cstate, sizeof(*sv));
+	sv->v = v;
+	sv->mask = mask;
+	sv->next = *vals;
+	*vals = sv;
+	(*nvals)++;
+}
+
+/*
+ * Sort values with the longest mask first, and values with the same
+ * mask in ascending order, so that each run of values with the same
+ * mask can be handed to gen_set_tree().
+ */
+static int
+set_val_compare(const void *a, const void *b)
+{
+	const struct set_val *va = *(const struct set_val * const *)a;
+	const struct set_val *vb = *(const struct set_val * const *)b;
+
+	if (va->mask != vb->mask)
+		return (va->mask > vb->mask ? -1 : 1);
+	if (va->v != vb->v)
+		return (va->v < vb->v ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Describe an element of a set for an error message: quoted, as it was
+ * written, if it was in the filter, or by where it is if it was read
+ * from a file, so that what's in the file isn't disclosed.
+ */
+static const char *
+set_elem_desc(compiler_state_t *cstate, const struct set_elem *e)
+{
+	char *buf;
+
+	buf = (char *)newchunk(cstate, PCAP_ERRBUF_SIZE);
+	if (e->file != NULL)
+		snprintf(buf, PCAP_ERRBUF_SIZE, "on line %u of %s",
+		    e->lineno, e->file);
+	else if (e->s == NULL)
+		snprintf(buf, PCAP_ERRBUF_SIZE, "'%u'", e->v);
+	else if (e->masklen != SET_NO_MASKLEN)
+		snprintf(buf, PCAP_ERRBUF_SIZE, "'%s/%u'", e->s, e->masklen);
+	else
+		snprintf(buf, PCAP_ERRBUF_SIZE, "'%s'", e->s);
+	return (buf);
+}
+
+#ifdef INET6
+/*
+ * Generate code for one IPv6 address or network in a set; those
+ * aren't put into a search tree, as BPF can only compare 32 bits at
+ * a time.
+ */
+static struct block *
+gen_set_host6(compiler_state_t *cstate, const struct set_elem *e,
+    struct qual q)
+{
+	struct addrinfo *res;
+	struct in6_addr *addr;
+	struct in6_addr mask;
+	struct block *b;
+	uint32_t *a, *m;
+	bpf_u_int32 masklen;
+
+	res = pcap_nametoaddrinfo(e->s);
+	if (!res)
+		bpf_error(cstate, "invalid ip6 address %s",
+		    set_elem_desc(cstate, e));
+	cstate->ai = res;
+	if (res->ai_next)
+		bpf_error(cstate, "ip6 address %s resolved to multiple addresses",
+		    set_elem_desc(cstate, e));
+	addr = &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr;
+
+	masklen = e->masklen;
+	if (masklen == SET_NO_MASKLEN)
+		masklen = 128;
+	else if (q.addr != Q_NET)
+		bpf_error(cstate, "Mask syntax for networks only");
+	if (masklen > sizeof(mask.s6_addr) * 8)
+		bpf_error(cstate, "mask length must be <= %u", (unsigned int)(sizeof(mask.s6_addr) * 8));
+	memset(&mask, 0, sizeof(mask));
+	memset(&mask.s6_addr, 0xff, masklen / 8);
+	if (masklen % 8) {
+		mask.s6_addr[masklen / 8] =
+			(0xff << (8 - masklen % 8)) & 0xff;
+	}
+
+	a = (uint32_t *)addr;
+	m = (uint32_t *)&mask;
+	if ((a[0] & ~m[0]) || (a[1] & ~m[1])
+	 || (a[2] & ~m[2]) || (a[3] & ~m[3])) {
+		bpf_error(cstate, "non-network bits set in network %s",
+		    set_elem_desc(cstate, e));
+	}
+
+	b = gen_host6(cstate, addr, &mask, q.proto, q.dir, q.addr);
+	cstate->ai = NULL;
+	freeaddrinfo(res);
+	return b;
+}
+#endif /*INET6*/
+
+/*
+ * Turn a host or network element of a set into IPv4 values, handled
+ * the way gen_ncode(), gen_mcode(), and gen_scode() would handle it;
+ * IPv6 addresses are ORed into "*bp".
+ */
+static void
+gen_set_hostelem(compiler_state_t *cstate, const struct set_elem *e,
+    struct qual q, struct set_val **vals, u_int *nvals, struct block **bp)
+{
+	bpf_u_int32 v, mask;
+	int vlen;
+	struct block *tmp;
+	struct addrinfo *res, *res0;
+	struct sockaddr_in *sin4;
+#ifdef INET6
+	struct sockaddr_in6 *sin6;
+	struct in6_addr mask128;
+#endif
+
+	if (e->s == NULL) {
+		v = e->v;
+		mask = 0xffffffff;
+		if (q.addr == Q_NET) {
+			/* Promote short net number */
+			while (v && (v & 0xff000000) == 0) {
+				v <<= 8;
+				mask <<= 8;
+			}
+		}
+		add_set_val(cstate, vals, nvals, v, mask);
+		return;
+	}
+
+	if (strchr(e->s, ':') != NULL) {
+#ifdef INET6
+		tmp = gen_set_host6(cstate, e, q);
+		if (*bp != NULL)
+			gen_or(*bp, tmp);
+		*bp = tmp;
+		return;
+#else
+		bpf_error(cstate, "IPv6 address %s not supported",
+		    set_elem_desc(cstate, e));
+#endif
+	}
+
+	if (e->s[strspn(e->s, "0123456789.")] == '\0') {
+		vlen = __pcap_atoin(e->s, &v);
+		if (vlen < 0)
+			bpf_error(cstate, "invalid IPv4 address %s",
+			    set_elem_desc(cstate, e));
+		/* Promote short ipaddr */
+		v <<= 32 - vlen;
+		if (e->masklen == SET_NO_MASKLEN)
+			mask = 0xffffffff << (32 - vlen);
+		else {
+			if (q.addr != Q_NET)
+				bpf_error(cstate, "Mask syntax for networks only");
+			if (e->masklen > 32)
+				bpf_error(cstate, "mask length must be <= 32");
+			if (e->masklen == 0) {
+				/*
+				 * X << 32 is not guaranteed by C to be 0;
+				 * it's undefined.
+				 */
+				mask = 0;
+			} else
+				mask = 0xffffffff << (32 - e->masklen);
+			if ((v & ~mask) != 0)
+				bpf_error(cstate, "non-network bits set in network %s",
+				    set_elem_desc(cstate, e));
+		}
+		add_set_val(cstate, vals, nvals, v, mask);
+		return;
+	}
+
+	if (e->masklen != SET_NO_MASKLEN)
+		bpf_error(cstate, "invalid IPv4 address %s",
+		    set_elem_desc(cstate, e));
+	if (q.addr == Q_NET) {
+		v = pcap_nametonetaddr(e->s);
+		if (v == 0)
+			bpf_error(cstate, "unknown network %s",
+			    set_elem_desc(cstate, e));
+		/* Left justify network addr and calculate its network mask */
+		mask = 0xffffffff;
+		while (v && (v & 0xff000000) == 0) {
+			v <<= 8;
+			mask <<= 8;
+		}
+		add_set_val(cstate, vals, nvals, v, mask);
+		return;
+	}
+
+	res0 = pcap_nametoaddrinfo(e->s);
+	if (res0 == NULL)
+		bpf_error(cstate, "unknown host %s",
+		    set_elem_desc(cstate, e));
+	cstate->ai = res0;
+#ifdef INET6
+	memset(&mask128, 0xff, sizeof(mask128));
+#endif
+	for (res = res0; res; res = res->ai_next) {
+		switch (res->ai_family) {
+
+		case AF_INET:
+			if (q.proto == Q_IPV6)
+				continue;
+			sin4 = (struct sockaddr_in *)res->ai_addr;
+			add_set_val(cstate, vals, nvals,
+			    ntohl(sin4->sin_addr.s_addr), 0xffffffff);
+			break;
+
+#ifdef INET6
+		case AF_INET6:
+			if (q.proto == Q_IP || q.proto == Q_ARP ||
+			    q.proto == Q_RARP)
+				continue;
+			sin6 = (struct sockaddr_in6 *)res->ai_addr;
+			tmp = gen_host6(cstate, &sin6->sin6_addr, &mask128,
+			    q.proto, q.dir, q.addr);
+			if (*bp != NULL)
+				gen_or(*bp, tmp);
+			*bp = tmp;
+			break;
+#endif
+		}
+	}
+	cstate->ai = NULL;
+	freeaddrinfo(res0);
+}
+
+/*
+ * Generate code to test whether the field given by "q" is one of the
+ * "nvals" values in "vals", for the protocol "proto"; for ports,
+ * that's the protocol number, or PROTO_UNDEF for TCP, UDP, and SCTP.
+ *
+ * IPv4 addresses and networks, and port numbers, are sorted, and the
+ * field is tested against them with a binary search tree, so that a
+ * set of thousands of addresses compiles in a fraction of a second,
+ * and a packet is tested against a handful of them rather than all of
+ * them.  The protocol tests for the field are generated only once, as
+ * gen_host() and gen_port() are called only once, with gen_mcmp_set()
+ * doing the comparison against the whole set; networks with different
+ * prefix lengths get a tree per prefix length.
+ */
+static struct block *
+gen_set_vals(compiler_state_t *cstate, struct set_val *vals, u_int nvals,
+    struct qual q, int proto)
+{
+	struct set_val *sv, **sorted;
+	bpf_u_int32 *cmp_set;
+	u_int n, i, j;
+	struct block *b, *tmp;
+
+	sorted = (struct set_val **)newchunk(cstate, nvals * sizeof(*sorted));
+	for (sv = vals, i = 0; sv != NULL; sv = sv->next)
+		sorted[i++] = sv;
+	qsort(sorted, nvals, sizeof(*sorted), set_val_compare);
+	cmp_set = (bpf_u_int32 *)newchunk(cstate, nvals * sizeof(*cmp_set));
+
+	b = NULL;
+	for (i = 0; i < nvals; i = j) {
+		n = 0;
+		for (j = i; j < nvals && sorted[j]->mask == sorted[i]->mask;
+		    j++) {
+			if (n == 0 || cmp_set[n - 1] != sorted[j]->v)
+				cmp_set[n++] = sorted[j]->v;
+		}
+		cstate->cmp_set = cmp_set;
+		cstate->cmp_set_len = n;
+		if (q.addr == Q_PORT) {
+			tmp = gen_port(cstate, 0, proto, q.dir);
+			gen_or(gen_port6(cstate, 0, proto, q.dir), tmp);
+		} else
+			tmp = gen_host(cstate, 0, sorted[i]->mask, proto,
+			    q.dir, q.addr);
+		cstate->cmp_set = NULL;
+		if (b != NULL)
+			gen_or(b, tmp);
+		b = tmp;
+		cmp_set += n;
+	}
+	return b;
+}
+
+/*
+ * Index into the lists of ports in gen_set_dir() for a protocol, and
+ * the protocol for an index.
+ */
+#define SET_PORT_PROTOS		4
+static const int set_port_protos[SET_PORT_PROTOS] = {
+	PROTO_UNDEF, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_SCTP
+};
+
+static u_int
+set_port_index(int proto)
+{
+	switch (proto) {
+
+	case IPPROTO_TCP:
+		return (1);
+
+	case IPPROTO_UDP:
+		return (2);
+
+	case IPPROTO_SCTP:
+		return (3);
+
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Generate code to test whether a host, network, or port, in the
+ * direction given by "q", is in the set whose elements are "elems".
+ * A port with a name that's only for one protocol is tested only for
+ * that protocol, as it would be in "port name", so ports are put into
+ * a tree per protocol.
+ */
+static struct block *
+gen_set_dir(compiler_state_t *cstate, struct set_elem *elems, struct qual q)
+{
+	struct set_elem *e;
+	struct set_val *vals, *port_vals[SET_PORT_PROTOS];
+	u_int nvals, port_nvals[SET_PORT_PROTOS], i;
+	int port, real_proto, proto;
+	struct block *b, *tmp;
+
+	vals = NULL;
+	nvals = 0;
+	b = NULL;
+	proto = q.proto;
+	switch (q.addr) {
+
+	case Q_DEFAULT:
+	case Q_HOST:
+	case Q_NET:
+		if (proto == Q_LINK)
+			bpf_error(cstate, "illegal link layer address");
+		if (proto == Q_DECNET)
+			bpf_error(cstate, "DECnet addresses are not supported in sets");
+		for (e = elems; e != NULL; e = e->next)
+			gen_set_hostelem(cstate, e, q, &vals, &nvals, &b);
+		break;
+
+	case Q_PORT:
+		if (proto == Q_UDP)
+			proto = IPPROTO_UDP;
+		else if (proto == Q_TCP)
+			proto = IPPROTO_TCP;
+		else if (proto == Q_SCTP)
+			proto = IPPROTO_SCTP;
+		else if (proto == Q_DEFAULT)
+			proto = PROTO_UNDEF;
+		else
+			bpf_error(cstate, "illegal qualifier of 'port'");
+
+		for (i = 0; i < SET_PORT_PROTOS; i++) {
+			port_vals[i] = NULL;
+			port_nvals[i] = 0;
+		}
+		for (e = elems; e != NULL; e = e->next) {
+			if (e->masklen != SET_NO_MASKLEN)
+				bpf_error(cstate, "Mask syntax for networks only");
+			real_proto = PROTO_UNDEF;
+			if (e->s == NULL) {
+				if (e->v > 65535)
+					bpf_error(cstate, "illegal port number %s",
+					    set_elem_desc(cstate, e));
+				port = (int)e->v;
+			} else {
+				if (pcap_nametoport(e->s, &port, &real_proto) == 0)
+					bpf_error(cstate, "unknown port %s",
+					    set_elem_desc(cstate, e));
+				if (proto != PROTO_UNDEF &&
+				    real_proto != PROTO_UNDEF &&
+				    real_proto != proto)
+					bpf_error(cstate, "port %s is %s",
+					    set_elem_desc(cstate, e),
+					    real_proto == IPPROTO_TCP ? "tcp" :
+					    real_proto == IPPROTO_UDP ? "udp" :
+					    "sctp");
+			}
+			if (proto != PROTO_UNDEF)
+				real_proto = proto;
+			i = set_port_index(real_proto);
+			add_set_val(cstate, &port_vals[i], &port_nvals[i],
+			    (bpf_u_int32)port, 0xffffffff);
+		}
+		for (i = 0; i < SET_PORT_PROTOS; i++) {
+			if (port_nvals[i] == 0)
+				continue;
+			tmp = gen_set_vals(cstate, port_vals[i],
+			    port_nvals[i], q, set_port_protos[i]);
+			if (b != NULL)
+				gen_or(b, tmp);
+			b = tmp;
+		}
+		return b;
+
+	case Q_UNDEF:
+		syntax(cstate);
+		/*NOTREACHED*/
+
+	default:
+		bpf_error(cstate, "sets are supported only for 'host', 'net', and 'port'");
+		/*NOTREACHED*/
+	}
+
+	if (nvals == 0) {
+		/* Only IPv6 addresses */
+		return b;
+	}
+	tmp = gen_set_vals(cstate, vals, nvals, q, proto);
+	if (b != NULL)
+		gen_or(b, tmp);
+	return tmp;
+}
+
+/*
+ * Generate code to test whether a host, network, or port is in the set
+ * built up by gen_set_add() and gen_set_file().  "src and dst" means
+ * that both the source and destination are in the set, not necessarily
+ * as the same element of it.
+ */
+struct block *
+gen_set(compiler_state_t *cstate, struct qual q)
+{
+	struct set_elem *elems;
+	struct block *b0, *b1;
+
+	/*
+	 * Catch errors reported by us and routines below us, and return NULL
+	 * on an error.
+	 */
+	if (setjmp(cstate->top_ctx))
+		return (NULL);
+
+	elems = cstate->set_elems;
+	cstate->set_elems = NULL;
+	if (elems == NULL)
+		bpf_error(cstate, "empty set");
+
+	if (q.dir != Q_AND)
+		return gen_set_dir(cstate, elems, q);
+	q.dir = Q_SRC;
+	b0 = gen_set_dir(cstate, elems, q);
+	q.dir = Q_DST;
+	b1 = gen_set_dir(cstate, elems, q);
+	gen_and(b0, b1);
+	return b1;
+}
+
 struct block *
 gen_ecode(compiler_state_t *cstate, const char *s, struct qual q)
 {
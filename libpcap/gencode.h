@@ -224,9 +224,16 @@ typedef bpf_u_int32 atomset;
 #define ATOMELEM(d, n) (d & ATOMMASK(n))
 
 /*
- * An unbounded set.
+ * A node in a dominator tree.  The parent of a node is its
+ * immediate dominator; the jump pointer points to an ancestor
+ * chosen so that any ancestor can be found in O(log depth) steps.
  */
-typedef bpf_u_int32 *uset;
+struct domnode {
+	u_int id;		/* id of the block or edge */
+	u_int depth;		/* number of ancestors */
+	struct domnode *parent;	/* NULL if not reachable from the root */
+	struct domnode *jump;
+};
 
 /*
  * Total number of atomic entities, including accumulator (A) and index (X).
@@ -242,7 +249,7 @@ typedef bpf_u_int32 *uset;
 struct edge {
 	u_int id;
 	int code;		/* opcode for branch corresponding to this edge */
-	uset edom;
+	struct domnode edom;	/* node in the edge dominator tree */
 	struct block *succ;	/* successor vertex */
 	struct block *pred;	/* predecessor vertex */
 	struct edge *next;	/* link list of incoming edges for a node */
@@ -267,8 +274,7 @@ struct block {
 	struct edge ef;		/* edge corresponding to the jf branch */
 	struct block *head;
 	struct block *link;	/* link field used by optimizer */
-	uset dom;
-	uset closure;
+	struct domnode dom;	/* node in the dominator tree */
 	struct edge *in_edges;	/* first edge in the set (linked list) of edges with this as a successor */
 	atomset def, kill;
 	atomset in_use;
@@ -320,6 +326,13 @@ struct block *gen_mcode6(compiler_state_t *, const char *, const char *,
 #endif
 struct block *gen_ncode(compiler_state_t *, const char *, bpf_u_int32,
     struct qual);
+
+/* Sets of hosts, networks, or ports: "host in { ... }", "net in file ..." */
+#define SET_NO_MASKLEN	0xffffffffU
+int gen_set_add(compiler_state_t *, const char *, bpf_u_int32, bpf_u_int32);
+int gen_set_file(compiler_state_t *, const char *);
+struct block *gen_set(compiler_state_t *, struct qual);
+
 struct block *gen_proto_abbrev(compiler_state_t *, int);
 struct block *gen_relation(compiler_state_t *, int, struct arth *,
     struct arth *, int);
@@ -375,20 +388,35 @@ struct block *gen_p80211_fcdir(compiler_state_t *, bpf_u_int32);
 #define unMarkAll(icp) (icp)->cur_mark += 1
 #define Mark(icp, p) ((p)->mark = (icp)->cur_mark)
 
+/*
+ * An arena from which all the memory for compiling a filter is
+ * allocated; it's all freed at once when the compile is over.
+ */
+struct compile_arena;
+
+void *arena_calloc(struct compile_arena *, size_t, size_t);
+size_t arena_in_use(struct compile_arena *);
+
 struct icode {
 	struct block *root;
 	int cur_mark;
+	struct compile_arena *arena;
 };
 
-int bpf_optimize(struct icode *, char *);
+int bpf_optimize(struct icode *, const struct pcap_compile_opts *,
+    struct pcap_compile_stat *, char *);
+int bpf_reorder_by_profile(struct icode *, const struct pcap_filter_profile *,
+    char *);
 void bpf_set_error(compiler_state_t *, const char *, ...)
     PCAP_PRINTFLIKE(2, 3);
 
 int finish_parse(compiler_state_t *, struct block *);
 char *sdup(compiler_state_t *, const char *);
+void *compile_alloc(compiler_state_t *, size_t);
 
 struct bpf_insn *icode_to_fcode(struct icode *, struct block *, u_int *,
     char *);
+uint64_t bpf_compile_usecs(void);
 void sappend(struct slist *, struct slist *);
 
 /*
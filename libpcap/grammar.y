@@ -130,6 +130,14 @@ extern int yydebug;
 extern int yynerrs;
 #endif
 
+/*
+ * If Bison has to grow its stacks, have it allocate them from the
+ * compiler's arena; they're freed with everything else in it when
+ * the compile is over, so they mustn't be freed before that.
+ */
+#define YYMALLOC(n)	compile_alloc(cstate, (n))
+#define YYFREE(p)	((void)(p))
+
 #define QSET(q, p, d, a) (q).proto = (unsigned char)(p),\
 			 (q).dir = (unsigned char)(d),\
 			 (q).addr = (unsigned char)(a)
@@ -376,9 +384,10 @@ DIAG_OFF_BISON_BYACC
 %token	RADIO
 %token	FISU LSSU MSU HFISU HLSSU HMSU
 %token	SIO OPC DPC SLS HSIO HOPC HDPC HSLS
+%token	TK_IN TK_FILE QSTRING
 %token	LEX_ERROR
 
-%type	<s> ID EID AID
+%type	<s> ID EID AID QSTRING
 %type	<s> HID HID6
 %type	<h> NUM
 %type	<i> action reason type subtype type_subtype dir
@@ -463,8 +472,24 @@ nid:	  ID			{ CHECK_PTR_VAL($1); CHECK_PTR_VAL(($$.b = gen_scode(cstate, $1, $$.
 				}
 	| EID			{ CHECK_PTR_VAL($1); CHECK_PTR_VAL(($$.b = gen_ecode(cstate, $1, $$.q = $<blk>0.q))); }
 	| AID			{ CHECK_PTR_VAL($1); CHECK_PTR_VAL(($$.b = gen_acode(cstate, $1, $$.q = $<blk>0.q))); }
+	| TK_IN '{' setlist '}'	{ CHECK_PTR_VAL(($$.b = gen_set(cstate, $$.q = $<blk>0.q))); }
+	| TK_IN TK_FILE QSTRING	{
+				  CHECK_PTR_VAL($3);
+				  CHECK_INT_VAL(gen_set_file(cstate, $3));
+				  CHECK_PTR_VAL(($$.b = gen_set(cstate, $$.q = $<blk>0.q)));
+				}
 	| not id		{ gen_not($2.b); $$ = $2; }
 	;
+setlist:  setelem
+	| setlist ',' setelem
+	;
+setelem:  ID			{ CHECK_PTR_VAL($1); CHECK_INT_VAL(gen_set_add(cstate, $1, 0, SET_NO_MASKLEN)); }
+	| NUM			{ CHECK_INT_VAL(gen_set_add(cstate, NULL, $1, SET_NO_MASKLEN)); }
+	| HID			{ CHECK_PTR_VAL($1); CHECK_INT_VAL(gen_set_add(cstate, $1, 0, SET_NO_MASKLEN)); }
+	| HID '/' NUM		{ CHECK_PTR_VAL($1); CHECK_INT_VAL(gen_set_add(cstate, $1, 0, $3)); }
+	| HID6			{ CHECK_PTR_VAL($1); CHECK_INT_VAL(gen_set_add(cstate, $1, 0, SET_NO_MASKLEN)); }
+	| HID6 '/' NUM		{ CHECK_PTR_VAL($1); CHECK_INT_VAL(gen_set_add(cstate, $1, 0, $3)); }
+	;
 not:	  '!'			{ $$ = $<blk>0; }
 	;
 paren:	  '('			{ $$ = $<blk>0; }
@@ -32,6 +32,11 @@
 #include <memory.h>
 #include <setjmp.h>
 #include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <time.h>
+#include <sys/time.h>
+#endif
 
 #include <errno.h>
 
@@ -97,93 +102,6 @@ pcap_set_print_dot_graph(int value)
 
 #endif
 
-/*
- * lowest_set_bit().
- *
- * Takes a 32-bit integer as an argument.
- *
- * If handed a non-zero value, returns the index of the lowest set bit,
- * counting upwards from zero.
- *
- * If handed zero, the results are platform- and compiler-dependent.
- * Keep it out of the light, don't give it any water, don't feed it
- * after midnight, and don't pass zero to it.
- *
- * This is the same as the count of trailing zeroes in the word.
- */
-#if PCAP_IS_AT_LEAST_GNUC_VERSION(3,4)
-  /*
-   * GCC 3.4 and later; we have __builtin_ctz().
-   */
-  #define lowest_set_bit(mask) ((u_int)__builtin_ctz(mask))
-#elif defined(_MSC_VER)
-  /*
-   * Visual Studio; we support only 2005 and later, so use
-   * _BitScanForward().
-   */
-#include <intrin.h>
-
-#ifndef __clang__
-#pragma intrinsic(_BitScanForward)
-#endif
-
-static __forceinline u_int
-lowest_set_bit(int mask)
-{
-	unsigned long bit;
-
-	/*
-	 * Don't sign-extend mask if long is longer than int.
-	 * (It's currently not, in MSVC, even on 64-bit platforms, but....)
-	 */
-	if (_BitScanForward(&bit, (unsigned int)mask) == 0)
-		abort();	/* mask is zero */
-	return (u_int)bit;
-}
-#elif defined(MSDOS) && defined(__DJGPP__)
-  /*
-   * MS-DOS with DJGPP, which declares ffs() in <string.h>, which
-   * we've already included.
-   */
-  #define lowest_set_bit(mask)	((u_int)(ffs((mask)) - 1))
-#elif (defined(MSDOS) && defined(__WATCOMC__)) || defined(STRINGS_H_DECLARES_FFS)
-  /*
-   * MS-DOS with Watcom C, which has <strings.h> and declares ffs() there,
-   * or some other platform (UN*X conforming to a sufficient recent version
-   * of the Single UNIX Specification).
-   */
-  #include <strings.h>
-  #define lowest_set_bit(mask)	(u_int)((ffs((mask)) - 1))
-#else
-/*
- * None of the above.
- * Use a perfect-hash-function-based function.
- */
-static u_int
-lowest_set_bit(int mask)
-{
-	unsigned int v = (unsigned int)mask;
-
-	static const u_int MultiplyDeBruijnBitPosition[32] = {
-		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
-		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
-	};
-
-	/*
-	 * We strip off all but the lowermost set bit (v & ~v),
-	 * and perform a minimal perfect hash on it to look up the
-	 * number of low-order zero bits in a table.
-	 *
-	 * See:
-	 *
-	 *	http://7ooo.mooo.com/text/ComputingTrailingZerosHOWTO.pdf
-	 *
-	 *	http://supertech.csail.mit.edu/papers/debruijn.pdf
-	 */
-	return (MultiplyDeBruijnBitPosition[((v & -v) * 0x077CB531U) >> 27]);
-}
-#endif
-
 /*
  * Represents a deleted instruction.
  */
@@ -257,75 +175,44 @@ typedef struct {
 	 */
 	int non_branch_movement_performed;
 
+	/*
+	 * How many passes opt_loop() may run and until when, with 0
+	 * meaning no limit, how many it has run, and whether it had
+	 * to stop before it was done.
+	 */
+	u_int max_passes;
+	uint64_t deadline;
+	u_int passes;
+	int cut_short;
+
 	u_int n_blocks;		/* number of blocks in the CFG; guaranteed to be > 0, as it's a RET instruction at a minimum */
 	struct block **blocks;
 	u_int n_edges;		/* twice n_blocks, so guaranteed to be > 0 */
 	struct edge **edges;
 
-	/*
-	 * A bit vector set representation of the dominators.
-	 * We round up the set size to the next power of two.
-	 */
-	u_int nodewords;	/* number of 32-bit words for a bit vector of "number of nodes" bits; guaranteed to be > 0 */
-	u_int edgewords;	/* number of 32-bit words for a bit vector of "number of edges" bits; guaranteed to be > 0 */
 	struct block **levels;
-	bpf_u_int32 *space;
-
-#define BITS_PER_WORD (8*sizeof(bpf_u_int32))
-/*
- * True if a is in uset {p}
- */
-#define SET_MEMBER(p, a) \
-((p)[(unsigned)(a) / BITS_PER_WORD] & ((bpf_u_int32)1 << ((unsigned)(a) % BITS_PER_WORD)))
 
-/*
- * Add 'a' to uset p.
- */
-#define SET_INSERT(p, a) \
-(p)[(unsigned)(a) / BITS_PER_WORD] |= ((bpf_u_int32)1 << ((unsigned)(a) % BITS_PER_WORD))
-
-/*
- * Delete 'a' from uset p.
- */
-#define SET_DELETE(p, a) \
-(p)[(unsigned)(a) / BITS_PER_WORD] &= ~((bpf_u_int32)1 << ((unsigned)(a) % BITS_PER_WORD))
-
-/*
- * a := a intersect b
- * n must be guaranteed to be > 0
- */
-#define SET_INTERSECT(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register u_int _n = n;\
-	do *_x++ &= *_y++; while (--_n != 0);\
-}
-
-/*
- * a := a - b
- * n must be guaranteed to be > 0
- */
-#define SET_SUBTRACT(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register u_int _n = n;\
-	do *_x++ &=~ *_y++; while (--_n != 0);\
-}
+	/*
+	 * Roots of the dominator trees.  The root block of the CFG is
+	 * the only child of dom_root, and the two edges out of it are
+	 * the only children of edom_root; having a common root means
+	 * that any two nodes in a tree have a nearest common ancestor.
+	 */
+	struct domnode dom_root;
+	struct domnode edom_root;
 
-/*
- * a := a union b
- * n must be guaranteed to be > 0
- */
-#define SET_UNION(a, b, n)\
-{\
-	register bpf_u_int32 *_x = a, *_y = b;\
-	register u_int _n = n;\
-	do *_x++ |= *_y++; while (--_n != 0);\
-}
+	/*
+	 * Scratch space used by opt_j() for the dominators of an edge.
+	 */
+	struct edge **edom_list;
 
-	uset all_dom_sets;
-	uset all_closure_sets;
-	uset all_edge_sets;
+	/*
+	 * Hash table used by intern_blocks() to find identical blocks;
+	 * it has n_blocks buckets, and blk_hashnext, indexed by block
+	 * id, links the blocks in a bucket.
+	 */
+	struct block **blk_hashtbl;
+	struct block **blk_hashnext;
 
 #define MODULUS 213
 	struct valnode *hashtbl[MODULUS];
@@ -359,11 +246,12 @@ typedef struct {
 } conv_state_t;
 
 static void opt_init(opt_state_t *, struct icode *);
-static void opt_cleanup(opt_state_t *);
+static u_int slength(struct slist *);
 static void PCAP_NORETURN opt_error(opt_state_t *, const char *, ...)
     PCAP_PRINTFLIKE(2, 3);
 
 static void intern_blocks(opt_state_t *, struct icode *);
+static int count_blocks(struct icode *, struct block *);
 
 static void find_inedges(opt_state_t *, struct block *);
 #ifdef BDEBUG
@@ -410,6 +298,112 @@ find_levels(opt_state_t *opt_state, struct icode *ic)
 	find_levels_r(opt_state, ic, ic->root);
 }
 
+/*
+ * Dominators.
+ *
+ * Rather than keeping, for each block and edge, a bit vector of the
+ * blocks or edges that dominate it, which takes time and space
+ * quadratic in the size of the CFG, we build the dominator trees, in
+ * which the parent of a node is its immediate dominator.  The CFG is
+ * acyclic, so, if the nodes are visited in level order, all the
+ * predecessors of a node have been placed in the tree before the node
+ * is, and its immediate dominator is the nearest common ancestor of
+ * its predecessors.
+ *
+ * To make finding ancestors cheap, each node also has a pointer to
+ * an ancestor further up the tree, chosen as in the skew-binary
+ * random-access lists described in Eugene W. Myers, "An Applicative
+ * Random-Access Stack", so that the ancestor of a node at any depth
+ * can be found in O(log depth) steps.
+ */
+
+/*
+ * Put a node whose parent has been found into the tree.
+ */
+static void
+dom_insert(struct domnode *n)
+{
+	struct domnode *p = n->parent;
+
+	n->depth = p->depth + 1;
+	if (p->depth - p->jump->depth == p->jump->depth - p->jump->jump->depth)
+		n->jump = p->jump->jump;
+	else
+		n->jump = p;
+}
+
+/*
+ * Return the ancestor of n at the given depth, which must be no
+ * greater than the depth of n.
+ */
+static struct domnode *
+dom_ancestor(struct domnode *n, u_int depth)
+{
+	while (n->depth > depth) {
+		if (n->jump->depth >= depth)
+			n = n->jump;
+		else
+			n = n->parent;
+	}
+	return n;
+}
+
+/*
+ * Return the nearest common ancestor of a and b.
+ */
+static struct domnode *
+dom_nca(struct domnode *a, struct domnode *b)
+{
+	if (a->depth > b->depth)
+		a = dom_ancestor(a, b->depth);
+	else
+		b = dom_ancestor(b, a->depth);
+	while (a != b) {
+		/*
+		 * Nodes at the same depth have jump pointers to
+		 * nodes at the same depth.
+		 */
+		if (a->jump != b->jump) {
+			a = a->jump;
+			b = b->jump;
+		} else {
+			a = a->parent;
+			b = b->parent;
+		}
+	}
+	return a;
+}
+
+/*
+ * Note that p is a predecessor of n.
+ */
+static void
+dom_add_pred(struct domnode *n, struct domnode *p)
+{
+	if (n->parent == NULL)
+		n->parent = p;
+	else
+		n->parent = dom_nca(n->parent, p);
+}
+
+/*
+ * Return true if a dominates n.
+ *
+ * Nothing dominates a node that's unreachable from the root (and so
+ * isn't in the tree), and we treat it as if everything did; this can
+ * happen only if a block has been made unreachable since the tree was
+ * built.
+ */
+static int
+dominates(struct domnode *a, struct domnode *n)
+{
+	if (n->parent == NULL)
+		return 1;
+	if (a->parent == NULL || a->depth > n->depth)
+		return 0;
+	return dom_ancestor(n, a->depth) == a;
+}
+
 /*
  * Find dominator relationships.
  * Assumes graph has been leveled.
@@ -420,45 +414,30 @@ find_dom(opt_state_t *opt_state, struct block *root)
 	u_int i;
 	int level;
 	struct block *b;
-	bpf_u_int32 *x;
 
-	/*
-	 * Initialize sets to contain all nodes.
-	 */
-	x = opt_state->all_dom_sets;
-	/*
-	 * In opt_init(), we've made sure the product doesn't overflow.
-	 */
-	i = opt_state->n_blocks * opt_state->nodewords;
-	while (i != 0) {
-		--i;
-		*x++ = 0xFFFFFFFFU;
-	}
-	/* Root starts off empty. */
-	for (i = opt_state->nodewords; i != 0;) {
-		--i;
-		root->dom[i] = 0;
-	}
+	for (i = 0; i < opt_state->n_blocks; ++i)
+		opt_state->blocks[i]->dom.parent = NULL;
+	root->dom.parent = &opt_state->dom_root;
 
 	/* root->level is the highest level no found. */
 	for (level = root->level; level >= 0; --level) {
 		for (b = opt_state->levels[level]; b; b = b->link) {
-			SET_INSERT(b->dom, b->id);
+			dom_insert(&b->dom);
 			if (JT(b) == 0)
 				continue;
-			SET_INTERSECT(JT(b)->dom, b->dom, opt_state->nodewords);
-			SET_INTERSECT(JF(b)->dom, b->dom, opt_state->nodewords);
+			dom_add_pred(&JT(b)->dom, &b->dom);
+			dom_add_pred(&JF(b)->dom, &b->dom);
 		}
 	}
 }
 
 static void
-propedom(opt_state_t *opt_state, struct edge *ep)
+propedom(struct edge *ep)
 {
-	SET_INSERT(ep->edom, ep->id);
+	dom_insert(&ep->edom);
 	if (ep->succ) {
-		SET_INTERSECT(ep->succ->et.edom, ep->edom, opt_state->edgewords);
-		SET_INTERSECT(ep->succ->ef.edom, ep->edom, opt_state->edgewords);
+		dom_add_pred(&ep->succ->et.edom, &ep->edom);
+		dom_add_pred(&ep->succ->ef.edom, &ep->edom);
 	}
 }
 
@@ -470,59 +449,75 @@ static void
 find_edom(opt_state_t *opt_state, struct block *root)
 {
 	u_int i;
-	uset x;
 	int level;
 	struct block *b;
 
-	x = opt_state->all_edge_sets;
-	/*
-	 * In opt_init(), we've made sure the product doesn't overflow.
-	 */
-	for (i = opt_state->n_edges * opt_state->edgewords; i != 0; ) {
-		--i;
-		x[i] = 0xFFFFFFFFU;
+	for (i = 0; i < opt_state->n_blocks; ++i) {
+		b = opt_state->blocks[i];
+		b->et.edom.parent = NULL;
+		b->ef.edom.parent = NULL;
 	}
+	root->et.edom.parent = &opt_state->edom_root;
+	root->ef.edom.parent = &opt_state->edom_root;
 
 	/* root->level is the highest level no found. */
-	memset(root->et.edom, 0, opt_state->edgewords * sizeof(*(uset)0));
-	memset(root->ef.edom, 0, opt_state->edgewords * sizeof(*(uset)0));
 	for (level = root->level; level >= 0; --level) {
 		for (b = opt_state->levels[level]; b != 0; b = b->link) {
-			propedom(opt_state, &b->et);
-			propedom(opt_state, &b->ef);
+			propedom(&b->et);
+			propedom(&b->ef);
 		}
 	}
 }
 
+static int
+edge_id_cmp(const void *a, const void *b)
+{
+	u_int ida = (*(struct edge * const *)a)->id;
+	u_int idb = (*(struct edge * const *)b)->id;
+
+	return ida < idb ? -1 : ida > idb;
+}
+
 /*
- * Find the backwards transitive closure of the flow graph.  These sets
- * are backwards in the sense that we find the set of nodes that reach
- * a given node, not the set of nodes that can be reached by a node.
+ * Put the edges that dominate ep, including ep itself, into
+ * opt_state->edom_list, in order of edge id, and return the number
+ * of them.
  *
- * Assumes graph has been leveled.
+ * The ids of the true edges are the ids of the blocks they come
+ * from, and the ids of the false edges are those plus n_blocks;
+ * block ids are assigned in depth-first order, so, unless the CFG
+ * has changed a lot since then, walking up the tree visits each
+ * kind of edge in decreasing order of id, and filling in the list
+ * from the end puts it in order without sorting it.
  */
-static void
-find_closure(opt_state_t *opt_state, struct block *root)
+static u_int
+find_edge_doms(opt_state_t *opt_state, struct edge *ep)
 {
-	int level;
-	struct block *b;
-
-	/*
-	 * Initialize sets to contain no nodes.
-	 */
-	memset((char *)opt_state->all_closure_sets, 0,
-	      opt_state->n_blocks * opt_state->nodewords * sizeof(*opt_state->all_closure_sets));
-
-	/* root->level is the highest level no found. */
-	for (level = root->level; level >= 0; --level) {
-		for (b = opt_state->levels[level]; b; b = b->link) {
-			SET_INSERT(b->closure, b->id);
-			if (JT(b) == 0)
-				continue;
-			SET_UNION(JT(b)->closure, b->closure, opt_state->nodewords);
-			SET_UNION(JF(b)->closure, b->closure, opt_state->nodewords);
+	struct edge **list = opt_state->edom_list;
+	struct domnode *n;
+	u_int count, ntrue, i, j;
+
+	count = ntrue = 0;
+	for (n = &ep->edom; n != &opt_state->edom_root; n = n->parent) {
+		++count;
+		if (n->id < opt_state->n_blocks)
+			++ntrue;
+	}
+	i = ntrue;
+	j = count;
+	for (n = &ep->edom; n != &opt_state->edom_root; n = n->parent) {
+		if (n->id < opt_state->n_blocks)
+			list[--i] = opt_state->edges[n->id];
+		else
+			list[--j] = opt_state->edges[n->id];
+	}
+	for (i = 1; i < count; ++i) {
+		if (list[i - 1]->id > list[i]->id) {
+			qsort(list, count, sizeof(*list), edge_id_cmp);
+			break;
 		}
 	}
+	return count;
 }
 
 /*
@@ -1691,7 +1686,7 @@ fold_edge(struct block *child, struct edge *ep)
 static void
 opt_j(opt_state_t *opt_state, struct edge *ep)
 {
-	register u_int i, k;
+	register u_int i, n;
 	register struct block *target;
 
 	/*
@@ -1743,53 +1738,41 @@ opt_j(opt_state_t *opt_state, struct edge *ep)
 	/*
 	 * For each edge dominator that matches the successor of this
 	 * edge, promote the edge successor to the its grandchild.
-	 *
-	 * XXX We violate the set abstraction here in favor a reasonably
-	 * efficient loop.
 	 */
+	n = find_edge_doms(opt_state, ep);
  top:
-	for (i = 0; i < opt_state->edgewords; ++i) {
-		/* i'th word in the bitset of dominators */
-		register bpf_u_int32 x = ep->edom[i];
-
-		while (x != 0) {
-			/* Find the next dominator in that word and mark it as found */
-			k = lowest_set_bit(x);
-			x &=~ ((bpf_u_int32)1 << k);
-			k += i * BITS_PER_WORD;
-
-			target = fold_edge(ep->succ, opt_state->edges[k]);
+	for (i = 0; i < n; ++i) {
+		target = fold_edge(ep->succ, opt_state->edom_list[i]);
+		/*
+		 * We have a candidate to replace the successor
+		 * of ep.
+		 *
+		 * Check that there is no data dependency between
+		 * nodes that will be violated if we move the edge;
+		 * i.e., if any register used on exit from the
+		 * candidate has a value at that point different
+		 * from the value it has when we exit the
+		 * predecessor of that edge, there's a data
+		 * dependency that will be violated.
+		 */
+		if (target != 0 && !use_conflict(ep->pred, target)) {
 			/*
-			 * We have a candidate to replace the successor
-			 * of ep.
+			 * It's safe to replace the successor of
+			 * ep; do so, and note that we've made
+			 * at least one change.
 			 *
-			 * Check that there is no data dependency between
-			 * nodes that will be violated if we move the edge;
-			 * i.e., if any register used on exit from the
-			 * candidate has a value at that point different
-			 * from the value it has when we exit the
-			 * predecessor of that edge, there's a data
-			 * dependency that will be violated.
+			 * XXX - this is one of the operations that
+			 * happens when the optimizer gets into
+			 * one of those infinite loops.
 			 */
-			if (target != 0 && !use_conflict(ep->pred, target)) {
+			opt_state->done = 0;
+			ep->succ = target;
+			if (JT(target) != 0)
 				/*
-				 * It's safe to replace the successor of
-				 * ep; do so, and note that we've made
-				 * at least one change.
-				 *
-				 * XXX - this is one of the operations that
-				 * happens when the optimizer gets into
-				 * one of those infinite loops.
+				 * Start over unless we hit a leaf.
 				 */
-				opt_state->done = 0;
-				ep->succ = target;
-				if (JT(target) != 0)
-					/*
-					 * Start over unless we hit a leaf.
-					 */
-					goto top;
-				return;
-			}
+				goto top;
+			return;
 		}
 	}
 }
@@ -1882,7 +1865,7 @@ or_pullup(opt_state_t *opt_state, struct block *b)
 		 *
 		 * Does b dominate diffp?
 		 */
-		if (!SET_MEMBER((*diffp)->dom, b->id))
+		if (!dominates(&b->dom, &(*diffp)->dom))
 			return;
 
 		/*
@@ -1928,7 +1911,7 @@ or_pullup(opt_state_t *opt_state, struct block *b)
 		 *
 		 * Does b dominate samep?
 		 */
-		if (!SET_MEMBER((*samep)->dom, b->id))
+		if (!dominates(&b->dom, &(*samep)->dom))
 			return;
 
 		/*
@@ -2011,7 +1994,7 @@ and_pullup(opt_state_t *opt_state, struct block *b)
 		if (JF(*diffp) != JF(b))
 			return;
 
-		if (!SET_MEMBER((*diffp)->dom, b->id))
+		if (!dominates(&b->dom, &(*diffp)->dom))
 			return;
 
 		if ((*diffp)->val[A_ATOM] != val)
@@ -2028,7 +2011,7 @@ and_pullup(opt_state_t *opt_state, struct block *b)
 		if (JF(*samep) != JF(b))
 			return;
 
-		if (!SET_MEMBER((*samep)->dom, b->id))
+		if (!dominates(&b->dom, &(*samep)->dom))
 			return;
 
 		if ((*samep)->val[A_ATOM] == val)
@@ -2176,6 +2159,53 @@ opt_root(struct block **b)
 		(*b)->stmts = 0;
 }
 
+/*
+ * Return a time in microseconds, for measuring how long compiling
+ * takes.
+ */
+uint64_t
+bpf_compile_usecs(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return ((uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+	    (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#else
+	struct timeval tv;
+
+	(void)gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+#endif
+}
+
+/*
+ * Return true if opt_loop() has run as many passes as it may, or for
+ * as long as it may, and so should stop with the program it has;
+ * every pass leaves a correct program behind.
+ */
+static int
+opt_over_budget(opt_state_t *opt_state)
+{
+	if (opt_state->cut_short)
+		return 1;
+	if ((opt_state->max_passes != 0 &&
+	     opt_state->passes >= opt_state->max_passes) ||
+	    (opt_state->deadline != 0 &&
+	     bpf_compile_usecs() >= opt_state->deadline)) {
+		opt_state->cut_short = 1;
+		return 1;
+	}
+	return 0;
+}
+
 static void
 opt_loop(opt_state_t *opt_state, struct icode *ic, int do_stmts)
 {
@@ -2192,16 +2222,23 @@ opt_loop(opt_state_t *opt_state, struct icode *ic, int do_stmts)
 	 */
 	int loop_count = 0;
 	for (;;) {
+		if (opt_over_budget(opt_state))
+			break;
+		opt_state->passes++;
 		opt_state->done = 1;
 		/*
 		 * XXX - optimizer loop detection.
 		 */
 		opt_state->non_branch_movement_performed = 0;
 		find_levels(opt_state, ic);
-		find_dom(opt_state, ic->root);
-		find_closure(opt_state, ic->root);
 		find_ud(opt_state, ic->root);
-		find_edom(opt_state, ic->root);
+		if (!do_stmts) {
+			/*
+			 * Only the branch optimizations use dominators.
+			 */
+			find_dom(opt_state, ic->root);
+			find_edom(opt_state, ic->root);
+		}
 		opt_blks(opt_state, ic, do_stmts);
 #ifdef BDEBUG
 		if (pcap_optimizer_debug > 1 || pcap_print_dot_graph) {
@@ -2257,24 +2294,72 @@ opt_loop(opt_state_t *opt_state, struct icode *ic, int do_stmts)
 }
 
 /*
- * Optimize the filter code in its dag representation.
+ * Run the peephole optimizations, and only those, over each block until
+ * they find nothing more to do, for PCAP_OPTIMIZE_BASIC.  They need to
+ * know only which registers are used on exit from a block, not what
+ * values are in them, so no values are numbered; with every value in
+ * every block unknown, the rewrites in opt_peep() that depend on a
+ * register holding a known constant are never done.
+ */
+static void
+opt_peep_loop(opt_state_t *opt_state, struct icode *ic)
+{
+	int i, maxlevel;
+	struct block *p;
+
+	for (;;) {
+		if (opt_over_budget(opt_state))
+			break;
+		opt_state->passes++;
+		opt_state->done = 1;
+		find_levels(opt_state, ic);
+		find_ud(opt_state, ic->root);
+		maxlevel = ic->root->level;
+		for (i = maxlevel; i >= 0; --i) {
+			for (p = opt_state->levels[i]; p; p = p->link) {
+				memset((char *)p->val, 0, sizeof(p->val));
+				opt_peep(opt_state, p);
+			}
+		}
+#ifdef BDEBUG
+		if (pcap_optimizer_debug > 1 || pcap_print_dot_graph) {
+			printf("opt_peep_loop(root) bottom, done=%d\n", opt_state->done);
+			opt_dump(opt_state, ic);
+		}
+#endif
+		if (opt_state->done)
+			break;
+	}
+}
+
+/*
+ * Optimize the filter code in its dag representation, at the level
+ * and within the budget in opts, and fill in the optimizer statistics
+ * in stats.
  * Return 0 on success, -1 on error.
  */
 int
-bpf_optimize(struct icode *ic, char *errbuf)
+bpf_optimize(struct icode *ic, const struct pcap_compile_opts *opts,
+    struct pcap_compile_stat *stats, char *errbuf)
 {
 	opt_state_t opt_state;
 
 	memset(&opt_state, 0, sizeof(opt_state));
 	opt_state.errbuf = errbuf;
 	opt_state.non_branch_movement_performed = 0;
+	opt_state.max_passes = opts->co_max_passes;
+	if (opts->co_max_usecs != 0)
+		opt_state.deadline = bpf_compile_usecs() + opts->co_max_usecs;
 	if (setjmp(opt_state.top_ctx)) {
-		opt_cleanup(&opt_state);
 		return -1;
 	}
 	opt_init(&opt_state, ic);
-	opt_loop(&opt_state, ic, 0);
-	opt_loop(&opt_state, ic, 1);
+	stats->cs_blocks_before = opt_state.n_blocks;
+	if (opts->co_level >= PCAP_OPTIMIZE_DEFAULT) {
+		opt_loop(&opt_state, ic, 0);
+		opt_loop(&opt_state, ic, 1);
+	} else
+		opt_peep_loop(&opt_state, ic);
 	intern_blocks(&opt_state, ic);
 #ifdef BDEBUG
 	if (pcap_optimizer_debug > 1 || pcap_print_dot_graph) {
@@ -2289,92 +2374,398 @@ bpf_optimize(struct icode *ic, char *errbuf)
 		opt_dump(&opt_state, ic);
 	}
 #endif
-	opt_cleanup(&opt_state);
+	stats->cs_passes = opt_state.passes;
+	stats->cs_cut_short = opt_state.cut_short;
+	unMarkAll(ic);
+	stats->cs_blocks_after = count_blocks(ic, ic->root);
 	return 0;
 }
 
-static void
-make_marks(struct icode *ic, struct block *p)
-{
-	if (!isMarked(ic, p)) {
-		Mark(ic, p);
-		if (BPF_CLASS(p->s.code) != BPF_RET) {
-			make_marks(ic, JT(p));
-			make_marks(ic, JF(p));
-		}
-	}
-}
-
 /*
- * Mark code array such that isMarked(ic->cur_mark, i) is true
- * only for nodes that are alive.
+ * Profile-guided reordering of tests.
+ *
+ * A test block X, one of whose successors is a block Y reached only
+ * from X, where X and Y have a common successor Z, is an AND or OR of
+ * the two tests: the program goes to Z if either test says so, and on
+ * to Y's other successor W otherwise.  The two tests can be run in
+ * either order, provided that neither reads what the other defines,
+ * that Z reads nothing either of them defines, that W reads nothing
+ * they both define, and, as a test that loads past the end of the
+ * packet rejects it, that either Z rejects the packet or neither
+ * test loads packet data or divides by X.
+ *
+ * Given, for each test, its cost in instructions c and the fraction
+ * p of the packets that reach it that it sends to Z, running Y first
+ * is cheaper if c(Y) / p(Y) < c(X) / p(X); the fractions come from a
+ * profile of the program gathered on sample traffic, and, as in the
+ * profile the packets that reach Y are only those that got past X,
+ * we assume that the tests are independent.
  */
-static void
-mark_code(struct icode *ic)
-{
-	ic->cur_mark += 1;
-	make_marks(ic, ic->root);
-}
+typedef struct {
+	opt_state_t *opt_state;
+	double *ptrue;		/* fraction of runs a test's jump was taken */
+	u_char *known;		/* the test was run at least once */
+	u_int *npreds;		/* number of predecessors */
+	u_char *moved;		/* swapped in this pass */
+} reorder_state_t;
 
 /*
- * True iff the two stmt lists load the same value from the packet into
- * the accumulator.
+ * True if a block's statements can reject the packet: loads of
+ * packet data, which fail if the packet is too short, and divisions
+ * by X, which fail if X is 0.
  */
 static int
-eq_slist(struct slist *x, struct slist *y)
+may_fault(struct block *b)
 {
-	for (;;) {
-		while (x && x->s.code == NOP)
-			x = x->next;
-		while (y && y->s.code == NOP)
-			y = y->next;
-		if (x == 0)
-			return y == 0;
-		if (y == 0)
-			return x == 0;
-		if (x->s.code != y->s.code || x->s.k != y->s.k)
-			return 0;
-		x = x->next;
-		y = y->next;
+	struct slist *s;
+	int c;
+
+	for (s = b->stmts; s; s = s->next) {
+		c = s->s.code;
+		if (c == NOP)
+			continue;
+		switch (BPF_CLASS(c)) {
+
+		case BPF_LD:
+			if (BPF_MODE(c) == BPF_ABS || BPF_MODE(c) == BPF_IND)
+				return 1;
+			break;
+
+		case BPF_LDX:
+			if (BPF_MODE(c) == BPF_MSH)
+				return 1;
+			break;
+
+		case BPF_ALU:
+			if ((BPF_OP(c) == BPF_DIV || BPF_OP(c) == BPF_MOD) &&
+			    BPF_SRC(c) == BPF_X)
+				return 1;
+			break;
+		}
 	}
+	return 0;
 }
 
-static inline int
-eq_blk(struct block *b0, struct block *b1)
+/*
+ * Try to swap the tests in x and the successor of x on its true
+ * branch, if y_on_true is set, or its false branch, if it isn't.
+ * Return 1 if they were swapped.
+ */
+static int
+reorder_pair(reorder_state_t *rs, struct block *x, int y_on_true)
 {
-	if (b0->s.code == b1->s.code &&
-	    b0->s.k == b1->s.k &&
+	struct block *y, *z, *w;
+	struct slist *stmts;
+	struct stmt s;
+	int z_on_true_in_y;
+	double px, py, cx, cy, t;
+	u_char k;
+
+	y = y_on_true ? JT(x) : JF(x);
+	z = y_on_true ? JF(x) : JT(x);
+	if (BPF_CLASS(y->s.code) != BPF_JMP || y == z ||
+	    rs->npreds[y->id] != 1)
+		return 0;
+	if (JT(y) == z) {
+		z_on_true_in_y = 1;
+		w = JF(y);
+	} else if (JF(y) == z) {
+		z_on_true_in_y = 0;
+		w = JT(y);
+	} else
+		return 0;
+	if (w == z || rs->moved[x->id] || rs->moved[y->id] ||
+	    !rs->known[x->id] || !rs->known[y->id])
+		return 0;
+
+	/*
+	 * Check that running them in the other order leaves every
+	 * block reading the same values.
+	 */
+	if ((x->def & y->in_use) || (y->def & x->in_use) ||
+	    ((x->def | y->def) & z->in_use) ||
+	    (x->def & y->def & w->in_use))
+		return 0;
+	if (!(BPF_CLASS(z->s.code) == BPF_RET &&
+	    BPF_RVAL(z->s.code) == BPF_K && z->s.k == 0) &&
+	    (may_fault(x) || may_fault(y)))
+		return 0;
+
+	/*
+	 * Is it cheaper to run y first?
+	 */
+	px = y_on_true ? 1 - rs->ptrue[x->id] : rs->ptrue[x->id];
+	py = z_on_true_in_y ? rs->ptrue[y->id] : 1 - rs->ptrue[y->id];
+	cx = slength(x->stmts) + 1;
+	cy = slength(y->stmts) + 1;
+	if (!(cy * px < cx * py))
+		return 0;
+
+	/*
+	 * Swap the tests, keeping each one's branch sense, so that x
+	 * runs y's test, going on to y, which runs x's test.
+	 */
+	stmts = x->stmts;
+	x->stmts = y->stmts;
+	y->stmts = stmts;
+	s = x->s;
+	x->s = y->s;
+	y->s = s;
+	if (z_on_true_in_y) {
+		JT(x) = z;
+		JF(x) = y;
+	} else {
+		JT(x) = y;
+		JF(x) = z;
+	}
+	if (y_on_true) {
+		JT(y) = w;
+		JF(y) = z;
+	} else {
+		JT(y) = z;
+		JF(y) = w;
+	}
+	t = rs->ptrue[x->id];
+	rs->ptrue[x->id] = rs->ptrue[y->id];
+	rs->ptrue[y->id] = t;
+	k = rs->known[x->id];
+	rs->known[x->id] = rs->known[y->id];
+	rs->known[y->id] = k;
+	rs->moved[x->id] = rs->moved[y->id] = 1;
+	return 1;
+}
+
+static void
+reorder_blocks(reorder_state_t *rs, struct icode *ic,
+    const struct pcap_filter_profile *prof)
+{
+	opt_state_t *opt_state = rs->opt_state;
+	struct block *b;
+	u_int i, j, pass;
+	int level, swapped;
+
+	/*
+	 * Get each test's branch counts from the instruction at
+	 * which it was put in the program, and count predecessors.
+	 * Don't touch programs that return anything but constants,
+	 * as find_ud() doesn't treat the returns as reading A or X.
+	 */
+	for (i = 0; i < opt_state->n_blocks; i++) {
+		b = opt_state->blocks[i];
+		if (BPF_CLASS(b->s.code) == BPF_RET) {
+			if (BPF_RVAL(b->s.code) != BPF_K)
+				return;
+			continue;
+		}
+		j = b->offset + slength(b->stmts);
+		if (prof->fp_executed[j] != 0) {
+			rs->known[i] = 1;
+			rs->ptrue[i] = (double)prof->fp_taken[j] /
+			    (double)prof->fp_executed[j];
+		}
+		rs->npreds[JT(b)->id]++;
+		rs->npreds[JF(b)->id]++;
+	}
+
+	/*
+	 * Swapping doesn't change the shape of the graph, only what
+	 * each block does, so the levels and predecessors stay the
+	 * same; the uses and definitions don't, so a block swapped
+	 * in a pass isn't looked at again until the next one.
+	 */
+	for (pass = 0; pass < opt_state->n_blocks; pass++) {
+		find_levels(opt_state, ic);
+		find_ud(opt_state, ic->root);
+		memset(rs->moved, 0, opt_state->n_blocks);
+		swapped = 0;
+		for (level = ic->root->level; level > 0; level--) {
+			for (b = opt_state->levels[level]; b; b = b->link) {
+				if (reorder_pair(rs, b, 1) ||
+				    reorder_pair(rs, b, 0))
+					swapped = 1;
+			}
+		}
+		if (!swapped)
+			break;
+	}
+}
+
+/*
+ * Reorder the tests in optimized code using a profile of the program
+ * that icode_to_fcode() would generate from it.  Return 0 on success,
+ * -1 on error.
+ */
+int
+bpf_reorder_by_profile(struct icode *ic,
+    const struct pcap_filter_profile *prof, char *errbuf)
+{
+	opt_state_t opt_state;
+	reorder_state_t rs;
+	struct bpf_insn *fp;
+	u_int i, len;
+
+	/*
+	 * Generate the program, to find the offset at which each
+	 * block's code is put, and make sure the profile is for it.
+	 */
+	fp = icode_to_fcode(ic, ic->root, &len, errbuf);
+	if (fp == NULL)
+		return -1;
+	free(fp);
+	if (len != prof->fp_len) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "profile is for a %u-instruction program, not a %u-instruction one",
+		    prof->fp_len, len);
+		return -1;
+	}
+
+	memset(&opt_state, 0, sizeof(opt_state));
+	memset(&rs, 0, sizeof(rs));
+	opt_state.errbuf = errbuf;
+	if (setjmp(opt_state.top_ctx)) {
+		return -1;
+	}
+	opt_init(&opt_state, ic);
+	rs.opt_state = &opt_state;
+	rs.ptrue = (double *)arena_calloc(ic->arena, opt_state.n_blocks, sizeof(*rs.ptrue));
+	rs.known = (u_char *)arena_calloc(ic->arena, opt_state.n_blocks, sizeof(*rs.known));
+	rs.npreds = (u_int *)arena_calloc(ic->arena, opt_state.n_blocks, sizeof(*rs.npreds));
+	rs.moved = (u_char *)arena_calloc(ic->arena, opt_state.n_blocks, sizeof(*rs.moved));
+	if (rs.ptrue == NULL || rs.known == NULL || rs.npreds == NULL ||
+	    rs.moved == NULL)
+		opt_error(&opt_state, "malloc");
+	reorder_blocks(&rs, ic, prof);
+
+	/*
+	 * The tests have moved, so which branches need long jumps
+	 * has to be worked out again.
+	 */
+	for (i = 0; i < opt_state.n_blocks; i++)
+		opt_state.blocks[i]->longjt = opt_state.blocks[i]->longjf = 0;
+#ifdef BDEBUG
+	if (pcap_optimizer_debug > 1 || pcap_print_dot_graph) {
+		printf("after bpf_reorder_by_profile()\n");
+		opt_dump(&opt_state, ic);
+	}
+#endif
+	return 0;
+}
+
+static void
+make_marks(struct icode *ic, struct block *p)
+{
+	if (!isMarked(ic, p)) {
+		Mark(ic, p);
+		if (BPF_CLASS(p->s.code) != BPF_RET) {
+			make_marks(ic, JT(p));
+			make_marks(ic, JF(p));
+		}
+	}
+}
+
+/*
+ * Mark code array such that isMarked(ic->cur_mark, i) is true
+ * only for nodes that are alive.
+ */
+static void
+mark_code(struct icode *ic)
+{
+	ic->cur_mark += 1;
+	make_marks(ic, ic->root);
+}
+
+/*
+ * True iff the two stmt lists load the same value from the packet into
+ * the accumulator.
+ */
+static int
+eq_slist(struct slist *x, struct slist *y)
+{
+	for (;;) {
+		while (x && x->s.code == NOP)
+			x = x->next;
+		while (y && y->s.code == NOP)
+			y = y->next;
+		if (x == 0)
+			return y == 0;
+		if (y == 0)
+			return x == 0;
+		if (x->s.code != y->s.code || x->s.k != y->s.k)
+			return 0;
+		x = x->next;
+		y = y->next;
+	}
+}
+
+static inline int
+eq_blk(struct block *b0, struct block *b1)
+{
+	if (b0->s.code == b1->s.code &&
+	    b0->s.k == b1->s.k &&
 	    b0->et.succ == b1->et.succ &&
 	    b0->ef.succ == b1->ef.succ)
 		return eq_slist(b0->stmts, b1->stmts);
 	return 0;
 }
 
+/*
+ * Hash a block on everything eq_blk() compares.
+ */
+static u_int
+hash_blk(opt_state_t *opt_state, struct block *b)
+{
+	struct slist *s;
+	u_int hash;
+
+	hash = (u_int)b->s.code ^ (b->s.k << 4);
+	if (JT(b) != 0)
+		hash ^= (JT(b)->id << 8) ^ (JF(b)->id << 16);
+	for (s = b->stmts; s; s = s->next) {
+		if (s->s.code == NOP)
+			continue;
+		hash = hash * 31 + ((u_int)s->s.code ^ (s->s.k << 4));
+	}
+	return hash % opt_state->n_blocks;
+}
+
 static void
 intern_blocks(opt_state_t *opt_state, struct icode *ic)
 {
-	struct block *p;
-	u_int i, j;
+	struct block *p, *q;
+	u_int i, hash;
 	int done1; /* don't shadow global */
  top:
 	done1 = 1;
-	for (i = 0; i < opt_state->n_blocks; ++i)
+	for (i = 0; i < opt_state->n_blocks; ++i) {
 		opt_state->blocks[i]->link = 0;
+		opt_state->blk_hashtbl[i] = 0;
+	}
 
 	mark_code(ic);
 
-	for (i = opt_state->n_blocks - 1; i != 0; ) {
+	/*
+	 * Make each live block that's identical to a live block with a
+	 * higher id link to the one with the highest id.  Blocks are
+	 * put into the hash table in decreasing order of id, and only
+	 * if there's no identical block already there, so the one found
+	 * there is the one with the highest id.
+	 */
+	for (i = opt_state->n_blocks; i != 0; ) {
 		--i;
-		if (!isMarked(ic, opt_state->blocks[i]))
+		p = opt_state->blocks[i];
+		if (!isMarked(ic, p))
 			continue;
-		for (j = i + 1; j < opt_state->n_blocks; ++j) {
-			if (!isMarked(ic, opt_state->blocks[j]))
-				continue;
-			if (eq_blk(opt_state->blocks[i], opt_state->blocks[j])) {
-				opt_state->blocks[i]->link = opt_state->blocks[j]->link ?
-					opt_state->blocks[j]->link : opt_state->blocks[j];
+		hash = hash_blk(opt_state, p);
+		for (q = opt_state->blk_hashtbl[hash]; q != 0;
+		    q = opt_state->blk_hashnext[q->id]) {
+			if (eq_blk(p, q))
 				break;
-			}
+		}
+		if (q != 0)
+			p->link = q;
+		else {
+			opt_state->blk_hashnext[p->id] = opt_state->blk_hashtbl[hash];
+			opt_state->blk_hashtbl[hash] = p;
 		}
 	}
 	for (i = 0; i < opt_state->n_blocks; ++i) {
@@ -2394,17 +2785,6 @@ intern_blocks(opt_state_t *opt_state, struct icode *ic)
 		goto top;
 }
 
-static void
-opt_cleanup(opt_state_t *opt_state)
-{
-	free((void *)opt_state->vnode_base);
-	free((void *)opt_state->vmap);
-	free((void *)opt_state->edges);
-	free((void *)opt_state->space);
-	free((void *)opt_state->levels);
-	free((void *)opt_state->blocks);
-}
-
 /*
  * For optimizer errors.
  */
@@ -2515,10 +2895,7 @@ count_stmts(struct icode *ic, struct block *p)
 static void
 opt_init(opt_state_t *opt_state, struct icode *ic)
 {
-	bpf_u_int32 *p;
 	int i, n, max_stmts;
-	u_int product;
-	size_t block_memsize, edge_memsize;
 
 	/*
 	 * First, count the blocks, so we can malloc an array to map
@@ -2526,7 +2903,7 @@ opt_init(opt_state_t *opt_state, struct icode *ic)
 	 */
 	unMarkAll(ic);
 	n = count_blocks(ic, ic->root);
-	opt_state->blocks = (struct block **)calloc(n, sizeof(*opt_state->blocks));
+	opt_state->blocks = (struct block **)arena_calloc(ic->arena, n, sizeof(*opt_state->blocks));
 	if (opt_state->blocks == NULL)
 		opt_error(opt_state, "malloc");
 	unMarkAll(ic);
@@ -2546,7 +2923,7 @@ opt_init(opt_state_t *opt_state, struct icode *ic)
 		 */
 		opt_error(opt_state, "filter is too complex to optimize");
 	}
-	opt_state->edges = (struct edge **)calloc(opt_state->n_edges, sizeof(*opt_state->edges));
+	opt_state->edges = (struct edge **)arena_calloc(ic->arena, opt_state->n_edges, sizeof(*opt_state->edges));
 	if (opt_state->edges == NULL) {
 		opt_error(opt_state, "malloc");
 	}
@@ -2554,92 +2931,39 @@ opt_init(opt_state_t *opt_state, struct icode *ic)
 	/*
 	 * The number of levels is bounded by the number of nodes.
 	 */
-	opt_state->levels = (struct block **)calloc(opt_state->n_blocks, sizeof(*opt_state->levels));
+	opt_state->levels = (struct block **)arena_calloc(ic->arena, opt_state->n_blocks, sizeof(*opt_state->levels));
 	if (opt_state->levels == NULL) {
 		opt_error(opt_state, "malloc");
 	}
 
-	opt_state->edgewords = opt_state->n_edges / BITS_PER_WORD + 1;
-	opt_state->nodewords = opt_state->n_blocks / BITS_PER_WORD + 1;
-
-	/*
-	 * Make sure opt_state->n_blocks * opt_state->nodewords fits
-	 * in a u_int; we use it as a u_int number-of-iterations
-	 * value.
-	 */
-	product = opt_state->n_blocks * opt_state->nodewords;
-	if ((product / opt_state->n_blocks) != opt_state->nodewords) {
-		/*
-		 * XXX - just punt and don't try to optimize?
-		 * In practice, this is unlikely to happen with
-		 * a normal filter.
-		 */
-		opt_error(opt_state, "filter is too complex to optimize");
-	}
-
-	/*
-	 * Make sure the total memory required for that doesn't
-	 * overflow.
-	 */
-	block_memsize = (size_t)2 * product * sizeof(*opt_state->space);
-	if ((block_memsize / product) != 2 * sizeof(*opt_state->space)) {
-		opt_error(opt_state, "filter is too complex to optimize");
-	}
-
-	/*
-	 * Make sure opt_state->n_edges * opt_state->edgewords fits
-	 * in a u_int; we use it as a u_int number-of-iterations
-	 * value.
-	 */
-	product = opt_state->n_edges * opt_state->edgewords;
-	if ((product / opt_state->n_edges) != opt_state->edgewords) {
-		opt_error(opt_state, "filter is too complex to optimize");
-	}
-
 	/*
-	 * Make sure the total memory required for that doesn't
-	 * overflow.
+	 * The edges that dominate an edge are on a path from the root,
+	 * so there can't be more of them than there are blocks.
 	 */
-	edge_memsize = (size_t)product * sizeof(*opt_state->space);
-	if (edge_memsize / product != sizeof(*opt_state->space)) {
-		opt_error(opt_state, "filter is too complex to optimize");
-	}
-
-	/*
-	 * Make sure the total memory required for both of them dosn't
-	 * overflow.
-	 */
-	if (block_memsize > SIZE_MAX - edge_memsize) {
-		opt_error(opt_state, "filter is too complex to optimize");
-	}
-
-	/* XXX */
-	opt_state->space = (bpf_u_int32 *)malloc(block_memsize + edge_memsize);
-	if (opt_state->space == NULL) {
+	opt_state->edom_list = (struct edge **)arena_calloc(ic->arena, opt_state->n_blocks, sizeof(*opt_state->edom_list));
+	if (opt_state->edom_list == NULL) {
 		opt_error(opt_state, "malloc");
 	}
-	p = opt_state->space;
-	opt_state->all_dom_sets = p;
-	for (i = 0; i < n; ++i) {
-		opt_state->blocks[i]->dom = p;
-		p += opt_state->nodewords;
+	opt_state->blk_hashtbl = (struct block **)arena_calloc(ic->arena, opt_state->n_blocks, sizeof(*opt_state->blk_hashtbl));
+	if (opt_state->blk_hashtbl == NULL) {
+		opt_error(opt_state, "malloc");
 	}
-	opt_state->all_closure_sets = p;
-	for (i = 0; i < n; ++i) {
-		opt_state->blocks[i]->closure = p;
-		p += opt_state->nodewords;
+	opt_state->blk_hashnext = (struct block **)arena_calloc(ic->arena, opt_state->n_blocks, sizeof(*opt_state->blk_hashnext));
+	if (opt_state->blk_hashnext == NULL) {
+		opt_error(opt_state, "malloc");
 	}
-	opt_state->all_edge_sets = p;
+
+	opt_state->dom_root.jump = &opt_state->dom_root;
+	opt_state->edom_root.jump = &opt_state->edom_root;
 	for (i = 0; i < n; ++i) {
 		register struct block *b = opt_state->blocks[i];
 
-		b->et.edom = p;
-		p += opt_state->edgewords;
-		b->ef.edom = p;
-		p += opt_state->edgewords;
+		b->dom.id = i;
 		b->et.id = i;
+		b->et.edom.id = i;
 		opt_state->edges[i] = &b->et;
 		b->ef.id = opt_state->n_blocks + i;
+		b->ef.edom.id = opt_state->n_blocks + i;
 		opt_state->edges[opt_state->n_blocks + i] = &b->ef;
 		b->et.pred = b;
 		b->ef.pred = b;
@@ -2653,11 +2977,11 @@ opt_init(opt_state_t *opt_state, struct icode *ic)
 	 * we'll need.
 	 */
 	opt_state->maxval = 3 * max_stmts;
-	opt_state->vmap = (struct vmapinfo *)calloc(opt_state->maxval, sizeof(*opt_state->vmap));
+	opt_state->vmap = (struct vmapinfo *)arena_calloc(ic->arena, opt_state->maxval, sizeof(*opt_state->vmap));
 	if (opt_state->vmap == NULL) {
 		opt_error(opt_state, "malloc");
 	}
-	opt_state->vnode_base = (struct valnode *)calloc(opt_state->maxval, sizeof(*opt_state->vnode_base));
+	opt_state->vnode_base = (struct valnode *)arena_calloc(ic->arena, opt_state->maxval, sizeof(*opt_state->vnode_base));
 	if (opt_state->vnode_base == NULL) {
 		opt_error(opt_state, "malloc");
 	}
@@ -2680,6 +3004,11 @@ static void PCAP_NORETURN conv_error(conv_state_t *, const char *, ...)
  * an offset that is too large.  If so, we have marked that
  * branch so that on a subsequent iteration, it will be treated
  * properly.
+ *
+ * We keep going after finding such a branch, so that all of them
+ * are marked in one pass; a program with thousands of blocks, such
+ * as the search trees generated for large sets, could otherwise need
+ * a pass per branch.
  */
 static int
 convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
@@ -2689,15 +3018,15 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 	u_int slen;
 	u_int off;
 	struct slist **offset = NULL;
+	int ok;
 
 	if (p == 0 || isMarked(ic, p))
 		return (1);
 	Mark(ic, p);
 
-	if (convert_code_r(conv_state, ic, JF(p)) == 0)
-		return (0);
+	ok = convert_code_r(conv_state, ic, JF(p));
 	if (convert_code_r(conv_state, ic, JT(p)) == 0)
-		return (0);
+		ok = 0;
 
 	slen = slength(p->stmts);
 	dst = conv_state->ftail -= (slen + 1 + p->longjt + p->longjf);
@@ -2707,7 +3036,7 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 
 	/* generate offset[] for convenience  */
 	if (slen) {
-		offset = (struct slist **)calloc(slen, sizeof(struct slist *));
+		offset = (struct slist **)arena_calloc(ic->arena, slen, sizeof(struct slist *));
 		if (!offset) {
 			conv_error(conv_state, "not enough core");
 			/*NOTREACHED*/
@@ -2733,7 +3062,6 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 		if (BPF_CLASS(src->s.code) != BPF_JMP || src->s.code == (BPF_JMP|BPF_JA)) {
 #if 0
 			if (src->s.jt || src->s.jf) {
-				free(offset);
 				conv_error(conv_state, "illegal jmp destination");
 				/*NOTREACHED*/
 			}
@@ -2754,7 +3082,6 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 #endif
 
 		if (!src->s.jt || !src->s.jf) {
-			free(offset);
 			conv_error(conv_state, ljerr, "no jmp destination", off);
 			/*NOTREACHED*/
 		}
@@ -2763,13 +3090,11 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 		for (i = 0; i < slen; i++) {
 			if (offset[i] == src->s.jt) {
 				if (jt) {
-					free(offset);
 					conv_error(conv_state, ljerr, "multiple matches", off);
 					/*NOTREACHED*/
 				}
 
 				if (i - off - 1 >= 256) {
-					free(offset);
 					conv_error(conv_state, ljerr, "out-of-range jump", off);
 					/*NOTREACHED*/
 				}
@@ -2778,12 +3103,10 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 			}
 			if (offset[i] == src->s.jf) {
 				if (jf) {
-					free(offset);
 					conv_error(conv_state, ljerr, "multiple matches", off);
 					/*NOTREACHED*/
 				}
 				if (i - off - 1 >= 256) {
-					free(offset);
 					conv_error(conv_state, ljerr, "out-of-range jump", off);
 					/*NOTREACHED*/
 				}
@@ -2792,7 +3115,6 @@ convert_code_r(conv_state_t *conv_state, struct icode *ic, struct block *p)
 			}
 		}
 		if (!jt || !jf) {
-			free(offset);
 			conv_error(conv_state, ljerr, "no destination found", off);
 			/*NOTREACHED*/
 		}
@@ -2801,9 +3123,6 @@ filled:
 		++dst;
 		++off;
 	}
-	if (offset)
-		free(offset);
-
 #ifdef BDEBUG
 	if (dst - conv_state->fstart < NBIDS)
 		bids[dst - conv_state->fstart] = p->id + 1;
@@ -2819,12 +3138,13 @@ filled:
 		    if (p->longjt == 0) {
 			/* mark this instruction and retry */
 			p->longjt++;
-			return(0);
+			ok = 0;
+		    } else {
+			dst->jt = extrajmps;
+			extrajmps++;
+			dst[extrajmps].code = BPF_JMP|BPF_JA;
+			dst[extrajmps].k = off - extrajmps;
 		    }
-		    dst->jt = extrajmps;
-		    extrajmps++;
-		    dst[extrajmps].code = BPF_JMP|BPF_JA;
-		    dst[extrajmps].k = off - extrajmps;
 		}
 		else
 		    dst->jt = (u_char)off;
@@ -2834,19 +3154,20 @@ filled:
 		    if (p->longjf == 0) {
 			/* mark this instruction and retry */
 			p->longjf++;
-			return(0);
+			ok = 0;
+		    } else {
+			/* branch if F to following jump */
+			/* if two jumps are inserted, F goes to second one */
+			dst->jf = extrajmps;
+			extrajmps++;
+			dst[extrajmps].code = BPF_JMP|BPF_JA;
+			dst[extrajmps].k = off - extrajmps;
 		    }
-		    /* branch if F to following jump */
-		    /* if two jumps are inserted, F goes to second one */
-		    dst->jf = extrajmps;
-		    extrajmps++;
-		    dst[extrajmps].code = BPF_JMP|BPF_JA;
-		    dst[extrajmps].k = off - extrajmps;
 		}
 		else
 		    dst->jf = (u_char)off;
 	}
-	return (1);
+	return (ok);
 }
 
 
@@ -2927,18 +3248,761 @@ conv_error(conv_state_t *conv_state, const char *fmt, ...)
 	/* NOTREACHED */
 }
 
+/*
+ * Upper bounds on the values of the accumulator, the index register
+ * and the scratch memory words when an instruction is reached.
+ */
+struct value_bounds {
+	int reached;
+	bpf_u_int32 a;
+	bpf_u_int32 x;
+	bpf_u_int32 mem[BPF_MEMWORDS];
+};
+
+static bpf_u_int32
+bound_add(bpf_u_int32 a, bpf_u_int32 b)
+{
+	return (a > PCAP_FILTER_UNBOUNDED - b ? PCAP_FILTER_UNBOUNDED : a + b);
+}
+
+/*
+ * Bound on the result of an arithmetic instruction, given a bound on
+ * the accumulator and either the constant operand (if "exact" is set)
+ * or a bound on the index register.
+ */
+static bpf_u_int32
+bound_alu(u_int op, bpf_u_int32 a, bpf_u_int32 v, int exact)
+{
+	switch (op) {
+
+	case BPF_ADD:
+		return (bound_add(a, v));
+
+	case BPF_MUL:
+		if (v != 0 && a > PCAP_FILTER_UNBOUNDED / v)
+			return (PCAP_FILTER_UNBOUNDED);
+		return (a * v);
+
+	case BPF_DIV:
+		return (exact && v != 0 ? a / v : a);
+
+	case BPF_MOD:
+		if (v == 0)
+			return (0);
+		return (a < v - 1 ? a : v - 1);
+
+	case BPF_AND:
+		return (a < v ? a : v);
+
+	case BPF_OR:
+	case BPF_XOR:
+		/*
+		 * The result can have no bit set above the highest
+		 * bit set in either operand.
+		 */
+		a |= v;
+		a |= a >> 1;
+		a |= a >> 2;
+		a |= a >> 4;
+		a |= a >> 8;
+		a |= a >> 16;
+		return (a);
+
+	case BPF_LSH:
+		if (a == 0)
+			return (0);
+		if (!exact || v >= 32 || a > (PCAP_FILTER_UNBOUNDED >> v))
+			return (PCAP_FILTER_UNBOUNDED);
+		return (a << v);
+
+	case BPF_RSH:
+		return (exact && v < 32 ? a >> v : a);
+
+	default:
+		/*
+		 * BPF_SUB and BPF_NEG can wrap around.
+		 */
+		return (PCAP_FILTER_UNBOUNDED);
+	}
+}
+
+static void
+merge_bounds(struct value_bounds *to, const struct value_bounds *from)
+{
+	int i;
+
+	if (!to->reached) {
+		*to = *from;
+		return;
+	}
+	if (from->a > to->a)
+		to->a = from->a;
+	if (from->x > to->x)
+		to->x = from->x;
+	for (i = 0; i < BPF_MEMWORDS; i++)
+		if (from->mem[i] > to->mem[i])
+			to->mem[i] = from->mem[i];
+}
+
+/*
+ * Work out how far into the packet a filter program can look.
+ *
+ * Loads at fixed offsets are easy; for loads relative to the index
+ * register, we track an upper bound on the value of every register
+ * and scratch memory word through the program, which is enough to
+ * bound the usual "4*([n]&0xf)" header-length loads.  A single
+ * forward pass suffices, as every jump but the backward ones used by
+ * "ip6 protochain" goes forward; we don't try to bound programs with
+ * backward jumps.
+ *
+ * On success, *maxoffp is set to one past the offset of the last byte
+ * of packet data the program can read, or to PCAP_FILTER_UNBOUNDED if
+ * we can't bound that, and *has_indp, if not null, is set to whether
+ * the program has any loads relative to the index register.
+ */
+int
+pcap_filter_max_offset(const struct bpf_program *fp, bpf_u_int32 *maxoffp,
+    int *has_indp)
+{
+	const struct bpf_insn *insn;
+	struct value_bounds *vb, cur;
+	bpf_u_int32 end, maxoff;
+	u_int i, size;
+	int j;
+
+	if (fp->bf_insns == NULL ||
+	    !pcap_validate_filter(fp->bf_insns, fp->bf_len))
+		return (PCAP_ERROR);
+	vb = calloc(fp->bf_len, sizeof(*vb));
+	if (vb == NULL)
+		return (PCAP_ERROR);
+
+	/*
+	 * The interpreter and the JIT start with both registers
+	 * cleared, but leave the scratch memory as it is.
+	 */
+	vb[0].reached = 1;
+	for (j = 0; j < BPF_MEMWORDS; j++)
+		vb[0].mem[j] = PCAP_FILTER_UNBOUNDED;
+
+	if (has_indp != NULL) {
+		*has_indp = 0;
+		for (i = 0; i < fp->bf_len; i++) {
+			insn = &fp->bf_insns[i];
+			if (BPF_CLASS(insn->code) == BPF_LD &&
+			    BPF_MODE(insn->code) == BPF_IND)
+				*has_indp = 1;
+		}
+	}
+
+	maxoff = 0;
+	for (i = 0; i < fp->bf_len; i++) {
+		if (!vb[i].reached)
+			continue;
+		cur = vb[i];
+		insn = &fp->bf_insns[i];
+		end = 0;
+		switch (BPF_CLASS(insn->code)) {
+
+		case BPF_LD:
+			switch (BPF_SIZE(insn->code)) {
+			case BPF_W:
+				size = 4;
+				cur.a = PCAP_FILTER_UNBOUNDED;
+				break;
+			case BPF_H:
+				size = 2;
+				cur.a = 0xffff;
+				break;
+			default:
+				size = 1;
+				cur.a = 0xff;
+				break;
+			}
+			switch (BPF_MODE(insn->code)) {
+
+			case BPF_ABS:
+				/*
+				 * Offsets this large are the Linux
+				 * "ancillary data" ones, which don't
+				 * refer to packet data, and no packet
+				 * has data there in any case.
+				 */
+				if (insn->k < 0xfffff000U)
+					end = bound_add(insn->k, size);
+				else
+					cur.a = PCAP_FILTER_UNBOUNDED;
+				break;
+
+			case BPF_IND:
+				end = bound_add(bound_add(cur.x, insn->k), size);
+				break;
+
+			case BPF_IMM:
+				cur.a = insn->k;
+				break;
+
+			case BPF_MEM:
+				cur.a = cur.mem[insn->k];
+				break;
+
+			default:
+				cur.a = PCAP_FILTER_UNBOUNDED;
+				break;
+			}
+			break;
+
+		case BPF_LDX:
+			switch (BPF_MODE(insn->code)) {
+
+			case BPF_MSH:
+				end = bound_add(insn->k, 1);
+				cur.x = 4 * 0xf;
+				break;
+
+			case BPF_IMM:
+				cur.x = insn->k;
+				break;
+
+			case BPF_MEM:
+				cur.x = cur.mem[insn->k];
+				break;
+
+			default:
+				cur.x = PCAP_FILTER_UNBOUNDED;
+				break;
+			}
+			break;
+
+		case BPF_ST:
+			cur.mem[insn->k] = cur.a;
+			break;
+
+		case BPF_STX:
+			cur.mem[insn->k] = cur.x;
+			break;
+
+		case BPF_ALU:
+			if (BPF_SRC(insn->code) == BPF_K)
+				cur.a = bound_alu(BPF_OP(insn->code), cur.a,
+				    insn->k, 1);
+			else
+				cur.a = bound_alu(BPF_OP(insn->code), cur.a,
+				    cur.x, 0);
+			break;
+
+		case BPF_MISC:
+			if (BPF_MISCOP(insn->code) == BPF_TAX)
+				cur.x = cur.a;
+			else
+				cur.a = cur.x;
+			break;
+
+		case BPF_JMP:
+			if (BPF_OP(insn->code) != BPF_JA) {
+				merge_bounds(&vb[i + 1 + insn->jt], &cur);
+				merge_bounds(&vb[i + 1 + insn->jf], &cur);
+			} else if (i + 1 + insn->k > i)
+				merge_bounds(&vb[i + 1 + insn->k], &cur);
+			else {
+				free(vb);
+				*maxoffp = PCAP_FILTER_UNBOUNDED;
+				return (0);
+			}
+			continue;
+
+		case BPF_RET:
+			continue;
+		}
+		if (end > maxoff)
+			maxoff = end;
+		merge_bounds(&vb[i + 1], &cur);
+	}
+	free(vb);
+	*maxoffp = maxoff;
+	return (0);
+}
+
+/*
+ * What's known about the index register when an instruction is
+ * reached, for bpf_verdict_key().
+ */
+#define XS_UNREACHED	0
+#define XS_CONST	1	/* it's "val" */
+#define XS_MSH		2	/* it's 4*(pkt[val]&0xf) */
+#define XS_UNKNOWN	3
+
+struct x_source {
+	int kind;
+	bpf_u_int32 val;
+};
+
+static void
+merge_x_source(struct x_source *to, const struct x_source *from)
+{
+	if (to->kind == XS_UNREACHED)
+		*to = *from;
+	else if (to->kind != from->kind || to->val != from->val)
+		to->kind = XS_UNKNOWN;
+}
+
+static int
+key_slot_cmp(const void *a, const void *b)
+{
+	const struct bpf_key_slot *sa = a, *sb = b;
+
+	if (sa->msh != sb->msh)
+		return (sa->msh < sb->msh ? -1 : 1);
+	if (sa->off != sb->off)
+		return (sa->off < sb->off ? -1 : 1);
+	return (sa->len < sb->len ? -1 : sa->len > sb->len);
+}
+
+/*
+ * Work out which packet data the verdict of a filter program depends
+ * on, if that can be done in advance: bytes at fixed offsets, and
+ * bytes at fixed offsets past a header whose length is given by an
+ * "ldx 4*([k]&0xf)" instruction, as used for the IPv4 header in
+ * TCP and UDP port tests.  Given those bytes, and the captured length
+ * of the packet, the program always returns the same value.
+ *
+ * On success, a malloc()ed array of slots for the data, sorted and
+ * with overlapping and adjacent slots merged, is stored in *slotsp
+ * and the number of slots is returned.  If the verdict depends on
+ * something else, -2 is returned; if an error occurs, -1 is returned.
+ * In both cases, errbuf says why.
+ */
+int
+bpf_verdict_key(const struct bpf_program *fp, struct bpf_key_slot **slotsp,
+    char *errbuf)
+{
+	const struct bpf_insn *insn;
+	struct x_source *xs, cur;
+	struct bpf_key_slot *slots;
+	u_int i, n, m, size;
+
+	if (fp->bf_insns == NULL ||
+	    !pcap_validate_filter(fp->bf_insns, fp->bf_len)) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "BPF program is not valid");
+		return (-1);
+	}
+	xs = calloc(fp->bf_len, sizeof(*xs));
+	slots = malloc(fp->bf_len * sizeof(*slots));
+	if (xs == NULL || slots == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(xs);
+		free(slots);
+		return (-1);
+	}
+
+	/*
+	 * The index register starts out as 0.
+	 */
+	xs[0].kind = XS_CONST;
+	xs[0].val = 0;
+	n = 0;
+	for (i = 0; i < fp->bf_len; i++) {
+		if (xs[i].kind == XS_UNREACHED)
+			continue;
+		cur = xs[i];
+		insn = &fp->bf_insns[i];
+		switch (BPF_CLASS(insn->code)) {
+
+		case BPF_LD:
+			size = BPF_SIZE(insn->code) == BPF_W ? 4 :
+			    BPF_SIZE(insn->code) == BPF_H ? 2 : 1;
+			switch (BPF_MODE(insn->code)) {
+
+			case BPF_ABS:
+				if (insn->k >= 0xfffff000U) {
+					snprintf(errbuf, PCAP_ERRBUF_SIZE,
+					    "The filter reads data that isn't packet data");
+					goto fail;
+				}
+				slots[n].msh = -1;
+				slots[n].off = insn->k;
+				slots[n].len = size;
+				n++;
+				break;
+
+			case BPF_IND:
+				if (cur.kind == XS_CONST &&
+				    cur.val < 0xfffff000U &&
+				    insn->k < 0xfffff000U - cur.val) {
+					slots[n].msh = -1;
+					slots[n].off = cur.val + insn->k;
+				} else if (cur.kind == XS_MSH &&
+				    insn->k < 0xfffff000U) {
+					slots[n].msh = (int)cur.val;
+					slots[n].off = insn->k;
+				} else {
+					snprintf(errbuf, PCAP_ERRBUF_SIZE,
+					    "The filter reads packet data at offsets that can't be worked out in advance");
+					goto fail;
+				}
+				slots[n].len = size;
+				n++;
+				break;
+
+			case BPF_LEN:
+				snprintf(errbuf, PCAP_ERRBUF_SIZE,
+				    "The filter reads the packet length");
+				goto fail;
+			}
+			break;
+
+		case BPF_LDX:
+			switch (BPF_MODE(insn->code)) {
+
+			case BPF_MSH:
+				if (insn->k > INT_MAX) {
+					snprintf(errbuf, PCAP_ERRBUF_SIZE,
+					    "The filter reads data that isn't packet data");
+					goto fail;
+				}
+				slots[n].msh = -1;
+				slots[n].off = insn->k;
+				slots[n].len = 1;
+				n++;
+				cur.kind = XS_MSH;
+				cur.val = insn->k;
+				break;
+
+			case BPF_IMM:
+				cur.kind = XS_CONST;
+				cur.val = insn->k;
+				break;
+
+			case BPF_LEN:
+				snprintf(errbuf, PCAP_ERRBUF_SIZE,
+				    "The filter reads the packet length");
+				goto fail;
+
+			default:
+				cur.kind = XS_UNKNOWN;
+				break;
+			}
+			break;
+
+		case BPF_MISC:
+			if (BPF_MISCOP(insn->code) == BPF_TAX)
+				cur.kind = XS_UNKNOWN;
+			break;
+
+		case BPF_JMP:
+			if (BPF_OP(insn->code) != BPF_JA) {
+				merge_x_source(&xs[i + 1 + insn->jt], &cur);
+				merge_x_source(&xs[i + 1 + insn->jf], &cur);
+			} else if (i + 1 + insn->k > i)
+				merge_x_source(&xs[i + 1 + insn->k], &cur);
+			else {
+				snprintf(errbuf, PCAP_ERRBUF_SIZE,
+				    "The filter has loops");
+				goto fail;
+			}
+			continue;
+
+		case BPF_RET:
+			continue;
+		}
+		merge_x_source(&xs[i + 1], &cur);
+	}
+	free(xs);
+
+	if (n != 0) {
+		qsort(slots, n, sizeof(*slots), key_slot_cmp);
+		m = 0;
+		for (i = 1; i < n; i++) {
+			if (slots[i].msh == slots[m].msh &&
+			    slots[i].off <= slots[m].off + slots[m].len) {
+				if (slots[i].off + slots[i].len >
+				    slots[m].off + slots[m].len)
+					slots[m].len = slots[i].off +
+					    slots[i].len - slots[m].off;
+			} else
+				slots[++m] = slots[i];
+		}
+		n = m + 1;
+	}
+	*slotsp = slots;
+	return (n);
+
+fail:
+	free(xs);
+	free(slots);
+	return (-2);
+}
+
+/*
+ * If the instructions starting at index i are a load, an optional
+ * "and" with a constant and a "jeq" with a constant, of the sort
+ * bpf_lower_wide() combines, fill in *ld and *jeqp and return the
+ * number of instructions; otherwise, return 0.
+ */
+static u_int
+wide_load_at(const struct bpf_insn *f, u_int len, u_int i, int ind,
+    struct bpf_wide_load *ld, const struct bpf_insn **jeqp)
+{
+	const struct bpf_insn *p = &f[i];
+	u_int n;
+
+	if (i + 1 >= len || BPF_CLASS(p->code) != BPF_LD ||
+	    BPF_MODE(p->code) != (ind ? BPF_IND : BPF_ABS))
+		return (0);
+	switch (BPF_SIZE(p->code)) {
+
+	case BPF_W:
+		ld->size = 4;
+		break;
+
+	case BPF_H:
+		ld->size = 2;
+		break;
+
+	case BPF_B:
+		ld->size = 1;
+		break;
+
+	default:
+		return (0);
+	}
+
+	/*
+	 * Leave loads of data that isn't packet data alone.
+	 */
+	if (p->k >= 0xfffff000U)
+		return (0);
+	ld->k = p->k;
+	ld->mask = 0xffffffffU >> (32 - 8 * ld->size);
+	n = 1;
+	if (f[i + 1].code == (BPF_ALU|BPF_AND|BPF_K)) {
+		ld->mask &= f[i + 1].k;
+		n++;
+	}
+	if (i + n >= len || f[i + n].code != (BPF_JMP|BPF_JEQ|BPF_K))
+		return (0);
+
+	/*
+	 * A comparison that can never be true is left alone, so that
+	 * the masked data and the constants line up.
+	 */
+	if ((f[i + n].k & ~ld->mask) != 0)
+		return (0);
+	ld->val = f[i + n].k;
+	*jeqp = &f[i + n];
+	return (n + 1);
+}
+
+/*
+ * Return true if the load ld can be added to the loads of w without
+ * the data they compare overlapping or spanning more than 16 bytes.
+ */
+static int
+wide_load_fits(const struct bpf_wide_cmp *w, const struct bpf_wide_load *ld)
+{
+	const struct bpf_wide_load *o;
+	bpf_u_int32 lo, hi;
+	u_int i;
+
+	lo = ld->k;
+	hi = ld->k + ld->size;
+	for (i = 0; i < w->nloads; i++) {
+		o = &w->loads[i];
+		if (ld->k < o->k + o->size && o->k < ld->k + ld->size)
+			return (0);
+		if (o->k < lo)
+			lo = o->k;
+		if (o->k + o->size > hi)
+			hi = o->k + o->size;
+	}
+	return (hi - lo <= 16);
+}
+
+/*
+ * Return true if the instruction doesn't use the accumulator before
+ * setting it, so that the pre-decoded interpreter need not work out
+ * which comparison of a run failed when it jumps there.
+ */
+static int
+a_unused_by(const struct bpf_insn *p)
+{
+	switch (BPF_CLASS(p->code)) {
+
+	case BPF_LD:
+		return (1);
+
+	case BPF_RET:
+		return (BPF_RVAL(p->code) == BPF_K);
+
+	case BPF_MISC:
+		return (BPF_MISCOP(p->code) == BPF_TXA);
+	}
+	return (0);
+}
+
+/*
+ * Lower a validated program for the pre-decoded interpreter, finding
+ * the runs of loads and comparisons it can do as single 64-bit or
+ * 128-bit comparisons.  Nothing may jump into the middle of a run,
+ * and the loads are either all BPF_ABS loads or all BPF_IND loads,
+ * as the index register doesn't change within a run.
+ *
+ * On success, a malloc()ed array of the runs, in order, is stored in
+ * *widep, or NULL if there are none, and the number of runs is
+ * returned; -1 is returned if memory couldn't be allocated.
+ */
+int
+bpf_lower_wide(const struct bpf_insn *f, u_int len,
+    struct bpf_wide_cmp **widep)
+{
+	struct bpf_wide_cmp *wide, *w;
+	struct bpf_wide_load ld;
+	const struct bpf_insn *jeq = NULL;
+	u_char *target;
+	u_int i, j, n, m, b, idx, shift, nwide, jt, jf;
+	bpf_u_int32 lo, hi;
+	int ind;
+
+	*widep = NULL;
+	if (len < 4)
+		return (0);
+	/*
+	 * A run has at least two loads and two comparisons; leave room
+	 * for one more, for the run being looked at after the last one.
+	 */
+	target = calloc(len, 1);
+	wide = malloc((len / 4 + 1) * sizeof(*wide));
+	if (target == NULL || wide == NULL) {
+		free(target);
+		free(wide);
+		return (-1);
+	}
+
+	/*
+	 * Find the instructions that are jumped to other than by
+	 * going on to the next instruction.
+	 */
+	for (i = 0; i < len; i++) {
+		if (BPF_CLASS(f[i].code) != BPF_JMP)
+			continue;
+		if (BPF_OP(f[i].code) == BPF_JA) {
+			if (f[i].k != 0)
+				target[i + 1 + f[i].k] = 1;
+		} else {
+			if (f[i].jt != 0)
+				target[i + 1 + f[i].jt] = 1;
+			if (f[i].jf != 0)
+				target[i + 1 + f[i].jf] = 1;
+		}
+	}
+
+	nwide = 0;
+	for (i = 0; i < len; ) {
+		w = &wide[nwide];
+		w->nloads = 0;
+		ind = BPF_MODE(f[i].code) == BPF_IND;
+		jt = jf = 0;
+		for (j = i; w->nloads < BPF_WIDE_MAX_LOADS; j += n) {
+			n = wide_load_at(f, len, j, ind, &ld, &jeq);
+			if (n == 0)
+				break;
+			for (m = (j == i ? j + 1 : j); m < j + n; m++)
+				if (target[m])
+					break;
+			if (m < j + n)
+				break;
+			if (w->nloads != 0 && j + n + jeq->jf != jf)
+				break;
+			if (!wide_load_fits(w, &ld))
+				break;
+			w->loads[w->nloads++] = ld;
+			jf = j + n + jeq->jf;
+			jt = j + n + jeq->jt;
+			if (jeq->jt != 0) {
+				j += n;
+				break;
+			}
+		}
+		if (w->nloads < 2 || !a_unused_by(&f[jf])) {
+			i++;
+			continue;
+		}
+
+		w->start = i;
+		w->len = j - i;
+		w->jt = jt;
+		w->jf = jf;
+		w->ind = ind;
+		lo = 0xffffffffU;
+		hi = 0;
+		for (m = 0; m < w->nloads; m++) {
+			if (w->loads[m].k < lo)
+				lo = w->loads[m].k;
+			if (w->loads[m].k + w->loads[m].size > hi)
+				hi = w->loads[m].k + w->loads[m].size;
+		}
+		w->off = lo;
+		w->width = hi - lo <= 8 ? 8 : 16;
+		w->mask[0] = w->mask[1] = 0;
+		w->val[0] = w->val[1] = 0;
+		for (m = 0; m < w->nloads; m++) {
+			for (b = 0; b < w->loads[m].size; b++) {
+				idx = w->loads[m].k - lo + b;
+				shift = 8 * (w->loads[m].size - 1 - b);
+				w->mask[idx / 8] |=
+				    (uint64_t)((w->loads[m].mask >> shift) & 0xff) <<
+				    (56 - 8 * (idx % 8));
+				w->val[idx / 8] |=
+				    (uint64_t)((w->loads[m].val >> shift) & 0xff) <<
+				    (56 - 8 * (idx % 8));
+			}
+		}
+		nwide++;
+		i = j;
+	}
+	free(target);
+	if (nwide == 0)
+		free(wide);
+	else
+		*widep = wide;
+	return (nwide);
+}
+
+/*
+ * Free the program installed on a pcap_t, and everything made from it,
+ * if one is installed.
+ */
+void
+uninstall_bpf_program(pcap_t *p)
+{
+	pcap_jit_free(&p->fcode_jit);
+	pcap_free_predecoded(p->fcode_decoded);
+	p->fcode_decoded = NULL;
+	p->fcode_profile = NULL;
+	pcap_filter_cache_free(p->fcode_cache);
+	p->fcode_cache = NULL;
+	pcap_freecode(&p->fcode);
+	p->fcode_in_kernel = 0;
+}
+
 /*
  * Make a copy of a BPF program and put it in the "fcode" member of
  * a "pcap_t".
  *
- * If we fail to allocate memory for the copy, fill in the "errbuf"
- * member of the "pcap_t" with an error message, and return -1;
- * otherwise, return 0.
+ * If we fail to allocate memory for the copy, or for the cache of its
+ * verdicts, fill in the "errbuf" member of the "pcap_t" with an error
+ * message, and return -1, leaving the program that was installed in
+ * place; otherwise, return 0.
  */
 int
 install_bpf_program(pcap_t *p, struct bpf_program *fp)
 {
+	char errbuf[PCAP_ERRBUF_SIZE];
 	size_t prog_size;
+	struct bpf_insn *insns;
+	struct pcap_filter_cache *cache;
 
 	/*
 	 * Validate the program.
@@ -2950,19 +4014,56 @@ install_bpf_program(pcap_t *p, struct bpf_program *fp)
 	}
 
 	/*
-	 * Free up any already installed program.
+	 * Make everything that can fail before touching the installed
+	 * program, so that, if we fail, it stays installed.
 	 */
-	pcap_freecode(&p->fcode);
-
 	prog_size = sizeof(*fp->bf_insns) * fp->bf_len;
-	p->fcode.bf_len = fp->bf_len;
-	p->fcode.bf_insns = (struct bpf_insn *)malloc(prog_size);
-	if (p->fcode.bf_insns == NULL) {
+	insns = (struct bpf_insn *)malloc(prog_size);
+	if (insns == NULL) {
 		pcap_fmt_errmsg_for_errno(p->errbuf, sizeof(p->errbuf),
 		    errno, "malloc");
 		return (-1);
 	}
-	memcpy(p->fcode.bf_insns, fp->bf_insns, prog_size);
+	memcpy(insns, fp->bf_insns, prog_size);
+
+	/*
+	 * If we've been asked to cache its verdicts, do so if we can.
+	 */
+	cache = NULL;
+	if (p->fcode_cache_size != 0 &&
+	    pcap_filter_cache_create(fp, p->fcode_cache_size, &cache,
+	    errbuf) == -1) {
+		pcap_strlcpy(p->errbuf, errbuf, PCAP_ERRBUF_SIZE);
+		free(insns);
+		return (-1);
+	}
+
+	/*
+	 * Free up any already installed program, and install this one.
+	 */
+	uninstall_bpf_program(p);
+	p->fcode.bf_len = fp->bf_len;
+	p->fcode.bf_insns = insns;
+	p->fcode_cache = cache;
+
+	/*
+	 * Find out how much of a packet it can look at, so that
+	 * code reading packets can avoid reading more than that
+	 * for packets the filter rejects.
+	 */
+	if (pcap_filter_max_offset(&p->fcode, &p->fcode_maxoff, NULL) ==
+	    PCAP_ERROR)
+		p->fcode_maxoff = PCAP_FILTER_UNBOUNDED;
+
+	/*
+	 * Translate it into native code if we can; if we can't,
+	 * pre-decode it for the interpreter, and, if we can't do
+	 * that, interpret it as is.
+	 */
+	if (pcap_jit_compile(&p->fcode_jit, p->fcode.bf_insns,
+	    p->fcode.bf_len) == -1)
+		p->fcode_decoded = pcap_predecode_filter(p->fcode.bf_insns,
+		    p->fcode.bf_len);
 	return (0);
 }
 
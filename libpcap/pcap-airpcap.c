@@ -289,6 +289,7 @@ airpcap_setfilter(pcap_t *p, struct bpf_program *fp)
 	 * It worked.
 	 */
 	pa->filtering_in_kernel = 1;	/* filtering in the kernel */
+	p->fcode_in_kernel = 1;
 
 	/*
 	 * Discard any previously-received packets, as they might have
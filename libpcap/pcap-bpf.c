@@ -1273,7 +1273,7 @@ pcap_read_bpf(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 #endif
 		 */
 		if (pb->filtering_in_kernel ||
-		    pcap_filter(p->fcode.bf_insns, datap, bhp->bh_datalen, caplen)) {
+		    pcap_run_filter(p, datap, bhp->bh_datalen, caplen)) {
 			struct pcap_pkthdr pkthdr;
 #ifdef BIOCSTSTAMP
 			struct bintime bt;
@@ -3551,7 +3551,7 @@ pcap_setfilter_bpf(pcap_t *p, struct bpf_program *fp)
 	/*
 	 * Free any user-mode filter we might happen to have installed.
 	 */
-	pcap_freecode(&p->fcode);
+	uninstall_bpf_program(p);
 
 	/*
 	 * Try to install the kernel filter.
@@ -3561,6 +3561,7 @@ pcap_setfilter_bpf(pcap_t *p, struct bpf_program *fp)
 		 * It worked.
 		 */
 		pb->filtering_in_kernel = 1;	/* filtering in the kernel */
+		p->fcode_in_kernel = 1;
 
 		/*
 		 * Discard any previously-received packets, as they might
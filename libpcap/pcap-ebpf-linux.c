@@ -0,0 +1,687 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Linux eBPF support shared by the capture modules: the bpf() system
+ * call, and loading classic BPF programs as eBPF socket filters.
+ *
+ * Classic BPF is translated into eBPF much as the kernel does it for
+ * SO_ATTACH_FILTER - A is r0, X is r7, the scratch memory is on the
+ * stack, and packet loads use the legacy LD_ABS and LD_IND
+ * instructions, which handle the negative SKF_NET_OFF and SKF_LL_OFF
+ * offsets and drop the packet if the load is out of range - so that
+ * the program can start with checks against a map, which can then be
+ * changed without reloading the program.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pcap-int.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#include <linux/filter.h>
+
+#include "ethertype.h"
+#include "pcap-ebpf-linux.h"
+
+/*
+ * Registers.
+ */
+#define R_A	0	/* the accumulator; also the return value */
+#define R_ARG1	1
+#define R_ARG2	2
+#define R_CTX	6	/* the struct __sk_buff; LD_ABS and LD_IND need it here */
+#define R_X	7	/* the index register */
+#define R_SAVE	8	/* A, saved across the load of LDX MSH */
+#define R_TMP	9	/* immediates that can't be sign-extended */
+
+/*
+ * The scratch memory words are at the top of the stack; the map key
+ * goes below them.
+ */
+#define MEM_OFF(k)	(-(int)(BPF_MEMWORDS - (k)) * 4)
+#define KEY_OFF		(MEM_OFF(0) - 8)
+
+/*
+ * Offsets of fields in struct __sk_buff.
+ */
+#define SKB_LEN		0
+#define SKB_PKT_TYPE	4
+#define SKB_MARK	8
+#define SKB_QUEUE_MAPPING 12
+#define SKB_PROTOCOL	16
+#define SKB_VLAN_PRESENT 20
+#define SKB_VLAN_TCI	24
+#define SKB_VLAN_PROTO	28
+#define SKB_IFINDEX	40
+#define SKB_HASH	68
+
+#ifndef SKF_AD_VLAN_TPID
+#define SKF_AD_VLAN_TPID	60
+#endif
+
+struct ebpf_prog {
+	struct ebpf_insn *insns;	/* NULL when just counting */
+	u_int	len;
+	int	bad_jump;		/* a jump offset didn't fit */
+};
+
+int
+pcap_sys_bpf(int cmd, union ebpf_attr *attr)
+{
+#ifdef __NR_bpf
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+#else
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+static void
+emit(struct ebpf_prog *prog, u_int code, u_int dst, u_int src, int off,
+    bpf_u_int32 imm)
+{
+	struct ebpf_insn *insn;
+
+	if (prog->insns != NULL) {
+		insn = &prog->insns[prog->len];
+		insn->code = (__u8)code;
+		insn->dst_reg = dst;
+		insn->src_reg = src;
+		insn->off = (__s16)off;
+		insn->imm = (__s32)imm;
+	}
+	prog->len++;
+}
+
+/*
+ * Emit a jump to the instruction at target.
+ */
+static void
+emit_jmp(struct ebpf_prog *prog, u_int code, u_int dst, u_int src,
+    u_int target, bpf_u_int32 imm)
+{
+	int off = (int)target - (int)(prog->len + 1);
+
+	if (prog->insns != NULL && (off < -32768 || off > 32767))
+		prog->bad_jump = 1;
+	emit(prog, BPF_JMP|code, dst, src, off, imm);
+}
+
+/*
+ * Emit a 32-bit load of a struct __sk_buff field.
+ */
+static void
+emit_skb_load(struct ebpf_prog *prog, u_int dst, int off)
+{
+	emit(prog, BPF_LDX|BPF_W|BPF_MEM, dst, R_CTX, off, 0);
+}
+
+/*
+ * Emit a lookup of the 32-bit key in R_A in the map; afterwards, R_A
+ * is non-zero if the key is in the map.
+ */
+static void
+emit_lookup(struct ebpf_prog *prog, int map_fd)
+{
+	emit(prog, BPF_STX|BPF_W|BPF_MEM, EBPF_REG_FP, R_A, KEY_OFF, 0);
+	emit(prog, BPF_LD|EBPF_DW|BPF_IMM, R_ARG1, EBPF_PSEUDO_MAP_FD, 0,
+	    (bpf_u_int32)map_fd);
+	emit(prog, 0, 0, 0, 0, 0);
+	emit(prog, EBPF_ALU64|EBPF_MOV|BPF_X, R_ARG2, EBPF_REG_FP, 0, 0);
+	emit(prog, EBPF_ALU64|BPF_ADD|BPF_K, R_ARG2, 0, 0,
+	    (bpf_u_int32)KEY_OFF);
+	emit(prog, BPF_JMP|EBPF_CALL, 0, 0, 0, EBPF_FUNC_map_lookup_elem);
+}
+
+/*
+ * Emit the checks against the map.  Packets whose key is in the map
+ * end up at "match", and all others at "nomatch"; one of those is the
+ * start of the classic program, and the other drops the packet.
+ *
+ * The key is taken from the network-layer header, using SKF_NET_OFF,
+ * so this doesn't depend on the link-layer header type.
+ */
+static void
+emit_map_filter(struct ebpf_prog *prog, const struct ebpf_map_filter *mf)
+{
+	struct ebpf_prog count;
+	struct ebpf_prog *p;
+	u_int l_nomatch = 0, l_match = 0, l_ipv4 = 0, l_ports = 0;
+	u_int l_key = 0;
+	int pass, i;
+
+	/*
+	 * The code is emitted twice, first to find out where the
+	 * labels are and then with the jumps to them.
+	 */
+	count.insns = NULL;
+	count.len = prog->len;
+	count.bad_jump = 0;
+	for (pass = 0; pass < 2; pass++) {
+		p = pass == 0 ? &count : prog;
+
+		/* r0 = ntohs(skb->protocol) */
+		emit_skb_load(p, R_A, SKB_PROTOCOL);
+		emit(p, BPF_ALU|EBPF_END|EBPF_TO_BE, R_A, 0, 0, 16);
+		switch (mf->key_type) {
+
+		case PCAP_MAP_FILTER_IPV4_HOST:
+			emit_jmp(p, EBPF_JNE|BPF_K, R_A, 0, l_nomatch,
+			    ETHERTYPE_IP);
+			/* source address, then destination address */
+			for (i = 0; i < 2; i++) {
+				emit(p, BPF_LD|BPF_W|BPF_ABS, 0, 0, 0,
+				    (bpf_u_int32)(SKF_NET_OFF + 12 + 4*i));
+				emit_lookup(p, mf->map_fd);
+				emit_jmp(p, EBPF_JNE|BPF_K, R_A, 0, l_match, 0);
+			}
+			break;
+
+		case PCAP_MAP_FILTER_PORT:
+			/*
+			 * Get the transport protocol into A and the
+			 * offset of the transport header into X, for
+			 * IPv4 packets that aren't non-first fragments
+			 * and for IPv6 packets with the transport header
+			 * right after the fixed header.
+			 */
+			emit_jmp(p, BPF_JEQ|BPF_K, R_A, 0, l_ipv4,
+			    ETHERTYPE_IP);
+			emit_jmp(p, EBPF_JNE|BPF_K, R_A, 0, l_nomatch,
+			    ETHERTYPE_IPV6);
+			emit(p, BPF_LD|BPF_B|BPF_ABS, 0, 0, 0,
+			    (bpf_u_int32)(SKF_NET_OFF + 6));
+			emit(p, BPF_ALU|EBPF_MOV|BPF_K, R_X, 0, 0, 40);
+			emit_jmp(p, BPF_JA, 0, 0, l_ports, 0);
+			l_ipv4 = p->len;
+			emit(p, BPF_LD|BPF_H|BPF_ABS, 0, 0, 0,
+			    (bpf_u_int32)(SKF_NET_OFF + 6));
+			emit_jmp(p, BPF_JSET|BPF_K, R_A, 0, l_nomatch, 0x1fff);
+			emit(p, BPF_LD|BPF_B|BPF_ABS, 0, 0, 0,
+			    (bpf_u_int32)SKF_NET_OFF);
+			emit(p, BPF_ALU|BPF_AND|BPF_K, R_A, 0, 0, 0xf);
+			emit(p, BPF_ALU|BPF_LSH|BPF_K, R_A, 0, 0, 2);
+			emit(p, BPF_ALU|EBPF_MOV|BPF_X, R_X, R_A, 0, 0);
+			emit(p, BPF_LD|BPF_B|BPF_ABS, 0, 0, 0,
+			    (bpf_u_int32)(SKF_NET_OFF + 9));
+			l_ports = p->len;
+			emit_jmp(p, BPF_JEQ|BPF_K, R_A, 0, l_key, IPPROTO_TCP);
+			emit_jmp(p, BPF_JEQ|BPF_K, R_A, 0, l_key, IPPROTO_UDP);
+			emit_jmp(p, EBPF_JNE|BPF_K, R_A, 0, l_nomatch,
+			    IPPROTO_SCTP);
+			l_key = p->len;
+			/* source port, then destination port */
+			for (i = 0; i < 2; i++) {
+				emit(p, BPF_LD|BPF_H|BPF_IND, 0, R_X, 0,
+				    (bpf_u_int32)(SKF_NET_OFF + 2*i));
+				emit_lookup(p, mf->map_fd);
+				emit_jmp(p, EBPF_JNE|BPF_K, R_A, 0, l_match, 0);
+			}
+			break;
+		}
+
+		l_nomatch = p->len;
+		if (mf->action == PCAP_MAP_FILTER_DROP) {
+			/* Skip the drop and run the classic program. */
+			emit_jmp(p, BPF_JA, 0, 0, p->len + 3, 0);
+			l_match = p->len;
+		}
+		emit(p, BPF_ALU|EBPF_MOV|BPF_K, R_A, 0, 0, 0);
+		emit(p, BPF_JMP|EBPF_EXIT, 0, 0, 0, 0);
+		if (mf->action == PCAP_MAP_FILTER_ACCEPT)
+			l_match = p->len;
+	}
+}
+
+/*
+ * Emit the equivalent of a load of a classic BPF ancillary data
+ * item into A; returns -1 for items we can't get at from eBPF.
+ */
+static int
+emit_ancillary(struct ebpf_prog *prog, bpf_u_int32 k)
+{
+	switch ((bpf_int32)k - SKF_AD_OFF) {
+
+	case SKF_AD_PROTOCOL:
+		emit_skb_load(prog, R_A, SKB_PROTOCOL);
+		emit(prog, BPF_ALU|EBPF_END|EBPF_TO_BE, R_A, 0, 0, 16);
+		return 0;
+
+	case SKF_AD_PKTTYPE:
+		emit_skb_load(prog, R_A, SKB_PKT_TYPE);
+		return 0;
+
+	case SKF_AD_IFINDEX:
+		emit_skb_load(prog, R_A, SKB_IFINDEX);
+		return 0;
+
+	case SKF_AD_MARK:
+		emit_skb_load(prog, R_A, SKB_MARK);
+		return 0;
+
+	case SKF_AD_QUEUE:
+		emit_skb_load(prog, R_A, SKB_QUEUE_MAPPING);
+		return 0;
+
+	case SKF_AD_RXHASH:
+		emit_skb_load(prog, R_A, SKB_HASH);
+		return 0;
+
+	case SKF_AD_VLAN_TAG:
+		emit_skb_load(prog, R_A, SKB_VLAN_TCI);
+		return 0;
+
+	case SKF_AD_VLAN_TAG_PRESENT:
+		emit_skb_load(prog, R_A, SKB_VLAN_PRESENT);
+		return 0;
+
+	case SKF_AD_VLAN_TPID:
+		emit_skb_load(prog, R_A, SKB_VLAN_PROTO);
+		emit(prog, BPF_ALU|EBPF_END|EBPF_TO_BE, R_A, 0, 0, 16);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Emit the eBPF code for the classic program.  When just counting,
+ * this fills in the eBPF instruction at which each classic instruction
+ * starts, which the jumps then use.  Returns -1 if the program has an
+ * instruction we can't translate.
+ */
+static int
+emit_classic(struct ebpf_prog *prog, const struct bpf_insn *insns,
+    u_int len, u_int *start)
+{
+	const struct bpf_insn *p;
+	u_int i, jt, jf, src, reg, op;
+	bpf_u_int32 k;
+
+	for (i = 0; i < len; i++) {
+		p = &insns[i];
+		if (prog->insns == NULL)
+			start[i] = prog->len;
+		switch (BPF_CLASS(p->code)) {
+
+		case BPF_LD:
+		case BPF_LDX:
+			reg = BPF_CLASS(p->code) == BPF_LD ? R_A : R_X;
+			switch (BPF_MODE(p->code)) {
+
+			case BPF_ABS:
+				if (reg != R_A)
+					return -1;
+				if (p->k >= (bpf_u_int32)SKF_AD_OFF) {
+					if (emit_ancillary(prog, p->k) == -1)
+						return -1;
+					break;
+				}
+				emit(prog, BPF_LD|BPF_ABS|BPF_SIZE(p->code),
+				    0, 0, 0, p->k);
+				break;
+
+			case BPF_IND:
+				if (reg != R_A)
+					return -1;
+				emit(prog, BPF_LD|BPF_IND|BPF_SIZE(p->code),
+				    0, R_X, 0, p->k);
+				break;
+
+			case BPF_MSH:
+				/* X = 4*(P[k:1]&0xf); the load clobbers A */
+				if (reg != R_X || BPF_SIZE(p->code) != BPF_B)
+					return -1;
+				emit(prog, EBPF_ALU64|EBPF_MOV|BPF_X, R_SAVE,
+				    R_A, 0, 0);
+				emit(prog, BPF_LD|BPF_ABS|BPF_B, 0, 0, 0, p->k);
+				emit(prog, BPF_ALU|BPF_AND|BPF_K, R_A, 0, 0, 0xf);
+				emit(prog, BPF_ALU|BPF_LSH|BPF_K, R_A, 0, 0, 2);
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_X, R_X, R_A, 0, 0);
+				emit(prog, EBPF_ALU64|EBPF_MOV|BPF_X, R_A,
+				    R_SAVE, 0, 0);
+				break;
+
+			case BPF_IMM:
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_K, reg, 0, 0,
+				    p->k);
+				break;
+
+			case BPF_MEM:
+				if (p->k >= BPF_MEMWORDS)
+					return -1;
+				emit(prog, BPF_LDX|BPF_W|BPF_MEM, reg,
+				    EBPF_REG_FP, MEM_OFF(p->k), 0);
+				break;
+
+			case BPF_LEN:
+				emit_skb_load(prog, reg, SKB_LEN);
+				break;
+
+			default:
+				return -1;
+			}
+			break;
+
+		case BPF_ST:
+		case BPF_STX:
+			if (p->k >= BPF_MEMWORDS)
+				return -1;
+			reg = BPF_CLASS(p->code) == BPF_ST ? R_A : R_X;
+			emit(prog, BPF_STX|BPF_W|BPF_MEM, EBPF_REG_FP, reg,
+			    MEM_OFF(p->k), 0);
+			break;
+
+		case BPF_ALU:
+			op = BPF_OP(p->code);
+			switch (op) {
+
+			case BPF_NEG:
+				emit(prog, BPF_ALU|BPF_NEG, R_A, 0, 0, 0);
+				continue;
+
+			case BPF_LSH:
+			case BPF_RSH:
+				if (BPF_SRC(p->code) == BPF_K && p->k >= 32)
+					return -1;
+				break;
+
+			case BPF_DIV:
+			case BPF_MOD:
+				if (BPF_SRC(p->code) == BPF_K) {
+					if (p->k == 0)
+						return -1;
+					break;
+				}
+				/*
+				 * Classic BPF drops the packet on a
+				 * division by zero; eBPF yields 0.
+				 */
+				emit_jmp(prog, EBPF_JNE|BPF_K, R_X, 0,
+				    prog->len + 3, 0);
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_A, 0, 0, 0);
+				emit(prog, BPF_JMP|EBPF_EXIT, 0, 0, 0, 0);
+				break;
+
+			case BPF_ADD:
+			case BPF_SUB:
+			case BPF_MUL:
+			case BPF_OR:
+			case BPF_AND:
+			case BPF_XOR:
+				break;
+
+			default:
+				return -1;
+			}
+			if (BPF_SRC(p->code) == BPF_X)
+				emit(prog, BPF_ALU|op|BPF_X, R_A, R_X, 0, 0);
+			else
+				emit(prog, BPF_ALU|op|BPF_K, R_A, 0, 0, p->k);
+			break;
+
+		case BPF_JMP:
+			op = BPF_OP(p->code);
+			if (op == BPF_JA) {
+				if (p->k >= len - i - 1)
+					return -1;
+				emit_jmp(prog, BPF_JA, 0, 0,
+				    start[i + 1 + p->k], 0);
+				break;
+			}
+			if (op != BPF_JEQ && op != BPF_JGT && op != BPF_JGE &&
+			    op != BPF_JSET)
+				return -1;
+			if (p->jt >= len - i - 1 || p->jf >= len - i - 1)
+				return -1;
+			jt = start[i + 1 + p->jt];
+			jf = start[i + 1 + p->jf];
+
+			/*
+			 * eBPF sign-extends immediates to 64 bits, so
+			 * compare against a register for those with the
+			 * top bit set.
+			 */
+			src = BPF_K;
+			reg = 0;
+			k = p->k;
+			if (BPF_SRC(p->code) == BPF_X) {
+				src = BPF_X;
+				reg = R_X;
+				k = 0;
+			} else if ((bpf_int32)k < 0) {
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_TMP, 0, 0, k);
+				src = BPF_X;
+				reg = R_TMP;
+				k = 0;
+			}
+
+			/*
+			 * eBPF conditional jumps fall through if false;
+			 * if the true branch is the next instruction,
+			 * jump on the opposite condition instead.
+			 */
+			if (p->jf == 0)
+				emit_jmp(prog, op|src, R_A, reg, jt, k);
+			else if (p->jt == 0 && op != BPF_JSET) {
+				op = op == BPF_JEQ ? EBPF_JNE :
+				    op == BPF_JGT ? EBPF_JLE : EBPF_JLT;
+				emit_jmp(prog, op|src, R_A, reg, jf, k);
+			} else {
+				emit_jmp(prog, op|src, R_A, reg, jt, k);
+				emit_jmp(prog, BPF_JA, 0, 0, jf, 0);
+			}
+			break;
+
+		case BPF_RET:
+			switch (BPF_RVAL(p->code)) {
+
+			case BPF_K:
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_A, 0, 0,
+				    p->k);
+				break;
+
+			case BPF_X:
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_X, R_A, R_X,
+				    0, 0);
+				break;
+
+			case BPF_A:
+				break;
+
+			default:
+				return -1;
+			}
+			emit(prog, BPF_JMP|EBPF_EXIT, 0, 0, 0, 0);
+			break;
+
+		case BPF_MISC:
+			switch (BPF_MISCOP(p->code)) {
+
+			case BPF_TAX:
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_X, R_X, R_A,
+				    0, 0);
+				break;
+
+			case BPF_TXA:
+				emit(prog, BPF_ALU|EBPF_MOV|BPF_X, R_A, R_X,
+				    0, 0);
+				break;
+
+			default:
+				return -1;
+			}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Emit the whole program: set up the registers, check the map, if
+ * there is one, clear the scratch memory that the classic program
+ * loads from or stores to, as the verifier insists on it, and run the classic program,
+ * or accept the packet if there is none.
+ */
+static int
+emit_program(struct ebpf_prog *prog, const struct bpf_insn *insns,
+    u_int len, const struct ebpf_map_filter *mf, u_int *start)
+{
+	u_int i, used;
+
+	emit(prog, EBPF_ALU64|EBPF_MOV|BPF_X, R_CTX, R_ARG1, 0, 0);
+	if (mf != NULL && mf->map_fd != -1)
+		emit_map_filter(prog, mf);
+	if (len == 0) {
+		emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_A, 0, 0, 0xffffffffU);
+		emit(prog, BPF_JMP|EBPF_EXIT, 0, 0, 0, 0);
+		return 0;
+	}
+	emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_A, 0, 0, 0);
+	emit(prog, BPF_ALU|EBPF_MOV|BPF_K, R_X, 0, 0, 0);
+	used = 0;
+	for (i = 0; i < len; i++) {
+		switch (BPF_CLASS(insns[i].code)) {
+
+		case BPF_LD:
+		case BPF_LDX:
+			/*
+			 * The program may load a word before storing to
+			 * it; the verifier rejects that unless the word
+			 * has been initialized.
+			 */
+			if (BPF_MODE(insns[i].code) == BPF_MEM &&
+			    insns[i].k < BPF_MEMWORDS)
+				used |= 1U << insns[i].k;
+			break;
+
+		case BPF_ST:
+		case BPF_STX:
+			if (insns[i].k < BPF_MEMWORDS)
+				used |= 1U << insns[i].k;
+			break;
+		}
+	}
+	for (i = 0; i < BPF_MEMWORDS; i++) {
+		if (used & (1U << i))
+			emit(prog, BPF_ST|BPF_W|BPF_MEM, EBPF_REG_FP, 0,
+			    MEM_OFF(i), 0);
+	}
+	return emit_classic(prog, insns, len, start);
+}
+
+/*
+ * Load a classic BPF program, or no program if len is 0, as an eBPF
+ * socket filter, checking packets against the map first if mf isn't
+ * null, and return its descriptor.
+ *
+ * Returns -1, with errno set, if that fails; errno is EOPNOTSUPP if
+ * the program has instructions we can't translate, in which case the
+ * caller can attach a program without the classic part and filter in
+ * userland.
+ */
+int
+pcap_ebpf_load_socket_filter(const struct bpf_insn *insns, u_int len,
+    const struct ebpf_map_filter *mf, char *errbuf)
+{
+	struct ebpf_prog prog;
+	u_int *start = NULL;
+	union ebpf_attr attr;
+	static const char license[] = "BSD";
+	int fd, save_errno;
+
+	if (len != 0) {
+		start = calloc(len, sizeof(*start));
+		if (start == NULL) {
+			pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+			    errno, "malloc");
+			return (-1);
+		}
+	}
+
+	/*
+	 * Count the instructions, and find out where each classic
+	 * instruction starts, then emit them.
+	 */
+	prog.insns = NULL;
+	prog.len = 0;
+	prog.bad_jump = 0;
+	if (emit_program(&prog, insns, len, mf, start) == -1) {
+		free(start);
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "Filter can't be translated to eBPF");
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	prog.insns = calloc(prog.len, sizeof(*prog.insns));
+	if (prog.insns == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(start);
+		return (-1);
+	}
+	prog.len = 0;
+	(void)emit_program(&prog, insns, len, mf, start);
+	free(start);
+	if (prog.bad_jump) {
+		free(prog.insns);
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "Filter is too large to be translated to eBPF");
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog.prog_type = EBPF_PROG_TYPE_SOCKET_FILTER;
+	attr.prog.insns = (__u64)(unsigned long)prog.insns;
+	attr.prog.insn_cnt = prog.len;
+	attr.prog.license = (__u64)(unsigned long)license;
+	fd = pcap_sys_bpf(EBPF_PROG_LOAD, &attr);
+	save_errno = errno;
+	free(prog.insns);
+	if (fd == -1) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    save_errno, "Can't load eBPF socket filter");
+		errno = save_errno;
+		return (-1);
+	}
+	return (fd);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Linux eBPF support shared by the capture modules.
+ *
+ * We can't include <linux/bpf.h>, as its struct bpf_insn clashes with
+ * ours, so define the bits of the bpf() system call interface that we
+ * use here.
+ */
+
+#include <linux/types.h>
+
+#define EBPF_MAP_CREATE		0
+#define EBPF_MAP_LOOKUP_ELEM	1
+#define EBPF_MAP_UPDATE_ELEM	2
+#define EBPF_MAP_DELETE_ELEM	3
+#define EBPF_PROG_LOAD		5
+
+#define EBPF_MAP_TYPE_HASH	1
+#define EBPF_PROG_TYPE_SOCKET_FILTER	1
+#define EBPF_ANY		0
+#define EBPF_PSEUDO_MAP_FD	1
+#define EBPF_FUNC_map_lookup_elem	1
+
+/*
+ * Instruction fields that classic BPF doesn't have; the rest of the
+ * encoding is shared with it.
+ */
+#define EBPF_ALU64		0x07
+#define EBPF_DW			0x18
+#define EBPF_MOV		0xb0
+#define EBPF_END		0xd0
+#define EBPF_TO_BE		0x08
+#define EBPF_JNE		0x50
+#define EBPF_JLT		0xa0
+#define EBPF_JLE		0xb0
+#define EBPF_CALL		0x80
+#define EBPF_EXIT		0x90
+
+#define EBPF_REG_FP		10	/* read-only frame pointer */
+
+struct ebpf_insn {
+	__u8	code;
+	__u8	dst_reg:4;
+	__u8	src_reg:4;
+	__s16	off;
+	__s32	imm;
+};
+
+union ebpf_attr {
+	struct {	/* EBPF_MAP_CREATE */
+		__u32	map_type;
+		__u32	key_size;
+		__u32	value_size;
+		__u32	max_entries;
+		__u32	map_flags;
+	} map;
+	struct {	/* EBPF_MAP_{LOOKUP,UPDATE,DELETE}_ELEM */
+		__u32	map_fd;
+		__u64	key __attribute__((aligned(8)));
+		__u64	value;
+		__u64	flags;
+	} elem;
+	struct {	/* EBPF_PROG_LOAD */
+		__u32	prog_type;
+		__u32	insn_cnt;
+		__u64	insns __attribute__((aligned(8)));
+		__u64	license;
+		__u32	log_level;
+		__u32	log_size;
+		__u64	log_buf;
+		__u32	kern_version;
+	} prog;
+	u_char	pad[128];
+};
+
+/*
+ * How a socket filter program checks packets against a map of keys
+ * before running the classic filter; see pcap_set_map_filter_linux().
+ */
+struct ebpf_map_filter {
+	int	map_fd;		/* hash map of keys, or -1 if none */
+	int	key_type;	/* PCAP_MAP_FILTER_ key type */
+	int	action;		/* PCAP_MAP_FILTER_ action for keys in the map */
+};
+
+int	pcap_sys_bpf(int cmd, union ebpf_attr *attr);
+int	pcap_ebpf_load_socket_filter(const struct bpf_insn *insns, u_int len,
+	    const struct ebpf_map_filter *mf, char *errbuf);
@@ -173,6 +173,19 @@ struct pcap_opt {
 	 */
 #ifdef __linux__
 	int	protocol;	/* protocol to use when creating PF_PACKET socket */
+	int	fanout_enabled;	/* join a PACKET_FANOUT group when activated */
+	u_int	fanout_group;	/* PACKET_FANOUT group ID */
+	u_int	fanout_mode;	/* PACKET_FANOUT_ mode ORed with PACKET_FANOUT_FLAG_ flags */
+	struct pcap_ring_params_linux ring_params; /* requested ring geometry; 0 fields mean "default" */
+	int	tx_ring_size;	/* size of the PACKET_TX_RING, in bytes; 0 means don't use one */
+	int	vlan_metadata;	/* supply VLAN tags as metadata rather than in the packet */
+	int	rx_metadata;	/* supply the kernel's per-packet information as metadata */
+	u_int	busy_poll_usec;	/* spin this long waiting for packets before sleeping; 0 means don't */
+	int	kernel_busy_poll; /* have the kernel busy-poll the device as well */
+	int	map_filter_key_type; /* PCAP_MAP_FILTER_ key type; 0 means no map filter */
+	int	map_filter_action; /* PCAP_MAP_FILTER_ action for keys in the map */
+	u_int	map_filter_max_entries; /* maximum number of keys in the map */
+	int	xdp_divert;	/* let an xdp: device take its queue's packets from the stack */
 #endif
 #ifdef _WIN32
 	int	nocapture_local;/* disable NPF loopback */
@@ -192,6 +205,9 @@ typedef int	(*getnonblock_op_t)(pcap_t *);
 typedef int	(*setnonblock_op_t)(pcap_t *, int);
 typedef int	(*stats_op_t)(pcap_t *, struct pcap_stat *);
 typedef void	(*breakloop_op_t)(pcap_t *);
+typedef int	(*next_batch_op_t)(pcap_t *, struct pcap_pkt_batch *, int);
+typedef void	(*release_batch_op_t)(pcap_t *);
+typedef u_int	(*sendqueue_transmit_op_t)(pcap_t *, pcap_send_queue *, int);
 #ifdef _WIN32
 typedef struct pcap_stat *(*stats_ex_op_t)(pcap_t *, int *);
 typedef int	(*setbuff_op_t)(pcap_t *, int);
@@ -200,7 +216,6 @@ typedef int	(*setmintocopy_op_t)(pcap_t *, int);
 typedef HANDLE	(*getevent_op_t)(pcap_t *);
 typedef int	(*oid_get_request_op_t)(pcap_t *, bpf_u_int32, void *, size_t *);
 typedef int	(*oid_set_request_op_t)(pcap_t *, bpf_u_int32, const void *, size_t *);
-typedef u_int	(*sendqueue_transmit_op_t)(pcap_t *, pcap_send_queue *, int);
 typedef int	(*setuserbuffer_op_t)(pcap_t *, int);
 typedef int	(*live_dump_op_t)(pcap_t *, char *, int, int);
 typedef int	(*live_dump_ended_op_t)(pcap_t *, int);
@@ -212,6 +227,16 @@ typedef int	(*cleanup_interface_op_t)(const char *, char *);
 typedef int	(*send_multiple_op_t)(const char *, const struct pcap_pkthdr **, int);
 #endif /* __APPLE__ */
     
+/*
+ * A filter program translated into native code by pcap_jit_compile();
+ * the function takes the same packet arguments as pcap_filter().
+ */
+typedef u_int	(*bpf_jit_func)(const u_char *, u_int, u_int);
+struct bpf_jit {
+	bpf_jit_func func;	/* NULL if the program is interpreted */
+	size_t size;		/* size of the code's mapping */
+};
+
 /*
  * We put all the stuff used in the read code path at the beginning,
  * to try to keep it together in the same cache line or lines.
@@ -311,6 +336,13 @@ struct pcap {
 	 * Placeholder for filter code if bpf not in kernel.
 	 */
 	struct bpf_program fcode;
+	struct bpf_jit fcode_jit;	/* fcode as native code, if possible */
+	struct bpf_decoded *fcode_decoded; /* fcode pre-decoded, if not */
+	struct pcap_filter_profile *fcode_profile; /* counts for fcode, if profiling */
+	bpf_u_int32 fcode_maxoff;	/* packet bytes fcode can look at */
+	struct pcap_filter_cache *fcode_cache; /* verdicts of fcode, if cached */
+	int fcode_cache_size;		/* entries to cache verdicts in, or 0 */
+	int fcode_in_kernel;		/* filter is run by the kernel, not fcode */
 
 	char errbuf[PCAP_ERRBUF_SIZE + 1];
 #ifdef _WIN32
@@ -324,6 +356,7 @@ struct pcap {
 	u_int *tstamp_precision_list;
 
 	struct pcap_pkthdr pcap_header;	/* This is needed for the pcap_next_ex() to work */
+	struct pcap_pkt_metadata pkt_meta; /* metadata for the last packet supplied */
 
 	/*
 	 * More methods.
@@ -339,6 +372,9 @@ struct pcap {
 	setnonblock_op_t setnonblock_op;
 	stats_op_t stats_op;
 	breakloop_op_t breakloop_op;
+	next_batch_op_t next_batch_op;
+	release_batch_op_t release_batch_op;
+	sendqueue_transmit_op_t sendqueue_transmit_op;
 
 	/*
 	 * Routine to use as callback for pcap_next()/pcap_next_ex().
@@ -357,7 +393,6 @@ struct pcap {
 	getevent_op_t getevent_op;
 	oid_get_request_op_t oid_get_request_op;
 	oid_set_request_op_t oid_set_request_op;
-	sendqueue_transmit_op_t sendqueue_transmit_op;
 	setuserbuffer_op_t setuserbuffer_op;
 	live_dump_op_t live_dump_op;
 	live_dump_ended_op_t live_dump_ended_op;
@@ -576,6 +611,11 @@ void	pcap_remove_from_pcaps_to_close(pcap_t *);
 void	pcap_cleanup_live_common(pcap_t *);
 int	pcap_check_activated(pcap_t *);
 void	pcap_breakloop_common(pcap_t *);
+int	pcap_next_batch_common(pcap_t *, struct pcap_pkt_batch *, int);
+void	pcap_release_batch_common(pcap_t *);
+void	pcap_copy_pkt_metadata(struct pcap_pkt_batch *, int,
+    const struct pcap_pkt_metadata *);
+u_int	pcap_sendqueue_transmit_common(pcap_t *, pcap_send_queue *, int);
 
 /*
  * Internal interfaces for "pcap_findalldevs()".
@@ -703,11 +743,128 @@ u_int	pcap_filter_with_aux_data(const struct bpf_insn *,
  */
 u_int	pcap_filter(const struct bpf_insn *, const u_char *, u_int, u_int);
 
+/*
+ * Filtering routine that also counts, in a profile, the instructions
+ * executed and the branches taken.
+ */
+u_int	pcap_filter_profile(const struct bpf_insn *, const u_char *, u_int,
+    u_int, const struct pcap_bpf_aux_data *, struct pcap_filter_profile *);
+
+/*
+ * Routines to pre-decode a validated BPF program into a form that's
+ * faster to interpret, to run it, with the same results as
+ * pcap_filter_with_aux_data(), and to free it.  pcap_predecode_filter()
+ * returns NULL on failure, in which case the program should be run by
+ * pcap_filter_with_aux_data().
+ */
+struct bpf_decoded;
+struct bpf_decoded *pcap_predecode_filter(const struct bpf_insn *, u_int);
+u_int	pcap_filter_predecoded(const struct bpf_decoded *, const u_char *,
+    u_int, u_int, const struct pcap_bpf_aux_data *);
+void	pcap_free_predecoded(struct bpf_decoded *);
+
+/*
+ * A run of loads of packet data that all lie within 16 bytes of each
+ * other, each followed by an optional "and" with a constant and by a
+ * "jeq" with a constant that goes on to the next load if equal and
+ * to a common instruction if not, as generated to compare IPv6 and
+ * MAC addresses.  bpf_lower_wide() finds these runs, and the
+ * pre-decoded interpreter does each of them as a single 64-bit or
+ * 128-bit comparison of masked packet data, falling back on doing the
+ * loads one at a time if not all of the data was captured.
+ */
+#define BPF_WIDE_MAX_LOADS	16
+
+struct bpf_wide_load {
+	bpf_u_int32 k;		/* offset */
+	u_int	size;		/* 1, 2 or 4 bytes */
+	bpf_u_int32 mask;	/* constant it's ANDed with, if any */
+	bpf_u_int32 val;	/* constant it must be equal to */
+};
+
+struct bpf_wide_cmp {
+	u_int	start;		/* index of the first load */
+	u_int	len;		/* number of instructions in the run */
+	u_int	jt;		/* instruction to go to if all are equal */
+	u_int	jf;		/* instruction to go to if any aren't */
+	int	ind;		/* the loads are relative to the X register */
+	bpf_u_int32 off;	/* offset of the data compared */
+	u_int	width;		/* 8 or 16 bytes */
+	uint64_t mask[2];	/* bits compared, big-endian */
+	uint64_t val[2];	/* and the values they must have */
+	u_int	nloads;
+	struct bpf_wide_load loads[BPF_WIDE_MAX_LOADS];	/* in order */
+};
+
+int	bpf_lower_wide(const struct bpf_insn *, u_int, struct bpf_wide_cmp **);
+
 /*
  * Routine to validate a BPF program.
  */
 int	pcap_validate_filter(const struct bpf_insn *, int);
 
+/*
+ * Routines to translate a validated BPF program into native code, and
+ * to free the result; pcap_jit_compile() returns -1, leaving the
+ * program to be interpreted, if the program or platform isn't
+ * supported.
+ */
+int	pcap_jit_compile(struct bpf_jit *, const struct bpf_insn *, u_int);
+void	pcap_jit_free(struct bpf_jit *);
+
+/*
+ * The packet data a filter program's verdict depends on, as worked
+ * out by bpf_verdict_key(): "len" bytes at offset "off" into the
+ * packet or, if "msh" isn't -1, at offset "off" past the header
+ * whose length is 4*(pkt[msh]&0xf).
+ */
+struct bpf_key_slot {
+	bpf_u_int32 off;
+	u_int	len;
+	int	msh;
+};
+
+int	bpf_verdict_key(const struct bpf_program *, struct bpf_key_slot **,
+    char *);
+
+/*
+ * Routines to create a cache of the verdicts of a filter program,
+ * keyed on the packet data they depend on, to free it, and to run
+ * the filter installed in a pcap_t on a packet, looking the verdict
+ * up in the pcap_t's cache first.  pcap_filter_cache_create() returns
+ * 0 and sets the cache pointer, to NULL, with errbuf saying why, if the
+ * program's verdicts can't be cached; it returns -1, with errbuf saying
+ * why, on an error.
+ */
+struct pcap_filter_cache;
+int	pcap_filter_cache_create(const struct bpf_program *, u_int,
+    struct pcap_filter_cache **, char *);
+void	pcap_filter_cache_free(struct pcap_filter_cache *);
+u_int	pcap_filter_cached(pcap_t *, const u_char *, u_int, u_int);
+
+/*
+ * Run the filter installed in a pcap_t on a packet, counting what it
+ * does if it's being profiled, otherwise looking its verdict up in
+ * the pcap_t's verdict cache if it has one, otherwise as native code
+ * if it was translated, otherwise in pre-decoded form if it was
+ * pre-decoded.
+ */
+#define pcap_run_filter(p, pkt, wirelen, buflen) \
+	((p)->fcode_profile != NULL ? \
+	    pcap_filter_profile((p)->fcode.bf_insns, (pkt), (wirelen), \
+	    (buflen), NULL, (p)->fcode_profile) : \
+	 (p)->fcode_cache != NULL ? \
+	    pcap_filter_cached((p), (pkt), (wirelen), (buflen)) : \
+	    pcap_run_filter_uncached((p), (pkt), (wirelen), (buflen)))
+
+#define pcap_run_filter_uncached(p, pkt, wirelen, buflen) \
+	((p)->fcode_jit.func != NULL ? \
+	    (p)->fcode_jit.func((pkt), (wirelen), (buflen)) : \
+	 (p)->fcode_decoded != NULL ? \
+	    pcap_filter_predecoded((p)->fcode_decoded, (pkt), (wirelen), \
+	    (buflen), NULL) : \
+	    pcap_filter((p)->fcode.bf_insns, (pkt), (wirelen), (buflen)))
+
 /*
  * Internal interfaces for both "pcap_create()" and routines that
  * open savefiles.
@@ -718,6 +875,7 @@ int	pcap_validate_filter(const struct bpf_insn *, int);
 void	pcap_oneshot(u_char *, const struct pcap_pkthdr *, const u_char *);
 
 int	install_bpf_program(pcap_t *, struct bpf_program *);
+void	uninstall_bpf_program(pcap_t *);
 
 int	pcap_strcasecmp(const char *, const char *);
 
@@ -81,6 +81,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -142,6 +143,12 @@
 #include <linux/types.h>
 #include <linux/filter.h>
 
+#include "pcap-ebpf-linux.h"
+
+#ifndef SO_ATTACH_BPF
+#define SO_ATTACH_BPF	50
+#endif
+
 #ifdef HAVE_LINUX_NET_TSTAMP_H
 #include <linux/net_tstamp.h>
 #endif
@@ -198,14 +205,28 @@ struct pcap_linux {
 	u_char	*mmapbuf;	/* memory-mapped region pointer */
 	size_t	mmapbuflen;	/* size of region */
 	int	vlan_offset;	/* offset at which to insert vlan tags; if -1, don't insert */
+	int	vlan_metadata;	/* supply vlan tags as metadata rather than inserting them */
+	int	rx_metadata;	/* supply the ring's per-packet information as metadata */
 	u_int	tp_version;	/* version of tpacket_hdr for mmaped ring */
 	u_int	tp_hdrlen;	/* hdrlen of tpacket_hdr for mmaped ring */
+	struct pcap_ring_params_linux ring_params; /* geometry of the ring we created */
+	u_char	*tx_ring;	/* memory-mapped PACKET_TX_RING, or NULL if none */
+	u_int	tx_block_size;	/* size of a block in the tx ring */
+	u_int	tx_frame_size;	/* size of a frame in the tx ring */
+	u_int	tx_frames_per_block; /* number of frames in a tx ring block */
+	u_int	tx_frame_nr;	/* number of frames in the tx ring */
+	u_int	tx_offset;	/* index of the next tx ring frame to fill */
 	u_char	*oneshot_buffer; /* buffer for copy of packet */
 	int	poll_timeout;	/* timeout to use in poll() */
+	u_int	busy_poll_usec;	/* how long to spin on the ring before poll(); 0 means don't */
+	struct pcap_busy_poll_stats_linux busy_poll_stats; /* how the waits were satisfied */
+	struct ebpf_map_filter map_filter; /* map checked by the socket filter */
 #ifdef HAVE_TPACKET3
 	unsigned char *current_packet; /* Current packet within the TPACKET_V3 block. Move to next block if NULL. */
 	int packets_left; /* Unhandled packets left within the block from previous call to pcap_read_linux_mmap_v3 in case of TPACKET_V3. */
 #endif
+	int	batch_first;	/* ring offset of the first frame or block held by pcap_next_batch() */
+	int	batch_held;	/* number of frames or blocks held by pcap_next_batch() */
 	int poll_breakloop_fd; /* fd to an eventfd to break from blocking operations */
 };
 
@@ -226,6 +247,7 @@ static int activate_pf_packet(pcap_t *, int);
 static int setup_mmapped(pcap_t *, int *);
 static int pcap_can_set_rfmon_linux(pcap_t *);
 static int pcap_inject_linux(pcap_t *, const void *, int);
+static u_int pcap_sendqueue_transmit_linux(pcap_t *, pcap_send_queue *, int);
 static int pcap_stats_linux(pcap_t *, struct pcap_stat *);
 static int pcap_setfilter_linux(pcap_t *, struct bpf_program *);
 static int pcap_setdirection_linux(pcap_t *, pcap_direction_t);
@@ -245,11 +267,17 @@ union thdr {
 
 static void destroy_ring(pcap_t *handle);
 static int create_ring(pcap_t *handle, int *status);
+static size_t create_tx_ring(pcap_t *handle, int *status);
 static int prepare_tpacket_socket(pcap_t *handle);
 static int pcap_read_linux_mmap_v2(pcap_t *, int, pcap_handler , u_char *);
 #ifdef HAVE_TPACKET3
 static int pcap_read_linux_mmap_v3(pcap_t *, int, pcap_handler , u_char *);
 #endif
+static int pcap_next_batch_linux_mmap_v2(pcap_t *, struct pcap_pkt_batch *, int);
+#ifdef HAVE_TPACKET3
+static int pcap_next_batch_linux_mmap_v3(pcap_t *, struct pcap_pkt_batch *, int);
+#endif
+static void pcap_release_batch_linux(pcap_t *);
 static int pcap_setnonblock_linux(pcap_t *p, int nonblock);
 static int pcap_getnonblock_linux(pcap_t *p);
 static void pcap_oneshot_linux(u_char *user, const struct pcap_pkthdr *h,
@@ -316,6 +344,9 @@ static int	iface_get_id(int fd, const char *device, char *ebuf);
 static int	iface_get_mtu(int fd, const char *device, char *ebuf);
 static int 	iface_get_arptype(int fd, const char *device, char *ebuf);
 static int 	iface_bind(int fd, int ifindex, char *ebuf, int protocol);
+static int	iface_set_fanout(pcap_t *handle);
+static int	iface_set_busy_poll(pcap_t *handle);
+static int	iface_set_map_filter(pcap_t *handle);
 static int	enter_rfmon_mode(pcap_t *handle, int sock_fd,
     const char *device);
 #if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(PACKET_TIMESTAMP)
@@ -328,6 +359,8 @@ static int	fix_program(pcap_t *handle, struct sock_fprog *fcode);
 static int	fix_offset(pcap_t *handle, struct bpf_insn *p);
 static int	set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode);
 static int	reset_kernel_filter(pcap_t *handle);
+static int	attach_ebpf_filter(pcap_t *handle, const struct bpf_insn *insns,
+    u_int len);
 
 static struct sock_filter	total_insn
 	= BPF_STMT(BPF_RET | BPF_K, 0);
@@ -379,6 +412,7 @@ pcap_create_interface(const char *device, char *ebuf)
 
 	struct pcap_linux *handlep = handle->priv;
 	handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK);
+	handlep->map_filter.map_fd = -1;
 
 	return handle;
 }
@@ -845,6 +879,11 @@ static void	pcap_cleanup_linux( pcap_t *handle )
 		handlep->device = NULL;
 	}
 
+	if (handlep->map_filter.map_fd != -1) {
+		close(handlep->map_filter.map_fd);
+		handlep->map_filter.map_fd = -1;
+	}
+
 	close(handlep->poll_breakloop_fd);
 	pcap_cleanup_live_common(handle);
 }
@@ -1045,6 +1084,26 @@ pcap_activate_linux(pcap_t *handle)
 		status = ret;
 		goto fail;
 	}
+
+	/*
+	 * If we were asked to supply VLAN tags as metadata, rather
+	 * than putting them back into the packet, make sure the filter
+	 * code will look for them where the kernel leaves them, in the
+	 * auxiliary data; if it won't, fall back on reinserting them,
+	 * as the "vlan" filter primitives would otherwise stop working.
+	 */
+	handlep->rx_metadata = handle->opt.rx_metadata;
+	handlep->vlan_metadata = 0;
+	if (handle->opt.vlan_metadata) {
+		if (handle->bpf_codegen_flags & BPF_SPECIAL_VLAN_HANDLING)
+			handlep->vlan_metadata = 1;
+		else if (status == 0) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "This kernel doesn't support VLAN tag filtering on auxiliary data; VLAN tags will be put into the packets");
+			status = PCAP_WARNING;
+		}
+	}
+
 	/*
 	 * Success.
 	 * Try to set up memory-mapped access.
@@ -1076,7 +1135,43 @@ pcap_activate_linux(pcap_t *handle)
 		goto fail;
 	}
 
+	/*
+	 * If we were asked to join a fanout group, do so; the kernel
+	 * only lets a socket join a group once it's bound with a
+	 * non-zero protocol, so this has to come after the bind.
+	 */
+	if (handle->opt.fanout_enabled) {
+		if ((status2 = iface_set_fanout(handle)) != 0) {
+			status = status2;
+			goto fail;
+		}
+	}
+
+	/*
+	 * If we were asked to busy-poll, set up the socket for it.
+	 */
+	handlep->busy_poll_usec = handle->opt.busy_poll_usec;
+	if (handle->opt.kernel_busy_poll) {
+		if ((status2 = iface_set_busy_poll(handle)) != 0) {
+			status = status2;
+			goto fail;
+		}
+	}
+
+	/*
+	 * If we were asked to check packets against a map, create
+	 * the map and attach a socket filter that does just that;
+	 * filters set later are added to it.
+	 */
+	if (handle->opt.map_filter_key_type != 0) {
+		if ((status2 = iface_set_map_filter(handle)) != 0) {
+			status = status2;
+			goto fail;
+		}
+	}
+
 	handle->inject_op = pcap_inject_linux;
+	handle->sendqueue_transmit_op = pcap_sendqueue_transmit_linux;
 	handle->setfilter_op = pcap_setfilter_linux;
 	handle->setdirection_op = pcap_setdirection_linux;
 	handle->set_datalink_op = pcap_set_datalink_linux;
@@ -1090,13 +1185,16 @@ pcap_activate_linux(pcap_t *handle)
 
 	case TPACKET_V2:
 		handle->read_op = pcap_read_linux_mmap_v2;
+		handle->next_batch_op = pcap_next_batch_linux_mmap_v2;
 		break;
 #ifdef HAVE_TPACKET3
 	case TPACKET_V3:
 		handle->read_op = pcap_read_linux_mmap_v3;
+		handle->next_batch_op = pcap_next_batch_linux_mmap_v3;
 		break;
 #endif
 	}
+	handle->release_batch_op = pcap_release_batch_linux;
 	handle->oneshot_callback = pcap_oneshot_linux;
 	handle->selectable_fd = handle->fd;
 
@@ -1213,6 +1311,152 @@ device_still_exists(pcap_t *handle)
 	return (1);
 }
 
+/*
+ * Helpers for the PACKET_TX_RING.
+ */
+#define TX_RING_GET_FRAME(handlep, i) \
+	((handlep)->tx_ring + \
+	 ((i) / (handlep)->tx_frames_per_block) * (handlep)->tx_block_size + \
+	 ((i) % (handlep)->tx_frames_per_block) * (handlep)->tx_frame_size)
+
+static inline __u32 *
+tx_frame_status(struct pcap_linux *handlep, u_char *frame)
+{
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3)
+		return &((struct tpacket3_hdr *)frame)->tp_status;
+#endif
+	return &((struct tpacket2_hdr *)frame)->tp_status;
+}
+
+/*
+ * The kernel sets a frame's status to TP_STATUS_WRONG_FORMAT if it
+ * couldn't send the packet in it; report that, and hand the frame
+ * back so that it can be reused.
+ */
+static int
+tx_frame_rejected(pcap_t *handle, __u32 *status)
+{
+	__atomic_store_n(status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+	pcap_strlcpy(handle->errbuf,
+	    "The kernel rejected a packet in the tx ring as malformed",
+	    PCAP_ERRBUF_SIZE);
+	return -1;
+}
+
+/*
+ * Copy a packet into the next frame of the tx ring and mark it as
+ * ready to be sent; it's sent by the next tx_ring_flush().
+ *
+ * Returns 1 if the packet was put into the ring, 0 if the ring is
+ * full, and -1 on error, including the kernel having rejected the
+ * packet previously put into that frame.
+ */
+static int
+tx_ring_put(pcap_t *handle, const void *buf, u_int size)
+{
+	struct pcap_linux *handlep = handle->priv;
+	u_int data_offset = TPACKET_ALIGN(handlep->tp_hdrlen);
+	u_char *frame;
+	__u32 *status;
+
+	frame = TX_RING_GET_FRAME(handlep, handlep->tx_offset);
+	status = tx_frame_status(handlep, frame);
+	switch (__atomic_load_n(status, __ATOMIC_ACQUIRE)) {
+
+	case TP_STATUS_AVAILABLE:
+		break;
+
+	case TP_STATUS_WRONG_FORMAT:
+		return tx_frame_rejected(handle, status);
+
+	default:
+		/* still owned by the kernel */
+		return 0;
+	}
+
+	if (size > handlep->tx_frame_size - data_offset) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Packet of %u bytes is too large for the tx ring frame size of %u",
+		    size, handlep->tx_frame_size - data_offset);
+		return -1;
+	}
+	memcpy(frame + data_offset, buf, size);
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3) {
+		((struct tpacket3_hdr *)frame)->tp_len = size;
+		((struct tpacket3_hdr *)frame)->tp_next_offset = 0;
+	} else
+#endif
+		((struct tpacket2_hdr *)frame)->tp_len = size;
+	__atomic_store_n(status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	if (++handlep->tx_offset >= handlep->tx_frame_nr)
+		handlep->tx_offset = 0;
+	return 1;
+}
+
+/*
+ * Have the kernel send all the frames in the tx ring that are marked
+ * as ready to be sent.
+ */
+static int
+tx_ring_flush(pcap_t *handle)
+{
+	if (send(handle->fd, NULL, 0, 0) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "send");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send what's in the tx ring, and wait until frame i is handed back
+ * to us.  Returns -1 if that fails or if the kernel rejected the
+ * packet in that frame.
+ */
+static int
+tx_ring_wait_frame(pcap_t *handle, u_int i)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct pollfd pollinfo;
+	__u32 *status;
+
+	if (tx_ring_flush(handle) == -1)
+		return -1;
+	status = tx_frame_status(handlep, TX_RING_GET_FRAME(handlep, i));
+	pollinfo.fd = handle->fd;
+	pollinfo.events = POLLOUT;
+	for (;;) {
+		switch (__atomic_load_n(status, __ATOMIC_ACQUIRE)) {
+
+		case TP_STATUS_AVAILABLE:
+			return 0;
+
+		case TP_STATUS_WRONG_FORMAT:
+			return tx_frame_rejected(handle, status);
+		}
+		if (poll(&pollinfo, 1, -1) == -1 && errno != EINTR) {
+			pcap_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "can't poll on packet socket");
+			return -1;
+		}
+	}
+}
+
+/*
+ * The tx ring is full; send what's in it, and wait until the next
+ * frame we'd fill is handed back to us.
+ */
+static int
+tx_ring_wait(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+
+	return tx_ring_wait_frame(handle, handlep->tx_offset);
+}
+
 static int
 pcap_inject_linux(pcap_t *handle, const void *buf, int size)
 {
@@ -1243,6 +1487,26 @@ pcap_inject_linux(pcap_t *handle, const void *buf, int size)
 		return (-1);
 	}
 
+	if (handlep->tx_ring != NULL) {
+		/*
+		 * Once there's a tx ring, the kernel ignores the data
+		 * handed to send() and sends what's in the ring, so
+		 * we have to go through the ring.
+		 */
+		for (;;) {
+			ret = tx_ring_put(handle, buf, size);
+			if (ret == -1)
+				return (-1);
+			if (ret == 1)
+				break;
+			if (tx_ring_wait(handle) == -1)
+				return (-1);
+		}
+		if (tx_ring_flush(handle) == -1)
+			return (-1);
+		return (size);
+	}
+
 	ret = (int)send(handle->fd, buf, size, 0);
 	if (ret == -1) {
 		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
@@ -1252,6 +1516,124 @@ pcap_inject_linux(pcap_t *handle, const void *buf, int size)
 	return (ret);
 }
 
+/*
+ * Transmit a send queue.  If we have a tx ring, and don't have to
+ * reproduce the packets' timing, fill the ring with as many packets
+ * as it holds and have the kernel send them all with one send();
+ * otherwise, send them one at a time.
+ *
+ * As with pcap_sendqueue_transmit_common(), the return value is the
+ * number of bytes of the queue that were sent; a packet only counts
+ * once the kernel has handed its frame back, so we wait for all the
+ * frames we filled before returning.
+ */
+static u_int
+pcap_sendqueue_transmit_linux(pcap_t *handle, pcap_send_queue *queue, int sync)
+{
+	struct pcap_linux *handlep = handle->priv;
+	struct pcap_pkthdr hdr;
+	u_int off, done, pending, i;
+	u_int *ends;
+	__u32 *status;
+	int stop, ret;
+
+	if (handlep->tx_ring == NULL || sync)
+		return (pcap_sendqueue_transmit_common(handle, queue, sync));
+
+	/*
+	 * For each frame we fill, the offset in the queue just past
+	 * the packet in it.
+	 */
+	ends = malloc(handlep->tx_frame_nr * sizeof(*ends));
+	if (ends == NULL) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		return (0);
+	}
+
+	off = 0;
+	done = 0;
+	pending = 0;
+	stop = 0;
+	for (;;) {
+		/*
+		 * The kernel sends the frames in ring order, so count
+		 * the ones it has handed back, oldest first; if it
+		 * rejected one, nothing after it counts.
+		 */
+		while (pending != 0) {
+			i = (handlep->tx_offset + handlep->tx_frame_nr - pending) %
+			    handlep->tx_frame_nr;
+			status = tx_frame_status(handlep,
+			    TX_RING_GET_FRAME(handlep, i));
+			switch (__atomic_load_n(status, __ATOMIC_ACQUIRE)) {
+
+			case TP_STATUS_AVAILABLE:
+				done = ends[i];
+				pending--;
+				continue;
+
+			case TP_STATUS_WRONG_FORMAT:
+				tx_frame_rejected(handle, status);
+				goto out;
+			}
+			break;
+		}
+
+		if (!stop && queue->len - off >= sizeof(hdr)) {
+			/*
+			 * Packets are packed into the buffer, so the
+			 * header might not be aligned; copy it out.
+			 */
+			memcpy(&hdr, queue->buffer + off, sizeof(hdr));
+			if (hdr.caplen > queue->len - off - sizeof(hdr)) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "Packet at offset %u in the send queue is truncated",
+				    off);
+				stop = 1;
+				continue;
+			}
+			i = handlep->tx_offset;
+			ret = tx_ring_put(handle,
+			    queue->buffer + off + sizeof(hdr), hdr.caplen);
+			if (ret == -1) {
+				/*
+				 * Still send what's already in the ring.
+				 */
+				stop = 1;
+				continue;
+			}
+			if (ret == 0) {
+				/*
+				 * The ring is full; send what's in it,
+				 * and wait for a frame to free up.
+				 */
+				if (tx_ring_wait(handle) == -1)
+					break;
+				continue;
+			}
+			off += sizeof(hdr) + hdr.caplen;
+			ends[i] = off;
+			pending++;
+			continue;
+		}
+
+		/*
+		 * We're done filling the ring; wait for the kernel to
+		 * finish with what's in it.
+		 */
+		if (pending == 0)
+			break;
+		i = (handlep->tx_offset + handlep->tx_frame_nr - pending) %
+		    handlep->tx_frame_nr;
+		if (tx_ring_wait_frame(handle, i) == -1)
+			break;
+	}
+out:
+	free(ends);
+	return (done);
+}
+
 /*
  *  Get the statistics for the given packet capture handle.
  */
@@ -2877,6 +3259,7 @@ create_ring(pcap_t *handle, int *status)
 	socklen_t len;
 	unsigned int sk_type, tp_reserve, maclen, tp_hdrlen, netoff, macoff;
 	unsigned int frame_size;
+	size_t tx_ring_len;
 
 	/*
 	 * Start out assuming no warnings or errors.
@@ -3032,14 +3415,6 @@ create_ring(pcap_t *handle, int *status)
 			 */
 		macoff = netoff - maclen;
 		req.tp_frame_size = TPACKET_ALIGN(macoff + frame_size);
-		/*
-		 * Round the buffer size up to a multiple of the
-		 * frame size (rather than rounding down, which
-		 * would give a buffer smaller than our caller asked
-		 * for, and possibly give zero frames if the requested
-		 * buffer size is too small for one frame).
-		 */
-		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
 		break;
 
 #ifdef HAVE_TPACKET3
@@ -3051,14 +3426,6 @@ create_ring(pcap_t *handle, int *status)
 		 * enough room for at least one reasonably-sized packet
 		 * in the "frame". */
 		req.tp_frame_size = MAXIMUM_SNAPLEN;
-		/*
-		 * Round the buffer size up to a multiple of the
-		 * "frame" size (rather than rounding down, which
-		 * would give a buffer smaller than our caller asked
-		 * for, and possibly give zero "frames" if the requested
-		 * buffer size is too small for one "frame").
-		 */
-		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
 		break;
 #endif
 	default:
@@ -3069,16 +3436,79 @@ create_ring(pcap_t *handle, int *status)
 		return -1;
 	}
 
-	/* compute the minimum block size that will handle this frame.
-	 * The block has to be page size aligned.
-	 * The max block size allowed by the kernel is arch-dependent and
-	 * it's not explicitly checked here. */
-	req.tp_block_size = getpagesize();
-	while (req.tp_block_size < req.tp_frame_size)
-		req.tp_block_size <<= 1;
+	/*
+	 * If we were asked for a particular frame size, use it
+	 * instead of the one we picked.
+	 */
+	if (handle->opt.ring_params.frame_size != 0)
+		req.tp_frame_size = handle->opt.ring_params.frame_size;
+
+	if (handle->opt.ring_params.block_size != 0) {
+		/*
+		 * We were asked for a particular block size;
+		 * pcap_set_ring_params_linux() has checked that it's
+		 * a multiple of the page size.
+		 */
+		req.tp_block_size = handle->opt.ring_params.block_size;
+		if (handle->opt.ring_params.frame_size == 0 &&
+		    req.tp_frame_size > req.tp_block_size) {
+			/*
+			 * Our default frame size doesn't fit; shrink
+			 * it to fit the block.
+			 */
+			req.tp_frame_size = req.tp_block_size;
+		}
+		if (req.tp_block_size < req.tp_frame_size) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Ring block size %u is smaller than the frame size %u",
+			    req.tp_block_size, req.tp_frame_size);
+			*status = PCAP_ERROR;
+			return -1;
+		}
+	} else {
+		/* compute the minimum block size that will handle this frame.
+		 * The block has to be page size aligned.
+		 * The max block size allowed by the kernel is arch-dependent and
+		 * it's not explicitly checked here. */
+		req.tp_block_size = getpagesize();
+		while (req.tp_block_size < req.tp_frame_size)
+			req.tp_block_size <<= 1;
+	}
+
+#ifdef HAVE_TPACKET3
+	/*
+	 * With TPACKET_V3, the "frames" we walk through are the
+	 * blocks themselves, so there must be exactly one "frame"
+	 * per block.
+	 */
+	if (handlep->tp_version == TPACKET_V3)
+		req.tp_frame_size = req.tp_block_size;
+#endif
 
 	frames_per_block = req.tp_block_size/req.tp_frame_size;
 
+	if (handle->opt.ring_params.block_nr != 0) {
+		/*
+		 * We were asked for a particular number of blocks.
+		 */
+		req.tp_frame_nr = handle->opt.ring_params.block_nr * frames_per_block;
+	} else if (handle->opt.ring_params.frame_nr != 0) {
+		/*
+		 * We were asked for a particular number of frames;
+		 * round it up to fill the last block.
+		 */
+		req.tp_frame_nr = ((handle->opt.ring_params.frame_nr + frames_per_block - 1)/frames_per_block) * frames_per_block;
+	} else {
+		/*
+		 * Round the buffer size up to a multiple of the
+		 * frame size (rather than rounding down, which
+		 * would give a buffer smaller than our caller asked
+		 * for, and possibly give zero frames if the requested
+		 * buffer size is too small for one frame).
+		 */
+		req.tp_frame_nr = (handle->opt.buffer_size + req.tp_frame_size - 1)/req.tp_frame_size;
+	}
+
 	/*
 	 * PACKET_TIMESTAMP was added after linux/net_tstamp.h was,
 	 * so we check for PACKET_TIMESTAMP.  We check for
@@ -3199,7 +3629,10 @@ retry:
 
 #ifdef HAVE_TPACKET3
 	/* timeout value to retire block - use the configured buffering timeout, or default if <0. */
-	if (handlep->timeout > 0) {
+	if (handle->opt.ring_params.retire_blk_tov != 0) {
+		/* Use the block timeout we were explicitly asked for */
+		req.tp_retire_blk_tov = handle->opt.ring_params.retire_blk_tov;
+	} else if (handlep->timeout > 0) {
 		/* Use the user specified timeout as the block timeout */
 		req.tp_retire_blk_tov = handlep->timeout;
 	} else if (handlep->timeout == 0) {
@@ -3221,8 +3654,12 @@ retry:
 	}
 	/* private data not used */
 	req.tp_sizeof_priv = 0;
-	/* Rx ring - feature request bits - none (rxhash will not be filled) */
-	req.tp_feature_req_word = 0;
+	/*
+	 * Rx ring - feature request bits - have the kernel fill in
+	 * the rxhash only if it's wanted as metadata.
+	 */
+	req.tp_feature_req_word = handle->opt.rx_metadata ?
+	    TP_FT_REQ_FILL_RXHASH : 0;
 #endif
 
 	if (setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
@@ -3249,8 +3686,17 @@ retry:
 		return -1;
 	}
 
-	/* memory map the rx ring */
-	handlep->mmapbuflen = req.tp_block_nr * req.tp_block_size;
+	/*
+	 * If we were asked for a transmit ring, set it up now; the
+	 * kernel maps it right after the receive ring, so it has to
+	 * exist before we map the rings.
+	 */
+	tx_ring_len = 0;
+	if (handle->opt.tx_ring_size != 0)
+		tx_ring_len = create_tx_ring(handle, status);
+
+	/* memory map the rx ring, and the tx ring if we have one */
+	handlep->mmapbuflen = req.tp_block_nr * req.tp_block_size + tx_ring_len;
 	handlep->mmapbuf = mmap(0, handlep->mmapbuflen,
 	    PROT_READ|PROT_WRITE, MAP_SHARED, handle->fd, 0);
 	if (handlep->mmapbuf == MAP_FAILED) {
@@ -3263,6 +3709,11 @@ retry:
 		return -1;
 	}
 
+	if (tx_ring_len != 0) {
+		handlep->tx_ring = handlep->mmapbuf + req.tp_block_nr * req.tp_block_size;
+		handlep->tx_offset = 0;
+	}
+
 	/* allocate a ring for each frame header pointer*/
 	handle->cc = req.tp_frame_nr;
 	handle->buffer = malloc(handle->cc * sizeof(union thdr *));
@@ -3287,9 +3738,85 @@ retry:
 
 	handle->bufsize = req.tp_frame_size;
 	handle->offset = 0;
+
+	/* remember what we got, for pcap_get_ring_params_linux() */
+	handlep->ring_params.block_size = req.tp_block_size;
+	handlep->ring_params.block_nr = req.tp_block_nr;
+	handlep->ring_params.frame_size = req.tp_frame_size;
+	handlep->ring_params.frame_nr = req.tp_frame_nr;
+#ifdef HAVE_TPACKET3
+	if (handlep->tp_version == TPACKET_V3)
+		handlep->ring_params.retire_blk_tov = req.tp_retire_blk_tov;
+	else
+#endif
+		handlep->ring_params.retire_blk_tov = 0;
 	return 1;
 }
 
+/*
+ * Create a PACKET_TX_RING on the socket, for sending packets without
+ * a system call apiece.  This must be called after the rx ring has been
+ * created and before the rings are mapped.
+ *
+ * On success, returns the size of the tx ring, in bytes.  If we can't
+ * create one, returns 0 and sets *status to PCAP_WARNING (unless there's
+ * already a warning), with handle->errbuf saying why; packets are then
+ * sent with a send() apiece, as if we'd never been asked for a tx ring.
+ */
+static size_t
+create_tx_ring(pcap_t *handle, int *status)
+{
+	struct pcap_linux *handlep = handle->priv;
+#ifdef HAVE_TPACKET3
+	struct tpacket_req3 req;
+#else
+	struct tpacket_req req;
+#endif
+	int mtu;
+
+	/*
+	 * We can't send on the "any" device or on cooked-mode
+	 * sockets in any case; see pcap_inject_linux().
+	 */
+	if (handlep->ifindex == -1 || handlep->cooked)
+		return 0;
+
+	mtu = iface_get_mtu(handle->fd, handle->opt.device, handle->errbuf);
+	if (mtu == -1)
+		goto fail;
+
+	/*
+	 * Each frame has to hold the frame header and the largest
+	 * packet we could be asked to send; the packet data
+	 * starts right after the (aligned) header.
+	 */
+	memset(&req, 0, sizeof(req));
+	req.tp_frame_size = TPACKET_ALIGN(TPACKET_ALIGN(handlep->tp_hdrlen) +
+	    MAX_LINKHEADER_SIZE + mtu);
+	req.tp_block_size = getpagesize();
+	while (req.tp_block_size < req.tp_frame_size)
+		req.tp_block_size <<= 1;
+	handlep->tx_frames_per_block = req.tp_block_size / req.tp_frame_size;
+	req.tp_block_nr = (handle->opt.tx_ring_size + req.tp_block_size - 1) / req.tp_block_size;
+	req.tp_frame_nr = req.tp_block_nr * handlep->tx_frames_per_block;
+
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_TX_RING,
+	    (void *) &req, sizeof(req))) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "can't create tx ring on packet socket");
+		goto fail;
+	}
+	handlep->tx_block_size = req.tp_block_size;
+	handlep->tx_frame_size = req.tp_frame_size;
+	handlep->tx_frame_nr = req.tp_frame_nr;
+	return (size_t)req.tp_block_nr * req.tp_block_size;
+
+fail:
+	if (*status == 0)
+		*status = PCAP_WARNING;
+	return 0;
+}
+
 /* free all ring related resources*/
 static void
 destroy_ring(pcap_t *handle)
@@ -3306,6 +3833,9 @@ destroy_ring(pcap_t *handle)
 	memset(&req, 0, sizeof(req));
 	(void)setsockopt(handle->fd, SOL_PACKET, PACKET_RX_RING,
 				(void *) &req, sizeof(req));
+	if (handlep->tx_ring != NULL || handle->opt.tx_ring_size != 0)
+		(void)setsockopt(handle->fd, SOL_PACKET, PACKET_TX_RING,
+					(void *) &req, sizeof(req));
 
 	/* if ring is mapped, unmap it*/
 	if (handlep->mmapbuf) {
@@ -3313,6 +3843,7 @@ destroy_ring(pcap_t *handle)
 		(void)munmap(handlep->mmapbuf, handlep->mmapbuflen);
 		handlep->mmapbuf = NULL;
 	}
+	handlep->tx_ring = NULL;
 }
 
 /*
@@ -3413,20 +3944,99 @@ pcap_get_ring_frame_status(pcap_t *handle, int offset)
 }
 
 /*
- * Block waiting for frames to be available.
+ * Let the other hardware thread on this core, if any, have the core for
+ * a moment while we spin.
  */
-static int pcap_wait_for_frames_mmap(pcap_t *handle)
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()	__asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()	do { } while (0)
+#endif
+
+/*
+ * Spin, for at most the busy-poll time, waiting for the kernel to hand
+ * us the current frame or block.  Return 1 if it did, and 0 if time ran
+ * out or we were told to break out of the loop.
+ */
+static int pcap_spin_for_frames_mmap(pcap_t *handle)
 {
 	struct pcap_linux *handlep = handle->priv;
-	int timeout;
-	struct ifreq ifr;
-	int ret;
+	union thdr h;
+	struct timespec now, deadline;
+	u_int spins = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += handlep->busy_poll_usec / 1000000;
+	deadline.tv_nsec += (handlep->busy_poll_usec % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	for (;;) {
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		switch (handlep->tp_version) {
+
+		case TPACKET_V2:
+			if (packet_mmap_acquire(h.h2))
+				return 1;
+			break;
+
+#ifdef HAVE_TPACKET3
+		case TPACKET_V3:
+			if (packet_mmap_v3_acquire(h.h3))
+				return 1;
+			break;
+#endif
+		}
+		if (handle->break_loop)
+			return 0;
+
+		/*
+		 * Reading the clock costs more than looking at the
+		 * ring, so only do it every so often.
+		 */
+		if ((++spins & 63) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline.tv_sec ||
+			    (now.tv_sec == deadline.tv_sec &&
+			     now.tv_nsec >= deadline.tv_nsec))
+				return 0;
+		}
+		cpu_relax();
+	}
+}
+
+/*
+ * Block waiting for frames to be available.
+ */
+static int pcap_wait_for_frames_mmap(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int timeout;
+	struct ifreq ifr;
+	int ret;
 	struct pollfd pollinfo[2];
 	pollinfo[0].fd = handle->fd;
 	pollinfo[0].events = POLLIN;
 	pollinfo[1].fd = handlep->poll_breakloop_fd;
 	pollinfo[1].events = POLLIN;
 
+	/*
+	 * In busy-poll mode, if we'd block, spin on the ring for a
+	 * while first, in the hope that a packet arrives before we
+	 * have to pay for going to sleep and being woken up.
+	 */
+	if (handlep->busy_poll_usec != 0 && handlep->poll_timeout != 0 &&
+	    !handlep->netdown) {
+		if (pcap_spin_for_frames_mmap(handle)) {
+			handlep->busy_poll_stats.bp_spin_hits++;
+			return 0;
+		}
+		handlep->busy_poll_stats.bp_poll_waits++;
+	}
+
 	/*
 	 * Keep polling until we either get some packets to read, see
 	 * that we got told to break out of the loop, get a fatal error,
@@ -3753,20 +4363,29 @@ static int pcap_wait_for_frames_mmap(pcap_t *handle)
 	return 0;
 }
 
-/* handle a single memory mapped packet */
-static int pcap_handle_packet_mmap(
+/*
+ * Prepare a single memory mapped packet for delivery, in place in the
+ * ring: run the userland filter if necessary, build the cooked-mode
+ * header and either reinsert any VLAN tag or put it in *metap.  On
+ * success, fill in *pcaphdrp, *metap and *bpp and return 1; return 0
+ * if the packet is to be skipped and -1 on error.
+ */
+static inline int pcap_prepare_packet_mmap(
 		pcap_t *handle,
-		pcap_handler callback,
-		u_char *user,
 		unsigned char *frame,
+		unsigned int tp_status,
 		unsigned int tp_len,
 		unsigned int tp_mac,
 		unsigned int tp_snaplen,
 		unsigned int tp_sec,
-		unsigned int tp_usec,
+		unsigned int tp_nsec,
 		int tp_vlan_tci_valid,
 		__u16 tp_vlan_tci,
-		__u16 tp_vlan_tpid)
+		__u16 tp_vlan_tpid,
+		__u32 tp_rxhash,
+		struct pcap_pkthdr *pcaphdrp,
+		struct pcap_pkt_metadata *metap,
+		u_char **bpp)
 {
 	struct pcap_linux *handlep = handle->priv;
 	unsigned char *bp;
@@ -3895,15 +4514,34 @@ static int pcap_handle_packet_mmap(
 	if (handlep->filter_in_userland && handle->fcode.bf_insns) {
 		struct pcap_bpf_aux_data aux_data;
 
-		aux_data.vlan_tag_present = tp_vlan_tci_valid;
-		aux_data.vlan_tag = tp_vlan_tci & 0x0fff;
+		/*
+		 * Programs that use the auxiliary data are never
+		 * translated into native code.
+		 */
+		if (handle->fcode_profile == NULL &&
+		    handle->fcode_jit.func != NULL) {
+			if (handle->fcode_jit.func(bp, tp_len, snaplen) == 0)
+				return 0;
+		} else {
+			aux_data.vlan_tag_present = tp_vlan_tci_valid;
+			aux_data.vlan_tag = tp_vlan_tci & 0x0fff;
 
-		if (pcap_filter_with_aux_data(handle->fcode.bf_insns,
-					      bp,
-					      tp_len,
-					      snaplen,
-					      &aux_data) == 0)
-			return 0;
+			if (handle->fcode_profile != NULL) {
+				if (pcap_filter_profile(handle->fcode.bf_insns,
+				    bp, tp_len, snaplen, &aux_data,
+				    handle->fcode_profile) == 0)
+					return 0;
+			} else if (handle->fcode_decoded != NULL) {
+				if (pcap_filter_predecoded(handle->fcode_decoded,
+				    bp, tp_len, snaplen, &aux_data) == 0)
+					return 0;
+			} else if (pcap_filter_with_aux_data(handle->fcode.bf_insns,
+						      bp,
+						      tp_len,
+						      snaplen,
+						      &aux_data) == 0)
+				return 0;
+		}
 	}
 
 	if (!linux_check_direction(handle, sll))
@@ -3911,7 +4549,10 @@ static int pcap_handle_packet_mmap(
 
 	/* get required packet info from ring header */
 	pcaphdr.ts.tv_sec = tp_sec;
-	pcaphdr.ts.tv_usec = tp_usec;
+	if (handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO)
+		pcaphdr.ts.tv_usec = tp_nsec;
+	else
+		pcaphdr.ts.tv_usec = tp_nsec / 1000;
 	pcaphdr.caplen = tp_snaplen;
 	pcaphdr.len = tp_len;
 
@@ -3927,7 +4568,45 @@ static int pcap_handle_packet_mmap(
 		}
 	}
 
-	if (tp_vlan_tci_valid &&
+	metap->present = 0;
+	if (handlep->rx_metadata) {
+		/*
+		 * Hand over what the kernel told us about the packet
+		 * that isn't otherwise available; the time stamp is
+		 * supplied at full precision, along with where it
+		 * came from, which can differ from packet to packet.
+		 */
+		metap->present |= PCAP_PKT_META_IFINDEX |
+		    PCAP_PKT_META_PKTTYPE | PCAP_PKT_META_TSTAMP;
+		metap->ifindex = sll->sll_ifindex;
+		metap->pkttype = sll->sll_pkttype;
+		metap->tstamp_sec = tp_sec;
+		metap->tstamp_nsec = tp_nsec;
+#ifdef TP_STATUS_TS_RAW_HARDWARE
+		if (tp_status & TP_STATUS_TS_RAW_HARDWARE)
+			metap->tstamp_type = PCAP_TSTAMP_ADAPTER_UNSYNCED;
+		else
+#endif
+			metap->tstamp_type = PCAP_TSTAMP_HOST;
+
+		/*
+		 * Only TPACKET_V3 has room for the hash.
+		 */
+		if (handlep->tp_version == TPACKET_V3) {
+			metap->present |= PCAP_PKT_META_RXHASH;
+			metap->rxhash = tp_rxhash;
+		}
+	}
+	if (tp_vlan_tci_valid && handlep->vlan_metadata) {
+		/*
+		 * Leave the packet alone, and hand the tag to the
+		 * caller separately; the filter has already looked
+		 * at it through the auxiliary data.
+		 */
+		metap->present |= PCAP_PKT_META_VLAN;
+		metap->vlan_tci = tp_vlan_tci;
+		metap->vlan_tpid = tp_vlan_tpid;
+	} else if (tp_vlan_tci_valid &&
 		handlep->vlan_offset != -1 &&
 		tp_snaplen >= (unsigned int) handlep->vlan_offset)
 	{
@@ -3974,6 +4653,39 @@ static int pcap_handle_packet_mmap(
 	if (pcaphdr.caplen > (bpf_u_int32)handle->snapshot)
 		pcaphdr.caplen = handle->snapshot;
 
+	*pcaphdrp = pcaphdr;
+	*bpp = bp;
+	return 1;
+}
+
+/* handle a single memory mapped packet */
+static int pcap_handle_packet_mmap(
+		pcap_t *handle,
+		pcap_handler callback,
+		u_char *user,
+		unsigned char *frame,
+		unsigned int tp_status,
+		unsigned int tp_len,
+		unsigned int tp_mac,
+		unsigned int tp_snaplen,
+		unsigned int tp_sec,
+		unsigned int tp_nsec,
+		int tp_vlan_tci_valid,
+		__u16 tp_vlan_tci,
+		__u16 tp_vlan_tpid,
+		__u32 tp_rxhash)
+{
+	struct pcap_pkthdr pcaphdr;
+	u_char *bp;
+	int ret;
+
+	ret = pcap_prepare_packet_mmap(handle, frame, tp_status, tp_len,
+	    tp_mac, tp_snaplen, tp_sec, tp_nsec, tp_vlan_tci_valid,
+	    tp_vlan_tci, tp_vlan_tpid, tp_rxhash, &pcaphdr, &handle->pkt_meta,
+	    &bp);
+	if (ret != 1)
+		return ret;
+
 	/* pass the packet to the user */
 	callback(user, &pcaphdr, bp);
 
@@ -3989,6 +4701,10 @@ pcap_read_linux_mmap_v2(pcap_t *handle, int max_packets, pcap_handler callback,
 	int pkts = 0;
 	int ret;
 
+	/* hand back any frames still held by pcap_next_batch() */
+	if (handlep->batch_held != 0)
+		pcap_release_batch_linux(handle);
+
 	/* wait for frames availability.*/
 	h.raw = RING_GET_CURRENT_FRAME(handle);
 	if (!packet_mmap_acquire(h.h2)) {
@@ -4018,14 +4734,16 @@ pcap_read_linux_mmap_v2(pcap_t *handle, int max_packets, pcap_handler callback,
 				callback,
 				user,
 				h.raw,
+				h.h2->tp_status,
 				h.h2->tp_len,
 				h.h2->tp_mac,
 				h.h2->tp_snaplen,
 				h.h2->tp_sec,
-				handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO ? h.h2->tp_nsec : h.h2->tp_nsec / 1000,
+				h.h2->tp_nsec,
 				VLAN_VALID(h.h2, h.h2),
 				h.h2->tp_vlan_tci,
-				VLAN_TPID(h.h2, h.h2));
+				VLAN_TPID(h.h2, h.h2),
+				0);
 		if (ret == 1) {
 			pkts++;
 		} else if (ret < 0) {
@@ -4073,6 +4791,10 @@ pcap_read_linux_mmap_v3(pcap_t *handle, int max_packets, pcap_handler callback,
 	int pkts = 0;
 	int ret;
 
+	/* hand back any block still held by pcap_next_batch() */
+	if (handlep->batch_held != 0)
+		pcap_release_batch_linux(handle);
+
 again:
 	if (handlep->current_packet == NULL) {
 		/* wait for frames availability.*/
@@ -4130,14 +4852,16 @@ again:
 					callback,
 					user,
 					handlep->current_packet,
+					tp3_hdr->tp_status,
 					tp3_hdr->tp_len,
 					tp3_hdr->tp_mac,
 					tp3_hdr->tp_snaplen,
 					tp3_hdr->tp_sec,
-					handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO ? tp3_hdr->tp_nsec : tp3_hdr->tp_nsec / 1000,
+					tp3_hdr->tp_nsec,
 					VLAN_VALID(tp3_hdr, &tp3_hdr->hv1),
 					tp3_hdr->hv1.tp_vlan_tci,
-					VLAN_TPID(tp3_hdr, &tp3_hdr->hv1));
+					VLAN_TPID(tp3_hdr, &tp3_hdr->hv1),
+					tp3_hdr->hv1.tp_rxhash);
 			if (ret == 1) {
 				pkts++;
 			} else if (ret < 0) {
@@ -4189,6 +4913,223 @@ again:
 }
 #endif /* HAVE_TPACKET3 */
 
+/*
+ * Hand the frames (TPACKET_V2) or block (TPACKET_V3) held by the last
+ * pcap_next_batch() call back to the kernel.
+ */
+static void
+pcap_release_batch_linux(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	int offset;
+
+	offset = handlep->batch_first;
+	while (handlep->batch_held > 0) {
+		h.raw = RING_GET_FRAME_AT(handle, offset);
+		switch (handlep->tp_version) {
+
+		case TPACKET_V2:
+			packet_mmap_release(h.h2);
+			break;
+#ifdef HAVE_TPACKET3
+		case TPACKET_V3:
+			packet_mmap_v3_release(h.h3);
+			break;
+#endif
+		}
+
+		/*
+		 * If we're counting blocks that need to be filtered
+		 * in userland after having been filtered by the kernel,
+		 * count the one we've just handed back.
+		 */
+		if (handlep->blocks_to_filter_in_userland > 0) {
+			handlep->blocks_to_filter_in_userland--;
+			if (handlep->blocks_to_filter_in_userland == 0)
+				handlep->filter_in_userland = 0;
+		}
+		if (++offset >= handle->cc)
+			offset = 0;
+		handlep->batch_held--;
+	}
+}
+
+/*
+ * Fill in a batch with pointers to packets in the TPACKET_V2 ring,
+ * holding on to their frames until the batch is released.
+ */
+static int
+pcap_next_batch_linux_mmap_v2(pcap_t *handle, struct pcap_pkt_batch *batch,
+    int max_packets)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	u_char *bp;
+	int ret;
+
+	batch->count = 0;
+	pcap_release_batch_linux(handle);
+
+	/* wait for frames availability.*/
+	h.raw = RING_GET_CURRENT_FRAME(handle);
+	if (!packet_mmap_acquire(h.h2)) {
+		ret = pcap_wait_for_frames_mmap(handle);
+		if (ret)
+			return ret;
+	}
+
+	while (batch->count < max_packets &&
+	    handlep->batch_held < handle->cc) {
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		if (!packet_mmap_acquire(h.h2))
+			break;
+
+		/*
+		 * The frame now belongs to the batch, whether or not
+		 * the packet in it is delivered; it goes back to the
+		 * kernel when the batch is released.
+		 */
+		if (handlep->batch_held++ == 0)
+			handlep->batch_first = handle->offset;
+		if (++handle->offset >= handle->cc)
+			handle->offset = 0;
+
+		ret = pcap_prepare_packet_mmap(
+				handle,
+				h.raw,
+				h.h2->tp_status,
+				h.h2->tp_len,
+				h.h2->tp_mac,
+				h.h2->tp_snaplen,
+				h.h2->tp_sec,
+				h.h2->tp_nsec,
+				VLAN_VALID(h.h2, h.h2),
+				h.h2->tp_vlan_tci,
+				VLAN_TPID(h.h2, h.h2),
+				0,
+				&batch->hdrs[batch->count],
+				&handle->pkt_meta,
+				&bp);
+		if (ret == 1) {
+			if (batch->meta != NULL)
+				pcap_copy_pkt_metadata(batch, batch->count,
+				    &handle->pkt_meta);
+			batch->pkts[batch->count++] = bp;
+		} else if (ret < 0)
+			return ret;
+
+		/* check for break loop condition*/
+		if (handle->break_loop) {
+			handle->break_loop = 0;
+			return PCAP_ERROR_BREAK;
+		}
+	}
+	return batch->count;
+}
+
+#ifdef HAVE_TPACKET3
+/*
+ * Fill in a batch with pointers to packets in the current TPACKET_V3
+ * block.  A batch never spans blocks; once all the packets in a block
+ * have been handed out, the block is held until the batch is released.
+ */
+static int
+pcap_next_batch_linux_mmap_v3(pcap_t *handle, struct pcap_pkt_batch *batch,
+    int max_packets)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union thdr h;
+	u_char *bp;
+	int ret;
+
+	batch->count = 0;
+	pcap_release_batch_linux(handle);
+
+	for (;;) {
+		if (handle->break_loop) {
+			handle->break_loop = 0;
+			return PCAP_ERROR_BREAK;
+		}
+		h.raw = RING_GET_CURRENT_FRAME(handle);
+		if (handlep->current_packet == NULL) {
+			if (!packet_mmap_v3_acquire(h.h3)) {
+				/*
+				 * The current block is owned by the kernel;
+				 * wait for a block to be handed to us.
+				 */
+				ret = pcap_wait_for_frames_mmap(handle);
+				if (ret)
+					return ret;
+				if (!packet_mmap_v3_acquire(h.h3)) {
+					if (handlep->timeout == 0) {
+						/* Block until we see a packet. */
+						continue;
+					}
+					return 0;
+				}
+			}
+			handlep->current_packet = h.raw + h.h3->hdr.bh1.offset_to_first_pkt;
+			handlep->packets_left = h.h3->hdr.bh1.num_pkts;
+		}
+
+		while (handlep->packets_left > 0 &&
+		    batch->count < max_packets) {
+			struct tpacket3_hdr* tp3_hdr = (struct tpacket3_hdr*) handlep->current_packet;
+
+			ret = pcap_prepare_packet_mmap(
+					handle,
+					handlep->current_packet,
+					tp3_hdr->tp_status,
+					tp3_hdr->tp_len,
+					tp3_hdr->tp_mac,
+					tp3_hdr->tp_snaplen,
+					tp3_hdr->tp_sec,
+					tp3_hdr->tp_nsec,
+					VLAN_VALID(tp3_hdr, &tp3_hdr->hv1),
+					tp3_hdr->hv1.tp_vlan_tci,
+					VLAN_TPID(tp3_hdr, &tp3_hdr->hv1),
+					tp3_hdr->hv1.tp_rxhash,
+					&batch->hdrs[batch->count],
+					&handle->pkt_meta,
+					&bp);
+			if (ret == 1) {
+				if (batch->meta != NULL)
+					pcap_copy_pkt_metadata(batch,
+					    batch->count, &handle->pkt_meta);
+				batch->pkts[batch->count++] = bp;
+			} else if (ret < 0) {
+				handlep->current_packet = NULL;
+				return ret;
+			}
+			handlep->current_packet += tp3_hdr->tp_next_offset;
+			handlep->packets_left--;
+		}
+
+		if (handlep->packets_left <= 0) {
+			/*
+			 * We've handed out everything in this block;
+			 * hold on to it until the batch is released,
+			 * and move on to the next block.
+			 */
+			handlep->batch_first = handle->offset;
+			handlep->batch_held = 1;
+			if (++handle->offset >= handle->cc)
+				handle->offset = 0;
+			handlep->current_packet = NULL;
+		}
+		if (batch->count != 0)
+			return batch->count;
+
+		/*
+		 * Nothing in that block passed the filter; give it
+		 * back and look at the next one.
+		 */
+		pcap_release_batch_linux(handle);
+	}
+}
+#endif /* HAVE_TPACKET3 */
+
 /*
  *  Attach the given BPF code to the packet capture device.
  */
@@ -4314,6 +5255,7 @@ pcap_setfilter_linux(pcap_t *handle, struct bpf_program *filter)
 			 * so userland filtering not needed.
 			 */
 			handlep->filter_in_userland = 0;
+			handle->fcode_in_kernel = 1;
 		}
 		else if (err == -1)	/* Non-fatal error */
 		{
@@ -4500,6 +5442,141 @@ iface_bind(int fd, int ifindex, char *ebuf, int protocol)
 	return 0;
 }
 
+/*
+ *  Add the socket to the PACKET_FANOUT group requested with
+ *  pcap_set_fanout_linux(), so that the kernel spreads the packets
+ *  it would have handed to the sockets in that group among them.
+ *  Return 0 on success, or a PCAP_ERROR_ value and set the error
+ *  buffer on failure.
+ */
+static int
+iface_set_fanout(pcap_t *handle)
+{
+#ifdef PACKET_FANOUT
+	int	val;
+
+	/*
+	 * The low-order 16 bits are the group ID; the upper 16 bits
+	 * are the fanout mode, ORed with the flags, which are defined
+	 * in <linux/if_packet.h> to be above the mode.
+	 */
+	val = (int)((handle->opt.fanout_mode << 16) |
+	    (handle->opt.fanout_group & 0xffff));
+	if (setsockopt(handle->fd, SOL_PACKET, PACKET_FANOUT, &val,
+	    sizeof(val)) == -1) {
+		if (errno == EPERM || errno == EACCES) {
+			pcap_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "setsockopt (PACKET_FANOUT)");
+			return PCAP_ERROR_PERM_DENIED;
+		}
+		if (errno == EINVAL) {
+			/*
+			 * Either the mode or flags aren't supported by
+			 * this kernel, or the group already exists with
+			 * a different mode, flags, or protocol.
+			 */
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Fanout mode 0x%x isn't supported, or doesn't match the mode of existing fanout group %u",
+			    handle->opt.fanout_mode,
+			    handle->opt.fanout_group);
+			return PCAP_ERROR;
+		}
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (PACKET_FANOUT)");
+		return PCAP_ERROR;
+	}
+	return 0;
+#else /* PACKET_FANOUT */
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Fanout groups aren't supported by this version of libpcap");
+	return PCAP_ERROR;
+#endif /* PACKET_FANOUT */
+}
+
+/*
+ *  Have the kernel busy-poll the device's receive queue, for the
+ *  busy-poll time, when we poll() the socket, rather than waiting for
+ *  an interrupt, as requested with pcap_set_busy_poll_linux().  Return
+ *  0 on success, or a PCAP_ERROR_ value and set the error buffer on
+ *  failure.
+ */
+static int
+iface_set_busy_poll(pcap_t *handle)
+{
+#ifdef SO_BUSY_POLL
+	int	val;
+
+	val = (int)handle->opt.busy_poll_usec;
+	if (setsockopt(handle->fd, SOL_SOCKET, SO_BUSY_POLL, &val,
+	    sizeof(val)) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (SO_BUSY_POLL)");
+		if (errno == EPERM || errno == EACCES)
+			return PCAP_ERROR_PERM_DENIED;
+		return PCAP_ERROR;
+	}
+
+#ifdef SO_PREFER_BUSY_POLL
+	/*
+	 * Ask that the device's interrupts stay off while we're
+	 * busy-polling; kernels before 5.11 don't support this, and
+	 * can only busy-poll alongside the interrupts, so that's not
+	 * an error.
+	 */
+	val = 1;
+	if (setsockopt(handle->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val,
+	    sizeof(val)) == -1 && errno != ENOPROTOOPT) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "setsockopt (SO_PREFER_BUSY_POLL)");
+		if (errno == EPERM || errno == EACCES)
+			return PCAP_ERROR_PERM_DENIED;
+		return PCAP_ERROR;
+	}
+#endif /* SO_PREFER_BUSY_POLL */
+	return 0;
+#else /* SO_BUSY_POLL */
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Kernel busy-polling isn't supported by this version of libpcap");
+	return PCAP_ERROR;
+#endif /* SO_BUSY_POLL */
+}
+
+/*
+ *  Create the map of keys requested with pcap_set_map_filter_linux(),
+ *  and attach a socket filter that checks packets against it.  Return
+ *  0 on success or a PCAP_ERROR_ value on failure.
+ */
+static int
+iface_set_map_filter(pcap_t *handle)
+{
+	struct pcap_linux *handlep = handle->priv;
+	union ebpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map.map_type = EBPF_MAP_TYPE_HASH;
+	attr.map.key_size = sizeof(bpf_u_int32);
+	attr.map.value_size = sizeof(bpf_u_int32);
+	attr.map.max_entries = handle->opt.map_filter_max_entries;
+	handlep->map_filter.map_fd = pcap_sys_bpf(EBPF_MAP_CREATE, &attr);
+	if (handlep->map_filter.map_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create map for the socket filter");
+		if (errno == EPERM || errno == EACCES)
+			return PCAP_ERROR_PERM_DENIED;
+		return PCAP_ERROR;
+	}
+	handlep->map_filter.key_type = handle->opt.map_filter_key_type;
+	handlep->map_filter.action = handle->opt.map_filter_action;
+
+	if (attach_ebpf_filter(handle, NULL, 0) == -1) {
+		if (errno == EPERM || errno == EACCES)
+			return PCAP_ERROR_PERM_DENIED;
+		return PCAP_ERROR;
+	}
+	return 0;
+}
+
 /*
  * Try to enter monitor mode.
  * If we have libnl, try to create a new monitor-mode device and
@@ -5262,6 +6339,7 @@ fix_offset(pcap_t *handle, struct bpf_insn *p)
 static int
 set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode)
 {
+	struct pcap_linux *handlep = handle->priv;
 	int total_filter_on = 0;
 	int save_mode;
 	int ret;
@@ -5352,10 +6430,16 @@ set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode)
 	}
 
 	/*
-	 * Now attach the new filter.
+	 * Now attach the new filter.  If packets are being checked
+	 * against a map, it's translated to eBPF and attached after
+	 * the map checks.
 	 */
-	ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
-			 fcode, sizeof(*fcode));
+	if (handlep->map_filter.map_fd != -1)
+		ret = attach_ebpf_filter(handle,
+		    (const struct bpf_insn *)fcode->filter, fcode->len);
+	else
+		ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+				 fcode, sizeof(*fcode));
 	if (ret == -1 && total_filter_on) {
 		/*
 		 * Well, we couldn't set that filter on the socket,
@@ -5389,6 +6473,7 @@ set_kernel_filter(pcap_t *handle, struct sock_fprog *fcode)
 static int
 reset_kernel_filter(pcap_t *handle)
 {
+	struct pcap_linux *handlep = handle->priv;
 	int ret;
 	/*
 	 * setsockopt() barfs unless it get a dummy parameter.
@@ -5398,6 +6483,13 @@ reset_kernel_filter(pcap_t *handle)
 	 */
 	int dummy = 0;
 
+	/*
+	 * If packets are being checked against a map, that has to
+	 * stay, so put on a filter that does only that.
+	 */
+	if (handlep->map_filter.map_fd != -1)
+		return attach_ebpf_filter(handle, NULL, 0);
+
 	ret = setsockopt(handle->fd, SOL_SOCKET, SO_DETACH_FILTER,
 				   &dummy, sizeof(dummy));
 	/*
@@ -5412,6 +6504,35 @@ reset_kernel_filter(pcap_t *handle)
 	return 0;
 }
 
+/*
+ * Attach the classic program, or none if len is 0, translated to an
+ * eBPF socket filter that first checks packets against our map.
+ * Returns -1, with errno set, on failure; errno is EOPNOTSUPP if the
+ * program can't be translated.
+ */
+static int
+attach_ebpf_filter(pcap_t *handle, const struct bpf_insn *insns, u_int len)
+{
+	struct pcap_linux *handlep = handle->priv;
+	int prog_fd, ret, save_errno;
+
+	prog_fd = pcap_ebpf_load_socket_filter(insns, len,
+	    &handlep->map_filter, handle->errbuf);
+	if (prog_fd == -1)
+		return -1;
+
+	/*
+	 * The socket holds a reference to the program, so we don't
+	 * need to keep its descriptor.
+	 */
+	ret = setsockopt(handle->fd, SOL_SOCKET, SO_ATTACH_BPF,
+			 &prog_fd, sizeof(prog_fd));
+	save_errno = errno;
+	close(prog_fd);
+	errno = save_errno;
+	return ret;
+}
+
 int
 pcap_set_protocol_linux(pcap_t *p, int protocol)
 {
@@ -5421,6 +6542,279 @@ pcap_set_protocol_linux(pcap_t *p, int protocol)
 	return (0);
 }
 
+int
+pcap_set_fanout_linux(pcap_t *p, int group_id, int mode, int flags)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (group_id < 0) {
+		/*
+		 * Don't join a fanout group.
+		 */
+		p->opt.fanout_enabled = 0;
+		return (0);
+	}
+	if (group_id > 0xffff || mode < 0 || mode > 0xff ||
+	    (flags & ~0xff00) != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Invalid fanout group ID %d, mode %d, or flags 0x%x",
+		    group_id, mode, flags);
+		return (PCAP_ERROR);
+	}
+	p->opt.fanout_enabled = 1;
+	p->opt.fanout_group = group_id;
+	p->opt.fanout_mode = mode | flags;
+	return (0);
+}
+
+int
+pcap_set_ring_params_linux(pcap_t *p,
+    const struct pcap_ring_params_linux *params)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (params->block_size % getpagesize() != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring block size %u is not a multiple of the page size %d",
+		    params->block_size, getpagesize());
+		return (PCAP_ERROR);
+	}
+	if (params->frame_size % TPACKET_ALIGNMENT != 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring frame size %u is not a multiple of %d",
+		    params->frame_size, TPACKET_ALIGNMENT);
+		return (PCAP_ERROR);
+	}
+	if (params->block_size != 0 && params->frame_size > params->block_size) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Ring frame size %u is larger than the block size %u",
+		    params->frame_size, params->block_size);
+		return (PCAP_ERROR);
+	}
+	p->opt.ring_params = *params;
+	return (0);
+}
+
+int
+pcap_set_tx_ring_size_linux(pcap_t *p, int tx_ring_size)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (tx_ring_size < 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Negative tx ring size %d", tx_ring_size);
+		return (PCAP_ERROR);
+	}
+	p->opt.tx_ring_size = tx_ring_size;
+	return (0);
+}
+
+int
+pcap_set_vlan_metadata_linux(pcap_t *p, int vlan_metadata)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.vlan_metadata = vlan_metadata;
+	return (0);
+}
+
+int
+pcap_set_rx_metadata_linux(pcap_t *p, int rx_metadata)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.rx_metadata = rx_metadata;
+	return (0);
+}
+
+int
+pcap_set_xdp_divert_linux(pcap_t *p, int divert)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	p->opt.xdp_divert = divert;
+	return (0);
+}
+
+int
+pcap_set_busy_poll_linux(pcap_t *p, int busy_poll_usec, int kernel_busy_poll)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	if (busy_poll_usec < 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Negative busy-poll time %d", busy_poll_usec);
+		return (PCAP_ERROR);
+	}
+	if (busy_poll_usec == 0 && kernel_busy_poll) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Kernel busy-polling requires a non-zero busy-poll time");
+		return (PCAP_ERROR);
+	}
+	p->opt.busy_poll_usec = (u_int)busy_poll_usec;
+	p->opt.kernel_busy_poll = kernel_busy_poll;
+	return (0);
+}
+
+int
+pcap_get_busy_poll_stats_linux(pcap_t *p,
+    struct pcap_busy_poll_stats_linux *stats)
+{
+	struct pcap_linux *handlep;
+
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	if (p->activate_op != pcap_activate_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This device doesn't capture with a memory-mapped ring");
+		return (PCAP_ERROR);
+	}
+	handlep = p->priv;
+	*stats = handlep->busy_poll_stats;
+	return (0);
+}
+
+int
+pcap_set_map_filter_linux(pcap_t *p, int key_type, int action,
+    int max_entries)
+{
+	if (pcap_check_activated(p))
+		return (PCAP_ERROR_ACTIVATED);
+	switch (key_type) {
+
+	case PCAP_MAP_FILTER_IPV4_HOST:
+	case PCAP_MAP_FILTER_PORT:
+		break;
+
+	default:
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Unknown map filter key type %d", key_type);
+		return (PCAP_ERROR);
+	}
+	if (action != PCAP_MAP_FILTER_DROP && action != PCAP_MAP_FILTER_ACCEPT) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Unknown map filter action %d", action);
+		return (PCAP_ERROR);
+	}
+	if (max_entries <= 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "Map filter size %d isn't positive", max_entries);
+		return (PCAP_ERROR);
+	}
+	p->opt.map_filter_key_type = key_type;
+	p->opt.map_filter_action = action;
+	p->opt.map_filter_max_entries = (u_int)max_entries;
+	return (0);
+}
+
+/*
+ * Add keys to, or remove them from, the map that the socket filter
+ * checks; the filter program itself isn't touched.
+ */
+static int
+map_filter_update(pcap_t *p, const bpf_u_int32 *keys, int count, int cmd)
+{
+	struct pcap_linux *handlep;
+	union ebpf_attr attr;
+	bpf_u_int32 value = 1;
+	int i;
+#ifdef PCAP_SUPPORT_LINUX_MULTI
+	const struct pcap_multi_if_linux *ifs;
+	int n;
+#endif
+
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+#ifdef PCAP_SUPPORT_LINUX_MULTI
+	/*
+	 * Each of the devices of a multi: device has its own map;
+	 * update all of them.
+	 */
+	if (p->activate_op != pcap_activate_linux &&
+	    p->opt.map_filter_key_type != 0 &&
+	    (n = pcap_get_multi_ifs_linux(p, &ifs)) >= 0) {
+		for (i = 0; i < n; i++) {
+			if (map_filter_update(ifs[i].handle, keys, count,
+			    cmd) != 0) {
+				snprintf(p->errbuf, PCAP_ERRBUF_SIZE, "%s: %s",
+				    ifs[i].name, pcap_geterr(ifs[i].handle));
+				return (PCAP_ERROR);
+			}
+		}
+		return (0);
+	}
+#endif
+	if (p->activate_op != pcap_activate_linux ||
+	    (handlep = p->priv)->map_filter.map_fd == -1) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This handle wasn't set up with pcap_set_map_filter_linux()");
+		return (PCAP_ERROR);
+	}
+	for (i = 0; i < count; i++) {
+		if (handlep->map_filter.key_type == PCAP_MAP_FILTER_PORT &&
+		    keys[i] > 65535) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "%u isn't a valid port number", keys[i]);
+			return (PCAP_ERROR);
+		}
+		memset(&attr, 0, sizeof(attr));
+		attr.elem.map_fd = handlep->map_filter.map_fd;
+		attr.elem.key = (__u64)(unsigned long)&keys[i];
+		if (cmd == EBPF_MAP_UPDATE_ELEM) {
+			attr.elem.value = (__u64)(unsigned long)&value;
+			attr.elem.flags = EBPF_ANY;
+		}
+		if (pcap_sys_bpf(cmd, &attr) == -1) {
+			/*
+			 * Removing a key that isn't there isn't an
+			 * error.
+			 */
+			if (cmd == EBPF_MAP_DELETE_ELEM && errno == ENOENT)
+				continue;
+			if (errno == E2BIG) {
+				snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+				    "The map filter already has its maximum of %u keys",
+				    p->opt.map_filter_max_entries);
+			} else {
+				pcap_fmt_errmsg_for_errno(p->errbuf,
+				    PCAP_ERRBUF_SIZE, errno,
+				    "Can't update the map filter");
+			}
+			return (PCAP_ERROR);
+		}
+	}
+	return (0);
+}
+
+int
+pcap_map_filter_add_linux(pcap_t *p, const bpf_u_int32 *keys, int count)
+{
+	return (map_filter_update(p, keys, count, EBPF_MAP_UPDATE_ELEM));
+}
+
+int
+pcap_map_filter_delete_linux(pcap_t *p, const bpf_u_int32 *keys, int count)
+{
+	return (map_filter_update(p, keys, count, EBPF_MAP_DELETE_ELEM));
+}
+
+int
+pcap_get_ring_params_linux(pcap_t *p, struct pcap_ring_params_linux *params)
+{
+	struct pcap_linux *handlep;
+
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	if (p->activate_op != pcap_activate_linux) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This device doesn't capture with a memory-mapped ring");
+		return (PCAP_ERROR);
+	}
+	handlep = p->priv;
+	*params = handlep->ring_params;
+	return (0);
+}
+
 /*
  * Libpcap version string.
  */
@@ -0,0 +1,667 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture on several devices with one handle.
+ *
+ * The device name is "multi:{device},{device},..."; each device is
+ * a device name that pcap_create() accepts, or a network interface
+ * index.  We open a capture handle of our own for each of them, in
+ * non-blocking mode, and put their selectable descriptors into an
+ * epoll set; a read services every device that has packets, and
+ * waits on the epoll set, rather than on each device in turn, if none
+ * do.
+ *
+ * Each packet is tagged, in its metadata, with the position of its
+ * device in the list - which is the interface ID it would have in a
+ * pcapng file with one IDB per device, in that order - and with the
+ * link-layer header type of that device, as the devices need not all
+ * have the same one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pcap-int.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+
+#include "pcap-multi-linux.h"
+
+#define MULTI_IFACE	"multi"
+
+/*
+ * Private data for capturing on several devices.
+ */
+struct pcap_multi {
+	struct pcap_multi_if_linux *ifs; /* the devices */
+	char	**names;		/* our copies of their names */
+	int	if_count;		/* number of devices */
+	int	next_if;		/* device to service first on the next read */
+	int	epoll_fd;		/* epoll set with the devices' descriptors */
+	int	poll_breakloop_fd;	/* eventfd to break out of epoll_wait() */
+	int	nonblock;		/* non-blocking mode */
+	u_char	*oneshot_buffer;	/* buffer for copy of packet */
+};
+
+/*
+ * State passed through a device's pcap_dispatch() to our callback.
+ */
+struct multi_dispatch_ctx {
+	pcap_t	*handle;		/* our handle */
+	int	id;			/* position of the device in the list */
+	pcap_handler callback;		/* caller's callback */
+	u_char	*user;			/* caller's callback argument */
+};
+
+#define MULTI_BREAKLOOP_ID	(-1)	/* epoll data for the breakloop eventfd */
+
+static void
+multi_callback(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+	struct multi_dispatch_ctx *ctx = (struct multi_dispatch_ctx *)user;
+	pcap_t *handle = ctx->handle;
+	struct pcap_multi *handlep = handle->priv;
+	const struct pcap_multi_if_linux *ifp = &handlep->ifs[ctx->id];
+
+	/*
+	 * Start with whatever the device supplied, and add where the
+	 * packet came from.
+	 */
+	handle->pkt_meta = ifp->handle->pkt_meta;
+	handle->pkt_meta.present |= PCAP_PKT_META_INTERFACE;
+	handle->pkt_meta.interface_id = (u_int)ctx->id;
+	handle->pkt_meta.linktype = ifp->linktype;
+	if (!(handle->pkt_meta.present & PCAP_PKT_META_IFINDEX) &&
+	    ifp->ifindex != 0) {
+		handle->pkt_meta.present |= PCAP_PKT_META_IFINDEX;
+		handle->pkt_meta.ifindex = ifp->ifindex;
+	}
+	ctx->callback(ctx->user, h, bytes);
+}
+
+static void
+multi_oneshot(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+	struct oneshot_userdata *sp = (struct oneshot_userdata *)user;
+	pcap_t *handle = sp->pd;
+	struct pcap_multi *handlep = handle->priv;
+
+	/*
+	 * The packet is in the device's buffer, which may be handed
+	 * back to the kernel as soon as we return, so copy it.
+	 */
+	*sp->hdr = *h;
+	memcpy(handlep->oneshot_buffer, bytes, h->caplen);
+	*sp->pkt = handlep->oneshot_buffer;
+}
+
+static int
+multi_read_linux(pcap_t *handle, int max_packets, pcap_handler callback,
+    u_char *user)
+{
+	struct pcap_multi *handlep = handle->priv;
+	struct multi_dispatch_ctx ctx;
+	struct epoll_event event;
+	int count = 0;
+	int i, id, ret;
+
+	ctx.handle = handle;
+	ctx.callback = callback;
+	ctx.user = user;
+	for (;;) {
+		/*
+		 * Service every device, starting with a different one
+		 * each time, so that a busy device early in the list
+		 * can't starve the ones after it when max_packets
+		 * is limited.
+		 */
+		for (i = 0; i < handlep->if_count; i++) {
+			/*
+			 * Has "pcap_breakloop()" been called?
+			 */
+			if (handle->break_loop) {
+				/*
+				 * Yes - clear the flag that indicates that it
+				 * has, and return PCAP_ERROR_BREAK to indicate
+				 * that we were told to break out of the loop.
+				 */
+				handle->break_loop = 0;
+				return PCAP_ERROR_BREAK;
+			}
+			if (!PACKET_COUNT_IS_UNLIMITED(max_packets) &&
+			    count >= max_packets)
+				break;
+
+			id = (handlep->next_if + i) % handlep->if_count;
+			ctx.id = id;
+			ret = pcap_dispatch(handlep->ifs[id].handle,
+			    PACKET_COUNT_IS_UNLIMITED(max_packets) ?
+			    -1 : max_packets - count,
+			    multi_callback, (u_char *)&ctx);
+			if (ret < 0 && ret != PCAP_ERROR_BREAK) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "%s: %s", handlep->ifs[id].name,
+				    pcap_geterr(handlep->ifs[id].handle));
+				return PCAP_ERROR;
+			}
+			if (ret > 0)
+				count += ret;
+		}
+		handlep->next_if = (handlep->next_if + 1) % handlep->if_count;
+		if (count != 0)
+			return count;
+		if (handlep->nonblock)
+			return 0;
+
+		/*
+		 * Nothing was available; wait for some device to have
+		 * packets, for the timeout, or for a pcap_breakloop().
+		 */
+		ret = epoll_wait(handlep->epoll_fd, &event, 1,
+		    handle->opt.timeout > 0 ? handle->opt.timeout : -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			pcap_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "epoll_wait");
+			return PCAP_ERROR;
+		}
+		if (ret == 0)
+			return 0;	/* timed out */
+		if (event.data.u32 == (uint32_t)MULTI_BREAKLOOP_ID) {
+			uint64_t value;
+
+			(void)read(handlep->poll_breakloop_fd, &value,
+			    sizeof(value));
+		}
+	}
+}
+
+static int
+multi_inject_linux(pcap_t *handle, const void *buf _U_, int size _U_)
+{
+	snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+	    "Packet injection is not supported on multi: devices; use the handle for the device on which to send");
+	return (-1);
+}
+
+static int
+multi_setfilter_linux(pcap_t *handle, struct bpf_program *fp)
+{
+	struct pcap_multi *handlep = handle->priv;
+	int i;
+
+	/*
+	 * The filter was compiled for our link-layer header type and
+	 * code generation flags, which are those of the first device;
+	 * it can't be used on a device with different ones.
+	 */
+	for (i = 0; i < handlep->if_count; i++) {
+		if (handlep->ifs[i].linktype != handle->linktype) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s has a different link-layer header type from %s; set filters on the devices' own handles",
+			    handlep->ifs[i].name, handlep->ifs[0].name);
+			return (-1);
+		}
+		if (handlep->ifs[i].handle->bpf_codegen_flags !=
+		    handle->bpf_codegen_flags) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s needs filters compiled differently from %s; set filters on the devices' own handles",
+			    handlep->ifs[i].name, handlep->ifs[0].name);
+			return (-1);
+		}
+	}
+	for (i = 0; i < handlep->if_count; i++) {
+		if (pcap_setfilter(handlep->ifs[i].handle, fp) == -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s: %s", handlep->ifs[i].name,
+			    pcap_geterr(handlep->ifs[i].handle));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int
+multi_setdirection_linux(pcap_t *handle, pcap_direction_t d)
+{
+	struct pcap_multi *handlep = handle->priv;
+	int i;
+
+	for (i = 0; i < handlep->if_count; i++) {
+		if (pcap_setdirection(handlep->ifs[i].handle, d) == -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s: %s", handlep->ifs[i].name,
+			    pcap_geterr(handlep->ifs[i].handle));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int
+multi_stats_linux(pcap_t *handle, struct pcap_stat *stats)
+{
+	struct pcap_multi *handlep = handle->priv;
+	struct pcap_stat ifstats;
+	int i;
+
+	stats->ps_recv = 0;
+	stats->ps_drop = 0;
+	stats->ps_ifdrop = 0;
+	for (i = 0; i < handlep->if_count; i++) {
+		if (pcap_stats(handlep->ifs[i].handle, &ifstats) == -1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s: %s", handlep->ifs[i].name,
+			    pcap_geterr(handlep->ifs[i].handle));
+			return (-1);
+		}
+		stats->ps_recv += ifstats.ps_recv;
+		stats->ps_drop += ifstats.ps_drop;
+		stats->ps_ifdrop += ifstats.ps_ifdrop;
+	}
+	return (0);
+}
+
+static int
+multi_getnonblock_linux(pcap_t *handle)
+{
+	struct pcap_multi *handlep = handle->priv;
+
+	return (handlep->nonblock);
+}
+
+static int
+multi_setnonblock_linux(pcap_t *handle, int nonblock)
+{
+	struct pcap_multi *handlep = handle->priv;
+
+	/*
+	 * The devices are always in non-blocking mode; it's the
+	 * epoll_wait() that we skip.
+	 */
+	handlep->nonblock = nonblock;
+	return (0);
+}
+
+static void
+multi_breakloop_linux(pcap_t *handle)
+{
+	struct pcap_multi *handlep = handle->priv;
+	uint64_t value = 1;
+
+	pcap_breakloop_common(handle);
+	/* XXX - what if this fails? */
+	(void)write(handlep->poll_breakloop_fd, &value, sizeof(value));
+}
+
+static void
+multi_cleanup_linux(pcap_t *handle)
+{
+	struct pcap_multi *handlep = handle->priv;
+	int i;
+
+	if (handlep->ifs != NULL) {
+		for (i = 0; i < handlep->if_count; i++) {
+			if (handlep->ifs[i].handle != NULL)
+				pcap_close(handlep->ifs[i].handle);
+			free(handlep->names[i]);
+		}
+		free(handlep->ifs);
+		handlep->ifs = NULL;
+		free(handlep->names);
+		handlep->names = NULL;
+		handlep->if_count = 0;
+	}
+	if (handlep->epoll_fd != -1) {
+		close(handlep->epoll_fd);
+		handlep->epoll_fd = -1;
+	}
+	if (handlep->poll_breakloop_fd != -1) {
+		close(handlep->poll_breakloop_fd);
+		handlep->poll_breakloop_fd = -1;
+	}
+	free(handlep->oneshot_buffer);
+	handlep->oneshot_buffer = NULL;
+	pcap_cleanup_live_common(handle);
+}
+
+/*
+ * Open and activate the handle for one device, with our options.
+ * Return the activation status, with any warning or error message,
+ * prefixed with the device name, in our error buffer.
+ */
+static int
+multi_open_if(pcap_t *handle, struct pcap_multi_if_linux *ifp)
+{
+	struct pcap_multi *handlep = handle->priv;
+	char *device;
+	struct epoll_event event;
+	int status, fd;
+
+	ifp->handle = pcap_create(ifp->name, handle->errbuf);
+	if (ifp->handle == NULL)
+		return PCAP_ERROR;
+
+	/*
+	 * Give it our options, other than those that only make sense
+	 * for one device: a PACKET_FANOUT group can't span devices,
+	 * we don't transmit, and we do the waiting.
+	 */
+	device = ifp->handle->opt.device;
+	ifp->handle->opt = handle->opt;
+	ifp->handle->opt.device = device;
+	ifp->handle->opt.nonblock = 1;
+	ifp->handle->opt.fanout_enabled = 0;
+	ifp->handle->opt.tx_ring_size = 0;
+	ifp->handle->opt.busy_poll_usec = 0;
+	ifp->handle->opt.kernel_busy_poll = 0;
+	ifp->handle->snapshot = handle->snapshot;
+
+	status = pcap_activate(ifp->handle);
+	if (status < 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "%s: %s",
+		    ifp->name, pcap_geterr(ifp->handle));
+		return status;
+	}
+	if (status > 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE, "%s: %s",
+		    ifp->name, pcap_geterr(ifp->handle));
+	}
+
+	fd = pcap_get_selectable_fd(ifp->handle);
+	if (fd == -1) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "%s can't be waited on, so it can't be part of a multi: device",
+		    ifp->name);
+		return PCAP_ERROR;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = (uint32_t)(ifp - handlep->ifs);
+	if (epoll_ctl(handlep->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_ctl");
+		return PCAP_ERROR;
+	}
+
+	ifp->ifindex = (int)if_nametoindex(ifp->name);
+	ifp->linktype = pcap_datalink(ifp->handle);
+	ifp->snaplen = pcap_snapshot(ifp->handle);
+	return status;
+}
+
+static int
+multi_activate(pcap_t* handle)
+{
+	struct pcap_multi *handlep = handle->priv;
+	const char *cp, *comma;
+	char ifname[IF_NAMESIZE];
+	char *name;
+	size_t len;
+	int count, i, status, ret, snaplen;
+	struct epoll_event event;
+
+	handlep->epoll_fd = -1;
+	handlep->poll_breakloop_fd = -1;
+
+	if (handle->opt.rfmon) {
+		/*
+		 * Monitor mode would have to be set on each device.
+		 */
+		return PCAP_ERROR_RFMON_NOTSUP;
+	}
+
+	/*
+	 * Count the devices in "multi:{device},{device},...".
+	 */
+	cp = handle->opt.device + sizeof MULTI_IFACE;
+	count = 1;
+	for (comma = cp; (comma = strchr(comma, ',')) != NULL; comma++)
+		count++;
+	handlep->ifs = calloc(count, sizeof(*handlep->ifs));
+	handlep->names = calloc(count, sizeof(*handlep->names));
+	if (handlep->ifs == NULL || handlep->names == NULL) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "calloc");
+		free(handlep->ifs);
+		handlep->ifs = NULL;
+		free(handlep->names);
+		handlep->names = NULL;
+		return PCAP_ERROR;
+	}
+
+	handlep->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (handlep->epoll_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_create1");
+		goto fail;
+	}
+	handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK);
+	if (handlep->poll_breakloop_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create eventfd");
+		goto fail;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = (uint32_t)MULTI_BREAKLOOP_ID;
+	if (epoll_ctl(handlep->epoll_fd, EPOLL_CTL_ADD,
+	    handlep->poll_breakloop_fd, &event) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "epoll_ctl");
+		goto fail;
+	}
+
+	status = 0;
+	for (i = 0; i < count; i++) {
+		comma = strchr(cp, ',');
+		len = comma != NULL ? (size_t)(comma - cp) : strlen(cp);
+		if (len == 0) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Empty device name in %s", handle->opt.device);
+			goto fail;
+		}
+		name = malloc(len + 1);
+		if (name == NULL) {
+			pcap_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno, "malloc");
+			goto fail;
+		}
+		memcpy(name, cp, len);
+		name[len] = '\0';
+		handlep->ifs[i].name = handlep->names[i] = name;
+		handlep->if_count++;
+		cp += len + 1;
+
+		if (strncmp(name, MULTI_IFACE ":", sizeof MULTI_IFACE) == 0) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "multi: devices can't be nested");
+			goto fail;
+		}
+
+		/*
+		 * If it's all digits, and there's no device with that
+		 * name, it's an interface index.
+		 */
+		if (strspn(name, "0123456789") == len &&
+		    if_nametoindex(name) == 0) {
+			if (if_indextoname((unsigned int)strtoul(name, NULL, 10),
+			    ifname) == NULL) {
+				snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+				    "No interface with index %s", name);
+				ret = PCAP_ERROR_NO_SUCH_DEVICE;
+				goto fail_status;
+			}
+			free(name);
+			name = strdup(ifname);
+			handlep->ifs[i].name = handlep->names[i] = name;
+			if (name == NULL) {
+				pcap_fmt_errmsg_for_errno(handle->errbuf,
+				    PCAP_ERRBUF_SIZE, errno, "strdup");
+				goto fail;
+			}
+		}
+
+		ret = multi_open_if(handle, &handlep->ifs[i]);
+		if (ret < 0)
+			goto fail_status;
+		if (ret > 0 && status == 0) {
+			/*
+			 * Report the first warning; the message is
+			 * already in our error buffer.
+			 */
+			status = ret;
+		}
+	}
+
+	/*
+	 * The handle as a whole has the link-layer header type of the
+	 * first device, and a snapshot length big enough for any of
+	 * them.
+	 */
+	snaplen = 0;
+	for (i = 0; i < handlep->if_count; i++) {
+		if (handlep->ifs[i].snaplen > snaplen)
+			snaplen = handlep->ifs[i].snaplen;
+	}
+	handle->snapshot = snaplen;
+	handle->linktype = handlep->ifs[0].linktype;
+	handle->bufsize = snaplen;
+
+	/*
+	 * Filters are compiled on the handle as a whole and run on
+	 * the devices' handles, so they have to agree on how to
+	 * generate code, such as whether VLAN tags are in the packet
+	 * data or have been stripped by the kernel.
+	 */
+	handle->bpf_codegen_flags = handlep->ifs[0].handle->bpf_codegen_flags;
+	for (i = 1; i < handlep->if_count; i++) {
+		if (handlep->ifs[i].handle->bpf_codegen_flags !=
+		    handle->bpf_codegen_flags) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "%s and %s need filters compiled differently, so they can't be part of the same multi: device",
+			    handlep->ifs[0].name, handlep->ifs[i].name);
+			goto fail;
+		}
+	}
+	handlep->oneshot_buffer = malloc(snaplen);
+	if (handlep->oneshot_buffer == NULL) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		goto fail;
+	}
+
+	handle->read_op = multi_read_linux;
+	handle->inject_op = multi_inject_linux;
+	handle->setfilter_op = multi_setfilter_linux;
+	handle->setdirection_op = multi_setdirection_linux;
+	handle->set_datalink_op = NULL;	/* can't change data link type */
+	handle->getnonblock_op = multi_getnonblock_linux;
+	handle->setnonblock_op = multi_setnonblock_linux;
+	handle->stats_op = multi_stats_linux;
+	handle->breakloop_op = multi_breakloop_linux;
+	handle->cleanup_op = multi_cleanup_linux;
+	handle->oneshot_callback = multi_oneshot;
+	handlep->nonblock = handle->opt.nonblock;
+
+	/*
+	 * The epoll descriptor becomes readable when any of the
+	 * devices has packets, so it can be used in an event loop.
+	 */
+	handle->selectable_fd = handlep->epoll_fd;
+	return status;
+
+fail:
+	ret = PCAP_ERROR;
+fail_status:
+	multi_cleanup_linux(handle);
+	return ret;
+}
+
+int
+pcap_get_multi_ifs_linux(pcap_t *p, const struct pcap_multi_if_linux **ifsp)
+{
+	struct pcap_multi *handlep;
+
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	if (p->activate_op != multi_activate) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "This isn't a multi: device");
+		return (PCAP_ERROR);
+	}
+	handlep = p->priv;
+	*ifsp = handlep->ifs;
+	return (handlep->if_count);
+}
+
+pcap_t *
+multi_create(const char *device, char *ebuf, int *is_ours)
+{
+	pcap_t *p;
+
+	/* Does it begin with MULTI_IFACE followed by a colon? */
+	if (strncmp(device, MULTI_IFACE ":", sizeof MULTI_IFACE) != 0) {
+		/* Nope */
+		*is_ours = 0;
+		return NULL;
+	}
+
+	/* OK, it's probably ours. */
+	*is_ours = 1;
+
+	p = PCAP_CREATE_COMMON(ebuf, struct pcap_multi);
+	if (p == NULL)
+		return (NULL);
+
+	p->activate_op = multi_activate;
+	return (p);
+}
+
+int
+multi_findalldevs(pcap_if_list_t *devlistp _U_, char *err_str _U_)
+{
+	/*
+	 * Any set of devices can be opened as a multi: device, and
+	 * the devices themselves are already in the list, so there's
+	 * nothing to add.
+	 */
+	return 0;
+}
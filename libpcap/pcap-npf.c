@@ -1723,6 +1723,7 @@ pcap_setfilter_npf(pcap_t *p, struct bpf_program *fp)
 	 * It worked.
 	 */
 	pw->filtering_in_kernel = 1;	/* filtering in the kernel */
+	p->fcode_in_kernel = 1;
 
 	/*
 	 * Discard any previously-received packets, as they might have
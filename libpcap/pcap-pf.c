@@ -627,6 +627,7 @@ pcap_setfilter_pf(pcap_t *p, struct bpf_program *fp)
 			 */
 			fprintf(stderr, "tcpdump: Using kernel BPF filter\n");
 			pf->filtering_in_kernel = 1;
+			p->fcode_in_kernel = 1;
 
 			/*
 			 * Discard any previously-received packets,
@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2026 The Tcpdump Group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ * products derived from this software without specific prior written
+ * permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture with AF_XDP sockets.
+ *
+ * The device name is "xdp:{interface}" or "xdp:{interface}:{queue}";
+ * the queue defaults to 0.  We register a UMEM for the socket, give
+ * all of its frames to the kernel through the fill ring, bind the
+ * socket to that queue of the interface, and attach a small XDP
+ * program to the interface that redirects packets arriving on that
+ * queue to our socket through an XSKMAP.  Packets arriving on other
+ * queues are passed up the stack as usual.
+ *
+ * XDP can't copy a packet, so the packets we capture never reach the
+ * host's network stack; as a capture device mustn't change how the host
+ * handles packets behind the caller's back, we refuse to activate unless
+ * the caller has asked for that with pcap_set_xdp_divert_linux().
+ *
+ * The packets are handed to the callback straight out of the UMEM;
+ * the frame is given back to the kernel once the callback returns.
+ *
+ * We try to attach the program in driver mode first and, if the
+ * driver doesn't support XDP, fall back on generic ("SKB") mode, so
+ * this works on any interface, including veth devices.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "pcap-int.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+
+#include <linux/types.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "pcap-ebpf-linux.h"
+#include "pcap-xdp-linux.h"
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+#define XDP_IFACE	"xdp"
+
+/*
+ * As in pcap-linux.c, not all compilers that are used to compile code
+ * to run on Linux have these builtins.
+ */
+#ifndef HAVE___ATOMIC_LOAD_N
+#define __atomic_load_n(ptr, memory_model)		(*(ptr))
+#endif
+#ifndef HAVE___ATOMIC_STORE_N
+#define __atomic_store_n(ptr, val, memory_model)	*(ptr) = (val)
+#endif
+
+/*
+ * The bits of the bpf() system call interface that only XDP uses;
+ * the rest are in pcap-ebpf-linux.h.
+ */
+#define EBPF_MAP_TYPE_XSKMAP	17
+#define EBPF_PROG_TYPE_XDP	6
+#define EBPF_FUNC_redirect_map	51
+
+#define XDP_MD_RX_QUEUE_INDEX	16	/* offsetof(struct xdp_md, rx_queue_index) */
+#define XDP_ACTION_PASS		2	/* XDP_PASS */
+
+/*
+ * Size of a UMEM frame; each packet goes into one frame, so this
+ * limits the size of the packets we can capture.
+ */
+#define XDP_FRAME_SIZE	2048
+
+/*
+ * Number of descriptors to handle between updates of the ring
+ * pointers shared with the kernel.
+ */
+#define XDP_BATCH_SIZE	64
+
+/*
+ * A ring shared with the kernel.
+ */
+struct xdp_ring {
+	void	*map;		/* mapped region */
+	size_t	maplen;		/* size of mapped region */
+	__u32	*producer;
+	__u32	*consumer;
+	void	*descs;		/* descriptors - __u64 addresses or struct xdp_descs */
+	__u32	mask;		/* number of entries - 1 */
+};
+
+/*
+ * Private data for capturing on AF_XDP sockets.
+ */
+struct pcap_xdp {
+	u_char	*umem;		/* packet buffer memory shared with the kernel */
+	size_t	umem_len;
+	u_int	frame_nr;	/* number of frames in the UMEM */
+	struct xdp_ring fill;	/* frames we give to the kernel */
+	struct xdp_ring comp;	/* completion ring - unused, as we don't send */
+	struct xdp_ring rx;	/* received packets */
+	int	ifindex;
+	u_int	queue_id;
+	__u32	xdp_flags;	/* XDP_FLAGS_ value with which the program was attached */
+	int	map_fd;		/* XSKMAP */
+	int	prog_fd;	/* redirecting XDP program */
+	int	nonblock;
+	int	poll_breakloop_fd; /* eventfd to wake up a blocked poll() */
+	u_int	packets_read;
+};
+
+/*
+ * Map one of the rings of the socket.
+ */
+static int
+xdp_map_ring(pcap_t *handle, struct xdp_ring *ring,
+    const struct xdp_ring_offset *off, u_int nentries, size_t desc_size,
+    off_t pgoff, const char *what)
+{
+	ring->maplen = off->desc + nentries * desc_size;
+	ring->map = mmap(NULL, ring->maplen, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, handle->fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't mmap %s ring", what);
+		return -1;
+	}
+	ring->producer = (__u32 *)((u_char *)ring->map + off->producer);
+	ring->consumer = (__u32 *)((u_char *)ring->map + off->consumer);
+	ring->descs = (u_char *)ring->map + off->desc;
+	ring->mask = nentries - 1;
+	return 0;
+}
+
+static void
+xdp_unmap_ring(struct xdp_ring *ring)
+{
+	if (ring->map != NULL) {
+		(void)munmap(ring->map, ring->maplen);
+		ring->map = NULL;
+	}
+}
+
+/*
+ * Attach the program to the interface, or, if prog_fd is -1, detach
+ * it, with an RTM_SETLINK netlink request.
+ */
+static int
+xdp_set_link_prog(int ifindex, int prog_fd, __u32 flags, char *errbuf)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifinfo;
+		char attrbuf[64];
+	} req;
+	struct {
+		struct nlmsghdr nh;
+		struct nlmsgerr err;
+		char pad[64];
+	} resp;
+	struct sockaddr_nl sa;
+	struct rtattr *nest, *rta;
+	ssize_t len;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sock == -1) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't open rtnetlink socket");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.nh.nlmsg_type = RTM_SETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+	req.nh.nlmsg_seq = 1;
+	req.ifinfo.ifi_family = AF_UNSPEC;
+	req.ifinfo.ifi_index = ifindex;
+
+	/* IFLA_XDP, containing IFLA_XDP_FD and IFLA_XDP_FLAGS */
+	nest = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+	nest->rta_len = RTA_LENGTH(0);
+
+	rta = (struct rtattr *)((char *)nest + RTA_ALIGN(nest->rta_len));
+	rta->rta_type = IFLA_XDP_FD;
+	rta->rta_len = RTA_LENGTH(sizeof(int));
+	memcpy(RTA_DATA(rta), &prog_fd, sizeof(int));
+	nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+	rta = (struct rtattr *)((char *)nest + RTA_ALIGN(nest->rta_len));
+	rta->rta_type = IFLA_XDP_FLAGS;
+	rta->rta_len = RTA_LENGTH(sizeof(__u32));
+	memcpy(RTA_DATA(rta), &flags, sizeof(__u32));
+	nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->rta_len;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (sendto(sock, &req, req.nh.nlmsg_len, 0,
+	    (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't send rtnetlink request");
+		close(sock);
+		return -1;
+	}
+	len = recv(sock, &resp, sizeof(resp), 0);
+	if (len == -1) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't read rtnetlink reply");
+		close(sock);
+		return -1;
+	}
+	close(sock);
+	if ((size_t)len >= NLMSG_LENGTH(sizeof(struct nlmsgerr)) &&
+	    resp.nh.nlmsg_type == NLMSG_ERROR && resp.err.error != 0) {
+		errno = -resp.err.error;
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't attach XDP program");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Create the XSKMAP, put our socket into it, and load the program
+ *
+ *	r2 = ctx->rx_queue_index
+ *	return bpf_redirect_map(&xskmap, r2, XDP_PASS)
+ *
+ * which hands packets for our queue to the socket and passes the rest
+ * on to the stack (with kernels before 5.3, which don't support a
+ * default action in the flags, the rest are dropped).
+ */
+static int
+xdp_load_prog(pcap_t *handle)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	union ebpf_attr attr;
+	__u32 key;
+	int sock_fd;
+	struct ebpf_insn insns[] = {
+		/* r2 = *(u32 *)(r1 + offsetof(struct xdp_md, rx_queue_index)) */
+		{ BPF_LDX|BPF_W|BPF_MEM, 2, 1, XDP_MD_RX_QUEUE_INDEX, 0 },
+		/* r1 = map fd (two-instruction 64-bit load) */
+		{ BPF_LD|EBPF_DW|BPF_IMM, 1, EBPF_PSEUDO_MAP_FD, 0, 0 },
+		{ 0, 0, 0, 0, 0 },
+		/* r3 = XDP_PASS */
+		{ EBPF_ALU64|EBPF_MOV|BPF_K, 3, 0, 0, XDP_ACTION_PASS },
+		/* r0 = bpf_redirect_map(r1, r2, r3) */
+		{ BPF_JMP|EBPF_CALL, 0, 0, 0, EBPF_FUNC_redirect_map },
+		{ BPF_JMP|EBPF_EXIT, 0, 0, 0, 0 },
+	};
+	static const char license[] = "BSD";
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map.map_type = EBPF_MAP_TYPE_XSKMAP;
+	attr.map.key_size = sizeof(__u32);
+	attr.map.value_size = sizeof(int);
+	attr.map.max_entries = handlep->queue_id + 1;
+	handlep->map_fd = pcap_sys_bpf(EBPF_MAP_CREATE, &attr);
+	if (handlep->map_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create XSKMAP");
+		return -1;
+	}
+
+	key = handlep->queue_id;
+	sock_fd = handle->fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.elem.map_fd = handlep->map_fd;
+	attr.elem.key = (__u64)(unsigned long)&key;
+	attr.elem.value = (__u64)(unsigned long)&sock_fd;
+	attr.elem.flags = EBPF_ANY;
+	if (pcap_sys_bpf(EBPF_MAP_UPDATE_ELEM, &attr) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't add socket to XSKMAP");
+		return -1;
+	}
+
+	insns[1].imm = handlep->map_fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog.prog_type = EBPF_PROG_TYPE_XDP;
+	attr.prog.insns = (__u64)(unsigned long)insns;
+	attr.prog.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.prog.license = (__u64)(unsigned long)license;
+	handlep->prog_fd = pcap_sys_bpf(EBPF_PROG_LOAD, &attr);
+	if (handlep->prog_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't load XDP program");
+		return -1;
+	}
+
+	/*
+	 * Don't replace a program someone else attached.  Try
+	 * driver mode and, if that fails, generic mode.
+	 */
+	handlep->xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST|XDP_FLAGS_DRV_MODE;
+	if (xdp_set_link_prog(handlep->ifindex, handlep->prog_fd,
+	    handlep->xdp_flags, handle->errbuf) == 0)
+		return 0;
+	if (errno == EBUSY || errno == EEXIST) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "%s already has an XDP program attached",
+		    handle->opt.device);
+		handlep->xdp_flags = 0;
+		return -1;
+	}
+	handlep->xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST|XDP_FLAGS_SKB_MODE;
+	if (xdp_set_link_prog(handlep->ifindex, handlep->prog_fd,
+	    handlep->xdp_flags, handle->errbuf) == 0)
+		return 0;
+	handlep->xdp_flags = 0;
+	return -1;
+}
+
+static int
+xdp_read_linux(pcap_t *handle, int max_packets, pcap_handler callback, u_char *user)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	struct xdp_desc *descs = handlep->rx.descs;
+	__u64 *fill_addrs = handlep->fill.descs;
+	struct pcap_pkthdr pkth;
+	struct pollfd pollinfo[2];
+	struct timespec ts;
+	__u32 prod, cons, fill_prod;
+	int count = 0;
+	int ret;
+
+	/*
+	 * Wait for packets, unless there are some already.
+	 */
+	for (;;) {
+		/*
+		 * Has "pcap_breakloop()" been called?
+		 */
+		if (handle->break_loop) {
+			/*
+			 * Yes - clear the flag that indicates that it
+			 * has, and return PCAP_ERROR_BREAK to indicate
+			 * that we were told to break out of the loop.
+			 */
+			handle->break_loop = 0;
+			return PCAP_ERROR_BREAK;
+		}
+		prod = __atomic_load_n(handlep->rx.producer, __ATOMIC_ACQUIRE);
+		cons = *handlep->rx.consumer;
+		if (prod != cons)
+			break;
+
+		pollinfo[0].fd = handle->fd;
+		pollinfo[0].events = POLLIN;
+		pollinfo[1].fd = handlep->poll_breakloop_fd;
+		pollinfo[1].events = POLLIN;
+		ret = poll(pollinfo, 2, handlep->nonblock ? 0 :
+		    (handle->opt.timeout > 0 ? handle->opt.timeout : -1));
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			pcap_fmt_errmsg_for_errno(handle->errbuf,
+			    PCAP_ERRBUF_SIZE, errno,
+			    "Can't poll on AF_XDP socket");
+			return PCAP_ERROR;
+		}
+		if (ret == 0)
+			return 0;	/* timed out, or non-blocking */
+		if (pollinfo[1].revents & POLLIN) {
+			uint64_t value;
+
+			(void)read(handlep->poll_breakloop_fd, &value,
+			    sizeof(value));
+		}
+		if (pollinfo[0].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Error condition on AF_XDP socket");
+			return PCAP_ERROR;
+		}
+	}
+
+	/*
+	 * AF_XDP doesn't give us time stamps; use the time at which
+	 * we picked up this batch.
+	 */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pkth.ts.tv_sec = ts.tv_sec;
+	if (handle->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO)
+		pkth.ts.tv_usec = ts.tv_nsec;
+	else
+		pkth.ts.tv_usec = ts.tv_nsec / 1000;
+
+	fill_prod = *handlep->fill.producer;
+	while (cons != prod &&
+	    (count < max_packets || PACKET_COUNT_IS_UNLIMITED(max_packets))) {
+		const struct xdp_desc *desc = &descs[cons & handlep->rx.mask];
+		u_char *bp = handlep->umem + desc->addr;
+
+		pkth.len = desc->len;
+		pkth.caplen = desc->len;
+		if (pkth.caplen > (bpf_u_int32)handle->snapshot)
+			pkth.caplen = handle->snapshot;
+
+		if (handle->fcode.bf_insns == NULL ||
+		    pcap_run_filter(handle, bp, pkth.len, pkth.caplen)) {
+			handlep->packets_read++;
+			callback(user, &pkth, bp);
+			count++;
+		}
+
+		/*
+		 * Give the frame back to the kernel.  The fill ring has
+		 * room for every frame, so it can't be full.
+		 */
+		fill_addrs[fill_prod & handlep->fill.mask] =
+		    desc->addr - (desc->addr % XDP_FRAME_SIZE);
+		fill_prod++;
+		cons++;
+
+		if ((cons & (XDP_BATCH_SIZE - 1)) == 0) {
+			__atomic_store_n(handlep->rx.consumer, cons, __ATOMIC_RELEASE);
+			__atomic_store_n(handlep->fill.producer, fill_prod, __ATOMIC_RELEASE);
+		}
+		if (handle->break_loop) {
+			handle->break_loop = 0;
+			count = PCAP_ERROR_BREAK;
+			break;
+		}
+	}
+	__atomic_store_n(handlep->rx.consumer, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(handlep->fill.producer, fill_prod, __ATOMIC_RELEASE);
+	return count;
+}
+
+static int
+xdp_inject_linux(pcap_t *handle, const void *buf _U_, int size _U_)
+{
+	pcap_strlcpy(handle->errbuf,
+	    "Packet injection is not supported on AF_XDP devices",
+	    PCAP_ERRBUF_SIZE);
+	return (-1);
+}
+
+static int
+xdp_stats_linux(pcap_t *handle, struct pcap_stat *stats)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	struct xdp_statistics xstats;
+	socklen_t len = sizeof(xstats);
+
+	memset(&xstats, 0, sizeof(xstats));
+	if (getsockopt(handle->fd, SOL_XDP, XDP_STATISTICS, &xstats, &len) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't get AF_XDP statistics");
+		return -1;
+	}
+	stats->ps_recv = handlep->packets_read;
+	stats->ps_drop = (u_int)xstats.rx_dropped;
+#ifdef HAVE_STRUCT_XDP_STATISTICS_RX_RING_FULL
+	stats->ps_drop += (u_int)xstats.rx_ring_full;
+#endif
+	stats->ps_ifdrop = (u_int)xstats.rx_invalid_descs;
+	return 0;
+}
+
+static int
+xdp_getnonblock_linux(pcap_t *handle)
+{
+	struct pcap_xdp *handlep = handle->priv;
+
+	return (handlep->nonblock);
+}
+
+static int
+xdp_setnonblock_linux(pcap_t *handle, int nonblock)
+{
+	struct pcap_xdp *handlep = handle->priv;
+
+	handlep->nonblock = nonblock;
+	return (0);
+}
+
+static void
+xdp_breakloop_linux(pcap_t *handle)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	uint64_t value = 1;
+
+	pcap_breakloop_common(handle);
+	/* XXX - what if this fails? */
+	(void)write(handlep->poll_breakloop_fd, &value, sizeof(value));
+}
+
+static void
+xdp_cleanup_linux(pcap_t *handle)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	if (handlep->xdp_flags != 0) {
+		/*
+		 * Detach our program; there's nothing we can do if
+		 * that fails.
+		 */
+		(void)xdp_set_link_prog(handlep->ifindex, -1,
+		    handlep->xdp_flags & ~XDP_FLAGS_UPDATE_IF_NOEXIST, errbuf);
+		handlep->xdp_flags = 0;
+	}
+	if (handlep->prog_fd != -1) {
+		close(handlep->prog_fd);
+		handlep->prog_fd = -1;
+	}
+	if (handlep->map_fd != -1) {
+		close(handlep->map_fd);
+		handlep->map_fd = -1;
+	}
+	xdp_unmap_ring(&handlep->rx);
+	xdp_unmap_ring(&handlep->fill);
+	xdp_unmap_ring(&handlep->comp);
+	if (handlep->poll_breakloop_fd != -1) {
+		close(handlep->poll_breakloop_fd);
+		handlep->poll_breakloop_fd = -1;
+	}
+	/*
+	 * Close the socket before we unmap the UMEM that it uses.
+	 */
+	pcap_cleanup_live_common(handle);
+	if (handlep->umem != NULL) {
+		(void)munmap(handlep->umem, handlep->umem_len);
+		handlep->umem = NULL;
+	}
+}
+
+static int
+xdp_activate(pcap_t* handle)
+{
+	struct pcap_xdp *handlep = handle->priv;
+	const char *dev = handle->opt.device;
+	char ifname[IF_NAMESIZE];
+	const char *cp, *colon;
+	char *end;
+	unsigned long queue;
+	size_t namelen;
+	struct xdp_umem_reg umem_reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t optlen;
+	u_int ring_size, i;
+	__u64 *fill_addrs;
+
+	handlep->map_fd = -1;
+	handlep->prog_fd = -1;
+	handlep->poll_breakloop_fd = -1;
+
+	/* Parse "xdp:{interface}[:{queue}]" */
+	cp = dev + sizeof XDP_IFACE;
+	colon = strchr(cp, ':');
+	namelen = colon != NULL ? (size_t)(colon - cp) : strlen(cp);
+	queue = 0;
+	if (colon != NULL) {
+		errno = 0;
+		queue = strtoul(colon + 1, &end, 10);
+		if (colon[1] == '\0' || *end != '\0' || errno != 0 ||
+		    queue > UINT_MAX - 1) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Invalid queue number in device name %s", dev);
+			return PCAP_ERROR;
+		}
+	}
+	if (namelen == 0 || namelen >= sizeof(ifname)) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "Invalid interface name in device name %s", dev);
+		return PCAP_ERROR;
+	}
+	memcpy(ifname, cp, namelen);
+	ifname[namelen] = '\0';
+	handlep->ifindex = if_nametoindex(ifname);
+	if (handlep->ifindex == 0) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "No such interface %s", ifname);
+		return PCAP_ERROR_NO_SUCH_DEVICE;
+	}
+	handlep->queue_id = (u_int)queue;
+
+	if (handle->opt.rfmon) {
+		/*
+		 * Monitor mode doesn't apply to AF_XDP devices.
+		 */
+		return PCAP_ERROR_RFMON_NOTSUP;
+	}
+
+	if (!handle->opt.xdp_divert) {
+		snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    "%s would take the packets arriving on queue %u of %s away from the network stack; call pcap_set_xdp_divert_linux() to allow that",
+		    dev, handlep->queue_id, ifname);
+		return PCAP_ERROR;
+	}
+
+	/*
+	 * Turn a negative snapshot value (invalid), a snapshot value of
+	 * 0 (unspecified), or a value bigger than the normal maximum
+	 * value, into the maximum allowed value.
+	 *
+	 * If some application really *needs* a bigger snapshot
+	 * length, we should just increase MAXIMUM_SNAPLEN.
+	 */
+	if (handle->snapshot <= 0 || handle->snapshot > MAXIMUM_SNAPLEN)
+		handle->snapshot = MAXIMUM_SNAPLEN;
+
+	handle->linktype = DLT_EN10MB;
+	handle->offset = 0;
+	handle->read_op = xdp_read_linux;
+	handle->inject_op = xdp_inject_linux;
+	handle->setfilter_op = install_bpf_program; /* no kernel filtering */
+	handle->setdirection_op = NULL;
+	handle->set_datalink_op = NULL;
+	handle->getnonblock_op = xdp_getnonblock_linux;
+	handle->setnonblock_op = xdp_setnonblock_linux;
+	handle->stats_op = xdp_stats_linux;
+	handle->breakloop_op = xdp_breakloop_linux;
+	handle->cleanup_op = xdp_cleanup_linux;
+	handlep->nonblock = handle->opt.nonblock;
+
+	handlep->poll_breakloop_fd = eventfd(0, EFD_NONBLOCK);
+	if (handlep->poll_breakloop_fd == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create eventfd");
+		goto fail;
+	}
+
+	handle->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (handle->fd < 0) {
+		if (errno == EPERM || errno == EACCES) {
+			snprintf(handle->errbuf, PCAP_ERRBUF_SIZE,
+			    "Attempt to create an AF_XDP socket failed - CAP_NET_RAW may be required");
+			xdp_cleanup_linux(handle);
+			return PCAP_ERROR_PERM_DENIED;
+		}
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't create AF_XDP socket");
+		goto fail;
+	}
+
+	/*
+	 * Size the UMEM from the buffer size, rounding the number of
+	 * frames down to a power of 2, as the ring sizes must be powers
+	 * of 2; every frame is either in the fill ring or in the rx
+	 * ring, so both rings have one entry per frame.
+	 */
+	ring_size = 64;
+	while (ring_size < 65536 &&
+	    (size_t)ring_size * 2 * XDP_FRAME_SIZE <= (size_t)handle->opt.buffer_size)
+		ring_size *= 2;
+	handlep->frame_nr = ring_size;
+	handlep->umem_len = (size_t)ring_size * XDP_FRAME_SIZE;
+	handlep->umem = mmap(NULL, handlep->umem_len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (handlep->umem == MAP_FAILED) {
+		handlep->umem = NULL;
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't allocate UMEM");
+		goto fail;
+	}
+
+	memset(&umem_reg, 0, sizeof(umem_reg));
+	umem_reg.addr = (__u64)(unsigned long)handlep->umem;
+	umem_reg.len = handlep->umem_len;
+	umem_reg.chunk_size = XDP_FRAME_SIZE;
+	umem_reg.headroom = 0;
+	if (setsockopt(handle->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg,
+	    sizeof(umem_reg)) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't register UMEM");
+		goto fail;
+	}
+	if (setsockopt(handle->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+	    sizeof(ring_size)) == -1 ||
+	    setsockopt(handle->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	    &ring_size, sizeof(ring_size)) == -1 ||
+	    setsockopt(handle->fd, SOL_XDP, XDP_RX_RING, &ring_size,
+	    sizeof(ring_size)) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't set AF_XDP ring sizes");
+		goto fail;
+	}
+
+	optlen = sizeof(off);
+	if (getsockopt(handle->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off,
+	    &optlen) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't get AF_XDP ring offsets");
+		goto fail;
+	}
+	if (xdp_map_ring(handle, &handlep->fill, &off.fr, ring_size,
+	    sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING, "fill") == -1 ||
+	    xdp_map_ring(handle, &handlep->comp, &off.cr, ring_size,
+	    sizeof(__u64), XDP_UMEM_PGOFF_COMPLETION_RING, "completion") == -1 ||
+	    xdp_map_ring(handle, &handlep->rx, &off.rx, ring_size,
+	    sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, "rx") == -1)
+		goto fail;
+
+	/*
+	 * Hand all the frames to the kernel.
+	 */
+	fill_addrs = handlep->fill.descs;
+	for (i = 0; i < ring_size; i++)
+		fill_addrs[i] = (__u64)i * XDP_FRAME_SIZE;
+	__atomic_store_n(handlep->fill.producer, ring_size, __ATOMIC_RELEASE);
+
+	/*
+	 * Bind to the queue, letting the kernel use zero-copy mode
+	 * if the driver supports it.
+	 */
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = handlep->ifindex;
+	sxdp.sxdp_queue_id = handlep->queue_id;
+	sxdp.sxdp_flags = 0;
+	if (bind(handle->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1) {
+		pcap_fmt_errmsg_for_errno(handle->errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "Can't bind AF_XDP socket to %s queue %u",
+		    ifname, handlep->queue_id);
+		goto fail;
+	}
+
+	if (xdp_load_prog(handle) == -1)
+		goto fail;
+
+	handle->bufsize = XDP_FRAME_SIZE;
+	handle->selectable_fd = handle->fd;
+	return 0;
+
+fail:
+	xdp_cleanup_linux(handle);
+	return PCAP_ERROR;
+}
+
+pcap_t *
+xdp_create(const char *device, char *ebuf, int *is_ours)
+{
+	pcap_t *p;
+
+	/* Does it begin with XDP_IFACE followed by a colon? */
+	if (strncmp(device, XDP_IFACE ":", sizeof XDP_IFACE) != 0) {
+		/* Nope */
+		*is_ours = 0;
+		return NULL;
+	}
+
+	/* OK, it's probably ours. */
+	*is_ours = 1;
+
+	p = PCAP_CREATE_COMMON(ebuf, struct pcap_xdp);
+	if (p == NULL)
+		return (NULL);
+
+	p->activate_op = xdp_activate;
+	return (p);
+}
+
+int
+xdp_findalldevs(pcap_if_list_t *devlistp _U_, char *err_str _U_)
+{
+	/*
+	 * Any network interface can be opened as "xdp:{interface}",
+	 * and the interfaces themselves are already in the list, so
+	 * there's nothing to add.
+	 */
+	return 0;
+}
@@ -62,6 +62,7 @@ struct rtentry;		/* declarations in <net/if.h> */
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 #include "diag-control.h"
 
@@ -75,6 +76,7 @@ struct rtentry;		/* declarations in <net/if.h> */
 
 #include "pcap-int.h"
 
+#include "extract.h"
 #include "optimize.h"
 
 #ifdef HAVE_DAG_API
@@ -109,6 +111,14 @@ struct rtentry;		/* declarations in <net/if.h> */
 #include "pcap-netfilter-linux.h"
 #endif
 
+#ifdef PCAP_SUPPORT_XDP
+#include "pcap-xdp-linux.h"
+#endif
+
+#ifdef PCAP_SUPPORT_LINUX_MULTI
+#include "pcap-multi-linux.h"
+#endif
+
 #ifdef PCAP_SUPPORT_NETMAP
 #include "pcap-netmap.h"
 #endif
@@ -460,14 +470,6 @@ pcap_oid_set_request_not_initialized(pcap_t *pcap, bpf_u_int32 oid _U_,
 	return (PCAP_ERROR_NOT_ACTIVATED);
 }
 
-static u_int
-pcap_sendqueue_transmit_not_initialized(pcap_t *pcap, pcap_send_queue* queue _U_,
-    int sync _U_)
-{
-	pcap_set_not_initialized_message(pcap);
-	return (0);
-}
-
 static int
 pcap_setuserbuffer_not_initialized(pcap_t *pcap, int size _U_)
 {
@@ -659,6 +661,142 @@ pcap_next_ex(pcap_t *p, struct pcap_pkthdr **pkt_header,
 	return (p->read_op(p, 1, p->oneshot_callback, (u_char *)&s));
 }
 
+/*
+ * Get up to max_packets packets, leaving them in the capture buffer
+ * where possible; they remain valid until the next call to
+ * pcap_next_batch(), pcap_release_batch() or any other routine that
+ * reads packets.
+ */
+int
+pcap_next_batch(pcap_t *p, struct pcap_pkt_batch *batch, int max_packets)
+{
+	batch->count = 0;
+	if (max_packets <= 0) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The maximum number of packets in a batch must be positive");
+		return (PCAP_ERROR);
+	}
+	if (batch->meta != NULL &&
+	    batch->meta_size < sizeof(batch->meta->present)) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The metadata structure is too small");
+		return (PCAP_ERROR);
+	}
+	return (p->next_batch_op(p, batch, max_packets));
+}
+
+void
+pcap_release_batch(pcap_t *p)
+{
+	p->release_batch_op(p);
+}
+
+/*
+ * The metadata fields, and where each set of them ends, so that a
+ * caller built with an older, smaller, struct pcap_pkt_metadata gets
+ * only the fields that fit in it.
+ */
+#define PKT_META_END(field) \
+	(offsetof(struct pcap_pkt_metadata, field) + \
+	 sizeof(((struct pcap_pkt_metadata *)0)->field))
+
+static const struct {
+	bpf_u_int32 bit;
+	size_t	end;
+} pkt_meta_fields[] = {
+	{ PCAP_PKT_META_VLAN,		PKT_META_END(vlan_tpid) },
+	{ PCAP_PKT_META_RXHASH,		PKT_META_END(rxhash) },
+	{ PCAP_PKT_META_IFINDEX,	PKT_META_END(ifindex) },
+	{ PCAP_PKT_META_PKTTYPE,	PKT_META_END(pkttype) },
+	{ PCAP_PKT_META_TSTAMP,		PKT_META_END(tstamp_nsec) },
+	{ PCAP_PKT_META_INTERFACE,	PKT_META_END(linktype) },
+};
+
+/*
+ * Copy as much of src as fits in size bytes to dst, with only the
+ * bits for the fields that fit set in "present".
+ */
+static void
+copy_pkt_metadata(struct pcap_pkt_metadata *dst, size_t size,
+    const struct pcap_pkt_metadata *src)
+{
+	struct pcap_pkt_metadata meta;
+	size_t i;
+
+	meta = *src;
+	for (i = 0; i < sizeof(pkt_meta_fields) / sizeof(pkt_meta_fields[0]);
+	    i++) {
+		if (pkt_meta_fields[i].end > size)
+			meta.present &= ~pkt_meta_fields[i].bit;
+	}
+	memcpy(dst, &meta, size < sizeof(meta) ? size : sizeof(meta));
+}
+
+/*
+ * Copy metadata into entry i of a batch's meta array, whose entries
+ * are the size of the caller's struct pcap_pkt_metadata.
+ */
+void
+pcap_copy_pkt_metadata(struct pcap_pkt_batch *batch, int i,
+    const struct pcap_pkt_metadata *src)
+{
+	copy_pkt_metadata((struct pcap_pkt_metadata *)
+	    ((u_char *)batch->meta + (size_t)i * batch->meta_size),
+	    batch->meta_size, src);
+}
+
+/*
+ * Get the metadata for the packet most recently supplied to a callback
+ * or returned by pcap_next() or pcap_next_ex(), filling in no more
+ * than size bytes of *meta.  Modules that don't supply metadata leave
+ * pkt_meta zeroed, so nothing is present.
+ */
+int
+pcap_get_pkt_metadata(pcap_t *p, struct pcap_pkt_metadata *meta, size_t size)
+{
+	if (!p->activated)
+		return (PCAP_ERROR_NOT_ACTIVATED);
+	if (size < sizeof(meta->present)) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The metadata structure is too small");
+		return (PCAP_ERROR);
+	}
+	copy_pkt_metadata(meta, size, &p->pkt_meta);
+	return (0);
+}
+
+/*
+ * Batch operations for modules that can't do better than handing
+ * out one packet at a time.
+ */
+int
+pcap_next_batch_common(pcap_t *p, struct pcap_pkt_batch *batch,
+    int max_packets _U_)
+{
+	struct pcap_pkthdr *hdr;
+	const u_char *data;
+	int status;
+
+	status = pcap_next_ex(p, &hdr, &data);
+	if (status != 1)
+		return (status);
+	batch->hdrs[0] = *hdr;
+	batch->pkts[0] = data;
+	if (batch->meta != NULL)
+		pcap_copy_pkt_metadata(batch, 0, &p->pkt_meta);
+	batch->count = 1;
+	return (1);
+}
+
+void
+pcap_release_batch_common(pcap_t *p _U_)
+{
+	/*
+	 * The packet handed out by pcap_next_ex() stays in the
+	 * buffer until the next read; nothing to release.
+	 */
+}
+
 /*
  * Implementation of a pcap_if_list_t.
  */
@@ -699,6 +837,12 @@ static struct capture_source_type {
 #ifdef PCAP_SUPPORT_NETFILTER
 	{ netfilter_findalldevs, netfilter_create },
 #endif
+#ifdef PCAP_SUPPORT_XDP
+	{ xdp_findalldevs, xdp_create },
+#endif
+#ifdef PCAP_SUPPORT_LINUX_MULTI
+	{ multi_findalldevs, multi_create },
+#endif
 #ifdef PCAP_SUPPORT_NETMAP
 	{ pcap_netmap_findalldevs, pcap_netmap_create },
 #endif
@@ -2423,6 +2567,13 @@ initialize_ops(pcap_t *p)
 	p->set_datalink_op = pcap_set_datalink_not_initialized;
 	p->getnonblock_op = pcap_getnonblock_not_initialized;
 	p->stats_op = pcap_stats_not_initialized;
+
+	/*
+	 * Send queues are transmitted a packet at a time with
+	 * pcap_inject() unless the module has a faster way; that
+	 * reports the "not activated" error for us if necessary.
+	 */
+	p->sendqueue_transmit_op = pcap_sendqueue_transmit_common;
 #ifdef _WIN32
 	p->stats_ex_op = pcap_stats_ex_not_initialized;
 	p->setbuff_op = pcap_setbuff_not_initialized;
@@ -2431,7 +2582,6 @@ initialize_ops(pcap_t *p)
 	p->getevent_op = pcap_getevent_not_initialized;
 	p->oid_get_request_op = pcap_oid_get_request_not_initialized;
 	p->oid_set_request_op = pcap_oid_set_request_not_initialized;
-	p->sendqueue_transmit_op = pcap_sendqueue_transmit_not_initialized;
 	p->setuserbuffer_op = pcap_setuserbuffer_not_initialized;
 	p->live_dump_op = pcap_live_dump_not_initialized;
 	p->live_dump_ended_op = pcap_live_dump_ended_not_initialized;
@@ -2457,6 +2607,15 @@ initialize_ops(pcap_t *p)
 	 * their own logic.
 	 */
 	p->breakloop_op = pcap_breakloop_common;
+
+	/*
+	 * Default batch operations - one packet at a time, using
+	 * pcap_next_ex(); implementations that can hand out several
+	 * packets from their buffer without copying them override
+	 * these.
+	 */
+	p->next_batch_op = pcap_next_batch_common;
+	p->release_batch_op = pcap_release_batch_common;
 }
 
 static pcap_t *
@@ -2543,6 +2702,19 @@ pcap_create_common(char *ebuf, size_t total_size, size_t private_offset)
 	 */
 #ifdef __linux__
 	p->opt.protocol = 0;
+	p->opt.fanout_enabled = 0;
+	p->opt.fanout_group = 0;
+	p->opt.fanout_mode = 0;
+	memset(&p->opt.ring_params, 0, sizeof(p->opt.ring_params));
+	p->opt.tx_ring_size = 0;
+	p->opt.vlan_metadata = 0;
+	p->opt.rx_metadata = 0;
+	p->opt.busy_poll_usec = 0;
+	p->opt.kernel_busy_poll = 0;
+	p->opt.map_filter_key_type = 0;
+	p->opt.map_filter_action = 0;
+	p->opt.map_filter_max_entries = 0;
+	p->opt.xdp_divert = 0;
 #endif
 #ifdef _WIN32
 	p->opt.nocapture_local = 0;
@@ -3843,6 +4015,7 @@ pcap_oid_set_request(pcap_t *p, bpf_u_int32 oid, const void *data, size_t *lenp)
 {
 	return (p->oid_set_request_op(p, oid, data, lenp));
 }
+#endif /* _WIN32 */
 
 pcap_send_queue *
 pcap_sendqueue_alloc(u_int memsize)
@@ -3899,6 +4072,80 @@ pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue, int sync)
 	return (p->sendqueue_transmit_op(p, queue, sync));
 }
 
+/*
+ * Wait for the given number of microseconds, for synchronized
+ * send queue transmission.
+ */
+static void
+pcap_sendqueue_wait(bpf_u_int32 usec)
+{
+#ifdef _WIN32
+	Sleep(usec / 1000);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+#endif
+}
+
+/*
+ * Transmit the packets in a send queue one at a time with pcap_inject(),
+ * for modules that don't have a faster way to do so.
+ *
+ * If sync is non-zero, the packets are sent with the same relative
+ * timing as their time stamps.
+ *
+ * Returns the number of bytes of the queue that were processed; if
+ * that's less than queue->len, an error occurred, and p->errbuf says
+ * what the error was.
+ */
+u_int
+pcap_sendqueue_transmit_common(pcap_t *p, pcap_send_queue *queue, int sync)
+{
+	struct pcap_pkthdr hdr;
+	struct timeval prev;
+	bpf_u_int32 delta;
+	u_int off;
+
+	prev.tv_sec = 0;
+	prev.tv_usec = 0;
+	off = 0;
+	while (queue->len - off >= sizeof(hdr)) {
+		/*
+		 * Packets are packed into the buffer, so the header
+		 * might not be aligned; copy it out.
+		 */
+		memcpy(&hdr, queue->buffer + off, sizeof(hdr));
+		if (hdr.caplen > queue->len - off - sizeof(hdr)) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Packet at offset %u in the send queue is truncated",
+			    off);
+			break;
+		}
+		if (sync && off != 0 && timercmp(&hdr.ts, &prev, >)) {
+			/*
+			 * Wait until it's time to send this packet.
+			 */
+			delta = (bpf_u_int32)(hdr.ts.tv_sec - prev.tv_sec) * 1000000;
+			if (p->opt.tstamp_precision == PCAP_TSTAMP_PRECISION_NANO)
+				delta = (bpf_u_int32)(delta + (hdr.ts.tv_usec - prev.tv_usec) / 1000);
+			else
+				delta = (bpf_u_int32)(delta + hdr.ts.tv_usec - prev.tv_usec);
+			pcap_sendqueue_wait(delta);
+		}
+		prev = hdr.ts;
+		if (pcap_inject(p, queue->buffer + off + sizeof(hdr),
+		    hdr.caplen) < 0)
+			break;
+		off += sizeof(hdr) + hdr.caplen;
+	}
+	return (off);
+}
+
+#ifdef _WIN32
 int
 pcap_setuserbuffer(pcap_t *p, int size)
 {
@@ -4068,7 +4315,7 @@ pcap_cleanup_live_common(pcap_t *p)
 		p->tstamp_precision_list = NULL;
 		p->tstamp_precision_count = 0;
 	}
-	pcap_freecode(&p->fcode);
+	uninstall_bpf_program(p);
 #if !defined(_WIN32) && !defined(MSDOS)
 	if (p->fd >= 0) {
 		close(p->fd);
@@ -4235,6 +4482,521 @@ pcap_offline_filter(const struct bpf_program *fp, const struct pcap_pkthdr *h,
 		return (0);
 }
 
+int
+pcap_offline_filter_profile(const struct bpf_program *fp,
+    const struct pcap_pkthdr *h, const u_char *pkt,
+    struct pcap_filter_profile *prof)
+{
+	const struct bpf_insn *fcode = fp->bf_insns;
+
+	if (fcode != NULL)
+		return (pcap_filter_profile(fcode, pkt, h->len, h->caplen,
+		    NULL, prof));
+	else
+		return (0);
+}
+
+/*
+ * Count what the filter run in userland for a handle does, in a
+ * profile created for that filter, or stop counting if prof is NULL.
+ * While profiling, the filter is interpreted as is rather than run
+ * as native code or in pre-decoded form.  Setting a new filter stops
+ * profiling.
+ */
+int
+pcap_set_filter_profile(pcap_t *p, struct pcap_filter_profile *prof)
+{
+	if (prof != NULL) {
+		if (p->fcode.bf_insns == NULL || p->fcode_in_kernel) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "No filter is being run in userland");
+			return (PCAP_ERROR);
+		}
+		if (prof->fp_len != p->fcode.bf_len) {
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "The profile is not for the handle's filter");
+			return (PCAP_ERROR);
+		}
+	}
+	p->fcode_profile = prof;
+	return (0);
+}
+
+/*
+ * Most 64-bit words a verdict cache key can have, and number of
+ * entries a key can be stored in; keys are looked up by hashing them
+ * and probing the entries that follow.  The number of entries in a
+ * cache is limited to FILTER_CACHE_MAX_ENTRIES.
+ */
+#define FILTER_CACHE_MAX_WORDS		16
+#define FILTER_CACHE_PROBES		4
+#define FILTER_CACHE_MAX_ENTRIES	(1 << 24)
+
+/*
+ * A cache of the verdicts of a filter program, for programs whose
+ * verdict depends only on a little packet data at offsets that can
+ * be worked out in advance.  The key is the captured length, cut
+ * down to the length needed to have all of that data, so that it
+ * determines which of the program's loads succeed, followed by the
+ * data, in pieces of up to 8 bytes, each in a word of its own;
+ * packets of a flow usually have the same key, so looking their
+ * verdict up is cheaper than running the filter.
+ */
+struct pcap_filter_cache {
+	struct bpf_key_slot *pieces;	/* where the key data is */
+	u_int	keywords;	/* words in a key; one more than pieces */
+	bpf_u_int32 needed;	/* captured length needed for all of it */
+	u_int	mask;		/* number of entries - 1 */
+	uint32_t *hashes;	/* hash of each entry's key, 0 if unused */
+	u_int	*verdicts;	/* each entry's verdict */
+	uint64_t *keys;		/* each entry's key */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+void
+pcap_filter_cache_free(struct pcap_filter_cache *c)
+{
+	if (c == NULL)
+		return;
+	free(c->pieces);
+	free(c->hashes);
+	free(c->verdicts);
+	free(c->keys);
+	free(c);
+}
+
+/*
+ * Work out where the pieces of a key's data are for a program, or why
+ * the program's verdicts can't be cached.  Returns the number of
+ * pieces, -2 if the verdicts can't be cached, or -1 on an error.
+ */
+static int
+filter_cache_pieces(const struct bpf_program *fp,
+    struct bpf_key_slot **piecesp, char *errbuf)
+{
+	struct bpf_key_slot *slots, *pieces;
+	int nslots, npieces, i;
+	u_int off;
+
+	nslots = bpf_verdict_key(fp, &slots, errbuf);
+	if (nslots < 0)
+		return (nslots);
+	npieces = 0;
+	for (i = 0; i < nslots; i++)
+		npieces += (slots[i].len + 7) / 8;
+	if (npieces > FILTER_CACHE_MAX_WORDS - 1) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE,
+		    "The filter reads too much packet data to be cached");
+		free(slots);
+		return (-2);
+	}
+	pieces = malloc((npieces != 0 ? npieces : 1) * sizeof(*pieces));
+	if (pieces == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(slots);
+		return (-1);
+	}
+	npieces = 0;
+	for (i = 0; i < nslots; i++) {
+		for (off = 0; off < slots[i].len; off += 8) {
+			pieces[npieces].msh = slots[i].msh;
+			pieces[npieces].off = slots[i].off + off;
+			pieces[npieces].len = slots[i].len - off < 8 ?
+			    slots[i].len - off : 8;
+			npieces++;
+		}
+	}
+	free(slots);
+	*piecesp = pieces;
+	return (npieces);
+}
+
+int
+pcap_filter_cache_create(const struct bpf_program *fp, u_int nentries,
+    struct pcap_filter_cache **cp, char *errbuf)
+{
+	struct pcap_filter_cache *c;
+	struct bpf_key_slot *pieces;
+	u_int size, i;
+	bpf_u_int32 end;
+	int npieces;
+
+	*cp = NULL;
+	npieces = filter_cache_pieces(fp, &pieces, errbuf);
+	if (npieces == -2)
+		return (0);
+	if (npieces == -1)
+		return (-1);
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		free(pieces);
+		return (-1);
+	}
+	c->pieces = pieces;
+	c->keywords = 1 + npieces;
+
+	/*
+	 * Data after a header has all been captured if it'd have
+	 * been captured after the longest possible header.
+	 */
+	c->needed = 0;
+	for (i = 0; i < (u_int)npieces; i++) {
+		end = pieces[i].off + pieces[i].len;
+		if (pieces[i].msh != -1)
+			end += 4 * 0xf;
+		if (end > c->needed)
+			c->needed = end;
+	}
+
+	/*
+	 * Round the number of entries up to a power of 2.
+	 */
+	for (size = FILTER_CACHE_PROBES; size < nentries; size <<= 1)
+		;
+	c->mask = size - 1;
+	c->hashes = calloc(size, sizeof(*c->hashes));
+	c->verdicts = malloc(size * sizeof(*c->verdicts));
+	c->keys = malloc(size * c->keywords * sizeof(*c->keys));
+	if (c->hashes == NULL || c->verdicts == NULL || c->keys == NULL) {
+		pcap_fmt_errmsg_for_errno(errbuf, PCAP_ERRBUF_SIZE,
+		    errno, "malloc");
+		pcap_filter_cache_free(c);
+		return (-1);
+	}
+	*cp = c;
+	return (0);
+}
+
+/*
+ * Build the key for a packet, and return its hash, which is never 0.
+ * If not all of the data was captured, the data that wasn't is
+ * filled in with zeroes; as the captured length is then part of the
+ * key, that doesn't make the keys for packets with different data
+ * the same.
+ *
+ * Each word is put together in a register, rather than by copying
+ * bytes into the key and reading it back a word at a time, which
+ * stalls many processors.
+ */
+static uint32_t
+filter_cache_key(const struct pcap_filter_cache *c, const u_char *pkt,
+    u_int buflen, uint64_t *key)
+{
+	const struct bpf_key_slot *pc;
+	bpf_u_int32 off;
+	u_int i, k, avail;
+	uint64_t w, h;
+
+	w = buflen < c->needed ? buflen : c->needed;
+	key[0] = w;
+
+	/*
+	 * Multiplying mixes each bit into the bits above it; shifting
+	 * mixes the high bits back into the low ones.
+	 */
+	h = w * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+	for (k = 1; k < c->keywords; k++) {
+		pc = &c->pieces[k - 1];
+		off = pc->off;
+		if (pc->msh != -1) {
+			if ((u_int)pc->msh < buflen)
+				off += 4 * (pkt[pc->msh] & 0xf);
+			else
+				off = buflen;
+		}
+		avail = off < buflen ? buflen - off : 0;
+		w = 0;
+		for (i = 0; i < pc->len; i++)
+			w = (w << 8) | (i < avail ? pkt[off + i] : 0);
+		key[k] = w;
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+	h ^= h >> 32;
+	return ((uint32_t)h != 0 ? (uint32_t)h : 1);
+}
+
+u_int
+pcap_filter_cached(pcap_t *p, const u_char *pkt, u_int wirelen, u_int buflen)
+{
+	struct pcap_filter_cache *c = p->fcode_cache;
+	uint64_t key[FILTER_CACHE_MAX_WORDS], *ekey;
+	uint32_t h;
+	u_int i, j, e, verdict;
+
+	h = filter_cache_key(c, pkt, buflen, key);
+	for (i = 0; i < FILTER_CACHE_PROBES; i++) {
+		e = (h + i) & c->mask;
+		if (c->hashes[e] == 0)
+			break;
+		if (c->hashes[e] != h)
+			continue;
+		ekey = c->keys + e * c->keywords;
+		for (j = 0; j < c->keywords && ekey[j] == key[j]; j++)
+			;
+		if (j == c->keywords) {
+			c->hits++;
+			return (c->verdicts[e]);
+		}
+	}
+
+	/*
+	 * Not there; run the filter, and put the verdict in the first
+	 * unused entry we found or, if they're all in use, in place of
+	 * the first entry the key could be in.
+	 */
+	c->misses++;
+	verdict = pcap_run_filter_uncached(p, pkt, wirelen, buflen);
+	if (i == FILTER_CACHE_PROBES)
+		e = h & c->mask;
+	c->hashes[e] = h;
+	c->verdicts[e] = verdict;
+	memcpy(c->keys + e * c->keywords, key, c->keywords * sizeof(*key));
+	return (verdict);
+}
+
+/*
+ * Cache the verdicts of the filters run in userland for a handle in
+ * a cache with at least nentries entries, or stop caching them if
+ * nentries is 0.  This applies to the filter that's set now and to
+ * filters set later; the verdicts of a filter are cached only if they
+ * depend on nothing but a little packet data at offsets that can be
+ * worked out in advance, which pcap_filter_cache_stats() reports.
+ */
+int
+pcap_set_filter_cache(pcap_t *p, int nentries)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	if (nentries < 0 || nentries > FILTER_CACHE_MAX_ENTRIES) {
+		snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+		    "The number of cache entries must be between 0 and %d",
+		    FILTER_CACHE_MAX_ENTRIES);
+		return (PCAP_ERROR);
+	}
+	pcap_filter_cache_free(p->fcode_cache);
+	p->fcode_cache = NULL;
+	p->fcode_cache_size = 0;
+	if (nentries != 0 && p->fcode.bf_insns != NULL) {
+		if (pcap_filter_cache_create(&p->fcode, nentries,
+		    &p->fcode_cache, errbuf) == -1) {
+			pcap_strlcpy(p->errbuf, errbuf, PCAP_ERRBUF_SIZE);
+			return (PCAP_ERROR);
+		}
+	}
+	p->fcode_cache_size = nentries;
+	return (0);
+}
+
+int
+pcap_filter_cache_stats(pcap_t *p, struct pcap_filter_cache_stat *st)
+{
+	struct bpf_key_slot *pieces;
+
+	if (p->fcode_cache == NULL) {
+		if (p->fcode_cache_size == 0)
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "Filter verdicts are not being cached");
+		else if (p->fcode.bf_insns == NULL)
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "No filter is being run in userland");
+		else if (filter_cache_pieces(&p->fcode, &pieces,
+		    p->errbuf) >= 0) {
+			/*
+			 * The filter's verdicts could have been cached,
+			 * so creating the cache must have failed.
+			 */
+			free(pieces);
+			snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+			    "The verdict cache could not be allocated");
+		}
+		return (PCAP_ERROR);
+	}
+	st->fcs_hits = p->fcode_cache->hits;
+	st->fcs_misses = p->fcode_cache->misses;
+	return (0);
+}
+
+/*
+ * Number of packets pcap_filter_batch() runs the tests at the start
+ * of the program over at a time.
+ */
+#define FILTER_BATCH_SIZE	64
+
+/*
+ * Return the number of tests at the start of a filter program that
+ * pcap_filter_batch() can run across a batch of packets: pairs of a
+ * BPF_ABS load followed by a comparison with a constant that goes on
+ * to the next instruction one way and to a "ret #0" the other way,
+ * as the link-layer type and protocol checks at the start of most
+ * programs generated by pcap_compile() do.
+ */
+static u_int
+filter_prefix_tests(const struct bpf_insn *insns, u_int len)
+{
+	const struct bpf_insn *ld, *jmp, *ret;
+	u_int i, reject;
+
+	for (i = 0; i + 2 < len; i += 2) {
+		ld = &insns[i];
+		jmp = &insns[i + 1];
+		if (ld->code != (BPF_LD|BPF_W|BPF_ABS) &&
+		    ld->code != (BPF_LD|BPF_H|BPF_ABS) &&
+		    ld->code != (BPF_LD|BPF_B|BPF_ABS))
+			break;
+		if (BPF_CLASS(jmp->code) != BPF_JMP ||
+		    BPF_SRC(jmp->code) != BPF_K || BPF_OP(jmp->code) == BPF_JA)
+			break;
+		if (jmp->jt == 0 && jmp->jf != 0)
+			reject = i + 2 + jmp->jf;
+		else if (jmp->jf == 0 && jmp->jt != 0)
+			reject = i + 2 + jmp->jt;
+		else
+			break;
+		if (reject >= len)
+			break;
+		ret = &insns[reject];
+		if (ret->code != (BPF_RET|BPF_K) || ret->k != 0)
+			break;
+	}
+	return (i / 2);
+}
+
+/*
+ * Given a BPF program and the headers and data for a number of
+ * packets, check which of the packets pass the filter, setting the
+ * corresponding entry in verdicts to 1 if the packet passes and to 0
+ * if it doesn't.  Returns the number of packets that pass.
+ *
+ * The tests at the start of the program are run a column at a time
+ * over the packets, rather than a packet at a time; only the packets
+ * that pass them are run through the whole program.
+ */
+int
+pcap_filter_batch(const struct bpf_program *fp,
+    const struct pcap_pkthdr *hdrs, const u_char **pkts, int n,
+    uint8_t *verdicts)
+{
+	const struct bpf_insn *insns = fp->bf_insns;
+	struct bpf_decoded *decoded;
+	uint32_t vals[FILTER_BATCH_SIZE];
+	uint8_t pass[FILTER_BATCH_SIZE];
+	const struct bpf_insn *ld, *jmp;
+	u_int prefix, t, size, r;
+	int base, count, i, matched;
+	bpf_u_int32 k;
+
+	if (n <= 0)
+		return (0);
+	if (insns == NULL) {
+		/*
+		 * As with pcap_offline_filter(), no program means no
+		 * match.
+		 */
+		memset(verdicts, 0, (size_t)n);
+		return (0);
+	}
+	prefix = filter_prefix_tests(insns, fp->bf_len);
+
+	/*
+	 * If we can, pre-decode the program once for the whole batch.
+	 */
+	decoded = pcap_predecode_filter(insns, fp->bf_len);
+
+	matched = 0;
+	for (base = 0; base < n; base += FILTER_BATCH_SIZE) {
+		count = n - base;
+		if (count > FILTER_BATCH_SIZE)
+			count = FILTER_BATCH_SIZE;
+		memset(pass, 1, sizeof(pass));
+		for (t = 0; t < prefix; t++) {
+			ld = &insns[2 * t];
+			jmp = &insns[2 * t + 1];
+			k = ld->k;
+			size = BPF_SIZE(ld->code) == BPF_W ? 4 :
+			    BPF_SIZE(ld->code) == BPF_H ? 2 : 1;
+
+			/*
+			 * Gather the field from each packet; a packet
+			 * too short to have it fails, as it would in
+			 * the interpreter.
+			 */
+			for (i = 0; i < count; i++) {
+				const struct pcap_pkthdr *h = &hdrs[base + i];
+				const u_char *pkt = pkts[base + i];
+
+				if (k > h->caplen || size > h->caplen - k) {
+					vals[i] = 0;
+					pass[i] = 0;
+				} else if (size == 4)
+					vals[i] = EXTRACT_BE_U_4(&pkt[k]);
+				else if (size == 2)
+					vals[i] = EXTRACT_BE_U_2(&pkt[k]);
+				else
+					vals[i] = pkt[k];
+			}
+
+			/*
+			 * Then compare the whole column; these loops
+			 * have no branches, so the compiler can
+			 * vectorize them.  A packet passes the test
+			 * if the comparison goes to the next
+			 * instruction rather than to the "ret #0".
+			 */
+			r = jmp->jt == 0;
+			switch (BPF_OP(jmp->code)) {
+
+			case BPF_JEQ:
+				for (i = 0; i < count; i++)
+					pass[i] &= (vals[i] == jmp->k) == r;
+				break;
+
+			case BPF_JGT:
+				for (i = 0; i < count; i++)
+					pass[i] &= (vals[i] > jmp->k) == r;
+				break;
+
+			case BPF_JGE:
+				for (i = 0; i < count; i++)
+					pass[i] &= (vals[i] >= jmp->k) == r;
+				break;
+
+			case BPF_JSET:
+				for (i = 0; i < count; i++)
+					pass[i] &= ((vals[i] & jmp->k) != 0) == r;
+				break;
+			}
+		}
+
+		/*
+		 * Finish off the packets that passed those tests one
+		 * at a time.
+		 */
+		for (i = 0; i < count; i++) {
+			const struct pcap_pkthdr *h = &hdrs[base + i];
+
+			if (pass[i]) {
+				if (decoded != NULL)
+					pass[i] = pcap_filter_predecoded(decoded,
+					    pkts[base + i], h->len, h->caplen,
+					    NULL) != 0;
+				else
+					pass[i] = pcap_filter(insns,
+					    pkts[base + i], h->len, h->caplen) != 0;
+			}
+			verdicts[base + i] = pass[i];
+			matched += pass[i];
+		}
+	}
+	pcap_free_predecoded(decoded);
+	return (matched);
+}
+
 static int
 pcap_can_set_rfmon_dead(pcap_t *p)
 {
@@ -4367,15 +5129,6 @@ pcap_oid_set_request_dead(pcap_t *p, bpf_u_int32 oid _U_, const void *data _U_,
 	return (PCAP_ERROR);
 }
 
-static u_int
-pcap_sendqueue_transmit_dead(pcap_t *p, pcap_send_queue *queue _U_,
-    int sync _U_)
-{
-	snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
-	    "Packets cannot be transmitted on a pcap_open_dead pcap_t");
-	return (0);
-}
-
 static int
 pcap_setuserbuffer_dead(pcap_t *p, int size _U_)
 {
@@ -4408,6 +5161,15 @@ pcap_get_airpcap_handle_dead(pcap_t *p _U_)
 }
 #endif /* _WIN32 */
 
+static u_int
+pcap_sendqueue_transmit_dead(pcap_t *p, pcap_send_queue *queue _U_,
+    int sync _U_)
+{
+	snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+	    "Packets cannot be transmitted on a pcap_open_dead pcap_t");
+	return (0);
+}
+
 static void
 pcap_cleanup_dead(pcap_t *p _U_)
 {
@@ -4451,6 +5213,7 @@ pcap_open_dead_with_tstamp_precision(int linktype, int snaplen, u_int precision)
 	p->getnonblock_op = pcap_getnonblock_dead;
 	p->setnonblock_op = pcap_setnonblock_dead;
 	p->stats_op = pcap_stats_dead;
+	p->sendqueue_transmit_op = pcap_sendqueue_transmit_dead;
 #ifdef _WIN32
 	p->stats_ex_op = pcap_stats_ex_dead;
 	p->setbuff_op = pcap_setbuff_dead;
@@ -4459,13 +5222,14 @@ pcap_open_dead_with_tstamp_precision(int linktype, int snaplen, u_int precision)
 	p->getevent_op = pcap_getevent_dead;
 	p->oid_get_request_op = pcap_oid_get_request_dead;
 	p->oid_set_request_op = pcap_oid_set_request_dead;
-	p->sendqueue_transmit_op = pcap_sendqueue_transmit_dead;
 	p->setuserbuffer_op = pcap_setuserbuffer_dead;
 	p->live_dump_op = pcap_live_dump_dead;
 	p->live_dump_ended_op = pcap_live_dump_ended_dead;
 	p->get_airpcap_handle_op = pcap_get_airpcap_handle_dead;
 #endif
 	p->cleanup_op = pcap_cleanup_dead;
+	p->next_batch_op = pcap_next_batch_common;
+	p->release_batch_op = pcap_release_batch_common;
 
 	/*
 	 * A "dead" pcap_t never requires special BPF code generation.
@@ -162,6 +162,8 @@ typedef	u_int bpf_u_int32;
 
 typedef struct pcap pcap_t;
 typedef struct pcap_dumper pcap_dumper_t;
+typedef struct pcap_classifier pcap_classifier_t;
+typedef struct pcap_filter_builder pcap_filter_builder_t;
 typedef struct pcap_if pcap_if_t;
 typedef struct pcap_addr pcap_addr_t;
 
@@ -464,6 +466,93 @@ PCAP_API const char *pcap_tstamp_type_val_to_description(int);
 #ifdef __linux__
 PCAP_AVAILABLE_1_9
 PCAP_API int	pcap_set_protocol_linux(pcap_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_fanout_linux(pcap_t *, int, int, int);
+
+/*
+ * Geometry of the memory-mapped ring used for capturing on Linux.
+ * A value of 0 in a request means "pick it from the buffer size,
+ * snapshot length, and timeout, as usual".
+ */
+struct pcap_ring_params_linux {
+	u_int	block_size;	/* size of a ring block, in bytes */
+	u_int	block_nr;	/* number of blocks in the ring */
+	u_int	frame_size;	/* size of a frame, in bytes */
+	u_int	frame_nr;	/* number of frames in the ring */
+	u_int	retire_blk_tov;	/* TPACKET_V3 block retire timeout, in milliseconds */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_ring_params_linux(pcap_t *,
+		    const struct pcap_ring_params_linux *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_get_ring_params_linux(pcap_t *,
+		    struct pcap_ring_params_linux *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_tx_ring_size_linux(pcap_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_vlan_metadata_linux(pcap_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_rx_metadata_linux(pcap_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_xdp_divert_linux(pcap_t *, int);
+
+/*
+ * Counts of how the waits for packets of a handle in busy-poll mode
+ * were satisfied.
+ */
+struct pcap_busy_poll_stats_linux {
+	u_int	bp_spin_hits;	/* a packet arrived while spinning */
+	u_int	bp_poll_waits;	/* spinning timed out; we slept in poll() */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_busy_poll_linux(pcap_t *, int, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_get_busy_poll_stats_linux(pcap_t *,
+		    struct pcap_busy_poll_stats_linux *);
+
+/*
+ * Kinds of keys for pcap_set_map_filter_linux(), and what to do with
+ * packets whose key is in the map.
+ */
+#define PCAP_MAP_FILTER_IPV4_HOST	1	/* IPv4 source or destination address */
+#define PCAP_MAP_FILTER_PORT		2	/* TCP, UDP, or SCTP source or destination port */
+
+#define PCAP_MAP_FILTER_DROP		0	/* drop them */
+#define PCAP_MAP_FILTER_ACCEPT		1	/* accept only them */
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_map_filter_linux(pcap_t *, int, int, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_map_filter_add_linux(pcap_t *, const bpf_u_int32 *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_map_filter_delete_linux(pcap_t *, const bpf_u_int32 *,
+		    int);
+
+/*
+ * One of the devices of a "multi:" handle.
+ */
+struct pcap_multi_if_linux {
+	const char *name;	/* device name */
+	int	ifindex;	/* interface index, or 0 if it has none */
+	int	linktype;	/* its link-layer header type */
+	int	snaplen;	/* its snapshot length */
+	pcap_t	*handle;	/* the capture handle for the device */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_get_multi_ifs_linux(pcap_t *,
+		    const struct pcap_multi_if_linux **);
 #endif
 
 /*
@@ -589,6 +678,60 @@ PCAP_API int 	pcap_next_ex(pcap_t *, struct pcap_pkthdr **, const u_char **);
 PCAP_AVAILABLE_0_8
 PCAP_API void	pcap_breakloop(pcap_t *);
 
+/*
+ * Per-packet metadata that a capture mechanism supplies in addition
+ * to the pcap_pkthdr; only the fields whose PCAP_PKT_META_ bits are
+ * set in "present" are valid.  Fields may be added at the end in
+ * later releases, so callers pass in sizeof(struct pcap_pkt_metadata),
+ * and only as much of the structure as they know about is filled in.
+ */
+struct pcap_pkt_metadata {
+	bpf_u_int32 present;	/* PCAP_PKT_META_ bits for the valid fields */
+	u_short	vlan_tci;	/* VLAN tag control information */
+	u_short	vlan_tpid;	/* VLAN tag protocol identifier */
+	bpf_u_int32 rxhash;	/* flow hash computed by the kernel or adapter */
+	int	ifindex;	/* index of the interface the packet arrived on */
+	u_short	pkttype;	/* PACKET_ type (host, broadcast, outgoing, ...) */
+	u_short	tstamp_type;	/* PCAP_TSTAMP_ type of this packet's time stamp */
+	bpf_u_int32 tstamp_sec;	/* time stamp seconds */
+	bpf_u_int32 tstamp_nsec; /* time stamp nanoseconds */
+	u_int	interface_id;	/* which device of a multi-device handle */
+	int	linktype;	/* link-layer header type of that device */
+};
+
+#define PCAP_PKT_META_VLAN	0x00000001	/* VLAN tag not in the packet data */
+#define PCAP_PKT_META_RXHASH	0x00000002	/* rxhash */
+#define PCAP_PKT_META_IFINDEX	0x00000004	/* ifindex */
+#define PCAP_PKT_META_PKTTYPE	0x00000008	/* pkttype */
+#define PCAP_PKT_META_TSTAMP	0x00000010	/* tstamp_type, tstamp_sec, tstamp_nsec */
+#define PCAP_PKT_META_INTERFACE	0x00000020	/* interface_id, linktype */
+
+/*
+ * A batch of packets returned by pcap_next_batch().  The caller
+ * supplies the hdrs and pkts arrays, each with room for at least as
+ * many entries as the maximum batch size it asks for, and, if it
+ * wants per-packet metadata, a meta array of the same size, with
+ * meta_size set to sizeof(struct pcap_pkt_metadata); otherwise meta
+ * must be NULL.
+ */
+struct pcap_pkt_batch {
+	struct pcap_pkthdr *hdrs;	/* headers of the packets */
+	const u_char **pkts;		/* pointers to the packet data */
+	struct pcap_pkt_metadata *meta;	/* metadata for the packets, or NULL */
+	size_t meta_size;		/* size of each entry in meta */
+	int count;			/* number of packets in the batch */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_next_batch(pcap_t *, struct pcap_pkt_batch *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_release_batch(pcap_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_get_pkt_metadata(pcap_t *, struct pcap_pkt_metadata *,
+    size_t);
+
 PCAP_AVAILABLE_0_4
 PCAP_API int	pcap_stats(pcap_t *, struct pcap_stat *);
 
@@ -638,6 +781,188 @@ PCAP_AVAILABLE_1_0
 PCAP_API int	pcap_offline_filter(const struct bpf_program *,
 	    const struct pcap_pkthdr *, const u_char *);
 
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_batch(const struct bpf_program *,
+	    const struct pcap_pkthdr *, const u_char **, int, uint8_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API pcap_classifier_t *pcap_classifier_create(const struct bpf_program *,
+	    int, char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_classify(pcap_classifier_t *, const struct pcap_pkthdr *,
+	    const u_char *, uint32_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_classifier_free(pcap_classifier_t *);
+
+/*
+ * Static cost of a filter program.  Path lengths are numbers of
+ * instructions executed for a packet; the average assumes that each
+ * conditional jump is as likely to be taken as not.
+ */
+struct pcap_filter_cost {
+	u_int	fc_insns;	/* number of instructions */
+	u_int	fc_min_path;	/* shortest path through the program */
+	u_int	fc_max_path;	/* longest path through the program */
+	double	fc_avg_path;	/* average path through the program */
+	u_int	fc_loads;	/* packet data loads at fixed offsets */
+	u_int	fc_ind_loads;	/* packet data loads at variable offsets */
+	u_int	fc_offsets;	/* distinct bytes read at fixed offsets */
+	bpf_u_int32 fc_max_offset; /* one past the last of them */
+	int	fc_loops;	/* program loops; each loop is counted once */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_analyze_filter(const struct bpf_program *,
+	    struct pcap_filter_cost *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	bpf_dump_cost(const struct bpf_program *);
+
+/*
+ * Value pcap_filter_max_offset() reports if it can't bound how far
+ * into a packet a filter can look.
+ */
+#define PCAP_FILTER_UNBOUNDED	0xffffffffU
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_max_offset(const struct bpf_program *,
+	    bpf_u_int32 *, int *);
+
+/*
+ * How well the verdict cache for a handle's filter is doing.
+ */
+struct pcap_filter_cache_stat {
+	uint64_t fcs_hits;	/* packets whose verdict was in the cache */
+	uint64_t fcs_misses;	/* packets the filter had to be run on */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_filter_cache(pcap_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_cache_stats(pcap_t *,
+	    struct pcap_filter_cache_stat *);
+
+/*
+ * Counts of what a filter program did over a run of packets.
+ */
+struct pcap_filter_profile {
+	u_int	fp_len;		/* number of instructions in the program */
+	uint64_t fp_runs;	/* packets run through the program */
+	uint64_t fp_accepted;	/* packets it accepted */
+	uint64_t *fp_executed;	/* times each instruction was executed */
+	uint64_t *fp_taken;	/* times each conditional jump was taken */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API struct pcap_filter_profile *pcap_filter_profile_create(
+	    const struct bpf_program *, char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_filter_profile_free(struct pcap_filter_profile *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_filter_profile(pcap_t *, struct pcap_filter_profile *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_offline_filter_profile(const struct bpf_program *,
+	    const struct pcap_pkthdr *, const u_char *,
+	    struct pcap_filter_profile *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	bpf_dump_profile(const struct bpf_program *,
+	    const struct pcap_filter_profile *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_compile_with_profile(pcap_t *, struct bpf_program *,
+	    const char *, int, bpf_u_int32, const struct pcap_filter_profile *);
+
+/*
+ * How well the process-wide cache of compiled filters is doing.
+ */
+struct pcap_compile_cache_stat {
+	uint64_t ccs_hits;	/* compilations found in the cache */
+	uint64_t ccs_misses;	/* compilations that had to be done */
+	u_int	ccs_entries;	/* programs in the cache now */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_compile_cached(pcap_t *, struct bpf_program **,
+	    const char *, int, bpf_u_int32);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_freecode_cached(struct bpf_program *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_set_compile_cache_size(int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_compile_cache_stats(struct pcap_compile_cache_stat *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API pcap_filter_builder_t *pcap_filter_builder_create(pcap_t *,
+	    const char *, int, bpf_u_int32);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_builder_add_term(pcap_filter_builder_t *,
+	    const char *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_builder_remove_term(pcap_filter_builder_t *, int);
+
+PCAP_AVAILABLE_1_11
+PCAP_API const struct bpf_program *pcap_filter_builder_program(
+	    pcap_filter_builder_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_filter_builder_setfilter(pcap_filter_builder_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API void	pcap_filter_builder_free(pcap_filter_builder_t *);
+
+PCAP_AVAILABLE_1_11
+PCAP_API u_int	pcap_filter_diff(const struct bpf_program *,
+	    const struct bpf_program *);
+
+/*
+ * Optimization levels for pcap_compile_ex().
+ */
+#define PCAP_OPTIMIZE_NONE	0	/* don't optimize */
+#define PCAP_OPTIMIZE_BASIC	1	/* only peephole-optimize basic blocks */
+#define PCAP_OPTIMIZE_DEFAULT	2	/* optimize as pcap_compile() does */
+#define PCAP_OPTIMIZE_PROFILE	3	/* that, then reorder using a profile */
+
+/*
+ * Options for pcap_compile_ex().
+ */
+struct pcap_compile_opts {
+	int	co_level;	/* PCAP_OPTIMIZE_ value */
+	u_int	co_max_passes;	/* optimizer passes to run at most, or 0 */
+	u_int	co_max_usecs;	/* microseconds to optimize for at most, or 0 */
+	const struct pcap_filter_profile *co_profile; /* for PCAP_OPTIMIZE_PROFILE */
+};
+
+/*
+ * What pcap_compile_ex() did.
+ */
+struct pcap_compile_stat {
+	u_int	cs_passes;	/* optimizer passes run */
+	u_int	cs_blocks_before; /* basic blocks before optimizing */
+	u_int	cs_blocks_after; /* basic blocks after optimizing */
+	u_int	cs_insns;	/* instructions in the program */
+	int	cs_cut_short;	/* optimizing stopped when over budget */
+	uint64_t cs_usecs;	/* microseconds spent compiling */
+	uint64_t cs_opt_usecs;	/* microseconds of that spent optimizing */
+	uint64_t cs_peak_bytes;	/* most memory the compiler used at once */
+};
+
+PCAP_AVAILABLE_1_11
+PCAP_API int	pcap_compile_ex(pcap_t *, struct bpf_program *, const char *,
+	    bpf_u_int32, const struct pcap_compile_opts *,
+	    struct pcap_compile_stat *);
+
 PCAP_AVAILABLE_0_4
 PCAP_API int	pcap_datalink(pcap_t *);
 
@@ -778,24 +1103,55 @@ PCAP_API void	pcap_freealldevs(pcap_if_t *);
 PCAP_AVAILABLE_0_8
 PCAP_API const char *pcap_lib_version(void);
 
-#if defined(_WIN32)
-
-  /*
-   * Win32 definitions
-   */
-
-  /*!
-    \brief A queue of raw packets that will be sent to the network with pcap_sendqueue_transmit().
-  */
-  struct pcap_send_queue
-  {
+/*
+ * A queue of raw packets that will be sent to the network with
+ * pcap_sendqueue_transmit().  Each packet in the buffer is preceded
+ * by its struct pcap_pkthdr.
+ *
+ * These were originally Win32-only; they're now available on all
+ * platforms, and, on Linux, can send through a memory-mapped
+ * PACKET_TX_RING.
+ */
+struct pcap_send_queue
+{
 	u_int maxlen;	/* Maximum size of the queue, in bytes. This
 			   variable contains the size of the buffer field. */
 	u_int len;	/* Current size of the queue, in bytes. */
 	char *buffer;	/* Buffer containing the packets to be sent. */
-  };
+};
+
+typedef struct pcap_send_queue pcap_send_queue;
+
+#if defined(_WIN32)
+  /*
+   * These have been there as long as WinPcap has.
+   */
+  PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
+
+  PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
+
+  PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
+
+  PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
+#else
+  PCAP_AVAILABLE_1_11
+  PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
+
+  PCAP_AVAILABLE_1_11
+  PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
 
-  typedef struct pcap_send_queue pcap_send_queue;
+  PCAP_AVAILABLE_1_11
+  PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
+
+  PCAP_AVAILABLE_1_11
+  PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
+#endif
+
+#if defined(_WIN32)
+
+  /*
+   * Win32 definitions
+   */
 
   /*!
     \brief This typedef is a support for the pcap_get_airpcap_handle() function
@@ -817,14 +1173,6 @@ PCAP_API const char *pcap_lib_version(void);
   PCAP_AVAILABLE_1_8
   PCAP_API int pcap_oid_set_request(pcap_t *, bpf_u_int32, const void *, size_t *);
 
-  PCAP_API pcap_send_queue* pcap_sendqueue_alloc(u_int memsize);
-
-  PCAP_API void pcap_sendqueue_destroy(pcap_send_queue* queue);
-
-  PCAP_API int pcap_sendqueue_queue(pcap_send_queue* queue, const struct pcap_pkthdr *pkt_header, const u_char *pkt_data);
-
-  PCAP_API u_int pcap_sendqueue_transmit(pcap_t *p, pcap_send_queue* queue, int sync);
-
   PCAP_API struct pcap_stat *pcap_stats_ex(pcap_t *p, int *pcap_stat_size);
 
   PCAP_API int pcap_setuserbuffer(pcap_t *p, int size);
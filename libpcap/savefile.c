@@ -184,14 +184,6 @@ sf_oid_set_request(pcap_t *p, bpf_u_int32 oid _U_, const void *data _U_,
 	return (PCAP_ERROR);
 }
 
-static u_int
-sf_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue _U_, int sync _U_)
-{
-	pcap_strlcpy(p->errbuf, "Sending packets isn't supported on savefiles",
-	    PCAP_ERRBUF_SIZE);
-	return (0);
-}
-
 static int
 sf_setuserbuffer(pcap_t *p, int size _U_)
 {
@@ -231,6 +223,14 @@ sf_inject(pcap_t *p, const void *buf _U_, int size _U_)
 	return (-1);
 }
 
+static u_int
+sf_sendqueue_transmit(pcap_t *p, pcap_send_queue *queue _U_, int sync _U_)
+{
+	pcap_strlcpy(p->errbuf, "Sending packets isn't supported on savefiles",
+	    PCAP_ERRBUF_SIZE);
+	return (0);
+}
+
 /*
  * Set direction flag: Which packets do we accept on a forwarding
  * single device? IN, OUT or both?
@@ -250,7 +250,7 @@ sf_cleanup(pcap_t *p)
 		(void)fclose(p->rfile);
     if (p->buffer != NULL)
         free(p->buffer);
-	pcap_freecode(&p->fcode);
+	uninstall_bpf_program(p);
 }
 
 #ifdef _WIN32
@@ -664,6 +664,7 @@ found:
 	p->getnonblock_op = sf_getnonblock;
 	p->setnonblock_op = sf_setnonblock;
 	p->stats_op = sf_stats;
+	p->sendqueue_transmit_op = sf_sendqueue_transmit;
 #ifdef _WIN32
 	p->stats_ex_op = sf_stats_ex;
 	p->setbuff_op = sf_setbuff;
@@ -672,7 +673,6 @@ found:
 	p->getevent_op = sf_getevent;
 	p->oid_get_request_op = sf_oid_get_request;
 	p->oid_set_request_op = sf_oid_set_request;
-	p->sendqueue_transmit_op = sf_sendqueue_transmit;
 	p->setuserbuffer_op = sf_setuserbuffer;
 	p->live_dump_op = sf_live_dump;
 	p->live_dump_ended_op = sf_live_dump_ended;
@@ -690,6 +690,12 @@ found:
 	 */
 	p->breakloop_op = pcap_breakloop_common;
 
+	/*
+	 * Packets are read one at a time from a savefile.
+	 */
+	p->next_batch_op = pcap_next_batch_common;
+	p->release_batch_op = pcap_release_batch_common;
+
 	/*
 	 * Savefiles never require special BPF code generation.
 	 */
@@ -730,9 +736,9 @@ pcap_fopen_offline(FILE *fp, char *errbuf)
 int
 pcap_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 {
-	struct bpf_insn *fcode;
 	int status = 0;
 	int n = 0;
+	int passed;
 	u_char *data;
 
 	while (status == 0) {
@@ -756,16 +762,23 @@ pcap_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 		}
 
 		status = p->next_packet_op(p, &h, &data);
-		if (status) {
+		if (status == 2) {
+			/*
+			 * The packet has already passed the filter.
+			 */
+			status = 0;
+			passed = 1;
+		} else if (status) {
 			if (status == 1)
 				return (0);
 			return (status);
-		}
+		} else
+			passed = (p->fcode.bf_insns == NULL ||
+			    pcap_run_filter(p, data, h.len, h.caplen));
 
 		p->packet_read_count += 1;
 
-		if ((fcode = p->fcode.bf_insns) == NULL ||
-		    pcap_filter(fcode, data, h.len, h.caplen)) {
+		if (passed) {
 			(*callback)(user, &h, data);
 			if (++n >= cnt && cnt > 0)
 				break;
@@ -784,7 +797,6 @@ pcap_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 int
 pcap_ng_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 {
-	struct bpf_insn *fcode;
 	int status = 0;
 	int n = 0;
 	u_char *data;
@@ -824,9 +836,9 @@ pcap_ng_offline_read(pcap_t *p, int cnt, pcap_handler callback, u_char *user)
 		 * TBD
 		 * Have one filter per link type 
 		 */
-		if ((fcode = p->fcode.bf_insns) == NULL ||
+		if (p->fcode.bf_insns == NULL ||
 			data == NULL || 
-		    bpf_filter(fcode, data, h.len, h.caplen)) {
+		    pcap_run_filter(p, data, h.len, h.caplen)) {
 			(*callback)(user, &h, p->buffer);
 			if (++n >= cnt && cnt > 0)
 				break;
@@ -151,6 +151,8 @@ struct pcap_sf {
 	size_t hdrsize;
 	swapped_type_t lengths_swapped;
 	tstamp_scale_type_t scale_type;
+	int cant_seek;			/* savefile isn't seekable */
+	bpf_u_int32 skipped_caplen;	/* caplen of the packet we seeked past */
 };
 
 /*
@@ -271,6 +273,12 @@ pcap_check_header(const uint8_t *magic, FILE *fp, u_int precision, char *errbuf,
 
 	ps = p->priv;
 
+	/*
+	 * We can only seek past packet data we don't need if the
+	 * file isn't a pipe.
+	 */
+	ps->cant_seek = (ftell(fp) == -1);
+
 	p->opt.tstamp_precision = precision;
 
 	/*
@@ -454,10 +462,20 @@ grow_buffer(pcap_t *p, u_int bufsize)
 	return (1);
 }
 
+/*
+ * Seeking in a standard I/O stream costs more than copying a few
+ * kilobytes out of its buffer, so we only seek past the part of a
+ * packet the filter can't look at, rather than reading it, if it's
+ * at least this big, as is the case for packets that were
+ * reassembled or coalesced by the network adapter or the OS.
+ */
+#define MIN_BYTES_TO_SKIP	8192
+
 /*
  * Read and return the next packet from the savefile.  Return the header
- * in hdr and a pointer to the contents in data.  Return 0 on success, 1
- * if there were no more packets, and -1 on an error.
+ * in hdr and a pointer to the contents in data.  Return 0 on success,
+ * 2 on success if the packet has already been run through the filter
+ * and passed it, 1 if there were no more packets, and -1 on an error.
  */
 static int
 pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
@@ -466,7 +484,11 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 	struct pcap_sf_patched_pkthdr sf_hdr;
 	FILE *fp = p->rfile;
 	size_t amt_read;
-	bpf_u_int32 t;
+	bpf_u_int32 t, maxoff;
+	long pos, end;
+	int status = 0;
+
+again:
 
 	/*
 	 * Read the packet header; the structure we use as a buffer
@@ -488,10 +510,28 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 				    ps->hdrsize, amt_read);
 				return (-1);
 			}
+
+			/*
+			 * If we seeked past the data of the last packet
+			 * rather than reading it, make sure it was all
+			 * there; seeking past the end of the file
+			 * doesn't fail.
+			 */
+			if (ps->skipped_caplen != 0 &&
+			    (pos = ftell(fp)) != -1 &&
+			    fseek(fp, 0, SEEK_END) == 0 &&
+			    (end = ftell(fp)) != -1 && end < pos) {
+				snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+				    "truncated dump file; tried to read %u captured bytes, only got %zu",
+				    ps->skipped_caplen,
+				    (size_t)(ps->skipped_caplen - (pos - end)));
+				return (-1);
+			}
 			/* EOF */
 			return (1);
 		}
 	}
+	ps->skipped_caplen = 0;
 #ifdef __APPLE__
 	memset(hdr->comment, 0, sizeof(hdr->comment));
 #endif
@@ -714,9 +754,59 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 				return (-1);
 		}
 
+		/*
+		 * If there's a filter, and there are at least
+		 * MIN_BYTES_TO_SKIP bytes of the packet it can't look
+		 * at, first read only the part it can look at, and
+		 * run the filter on that; if the filter rejects the
+		 * packet, seek past the rest of it rather than
+		 * copying it in.
+		 *
+		 * We don't do this for byte-swapped files, as the
+		 * pseudo-headers have to be swapped before the
+		 * filter is run, and that might need the rest of
+		 * the packet.
+		 */
+		maxoff = 0;
+		if (p->fcode.bf_insns != NULL && !p->swapped &&
+		    !ps->cant_seek && hdr->caplen > p->fcode_maxoff &&
+		    hdr->caplen - p->fcode_maxoff >= MIN_BYTES_TO_SKIP) {
+			maxoff = p->fcode_maxoff;
+			amt_read = fread(p->buffer, 1, maxoff, fp);
+			if (amt_read != maxoff) {
+				if (ferror(fp)) {
+					pcap_fmt_errmsg_for_errno(p->errbuf,
+					    PCAP_ERRBUF_SIZE, errno,
+					    "error reading dump file");
+				} else {
+					snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
+					    "truncated dump file; tried to read %u captured bytes, only got %zu",
+					    hdr->caplen, amt_read);
+				}
+				return (-1);
+			}
+			if (!pcap_run_filter(p, p->buffer, hdr->len,
+			    hdr->caplen)) {
+				if (fseek(fp, (long)(hdr->caplen - maxoff),
+				    SEEK_CUR) == -1) {
+					pcap_fmt_errmsg_for_errno(p->errbuf,
+					    PCAP_ERRBUF_SIZE, errno,
+					    "error seeking in dump file");
+					return (-1);
+				}
+				ps->skipped_caplen = hdr->caplen;
+#ifdef __APPLE__
+				p->packet_read_count += 1;
+#endif
+				goto again;
+			}
+			status = 2;
+		}
+
 		/* read the packet itself */
-		amt_read = fread(p->buffer, 1, hdr->caplen, fp);
-		if (amt_read != hdr->caplen) {
+		amt_read = fread((u_char *)p->buffer + maxoff, 1,
+		    hdr->caplen - maxoff, fp);
+		if (amt_read != hdr->caplen - maxoff) {
 			if (ferror(fp)) {
 				pcap_fmt_errmsg_for_errno(p->errbuf,
 				    PCAP_ERRBUF_SIZE, errno,
@@ -724,7 +814,7 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 			} else {
 				snprintf(p->errbuf, PCAP_ERRBUF_SIZE,
 				    "truncated dump file; tried to read %u captured bytes, only got %zu",
-				    hdr->caplen, amt_read);
+				    hdr->caplen, maxoff + amt_read);
 			}
 			return (-1);
 		}
@@ -734,7 +824,7 @@ pcap_next_packet(pcap_t *p, struct pcap_pkthdr *hdr, u_char **data)
 	if (p->swapped)
 		swap_pseudo_headers(p->linktype, hdr, *data);
 
-	return (0);
+	return (status);
 }
 
 static int
@@ -0,0 +1,353 @@
+#include "varattrs.h"
+
+/*
+ * Check that a classifier gives the same result as running each of its
+ * filters with pcap_offline_filter(), for sets of filters of the sort
+ * a capture daemon with many consumers might have - a few hundred
+ * "host", "port" and "net" filters, all different, or a few used over
+ * and over - and Ethernet packets carrying TCP and UDP over IPv4 and
+ * IPv6; then time the two over the same packets, to show how much of
+ * the work the classifier shares.
+ */
+
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "pcap/funcattrs.h"
+
+#define NFILTERS	200
+#define NPKTS		1000
+#define PKTLEN		74
+
+/* How many times the packets are run through, when timing. */
+#define ROUNDS		20
+
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+
+/*
+ * Sets of filters; each makes the text of filter i in buf.
+ */
+static void
+hosts(char *buf, size_t size, int i)
+{
+	/* 200 different hosts. */
+	snprintf(buf, size, "host 10.0.%d.%d", i / 16, i % 16);
+}
+
+static void
+mixed(char *buf, size_t size, int i)
+{
+	/* 40 different filters of each kind, each one used by 1 consumer. */
+	switch (i % 5) {
+
+	case 0:
+		snprintf(buf, size, "host 10.0.%d.%d", i / 80, (i / 5) % 16);
+		break;
+
+	case 1:
+		snprintf(buf, size, "tcp port %d", 1000 + i / 5);
+		break;
+
+	case 2:
+		snprintf(buf, size, "udp dst port %d", 1000 + i / 5);
+		break;
+
+	case 3:
+		snprintf(buf, size, "src net 10.%d.0.0/16", i / 5);
+		break;
+
+	default:
+		snprintf(buf, size, "ip6 and tcp dst port %d", 1000 + i / 5);
+		break;
+	}
+}
+
+static void
+consumers(char *buf, size_t size, int i)
+{
+	/* 10 different filters, each used by 20 consumers. */
+	switch (i % 10) {
+
+	case 0:
+		snprintf(buf, size, "tcp port 80");
+		break;
+
+	case 1:
+		snprintf(buf, size, "tcp port 443");
+		break;
+
+	case 2:
+		snprintf(buf, size, "udp port 53");
+		break;
+
+	case 3:
+		snprintf(buf, size, "host 10.0.0.1");
+		break;
+
+	case 4:
+		snprintf(buf, size, "net 10.0.1.0/24");
+		break;
+
+	case 5:
+		snprintf(buf, size, "ip6 and tcp");
+		break;
+
+	case 6:
+		snprintf(buf, size, "tcp[tcpflags] & tcp-syn != 0");
+		break;
+
+	case 7:
+		snprintf(buf, size, "udp and not port 53");
+		break;
+
+	case 8:
+		snprintf(buf, size, "host 10.0.0.2 and tcp port 22");
+		break;
+
+	default:
+		snprintf(buf, size, "ip and not net 10.0.0.0/8");
+		break;
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*make)(char *, size_t, int);
+} sets[] = {
+	{ "hosts", hosts },
+	{ "mixed", mixed },
+	{ "consumers", consumers },
+};
+
+/*
+ * Make an Ethernet packet carrying TCP or UDP over IPv4 or IPv6, with
+ * source and destination addresses in 10.0.0.0/20 (at the end of
+ * IPv4-mapped addresses for IPv6) and ports picked from the ones the
+ * filters look for and a few others.
+ */
+static void
+make_packet(u_char *pkt, unsigned int n)
+{
+	static const unsigned short ports[] = { 22, 53, 80, 443, 9999 };
+	unsigned short sport, dport;
+	int v6 = (n % 7) == 0;
+	u_char proto = (n % 3) == 0 ? 17 : 6;
+	u_char *l4;
+
+	memset(pkt, 0, PKTLEN);
+	if (v6) {
+		pkt[12] = 0x86;
+		pkt[13] = 0xdd;
+		pkt[14] = 0x60;
+		pkt[20] = proto;
+		pkt[32] = pkt[33] = 0xff;
+		pkt[34] = 10;
+		pkt[36] = (n / 5) % 16;
+		pkt[37] = n % 16;
+		pkt[48] = pkt[49] = 0xff;
+		pkt[50] = 10;
+		pkt[52] = (n / 11) % 16;
+		pkt[53] = (n / 3) % 16;
+		l4 = &pkt[54];
+	} else {
+		pkt[12] = 0x08;
+		pkt[13] = 0x00;
+		pkt[14] = 0x45;
+		pkt[23] = proto;
+		pkt[26] = 10;
+		pkt[27] = (n / 13) % 48;
+		pkt[28] = (n / 5) % 16;
+		pkt[29] = n % 16;
+		pkt[30] = 10;
+		pkt[32] = (n / 11) % 16;
+		pkt[33] = (n / 3) % 16;
+		l4 = &pkt[34];
+	}
+	sport = (n % 4) == 0 ? ports[n % 5] : 1000 + (n * 7) % 50;
+	dport = (n % 4) == 1 ? ports[(n / 4) % 5] : 1000 + (n * 3) % 50;
+	l4[0] = sport >> 8;
+	l4[1] = sport & 0xff;
+	l4[2] = dport >> 8;
+	l4[3] = dport & 0xff;
+	if (proto == 6)
+		l4[13] = (n % 6) == 0 ? 0x02 : 0x10;
+}
+
+static struct bpf_program progs[NFILTERS];
+static u_char pkts[NPKTS][PKTLEN];
+
+/*
+ * Check that the classifier agrees with each filter in set s about
+ * each packet.
+ */
+static void
+check(size_t s, pcap_classifier_t *c, const struct pcap_pkthdr *h)
+{
+	uint32_t matches[(NFILTERS + 31) / 32];
+	char text[64];
+	u_int n, r1, r2;
+	int i, count;
+
+	for (n = 0; n < NPKTS; n++) {
+		count = pcap_classify(c, h, pkts[n], matches);
+		for (i = 0; i < NFILTERS; i++) {
+			r1 = pcap_offline_filter(&progs[i], h, pkts[n]) != 0;
+			r2 = (matches[i / 32] >> (i % 32)) & 1;
+			if (r1 != r2) {
+				sets[s].make(text, sizeof(text), i);
+				error("%s: packet %u: \"%s\" %s, the "
+				    "classifier says it %s", sets[s].name, n,
+				    text, r1 ? "matches" : "doesn't match",
+				    r2 ? "does" : "doesn't");
+			}
+			count -= r1;
+		}
+		if (count != 0)
+			error("%s: packet %u: pcap_classify() returned the "
+			    "wrong count", sets[s].name, n);
+	}
+}
+
+static double
+seconds(clock_t start)
+{
+	return ((double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+/*
+ * Run each filter over each packet ROUNDS times, returning how long
+ * that took and setting *nmatchesp to the number of matches.
+ */
+static double
+time_filters(u_long *nmatchesp, const struct pcap_pkthdr *h)
+{
+	clock_t start;
+	u_long nmatches = 0;
+	u_int round, n;
+	int i;
+
+	start = clock();
+	for (round = 0; round < ROUNDS; round++) {
+		for (n = 0; n < NPKTS; n++) {
+			for (i = 0; i < NFILTERS; i++) {
+				if (pcap_offline_filter(&progs[i], h,
+				    pkts[n]) != 0)
+					nmatches++;
+			}
+		}
+	}
+	*nmatchesp = nmatches;
+	return (seconds(start));
+}
+
+/*
+ * The same, running the classifier over each packet.
+ */
+static double
+time_classifier(u_long *nmatchesp, pcap_classifier_t *c,
+    const struct pcap_pkthdr *h)
+{
+	uint32_t matches[(NFILTERS + 31) / 32];
+	clock_t start;
+	u_long nmatches = 0;
+	u_int round, n;
+
+	start = clock();
+	for (round = 0; round < ROUNDS; round++) {
+		for (n = 0; n < NPKTS; n++)
+			nmatches += pcap_classify(c, h, pkts[n], matches);
+	}
+	*nmatchesp = nmatches;
+	return (seconds(start));
+}
+
+int
+main(int argc _U_, char **argv)
+{
+	pcap_t *pd;
+	pcap_classifier_t *c;
+	struct pcap_pkthdr h;
+	char text[64], errbuf[PCAP_ERRBUF_SIZE];
+	size_t s;
+	u_int n;
+	int i, opt;
+	u_long nmatches1, nmatches2;
+	double t1, t2;
+	char *cp;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	for (n = 0; n < NPKTS; n++)
+		make_packet(pkts[n], n);
+	memset(&h, 0, sizeof(h));
+	h.caplen = PKTLEN;
+	h.len = PKTLEN;
+
+	pd = pcap_open_dead(DLT_EN10MB, 262144);
+	if (pd == NULL)
+		error("Can't open fake pcap_t");
+	for (s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+		for (opt = 0; opt < 2; opt++) {
+			for (i = 0; i < NFILTERS; i++) {
+				sets[s].make(text, sizeof(text), i);
+				if (pcap_compile(pd, &progs[i], text, opt,
+				    PCAP_NETMASK_UNKNOWN) < 0)
+					error("\"%s\": %s", text,
+					    pcap_geterr(pd));
+			}
+			c = pcap_classifier_create(progs, NFILTERS, errbuf);
+			if (c == NULL)
+				error("%s: %s", sets[s].name, errbuf);
+			check(s, c, &h);
+
+			t1 = time_filters(&nmatches1, &h);
+			t2 = time_classifier(&nmatches2, c, &h);
+			if (nmatches1 != nmatches2)
+				error("%s: %lu matches from the filters, "
+				    "%lu from the classifier",
+				    sets[s].name, nmatches1, nmatches2);
+			printf("%-9s %-11s: %d filters, %lu matches: "
+			    "filters %.3fs, classifier %.3fs",
+			    sets[s].name, opt ? "optimized" : "unoptimized",
+			    NFILTERS, nmatches1, t1, t2);
+			if (t2 > 0)
+				printf(" (%.1fx)", t1 / t2);
+			printf("\n");
+
+			pcap_classifier_free(c);
+			for (i = 0; i < NFILTERS; i++)
+				pcap_freecode(&progs[i]);
+		}
+	}
+	pcap_close(pd);
+	exit(0);
+}
+
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}
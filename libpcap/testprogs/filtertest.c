@@ -169,6 +169,56 @@ warn(const char *fmt, ...)
 	}
 }
 
+/*
+ * Run a filter over the packets in a savefile, counting what it does.
+ */
+static struct pcap_filter_profile *
+profile_savefile(struct bpf_program *fcode, const char *file)
+{
+	struct pcap_filter_profile *prof;
+	pcap_t *rd;
+	struct pcap_pkthdr *h;
+	const u_char *pkt;
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	prof = pcap_filter_profile_create(fcode, errbuf);
+	if (prof == NULL)
+		error("%s", errbuf);
+	rd = pcap_open_offline(file, errbuf);
+	if (rd == NULL)
+		error("%s", errbuf);
+	while (pcap_next_ex(rd, &h, &pkt) == 1)
+		pcap_offline_filter_profile(fcode, h, pkt, prof);
+	pcap_close(rd);
+	return (prof);
+}
+
+/*
+ * Check that two filters give the same result for every packet in a
+ * savefile.
+ */
+static void
+compare_savefile(struct bpf_program *fcode1, struct bpf_program *fcode2,
+    const char *file)
+{
+	pcap_t *rd;
+	struct pcap_pkthdr *h;
+	const u_char *pkt;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	u_int n;
+
+	rd = pcap_open_offline(file, errbuf);
+	if (rd == NULL)
+		error("%s", errbuf);
+	for (n = 1; pcap_next_ex(rd, &h, &pkt) == 1; n++) {
+		if (pcap_offline_filter(fcode1, h, pkt) !=
+		    pcap_offline_filter(fcode2, h, pkt))
+			error("reordered filter gives a different result for packet %u",
+			    n);
+	}
+	pcap_close(rd);
+}
+
 /*
  * Copy arg vector into a new buffer, concatenating arguments with spaces.
  */
@@ -208,11 +258,14 @@ main(int argc, char **argv)
 {
 	char *cp;
 	int op;
+	int cflag;
 	int dflag;
 #ifdef BDEBUG
 	int gflag;
 #endif
 	char *infile;
+	char *rfile;
+	char *Pfile;
 	int Oflag;
 	int snaplen;
 	char *p;
@@ -228,12 +281,15 @@ main(int argc, char **argv)
 		return 1;
 #endif /* _WIN32 */
 
+	cflag = 0;
 	dflag = 1;
 #ifdef BDEBUG
 	gflag = 0;
 #endif
 
 	infile = NULL;
+	rfile = NULL;
+	Pfile = NULL;
 	Oflag = 1;
 	snaplen = MAXIMUM_SNAPLEN;
 
@@ -243,9 +299,13 @@ main(int argc, char **argv)
 		program_name = argv[0];
 
 	opterr = 0;
-	while ((op = getopt(argc, argv, "dF:gm:Os:")) != -1) {
+	while ((op = getopt(argc, argv, "cdF:gm:OP:r:s:")) != -1) {
 		switch (op) {
 
+		case 'c':
+			++cflag;
+			break;
+
 		case 'd':
 			++dflag;
 			break;
@@ -266,6 +326,14 @@ main(int argc, char **argv)
 			Oflag = 0;
 			break;
 
+		case 'P':
+			Pfile = optarg;
+			break;
+
+		case 'r':
+			rfile = optarg;
+			break;
+
 		case 'm': {
 			bpf_u_int32 addr;
 
@@ -358,7 +426,40 @@ main(int argc, char **argv)
 		printf("machine codes for empty filter:\n");
 #endif
 
-	bpf_dump(&fcode, dflag);
+	if (Pfile != NULL) {
+		/*
+		 * Profile the filter on the packets in the file,
+		 * recompile it with its tests reordered using the
+		 * profile, and check that the result is the same for
+		 * all of those packets.
+		 */
+		struct pcap_filter_profile *prof;
+		struct bpf_program pcode;
+
+		prof = profile_savefile(&fcode, Pfile);
+		if (pcap_compile_with_profile(pd, &pcode, cmdbuf, Oflag,
+		    netmask, prof) < 0)
+			error("%s", pcap_geterr(pd));
+		pcap_filter_profile_free(prof);
+		compare_savefile(&fcode, &pcode, Pfile);
+		pcap_freecode(&fcode);
+		fcode = pcode;
+	}
+
+	if (rfile != NULL) {
+		/*
+		 * Run the filter over the packets in the file, and
+		 * show how often each instruction was executed.
+		 */
+		struct pcap_filter_profile *prof;
+
+		prof = profile_savefile(&fcode, rfile);
+		bpf_dump_profile(&fcode, prof);
+		pcap_filter_profile_free(prof);
+	} else
+		bpf_dump(&fcode, dflag);
+	if (cflag)
+		bpf_dump_cost(&fcode);
 	free(cmdbuf);
 	if (have_fcode)
 		pcap_freecode (&fcode);
@@ -373,9 +474,9 @@ usage(void)
 	    pcap_lib_version());
 	(void)fprintf(stderr,
 #ifdef BDEBUG
-	    "Usage: %s [-dgO] [ -F file ] [ -m netmask] [ -s snaplen ] dlt [ expression ]\n",
+	    "Usage: %s [-cdgO] [ -F file ] [ -m netmask] [ -P savefile ] [ -r savefile ] [ -s snaplen ] dlt [ expression ]\n",
 #else
-	    "Usage: %s [-dO] [ -F file ] [ -m netmask] [ -s snaplen ] dlt [ expression ]\n",
+	    "Usage: %s [-cdO] [ -F file ] [ -m netmask] [ -P savefile ] [ -r savefile ] [ -s snaplen ] dlt [ expression ]\n",
 #endif
 	    program_name);
 	exit(1);
@@ -1,13 +1,468 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pcap/pcap.h>
 
+#include "pcap-int.h"
+
 void fuzz_openFile(const char * name){
     //do nothing
 }
 
+#define NLENGTHS 4
+
+//fills in the buffer lengths the programs are run at: all of the input,
+//half of it, no more than an Ethernet header of it, and none of it
+static void bufferLengths(size_t Size, u_int lengths[NLENGTHS]) {
+    lengths[0] = (u_int)Size;
+    lengths[1] = (u_int)Size / 2;
+    lengths[2] = Size > 14 ? 14 : (u_int)Size;
+    lengths[3] = 0;
+}
+
+//runs the program with the pre-decoding interpreter, the plain one and,
+//if it can be translated, as native code, on the input, at a few lengths
+//and with and without VLAN auxiliary data, and checks that they agree
+static void compareInterpreters(const struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    struct bpf_decoded *decoded;
+    struct bpf_jit jit;
+    struct pcap_bpf_aux_data aux;
+    u_int lengths[NLENGTHS];
+    u_int r1, r2;
+    size_t i;
+
+    decoded = pcap_predecode_filter(bpf->bf_insns, bpf->bf_len);
+    if (decoded == NULL) {
+        return;
+    }
+    if (pcap_jit_compile(&jit, bpf->bf_insns, bpf->bf_len) == -1) {
+        jit.func = NULL;
+    }
+    bufferLengths(Size, lengths);
+    aux.vlan_tag_present = Size > 1 ? Data[0] & 1 : 0;
+    aux.vlan_tag = Size > 2 ? ((Data[1] << 8) | Data[2]) & 0x0fff : 0;
+    for (i = 0; i < NLENGTHS; i++) {
+        r1 = pcap_filter(bpf->bf_insns, Data, (u_int)Size, lengths[i]);
+        r2 = pcap_filter_predecoded(decoded, Data, (u_int)Size, lengths[i], NULL);
+        if (r1 != r2) {
+            printf("pre-decoded filter returned %u, not %u, for buflen %u\n", r2, r1, lengths[i]);
+            abort();
+        }
+        if (jit.func != NULL) {
+            r2 = jit.func(Data, (u_int)Size, lengths[i]);
+            if (r1 != r2) {
+                printf("native code returned %u, not %u, for buflen %u\n", r2, r1, lengths[i]);
+                abort();
+            }
+        }
+        r1 = pcap_filter_with_aux_data(bpf->bf_insns, Data, (u_int)Size, lengths[i], &aux);
+        r2 = pcap_filter_predecoded(decoded, Data, (u_int)Size, lengths[i], &aux);
+        if (r1 != r2) {
+            printf("pre-decoded filter returned %u, not %u, for buflen %u with aux data\n", r2, r1, lengths[i]);
+            abort();
+        }
+    }
+    pcap_jit_free(&jit);
+    pcap_free_predecoded(decoded);
+}
+
+//runs the program over the input at a few lengths as one batch, with
+//pcap_filter_batch(), and checks that the verdicts are those of
+//pcap_filter()
+static void compareBatch(const struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    struct pcap_pkthdr hdrs[NLENGTHS];
+    const u_char *pkts[NLENGTHS];
+    uint8_t verdicts[NLENGTHS];
+    u_int lengths[NLENGTHS];
+    int i, matched, n;
+
+    bufferLengths(Size, lengths);
+    for (i = 0; i < NLENGTHS; i++) {
+        memset(&hdrs[i], 0, sizeof(hdrs[i]));
+        hdrs[i].caplen = lengths[i];
+        hdrs[i].len = (bpf_u_int32)Size;
+        pkts[i] = Data;
+    }
+    matched = pcap_filter_batch(bpf, hdrs, pkts, NLENGTHS, verdicts);
+    n = 0;
+    for (i = 0; i < NLENGTHS; i++) {
+        if (verdicts[i] != (pcap_filter(bpf->bf_insns, Data, hdrs[i].len, hdrs[i].caplen) != 0)) {
+            printf("batch verdict %u is wrong for buflen %u\n", verdicts[i], hdrs[i].caplen);
+            abort();
+        }
+        n += verdicts[i];
+    }
+    if (matched != n) {
+        printf("batch returned %d matches, not %d\n", matched, n);
+        abort();
+    }
+}
+
+//puts the program in a classifier twice, along with the filter compiled
+//unoptimized and a few fixed filters for the same link-layer type,
+//compiled the first time they're needed for that type, classifies the
+//input at a few lengths, and checks that the matches are those of
+//pcap_filter()
+static void compareClassifier(pcap_t *pkts, const char *filter, const struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    static const char *others[] = { "ip", "tcp port 80", "ip6 or arp", "udp and ip[8] > 1" };
+    static struct bpf_program otherProgs[4];
+    static int nOthers;
+    static int othersLinktype = -1;
+    struct bpf_program progs[7];
+    struct bpf_program unopt;
+    pcap_classifier_t *c;
+    struct pcap_pkthdr h;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    uint32_t matches[1];
+    u_int lengths[NLENGTHS];
+    int i, j, n, matched, count;
+
+    if (pcap_datalink(pkts) != othersLinktype) {
+        for (j = 0; j < nOthers; j++) {
+            pcap_freecode(&otherProgs[j]);
+        }
+        nOthers = 0;
+        for (i = 0; i < 4; i++) {
+            if (pcap_compile(pkts, &otherProgs[nOthers], others[i], 1, PCAP_NETMASK_UNKNOWN) == 0) {
+                nOthers++;
+            }
+        }
+        othersLinktype = pcap_datalink(pkts);
+    }
+    progs[0] = *bpf;
+    progs[1] = *bpf;
+    n = 2;
+    if (pcap_compile(pkts, &unopt, filter, 0, PCAP_NETMASK_UNKNOWN) != 0) {
+        printf("pcap_compile failed unoptimized: %s\n", pcap_geterr(pkts));
+        abort();
+    }
+    progs[n++] = unopt;
+    for (j = 0; j < nOthers; j++) {
+        progs[n++] = otherProgs[j];
+    }
+    c = pcap_classifier_create(progs, n, errbuf);
+    if (c == NULL) {
+        printf("pcap_classifier_create failed: %s\n", errbuf);
+        abort();
+    }
+    bufferLengths(Size, lengths);
+    memset(&h, 0, sizeof(h));
+    h.len = (bpf_u_int32)Size;
+    for (i = 0; i < NLENGTHS; i++) {
+        h.caplen = lengths[i];
+        matched = pcap_classify(c, &h, Data, matches);
+        count = 0;
+        for (j = 0; j < n; j++) {
+            if (((matches[0] >> j) & 1) != (pcap_filter(progs[j].bf_insns, Data, h.len, h.caplen) != 0)) {
+                printf("classifier got filter %d wrong for buflen %u\n", j, h.caplen);
+                abort();
+            }
+            count += (matches[0] >> j) & 1;
+        }
+        if (matched != count) {
+            printf("classifier returned %d matches, not %d\n", matched, count);
+            abort();
+        }
+    }
+    pcap_classifier_free(c);
+    pcap_freecode(&unopt);
+}
+
+//installs the program on the handle with its verdicts cached, runs it
+//twice over the input at a few lengths, so the second verdict comes
+//from the cache, then over a copy with a byte changed, and checks that
+//the verdicts are those of pcap_filter()
+static void compareFilterCache(pcap_t *pkts, struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    const uint8_t *pkt;
+    uint8_t *copy;
+    u_int lengths[NLENGTHS];
+    u_int r1, r2;
+    int i, j, k;
+
+    if (pcap_set_filter_cache(pkts, 64) != 0) {
+        printf("pcap_set_filter_cache failed: %s\n", pcap_geterr(pkts));
+        abort();
+    }
+    if (install_bpf_program(pkts, bpf) != 0) {
+        printf("install_bpf_program failed: %s\n", pcap_geterr(pkts));
+        abort();
+    }
+    copy = malloc(Size);
+    if (copy == NULL) {
+        printf("malloc failed\n");
+        abort();
+    }
+    memcpy(copy, Data, Size);
+    copy[Size / 3] ^= 0xff;
+    bufferLengths(Size, lengths);
+    for (k = 0; k < 2; k++) {
+        pkt = k == 0 ? Data : copy;
+        for (i = 0; i < NLENGTHS; i++) {
+            r1 = pcap_filter(bpf->bf_insns, pkt, (u_int)Size, lengths[i]);
+            for (j = 0; j < 2; j++) {
+                r2 = pcap_run_filter(pkts, pkt, (u_int)Size, lengths[i]);
+                if (r1 != r2) {
+                    printf("cached filter returned %u, not %u, for buflen %u\n", r2, r1, lengths[i]);
+                    abort();
+                }
+            }
+        }
+    }
+    free(copy);
+
+    //pcap_close() doesn't free a filter on a pcap_open_dead() handle,
+    //as pcap_setfilter() can't set one
+    pcap_set_filter_cache(pkts, 0);
+    uninstall_bpf_program(pkts);
+}
+
+//builds the filter with a filter builder, checks that ANDing "ip" with
+//it gives the AND of their verdicts on the input and that removing the
+//term again gives the program pcap_compile() did, and checks that
+//pcap_filter_diff() is 0 for a program and itself and is symmetric
+static void compareBuilder(pcap_t *pkts, const char *filter, const struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    static const char *prefixes[] = { "vlan", "mpls", "pppoes", "geneve" };
+    pcap_filter_builder_t *fb;
+    struct bpf_program ip;
+    const struct bpf_program *prog;
+    u_int r1, r2;
+    int i, id;
+
+    if (pcap_compile(pkts, &ip, "ip", 1, PCAP_NETMASK_UNKNOWN) != 0) {
+        return;
+    }
+    if (pcap_filter_diff(bpf, bpf) != 0 || pcap_filter_diff(&ip, &ip) != 0) {
+        printf("pcap_filter_diff of a program and itself isn't 0\n");
+        abort();
+    }
+    if (pcap_filter_diff(bpf, &ip) != pcap_filter_diff(&ip, bpf)) {
+        printf("pcap_filter_diff isn't symmetric\n");
+        abort();
+    }
+    fb = pcap_filter_builder_create(pkts, filter, 1, PCAP_NETMASK_UNKNOWN);
+    if (fb == NULL) {
+        pcap_freecode(&ip);
+        return;
+    }
+    if (pcap_filter_diff(pcap_filter_builder_program(fb), bpf) != 0) {
+        printf("builder program differs from the compiled filter\n");
+        abort();
+    }
+    id = pcap_filter_builder_add_term(fb, "ip");
+    if (id > 0) {
+        //primitives that change how what follows them is compiled
+        //make the result something other than the AND
+        for (i = 0; i < 4; i++) {
+            if (strstr(filter, prefixes[i]) != NULL) {
+                break;
+            }
+        }
+        prog = pcap_filter_builder_program(fb);
+        if (i == 4) {
+            r1 = pcap_filter(bpf->bf_insns, Data, (u_int)Size, (u_int)Size) != 0 &&
+                pcap_filter(ip.bf_insns, Data, (u_int)Size, (u_int)Size) != 0;
+            r2 = pcap_filter(prog->bf_insns, Data, (u_int)Size, (u_int)Size) != 0;
+            if (r1 != r2) {
+                printf("builder with term returned %u, not %u\n", r2, r1);
+                abort();
+            }
+        }
+        if (pcap_filter_builder_remove_term(fb, id) != 0) {
+            printf("pcap_filter_builder_remove_term failed: %s\n", pcap_geterr(pkts));
+            abort();
+        }
+        if (pcap_filter_diff(pcap_filter_builder_program(fb), bpf) != 0) {
+            printf("builder program with the term removed differs from the compiled filter\n");
+            abort();
+        }
+    }
+    pcap_filter_builder_free(fb);
+    pcap_freecode(&ip);
+}
+
+//compiles the filter at each optimization level, and at the default
+//level with the optimizer stopped after a pass, the profile-guided
+//level using a profile gathered on the input, and checks that the
+//programs give the verdicts the unoptimized one does on the input,
+//padded with zeroes to all that it can look at, as optimizing can
+//remove loads past the end of a short packet that would reject it
+static void compareLevels(pcap_t *pkts, const char *filter, const uint8_t *Data, size_t Size) {
+    struct pcap_compile_opts opts;
+    struct pcap_compile_stat st;
+    struct pcap_filter_profile *prof;
+    struct bpf_program base, progs[4];
+    struct pcap_pkthdr h;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    bpf_u_int32 maxoff;
+    uint8_t *pkt;
+    u_int len, r1, r2;
+    int j, ok[4];
+
+    memset(&opts, 0, sizeof(opts));
+    opts.co_level = PCAP_OPTIMIZE_NONE;
+    if (pcap_compile_ex(pkts, &base, filter, PCAP_NETMASK_UNKNOWN, &opts, &st) != 0) {
+        return;
+    }
+    if (pcap_filter_max_offset(&base, &maxoff, NULL) != 0 ||
+        maxoff == PCAP_FILTER_UNBOUNDED) {
+        pcap_freecode(&base);
+        return;
+    }
+    len = maxoff > Size ? maxoff : (u_int)Size;
+    pkt = calloc(len, 1);
+    if (pkt == NULL) {
+        printf("calloc failed\n");
+        abort();
+    }
+    memcpy(pkt, Data, Size);
+
+    //an optimized program can fail to compile where the unoptimized
+    //one doesn't, if it rejects every packet
+    opts.co_level = PCAP_OPTIMIZE_BASIC;
+    ok[0] = pcap_compile_ex(pkts, &progs[0], filter, PCAP_NETMASK_UNKNOWN, &opts, &st) == 0;
+    opts.co_level = PCAP_OPTIMIZE_DEFAULT;
+    ok[1] = pcap_compile_ex(pkts, &progs[1], filter, PCAP_NETMASK_UNKNOWN, &opts, &st) == 0;
+    opts.co_max_passes = 1;
+    ok[2] = pcap_compile_ex(pkts, &progs[2], filter, PCAP_NETMASK_UNKNOWN, &opts, &st) == 0;
+    opts.co_max_passes = 0;
+    ok[3] = 0;
+    if (ok[1]) {
+        prof = pcap_filter_profile_create(&progs[1], errbuf);
+        if (prof == NULL) {
+            printf("pcap_filter_profile_create failed: %s\n", errbuf);
+            abort();
+        }
+        memset(&h, 0, sizeof(h));
+        h.caplen = len;
+        h.len = len;
+        pcap_offline_filter_profile(&progs[1], &h, pkt, prof);
+        opts.co_level = PCAP_OPTIMIZE_PROFILE;
+        opts.co_profile = prof;
+        ok[3] = pcap_compile_ex(pkts, &progs[3], filter, PCAP_NETMASK_UNKNOWN, &opts, &st) == 0;
+        pcap_filter_profile_free(prof);
+    }
+    r1 = pcap_filter(base.bf_insns, pkt, len, len) != 0;
+    for (j = 0; j < 4; j++) {
+        if (!ok[j]) {
+            continue;
+        }
+        r2 = pcap_filter(progs[j].bf_insns, pkt, len, len) != 0;
+        if (r1 != r2) {
+            printf("program optimized at setting %d returned %u, not %u\n", j, r2, r1);
+            abort();
+        }
+        pcap_freecode(&progs[j]);
+    }
+    free(pkt);
+    pcap_freecode(&base);
+}
+
+//if the filter is a set, such as "tcp dst port in { http, 22 }", with
+//qualifiers that neither negate it nor change how what follows them is
+//compiled, compiles the OR chain it's equivalent to and checks that
+//they give the same verdicts on the input and on copies of it made
+//into TCP, UDP and SCTP over unfragmented IPv4 from port 80, if it's
+//Ethernet; testprogs/settest checks fixed sets over many packets
+static void compareSets(pcap_t *pkts, const char *filter, const struct bpf_program *bpf, const uint8_t *Data, size_t Size) {
+    static const char *prefixes[] = { "not", "vlan", "mpls", "pppoes", "geneve" };
+    static const uint8_t protos[] = { 6, 17, 132 };
+    struct bpf_program chain;
+    const char *in, *open, *close, *elt, *end;
+    char *text, *p;
+    uint8_t *copy;
+    const uint8_t *pkt;
+    size_t qlen, i;
+    u_int r1, r2;
+    int j;
+
+    in = strstr(filter, " in ");
+    if (in == NULL) {
+        return;
+    }
+    qlen = (size_t)(in - filter);
+    for (i = 0; i < qlen; i++) {
+        if (filter[i] != ' ' && (filter[i] < 'a' || filter[i] > 'z') && (filter[i] < '0' || filter[i] > '9')) {
+            return;
+        }
+    }
+    for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        if (strstr(filter, prefixes[i]) != NULL) {
+            return;
+        }
+    }
+    open = in + 4;
+    while (*open == ' ') {
+        open++;
+    }
+    if (*open != '{') {
+        return;
+    }
+    close = strchr(open, '}');
+    if (close == NULL || strchr(open + 1, '{') != NULL || close[1 + strspn(close + 1, " ")] != '\0') {
+        return;
+    }
+
+    //each element becomes "(<qualifiers> <element>) or "
+    text = malloc((qlen + 8) * (size_t)(close - open) + (size_t)(close - open) + 1);
+    if (text == NULL) {
+        printf("malloc failed\n");
+        abort();
+    }
+    p = text;
+    for (elt = open + 1; elt < close; elt = end + 1) {
+        end = memchr(elt, ',', (size_t)(close - elt));
+        if (end == NULL) {
+            end = close;
+        }
+        if (p != text) {
+            p += sprintf(p, " or ");
+        }
+        p += sprintf(p, "(%.*s %.*s)", (int)qlen, filter, (int)(end - elt), elt);
+    }
+    *p = '\0';
+    if (pcap_compile(pkts, &chain, text, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+        free(text);
+        return;
+    }
+    copy = malloc(Size);
+    if (copy == NULL) {
+        printf("malloc failed\n");
+        abort();
+    }
+    for (j = -1; j < 3; j++) {
+        pkt = Data;
+        if (j >= 0) {
+            if (pcap_datalink(pkts) != DLT_EN10MB || Size < 38) {
+                break;
+            }
+            memcpy(copy, Data, Size);
+            copy[12] = 0x08;
+            copy[13] = 0x00;
+            copy[14] = 0x45;
+            copy[20] = 0;
+            copy[21] = 0;
+            copy[23] = protos[j];
+            copy[34] = 0;
+            copy[35] = 80;
+            pkt = copy;
+        }
+        r1 = pcap_filter(bpf->bf_insns, pkt, (u_int)Size, (u_int)Size) != 0;
+        r2 = pcap_filter(chain.bf_insns, pkt, (u_int)Size, (u_int)Size) != 0;
+        if (r1 != r2) {
+            printf("\"%s\" returned %u, \"%s\" %u\n", filter, r1, text, r2);
+            abort();
+        }
+    }
+    free(copy);
+    free(text);
+    pcap_freecode(&chain);
+}
+
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
     pcap_t * pkts;
     struct bpf_program bpf;
@@ -30,6 +485,14 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
     filter[Size-1] = 0;
 
     if (pcap_compile(pkts, &bpf, filter, 1, PCAP_NETMASK_UNKNOWN) == 0) {
+        //use the input as packet data
+        compareInterpreters(&bpf, Data, Size);
+        compareBatch(&bpf, Data, Size);
+        compareClassifier(pkts, filter, &bpf, Data, Size);
+        compareFilterCache(pkts, &bpf, Data, Size);
+        compareBuilder(pkts, filter, &bpf, Data, Size);
+        compareLevels(pkts, filter, Data, Size);
+        compareSets(pkts, filter, &bpf, Data, Size);
         pcap_setfilter(pkts, &bpf);
         pcap_close(pkts);
         pcap_freecode(&bpf);
@@ -0,0 +1,200 @@
+#include "varattrs.h"
+
+/*
+ * Check that "host/net/port in { ... }" sets give the same result as
+ * the chains of ORed primitives they're equivalent to, for Ethernet
+ * packets carrying TCP, UDP and SCTP over IPv4 and IPv6, and a few that
+ * carry neither, between a number of hosts and ports.
+ */
+
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "pcap/funcattrs.h"
+
+static const char *sets[][2] = {
+	{ "src port in { 1000, 22, 8080, http }",
+	  "src port 1000 or src port 22 or src port 8080 or src port http" },
+	{ "port in { http, domain, 5060 }",
+	  "port http or port domain or port 5060" },
+	{ "tcp dst port in { http, 22 }",
+	  "tcp dst port http or tcp dst port 22" },
+	{ "host in { 10.0.0.1, 10.0.0.2, 10.0.0.3 }",
+	  "host 10.0.0.1 or host 10.0.0.2 or host 10.0.0.3" },
+	{ "src net in { 10.0.0.0/8, 192.168.1.0/24 }",
+	  "src net 10.0.0.0/8 or src net 192.168.1.0/24" },
+	{ "dst host in { 10.0.0.1, 192.168.1.7, 172.16.0.1, 10.0.0.3, 10.0.0.2 }",
+	  "dst host 10.0.0.1 or dst host 192.168.1.7 or dst host 172.16.0.1 or dst host 10.0.0.3 or dst host 10.0.0.2" },
+	{ "udp src port in { 53, 5060, 22 }",
+	  "udp src port 53 or udp src port 5060 or udp src port 22" },
+};
+
+/* Addresses and ports the packets are between. */
+static const unsigned char addrs[][4] = {
+	{ 10, 0, 0, 1 },
+	{ 10, 0, 0, 2 },
+	{ 10, 0, 0, 3 },
+	{ 10, 1, 2, 3 },
+	{ 11, 0, 0, 1 },
+	{ 172, 16, 0, 1 },
+	{ 192, 168, 1, 7 },
+	{ 192, 168, 2, 7 },
+};
+#define NADDRS	(sizeof(addrs) / sizeof(addrs[0]))
+
+static const unsigned short ports[] = { 22, 53, 80, 1000, 5060, 8080, 9999 };
+#define NPORTS	(sizeof(ports) / sizeof(ports[0]))
+
+static const unsigned char protos[] = { 6, 17, 132 };
+#define NPROTOS	(sizeof(protos) / sizeof(protos[0]))
+
+#define PKTLEN	74
+
+static char *program_name;
+
+/* Forwards */
+static void PCAP_NORETURN error(const char *, ...) PCAP_PRINTFLIKE(1, 2);
+
+/*
+ * Make an Ethernet packet carrying the given protocol from and to the
+ * given addresses and ports, over IPv6, with the IPv4 addresses at the
+ * end of IPv4-mapped addresses, if v6 is set, and over IPv4 otherwise;
+ * return its length.
+ */
+static u_int
+make_packet(u_char *pkt, int v6, u_char proto, const u_char *src,
+    const u_char *dst, unsigned short sport, unsigned short dport)
+{
+	u_char *l4;
+
+	memset(pkt, 0, PKTLEN);
+	if (v6) {
+		pkt[12] = 0x86;
+		pkt[13] = 0xdd;
+		pkt[14] = 0x60;
+		pkt[20] = proto;
+		pkt[32] = pkt[33] = 0xff;
+		memcpy(&pkt[34], src, 4);
+		pkt[48] = pkt[49] = 0xff;
+		memcpy(&pkt[50], dst, 4);
+		l4 = &pkt[54];
+	} else {
+		pkt[12] = 0x08;
+		pkt[13] = 0x00;
+		pkt[14] = 0x45;
+		pkt[23] = proto;
+		memcpy(&pkt[26], src, 4);
+		memcpy(&pkt[30], dst, 4);
+		l4 = &pkt[34];
+	}
+	l4[0] = sport >> 8;
+	l4[1] = sport & 0xff;
+	l4[2] = dport >> 8;
+	l4[3] = dport & 0xff;
+	return (PKTLEN);
+}
+
+static void
+compare(struct bpf_program *set, struct bpf_program *chain, int i, int opt,
+    const u_char *pkt, u_int len)
+{
+	struct pcap_pkthdr h;
+	int r1, r2;
+
+	memset(&h, 0, sizeof(h));
+	h.caplen = len;
+	h.len = len;
+	r1 = pcap_offline_filter(set, &h, pkt) != 0;
+	r2 = pcap_offline_filter(chain, &h, pkt) != 0;
+	if (r1 != r2)
+		error("\"%s\" %s, \"%s\" %s, optimized %d",
+		    sets[i][0], r1 ? "matches" : "doesn't match",
+		    sets[i][1], r2 ? "matches" : "doesn't match", opt);
+}
+
+int
+main(int argc _U_, char **argv)
+{
+	pcap_t *pd;
+	struct bpf_program set, chain;
+	u_char pkt[PKTLEN];
+	u_int len;
+	size_t i, s, d, sp, dp, p;
+	int opt, v6;
+	u_int n = 0;
+	char *cp;
+
+	if ((cp = strrchr(argv[0], '/')) != NULL)
+		program_name = cp + 1;
+	else
+		program_name = argv[0];
+
+	pd = pcap_open_dead(DLT_EN10MB, 262144);
+	if (pd == NULL)
+		error("Can't open fake pcap_t");
+	for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+		for (opt = 0; opt < 2; opt++) {
+			if (pcap_compile(pd, &set, sets[i][0], opt,
+			    PCAP_NETMASK_UNKNOWN) < 0)
+				error("\"%s\": %s", sets[i][0], pcap_geterr(pd));
+			if (pcap_compile(pd, &chain, sets[i][1], opt,
+			    PCAP_NETMASK_UNKNOWN) < 0)
+				error("\"%s\": %s", sets[i][1], pcap_geterr(pd));
+
+			/* Not IP, and ARP. */
+			memset(pkt, 0, sizeof(pkt));
+			compare(&set, &chain, (int)i, opt, pkt, sizeof(pkt));
+			pkt[12] = 0x08;
+			pkt[13] = 0x06;
+			compare(&set, &chain, (int)i, opt, pkt, sizeof(pkt));
+
+			for (v6 = 0; v6 < 2; v6++)
+			for (p = 0; p < NPROTOS; p++)
+			for (s = 0; s < NADDRS; s++)
+			for (d = 0; d < NADDRS; d++)
+			for (sp = 0; sp < NPORTS; sp++)
+			for (dp = 0; dp < NPORTS; dp++) {
+				len = make_packet(pkt, v6, protos[p],
+				    addrs[s], addrs[d], ports[sp], ports[dp]);
+				compare(&set, &chain, (int)i, opt, pkt, len);
+				n++;
+
+				/*
+				 * A later fragment has no ports.
+				 */
+				if (!v6) {
+					pkt[21] = 1;
+					compare(&set, &chain, (int)i, opt,
+					    pkt, len);
+				}
+			}
+			pcap_freecode(&set);
+			pcap_freecode(&chain);
+		}
+	}
+	pcap_close(pd);
+	printf("%u packets checked\n", n);
+	exit(0);
+}
+
+/* VARARGS */
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)fprintf(stderr, "%s: ", program_name);
+	va_start(ap, fmt);
+	(void)vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (*fmt) {
+		fmt += strlen(fmt);
+		if (fmt[-1] != '\n')
+			(void)fputc('\n', stderr);
+	}
+	exit(1);
+	/* NOTREACHED */
+}